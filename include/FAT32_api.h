@@ -0,0 +1,118 @@
+/********************************************************************
+    Module: FAT32_api.h
+    Author: Brennan Couturier
+
+    Programmatic read API of libfat32, for programs that embed the
+    reader instead of driving the shell. Paths are resolved from the
+    root directory, with components separated by '/'. Functions that
+    look something up return NULL or -1 and set errno if it is not
+    there. A volume and everything opened on it must only be used by
+    one thread at a time
+********************************************************************/
+
+#ifndef FAT32_API_H
+#define FAT32_API_H
+
+#include <inttypes.h>
+#include <sys/types.h>
+
+#include "FAT32_structs_globals.h"
+
+#pragma region Volume_Functions
+
+/********************************************************************
+Fills settings with the defaults the shell starts with
+********************************************************************/
+void fat32_default_settings(FAT32_settings* settings);
+
+/********************************************************************
+Opens the disk image at path, read-only unless
+	settings->use_write_access is set. settings may be NULL to use
+	the defaults. Returns NULL with the errno of open(), or EINVAL
+	if the image is not a FAT32 volume
+********************************************************************/
+FAT32_volume* fat32_mount(char* path, FAT32_settings* settings);
+
+/********************************************************************
+Closes a volume returned by fat32_mount(). Every directory and file
+	opened on it must be closed first
+********************************************************************/
+void fat32_unmount(FAT32_volume* volume);
+
+#pragma endregion Volume_Functions
+
+#pragma region Lookup_Functions
+
+/********************************************************************
+Fills info with what is known about the file or directory at path.
+	Returns 0, or -1 with errno set to ENOENT or ENOTDIR
+********************************************************************/
+int fat32_stat(FAT32_volume* volume, char* path, FAT32_file_info* info);
+
+/********************************************************************
+Opens the directory at path for reading its entries. Returns NULL
+	with errno set to ENOENT or ENOTDIR if it cannot
+********************************************************************/
+FAT32_directory_stream* fat32_opendir(FAT32_volume* volume, char* path);
+
+/********************************************************************
+Fills info with the next entry of the directory, skipping deleted
+	entries, long name entries, the volume label, '.' and '..'.
+	Returns 1, or 0 once there are no entries left
+********************************************************************/
+int fat32_readdir(FAT32_directory_stream* stream, FAT32_file_info* info);
+
+/********************************************************************
+Closes a directory returned by fat32_opendir()
+********************************************************************/
+void fat32_closedir(FAT32_directory_stream* stream);
+
+#pragma endregion Lookup_Functions
+
+#pragma region File_Functions
+
+/********************************************************************
+Opens the file at path for reading. Returns NULL with errno set to
+	ENOENT, ENOTDIR or EISDIR if it cannot
+********************************************************************/
+FAT32_file* fat32_open(FAT32_volume* volume, char* path);
+
+/********************************************************************
+Reads up to count bytes of the file starting at offset into buffer,
+	without moving the position used by fat32_read(). Returns the
+	number of bytes read, which is only short at the end of the file
+********************************************************************/
+size_t fat32_pread(FAT32_file* file, void* buffer, size_t count, uint64_t offset);
+
+/********************************************************************
+Reads up to count bytes of the file from its position into buffer and
+	moves the position past them. Returns the number of bytes read,
+	0 at the end of the file
+********************************************************************/
+size_t fat32_read(FAT32_file* file, void* buffer, size_t count);
+
+/********************************************************************
+Closes a file returned by fat32_open()
+********************************************************************/
+void fat32_close(FAT32_file* file);
+
+/********************************************************************
+Copies the whole file into output_fd the same way the get command
+	does, letting the kernel copy the data when it can. Returns the
+	number of bytes written. Only reads the disk image, so other
+	threads may look paths up on the volume meanwhile as long as
+	they do not use the file
+********************************************************************/
+int64_t fat32_extract_file(FAT32_file* file, int output_fd);
+
+/********************************************************************
+Copies the whole file at path into output_fd the same way the get
+	command does, letting the kernel copy the data when it can.
+	Returns the number of bytes written, or -1 with errno set if
+	path is not a file
+********************************************************************/
+int64_t fat32_extract(FAT32_volume* volume, char* path, int output_fd);
+
+#pragma endregion File_Functions
+
+#endif
@@ -0,0 +1,55 @@
+/********************************************************************
+    Module: FAT32_bitmap.h
+    Author: Brennan Couturier
+
+    Bitmap of free clusters, used for exact free space accounting
+    and for allocation
+********************************************************************/
+
+#ifndef FAT32_BITMAP_H
+#define FAT32_BITMAP_H
+
+#include <inttypes.h>
+
+#include "FAT32_structs_globals.h"
+
+#pragma region Free_Bitmap_Functions
+
+/********************************************************************
+Scans the whole FAT and builds the free cluster bitmap, comparing
+	8 entries at a time with AVX2, 4 with SSE2, or one at a time if
+	neither is available. Called automatically on first use
+********************************************************************/
+void build_free_bitmap(FAT32_volume* volume);
+
+/********************************************************************
+Returns the exact number of free clusters on the volume
+********************************************************************/
+uint32_t get_free_cluster_count(FAT32_volume* volume);
+
+/********************************************************************
+Records count FAT entries, starting with the entry of first_cluster,
+	that were just written. Must be called after writing to the FAT
+********************************************************************/
+void update_free_bitmap(FAT32_volume* volume, uint32_t first_cluster, uint32_t* entries, uint32_t count);
+
+/********************************************************************
+Returns the first free cluster at or after cluster_number, or the end
+	of the volume (the number of clusters + 2) if there is none
+********************************************************************/
+uint32_t find_free_cluster(FAT32_volume* volume, uint32_t cluster_number);
+
+/********************************************************************
+Returns the first used cluster at or after cluster_number, or the end
+	of the volume (the number of clusters + 2) if there is none
+********************************************************************/
+uint32_t find_used_cluster(FAT32_volume* volume, uint32_t cluster_number);
+
+/********************************************************************
+Frees the memory used by the bitmap
+********************************************************************/
+void free_free_bitmap(FAT32_volume* volume);
+
+#pragma endregion Free_Bitmap_Functions
+
+#endif
@@ -0,0 +1,137 @@
+/********************************************************************
+    Module: FAT32_cache.h
+    Author: Brennan Couturier
+
+    In-memory caches for on-disk structures
+********************************************************************/
+
+#ifndef FAT32_CACHE_H
+#define FAT32_CACHE_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "FAT32_structs_globals.h"
+
+#define FAT_CACHE_MAX_SIZE (512 << 20) //FATs larger than this are not preloaded
+
+#pragma region FAT_Cache_Functions
+
+/********************************************************************
+Reads the whole first FAT into memory using large sequential reads.
+	If the FAT is too big to cache, entries keep being read from
+	the disk one at a time
+********************************************************************/
+void load_FAT_cache(FAT32_volume* volume);
+
+/********************************************************************
+Looks up the raw FAT entry for the given cluster in the cache. Returns
+	false if the entry is not cached, in which case the caller
+	has to read it from the disk
+********************************************************************/
+bool lookup_FAT_cache(FAT32_volume* volume, uint32_t cluster_number, uint32_t* FAT_entry);
+
+/********************************************************************
+Returns the raw FAT entries of count clusters starting at
+	cluster_number, re-reading any stale sectors among them. Returns
+	NULL if the FAT is not cached or a sector cannot be read, in
+	which case the caller has to read the entries from the disk
+********************************************************************/
+uint32_t* get_FAT_cache_entries(FAT32_volume* volume, uint32_t cluster_number, uint32_t count);
+
+/********************************************************************
+Marks the cached FAT sectors holding the entries of count clusters,
+	starting at cluster_number, as stale. They are re-read from
+	the disk the next time one of their entries is looked up.
+	Must be called after writing to the FAT
+********************************************************************/
+void invalidate_FAT_cache(FAT32_volume* volume, uint32_t cluster_number, uint32_t count);
+
+/********************************************************************
+Frees the memory used by the FAT cache
+********************************************************************/
+void free_FAT_cache(FAT32_volume* volume);
+
+#pragma endregion FAT_Cache_Functions
+
+#pragma region Directory_Cache_Functions
+
+/********************************************************************
+Returns the directory starting at first_cluster, reading and parsing
+	it only if it is not cached yet. The directory stays valid until
+	it is given back with release_cached_directory()
+********************************************************************/
+FAT32_cached_directory* get_cached_directory(FAT32_volume* volume, uint32_t first_cluster);
+
+/********************************************************************
+Returns the directory starting at first_cluster if it is cached, the
+	same way get_cached_directory() does, or NULL without reading it
+********************************************************************/
+FAT32_cached_directory* lookup_cached_directory(FAT32_volume* volume, uint32_t first_cluster);
+
+/********************************************************************
+Gives back a directory returned by get_cached_directory(), which then
+	becomes a candidate for eviction
+********************************************************************/
+void release_cached_directory(FAT32_volume* volume, FAT32_cached_directory* directory);
+
+/********************************************************************
+Finds the entry called name ("NAME.EXT" or "NAME", any case) in a
+	cached directory, or returns NULL. The directory's name index
+	is built on the first call, later lookups take constant time
+********************************************************************/
+FAT32_Directory_Entry* find_cached_directory_entry(FAT32_volume* volume, FAT32_cached_directory* directory, char* name);
+
+/********************************************************************
+Drops the directory starting at first_cluster from the cache so the
+	next lookup re-reads it. Must be called after writing to it
+********************************************************************/
+void invalidate_cached_directory(FAT32_volume* volume, uint32_t first_cluster);
+
+/********************************************************************
+Frees every directory in the cache
+********************************************************************/
+void free_directory_cache(FAT32_volume* volume);
+
+#pragma endregion Directory_Cache_Functions
+
+#pragma region Block_Cache_Functions
+
+/********************************************************************
+Sets up the block cache with settings.block_cache_budget bytes. Does
+	nothing if the budget is smaller than one block or the image is
+	mapped, in which case the kernel already caches it
+********************************************************************/
+void create_block_cache(FAT32_volume* volume);
+
+/********************************************************************
+Returns true if a read of count bytes goes through the block cache.
+	Larger reads are streaming file data and go to the disk image
+	directly, so they do not evict the FAT and directories
+********************************************************************/
+bool is_block_cache_read(FAT32_volume* volume, size_t count);
+
+/********************************************************************
+Reads count bytes starting at byte offset of the disk image into
+	buffer, copying the blocks that are cached and reading the
+	others with read_disk_image_uncached(). Returns the number of
+	bytes read, which is only short at the end of the image
+********************************************************************/
+size_t read_block_cache(FAT32_volume* volume, void* buffer, size_t count, off_t offset);
+
+/********************************************************************
+Copies count bytes written at byte offset of the disk image into the
+	cached blocks they overlap. Must be called after every write
+	to the disk image
+********************************************************************/
+void update_block_cache(FAT32_volume* volume, const void* buffer, size_t count, off_t offset);
+
+/********************************************************************
+Frees the memory used by the block cache
+********************************************************************/
+void free_block_cache(FAT32_volume* volume);
+
+#pragma endregion Block_Cache_Functions
+
+#endif
@@ -0,0 +1,40 @@
+/********************************************************************
+    Module: FAT32_check.h
+    Author: Brennan Couturier
+
+    Consistency check of a whole volume: FAT copies, cross-linked,
+    broken, looping and lost clusterchains, and file sizes
+********************************************************************/
+
+#ifndef FAT32_CHECK_H
+#define FAT32_CHECK_H
+
+#include <inttypes.h>
+
+#include "FAT32_structs_globals.h"
+
+#pragma region Check_Functions
+
+/********************************************************************
+Follows the clusterchain of one directory entry found by a traversal
+	and records the clusters it holds. Reports chains that share
+	clusters with another chain, are broken or loop, and files
+	whose chain does not match their size. Safe to call from any
+	thread
+********************************************************************/
+void check_entry_clusterchain(FAT32_check* check, FAT32_Directory_Entry* entry, char* directory_path, char* name);
+
+/********************************************************************
+Checks the whole volume and prints every problem found: FAT copies
+	that differ from the first, chains that are cross-linked,
+	broken or loop, files whose size does not match their chain,
+	and lost clusters that are used in the FAT but held by no
+	chain. The FAT copies are compared on one thread while
+	settings.num_threads threads walk the tree. Returns the number
+	of problems
+********************************************************************/
+uint64_t check_volume(FAT32_volume* volume);
+
+#pragma endregion Check_Functions
+
+#endif
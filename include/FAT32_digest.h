@@ -0,0 +1,50 @@
+/********************************************************************
+    Module: FAT32_digest.h
+    Author: Brennan Couturier
+
+    CRC32C and SHA-256 digests of extracted files, computed on the
+    buffers of the extraction data path with the CPU's CRC32 and SHA
+    instructions when it has them
+********************************************************************/
+
+#ifndef FAT32_DIGEST_H
+#define FAT32_DIGEST_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "FAT32_structs_globals.h"
+
+#define CRC32C_SUFFIX ".crc32c" //The CRC32C of FILE.TXT is written to FILE.TXT.crc32c
+#define SHA256_SUFFIX ".sha256" //The SHA-256 of FILE.TXT is written to FILE.TXT.sha256
+
+#pragma region Digest_Functions
+
+/********************************************************************
+Starts the digests the volume's settings ask for. Returns digest, or
+	NULL if no digest is wanted, to be handed to the copy functions
+********************************************************************/
+FAT32_digest* start_digest(FAT32_volume* volume, FAT32_digest* digest);
+
+/********************************************************************
+Adds length bytes of file data to the digests
+********************************************************************/
+void update_digest(FAT32_digest* digest, const uint8_t* data, size_t length);
+
+/********************************************************************
+Finishes the digests and writes them in hex to crc32c_hex and
+	sha256_hex
+********************************************************************/
+void finish_digest(FAT32_digest* digest);
+
+/********************************************************************
+Writes each finished digest next to the extracted file at
+	output_path, in the "<hex>  <name>" format of sha256sum, so
+	sha256sum -c can check the file later
+********************************************************************/
+void write_digest_files(FAT32_digest* digest, char* output_path);
+
+#pragma endregion Digest_Functions
+
+#endif
@@ -8,41 +8,96 @@
 #ifndef FAT32_DM_H
 #define FAT32_DM_H
 
+#include "FAT32_structs_globals.h"
+
+#pragma region Volume_Functions
+
+/********************************************************************
+Opens the disk image with a copy of the settings and reads the boot
+	sector, the FSInfo sector, the FAT and the root directory, and
+	the index if settings->use_index is set. Returns NULL with the
+	errno of open(), or EINVAL if the image is not a FAT32 volume.
+	Close it with close_volume()
+********************************************************************/
+FAT32_volume* open_volume(char* disk_image_path, FAT32_settings* settings);
+
+/********************************************************************
+Frees every cache of the volume and closes the disk image. Every
+	cursor of the volume must be closed first
+********************************************************************/
+void close_volume(FAT32_volume* volume);
+
+/********************************************************************
+Allocates a cursor on the volume, starting in the root directory.
+	Free it with close_cursor()
+********************************************************************/
+FAT32_cursor* open_cursor(FAT32_volume* volume);
+
+/********************************************************************
+Frees a cursor returned by open_cursor()
+********************************************************************/
+void close_cursor(FAT32_cursor* cursor);
+
+#pragma endregion Volume_Functions
+
 #pragma region Read_Functions
 
 /********************************************************************
-Read sizeof(FAT32_BS) bytes from the provided file descriptor into
-	an allocated FAT32_BS struct. Sets the global boot sector reference
-	to point to this memory
+Read sizeof(FAT32_BS) bytes from the disk image of the volume into
+	an allocated FAT32_BS struct. Sets volume->boot_sector to point
+	to this memory. Returns false with errno set to EINVAL if it is
+	not a FAT32 boot sector
+********************************************************************/
+bool read_boot_sector(FAT32_volume* volume);
+
+/********************************************************************
+Reads the FSInfo data into an allocated FAT32_FSInfo struct. Returns
+	false with errno set to EINVAL if its signatures are wrong
 ********************************************************************/
-void read_boot_sector();
+bool read_FS_info(FAT32_volume* volume);
 
 /********************************************************************
-Reads the FSInfo data into an allocated FAT32_FSInfo struct
+Reads the root directory and keeps it cached while the volume is open
 ********************************************************************/
-void read_FS_info();
+void read_root_directory(FAT32_volume* volume);
 
 /********************************************************************
-Reads the root directory into an allocated FAT32_Directory_Entry struct
+Searches the current directory of the cursor for a file with the
+	provided name. If the file is found, write the clusterchain to
+	a file in the output folder
 ********************************************************************/
-void read_root_directory();
+void download_file(FAT32_cursor* cursor, char* file_name);
 
 /********************************************************************
-Searches the current directory for a file with the provided name
-    If the file is found, write the clusterchain to a file in memory
+Searches the current directory of the cursor for a directory with
+	the provided name and copies the whole subtree into the output
+	folder, keeping the hierarchy. Files are written by
+	settings.num_threads workers
 ********************************************************************/
-void download_file(char* file_name);
+void download_directory(FAT32_cursor* cursor, char* directory_name);
 
 #pragma endregion Read_Functions
 
 #pragma region Set_Functions
 
 /********************************************************************
-Searches the current directory for the specified directory
-    If it exists, get its cluster number and set the global variable
+Searches the current directory of the cursor for the specified
+	directory. If it exists, moves the cursor into it
 ********************************************************************/
-void change_directory(char* destination);
+void change_directory(FAT32_cursor* cursor, char* destination);
 
 #pragma endregion Set_Functions
 
+#pragma region Write_Functions
+
+/********************************************************************
+Copies a file from the host into the current directory of the
+	cursor, under its 8.3 name. Clusters are allocated from
+	FSI_Nxt_Free, as one contiguous run when possible, and every
+	FAT copy and the FSInfo free count are updated
+********************************************************************/
+void upload_file(FAT32_cursor* cursor, char* host_path);
+
+#pragma endregion Write_Functions
+
 #endif
\ No newline at end of file
@@ -0,0 +1,37 @@
+/********************************************************************
+    Module: FAT32_extract.h
+    Author: Brennan Couturier
+
+    Worker pool used to copy many files out of the disk image at once
+********************************************************************/
+
+#ifndef FAT32_EXTRACT_H
+#define FAT32_EXTRACT_H
+
+#include <inttypes.h>
+
+#include "FAT32_structs_globals.h"
+
+#pragma region Extract_Pool_Functions
+
+/********************************************************************
+Allocates a pool and starts num_workers threads waiting for jobs
+	to extract from the volume
+********************************************************************/
+FAT32_extract_pool* start_extract_pool(FAT32_volume* volume, uint32_t num_workers);
+
+/********************************************************************
+Queues a file to be written to output_path, which the pool takes
+	ownership of. Blocks while the queue is full
+********************************************************************/
+void queue_extract_job(FAT32_extract_pool* pool, uint32_t first_cluster, uint32_t file_size, char* output_path);
+
+/********************************************************************
+Waits for every queued job to be written, stops the workers, prints
+	a summary and frees the pool
+********************************************************************/
+void finish_extract_pool(FAT32_extract_pool* pool);
+
+#pragma endregion Extract_Pool_Functions
+
+#endif
@@ -13,6 +13,9 @@
 
 #include "FAT32_structs_globals.h"
 
+#define SHORT_NAME_LENGTH 11 //Length of DIR_Name, 8 for the name and 3 for the extension
+#define NORMALIZED_NAME_LENGTH 13 //"NAME.EXT" plus the terminator
+
 #pragma region Get_Functions
 
 /********************************************************************
@@ -20,52 +23,95 @@ Calculate how many root directory sectors there are. If FAT32 this
 	will be 0, otherwise we should stop the program because we
 	aren't operating on FAT12/16.
 ********************************************************************/
-uint16_t get_root_dir_sectors();
+uint16_t get_root_dir_sectors(FAT32_volume* volume);
 
 /********************************************************************
 Calculate the sector number of the first data sector relative
 	to the sector that contains the BPB
 ********************************************************************/
-uint32_t get_first_data_sector();
+uint32_t get_first_data_sector(FAT32_volume* volume);
 
 /********************************************************************
 Calculate the first sector of a given cluster number
 ********************************************************************/
-uint32_t get_first_sector_of_cluster(uint32_t cluster_number);
+uint32_t get_first_sector_of_cluster(FAT32_volume* volume, uint32_t cluster_number);
 
 /********************************************************************
 Calculate the number of sectors in the data region of the volume
 ********************************************************************/
-uint32_t get_num_data_region_sectors();
+uint32_t get_num_data_region_sectors(FAT32_volume* volume);
 
 /********************************************************************
 Calculate the number of data clusters in total starting at cluster 2
 	This computation rounds down
 ********************************************************************/
-uint32_t get_num_clusters();
+uint32_t get_num_clusters(FAT32_volume* volume);
+
+/********************************************************************
+Computes the geometry of the volume from its boot sector. Returns
+	false with errno set to EINVAL if the BPB describes a layout that
+	cannot be addressed. Called by read_boot_sector()
+********************************************************************/
+bool compute_volume_geometry(FAT32_volume* volume);
+
+/********************************************************************
+Byte offset of a cluster in the disk image. Inline, and a shift when
+	clusters are a power of two in size, since every read of file
+	data and directories starts here. Clusters 0 and 1 have no data,
+	callers passing a value read from the disk check it is at least 2
+	first
+********************************************************************/
+static inline off_t get_cluster_byte_offset(FAT32_volume* volume, uint32_t cluster_number){
+
+    const FAT32_geometry* geometry = &volume->geometry;
+
+    if(geometry->is_power_of_two){
+        return geometry->data_byte_offset + (((off_t)cluster_number - 2) << geometry->cluster_shift);
+    }
+
+    return geometry->data_byte_offset + ((off_t)cluster_number - 2) * geometry->cluster_size;
+
+}
+
+/********************************************************************
+Index, from the start of the FAT, of the FAT sector holding the entry
+	of the given cluster. Inline, and a shift when sectors are a
+	power of two in size, since every FAT cache lookup starts here
+********************************************************************/
+static inline uint32_t get_FAT_sector_index(FAT32_volume* volume, uint32_t cluster_number){
+
+    const FAT32_geometry* geometry = &volume->geometry;
+
+    if(geometry->is_power_of_two){
+        return cluster_number >> geometry->FAT_entries_per_sector_shift;
+    }
+
+    return cluster_number / geometry->FAT_entries_per_sector;
+
+}
 
 /********************************************************************
 Calculate FAT entry number for given cluster number N
 	This is the sector number of the FAT sector that contains the 
 	entry for cluster N in the first FAT
 ********************************************************************/
-uint32_t get_FAT_sector_number_for_cluster(uint32_t cluster_number);
+uint32_t get_FAT_sector_number_for_cluster(FAT32_volume* volume, uint32_t cluster_number);
 
 /********************************************************************
 Calculate FAT entry offset value for given cluster number
 ********************************************************************/
-uint32_t get_FAT_entry_offset_for_cluster(uint32_t cluster_number);
+uint32_t get_FAT_entry_offset_for_cluster(FAT32_volume* volume, uint32_t cluster_number);
 
 /********************************************************************
 Fetch the contents of the given cluster's FAT entry
 ********************************************************************/
-uint32_t get_FAT_entry_contents(uint32_t cluster_number);
+uint32_t get_FAT_entry_contents(FAT32_volume* volume, uint32_t cluster_number);
 
 /********************************************************************
 Returns a string representing the FAT version we're using
 	"FAT12", "FAT16" or "FAT32"
 ********************************************************************/
-char* get_FAT_type();
+char* get_FAT_type(FAT32_volume* volume);
 
 #pragma endregion Get_Functions
 
@@ -76,49 +122,165 @@ Checks if the FAT entry is EOC or not
 ********************************************************************/
 bool is_FAT_entry_EOC(uint32_t FAT_entry);
 
+/********************************************************************
+Checks if the directory entry names a file or a subdirectory, and
+	is not a deleted entry, a long name entry, the volume label, '.'
+	or '..', which every walk of the tree skips
+********************************************************************/
+bool is_named_entry(FAT32_Directory_Entry* entry);
+
+/********************************************************************
+Sets the bit of first_cluster in visited, one bit per cluster of the
+	volume. Returns false if the cluster is not on the volume or the
+	bit was already set, so each directory of a cross-linked or
+	looping tree is walked only once. Safe to call from any thread
+********************************************************************/
+bool claim_directory(uint64_t* visited, uint32_t first_cluster, uint32_t end_cluster);
+
 #pragma endregion Value_Check_Functions
 
 #pragma region Clusterchain_Functions
 
 /********************************************************************
-This function builds a linked list of clusters. It starts at the
-	cluster specified by cluster_number, then adds clusters into
-	the list until it finds an EOC marker in the FAT. It then returns
-	a pointer to the head of this list
+Allocates an empty chain with room for a few extents. Its
+	allocations are counted in the volume's statistics
+********************************************************************/
+file_clusterchain* create_clusterchain(FAT32_volume* volume);
+
+/********************************************************************
+Appends a cluster to the chain, extending the last extent if the
+	cluster directly follows it
+********************************************************************/
+void append_cluster_to_chain(file_clusterchain* chain, uint32_t cluster_number);
+
+/********************************************************************
+Appends num_clusters consecutive clusters starting at first_cluster
+	to the chain
+********************************************************************/
+void append_extent_to_chain(file_clusterchain* chain, uint32_t first_cluster, uint32_t num_clusters);
+
+/********************************************************************
+Follows the FAT from cluster_number like build_clusterchain(), but
+	stops at a FAT entry that is not a cluster of the volume, or
+	once the chain loops back on itself, cutting the chain after
+	its last distinct cluster. status says how the walk ended
 ********************************************************************/
-file_cluster_node* build_clusterchain(uint32_t cluster_number);
+file_clusterchain* follow_clusterchain(FAT32_volume* volume, uint32_t cluster_number, FAT32_chain_status* status);
 
 /********************************************************************
-Print out all the cluster numbers in the chain, ending with EOC
+This function builds the chain of clusters of a file. It starts at
+	the cluster specified by cluster_number, then follows the FAT
+	until it finds an EOC marker, merging consecutive cluster
+	numbers into extents. It then returns a pointer to the chain.
+	A chain that is broken or loops is cut short with a warning
 ********************************************************************/
-void print_clusterchain(file_cluster_node* chain_head);
+file_clusterchain* build_clusterchain(FAT32_volume* volume, uint32_t cluster_number);
+
+/********************************************************************
+Print out all the extents in the chain, ending with EOC
+********************************************************************/
+void print_clusterchain(file_clusterchain* chain);
 
 /********************************************************************
 Read all the clusters into one bit char array (byte array), to be
-	formatted by the caller
+	formatted by the caller. Frees the chain
+********************************************************************/
+uint8_t* read_clusterchain(FAT32_volume* volume, file_clusterchain* chain);
+
+/********************************************************************
+Copy the first num_bytes bytes of the clusterchain into output_fd
+	through a fixed ring of buffers, so memory use stays constant
+	however large the file is. Each buffer is added to digest right
+	after it is read, unless digest is NULL, in which case the
+	kernel may copy the data instead. Frees the chain and returns
+	the number of bytes written
+********************************************************************/
+uint64_t stream_clusterchain(FAT32_volume* volume, file_clusterchain* chain, int output_fd, uint64_t num_bytes,
+								FAT32_digest* digest);
+
+/********************************************************************
+Copy the first num_bytes bytes of the clusterchain into output_fd on
+	the calling thread, reading through the caller's buffer of
+	buffer_size bytes and adding it to digest unless it is NULL.
+	Frees the chain and returns the number of bytes written. Safe
+	to call from several threads at once
+********************************************************************/
+uint64_t copy_clusterchain(FAT32_volume* volume, file_clusterchain* chain, int output_fd, uint64_t num_bytes,
+							uint8_t* buffer, size_t buffer_size, FAT32_digest* digest);
+
+/********************************************************************
+Free the clusterchain and its extents
 ********************************************************************/
-uint8_t* read_clusterchain(file_cluster_node* chain_head);
+void free_clusterchain(file_clusterchain* chain);
 
 /********************************************************************
-Free all the nodes in the clusterchain
+Returns the contents of the directory starting at cluster_number, and
+	their size in bytes. If the image is mapped and the directory is
+	contiguous this points straight into the mapping, otherwise the
+	clusters are read into a new buffer. Either way, give it back
+	with release_directory()
 ********************************************************************/
-void free_clusterchain(file_cluster_node* chain_head);
+uint8_t* read_directory(FAT32_volume* volume, uint32_t cluster_number, size_t* size);
+
+/********************************************************************
+Releases directory contents returned by read_directory()
+********************************************************************/
+void release_directory(FAT32_volume* volume, uint8_t* directory_data);
 
 #pragma endregion Clusterchain_Functions
 
+#pragma region Directory_Iterator_Functions
+
+/********************************************************************
+Starts iterating over the directory starting at first_cluster. No
+	cluster is read until the first entry is asked for
+********************************************************************/
+void open_directory_iterator(FAT32_volume* volume, uint32_t first_cluster, FAT32_directory_iterator* iterator);
+
+/********************************************************************
+Starts iterating over the entries of a directory from the directory
+	cache, which must stay in use until the iterator is closed
+********************************************************************/
+void open_cached_directory_iterator(FAT32_volume* volume, FAT32_cached_directory* directory, FAT32_directory_iterator* iterator);
+
+/********************************************************************
+Decodes the next entry of the directory into info, reading the next
+	cluster of the directory only when the entries of the current
+	one run out. Deleted entries, long name entries and the volume
+	label are skipped, and a leading 0x05 is turned back into 0xE5.
+	Returns false at the end marker or the end of the chain, and
+	warns when the chain is broken or loops
+********************************************************************/
+bool next_directory_entry(FAT32_directory_iterator* iterator, FAT32_file_info* info);
+
+/********************************************************************
+Frees what the iterator holds. It may be closed before the end
+********************************************************************/
+void close_directory_iterator(FAT32_directory_iterator* iterator);
+
+#pragma endregion Directory_Iterator_Functions
+
 #pragma region String_Trim_Functions
 
 /********************************************************************
-Gets rid of all the trailing whitespace in the file name
+Gets rid of all the trailing whitespace in the file name. name_out
+	must hold at least NORMALIZED_NAME_LENGTH characters
 ********************************************************************/
 void trim_directory_name(char* name_in, char* name_out);
 
 /********************************************************************
 Gets rid of the whitespace between the file name and the extension,
-	replaces it with 1 '.'
+	replaces it with 1 '.'. Names without an extension get no '.'.
+	name_out must hold at least NORMALIZED_NAME_LENGTH characters
 ********************************************************************/
 void trim_file_name(char* name_in, char* name_out);
 
+/********************************************************************
+Writes the name of the entry the way a user types it, "NAME.EXT" or
+	"NAME", with a leading 0x05 turned back into 0xE5
+********************************************************************/
+void normalize_entry_name(FAT32_Directory_Entry* entry, char* name_out);
+
 #pragma endregion String_Trim_Functions
 
 #endif
\ No newline at end of file
@@ -0,0 +1,63 @@
+/********************************************************************
+    Module: FAT32_index.h
+    Author: Brennan Couturier
+
+    Metadata index of the whole directory tree, kept in a file next
+    to the disk image so later sessions can resolve paths without
+    reading directories or following the FAT
+********************************************************************/
+
+#ifndef FAT32_INDEX_H
+#define FAT32_INDEX_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+#include "FAT32_structs_globals.h"
+
+#define INDEX_MAGIC "FAT32IDX"
+#define INDEX_VERSION 1
+#define INDEX_SUFFIX ".idx" //The index of image.img is image.img.idx
+
+#pragma region Index_Functions
+
+/********************************************************************
+Maps the index file of the disk image and checks it still matches
+	the image. A missing or stale index is rebuilt by walking the
+	whole tree and written back. Needs the FAT cache to be loaded
+********************************************************************/
+void open_index(FAT32_volume* volume);
+
+/********************************************************************
+Returns true if an index is open
+********************************************************************/
+bool is_index_open(FAT32_volume* volume);
+
+/********************************************************************
+Resolves path, relative to the directory starting at
+	directory_cluster unless it starts with '/'. Components are
+	separated by '/' and may be '.' or '..'. Returns NULL if the
+	path does not exist or no index is open
+********************************************************************/
+FAT32_index_node* find_index_path(FAT32_volume* volume, uint32_t directory_cluster, char* path);
+
+/********************************************************************
+Builds the clusterchain of a node from its extents, without reading
+	the FAT. Free it with free_clusterchain()
+********************************************************************/
+file_clusterchain* get_index_clusterchain(FAT32_volume* volume, FAT32_index_node* node);
+
+/********************************************************************
+Closes the index and deletes its file. Must be called after writing
+	to the disk image, the next session builds a new one
+********************************************************************/
+void invalidate_index(FAT32_volume* volume);
+
+/********************************************************************
+Closes the index, leaving its file in place
+********************************************************************/
+void close_index(FAT32_volume* volume);
+
+#pragma endregion Index_Functions
+
+#endif
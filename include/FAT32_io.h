@@ -8,39 +8,147 @@
 #ifndef FAT32_IO_H
 #define FAT32_IO_H
 
+#include <inttypes.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "FAT32_structs_globals.h"
+
 #pragma region File_Descriptor_Functions
 
 /********************************************************************
-Open the formatted FAT32 disk image for reading and writing, sets
-	the global disk_image_fd varible to this new file descriptor
+Open the formatted FAT32 disk image, read-only unless
+	settings.use_write_access is set, and sets volume->disk_image_fd
+	to this new file descriptor. If settings.use_mmap is set and the
+	image is a regular file, it is also mapped into memory and
+	volume->disk_image_map is set. Returns false with the errno of
+	open() if the image cannot be opened
 ********************************************************************/
-void open_disk_image(char* disk_image_path_in);
+bool open_disk_image(FAT32_volume* volume, char* disk_image_path_in);
 
 /********************************************************************
 Closes the disk image file descriptor that was opened at the beginning
+	and removes the mapping, if there is one
 ********************************************************************/
-void close_disk_image();
+void close_disk_image(FAT32_volume* volume);
 
 #pragma endregion File_Descriptor_Functions
 
+#pragma region Disk_Read_Functions
+
+/********************************************************************
+Reads count bytes starting at byte offset of the disk image into
+	buffer, without moving the file offset. Small reads go through
+	the block cache. Large reads are split into reads of at most
+	settings.max_io_size bytes. With direct I/O, unaligned parts of
+	the range go through a bounce buffer. Returns the number of
+	bytes read, which is only short at the end of the image
+********************************************************************/
+size_t read_disk_image(FAT32_volume* volume, void* buffer, size_t count, off_t offset);
+
+/********************************************************************
+Same as read_disk_image(), but always reads from the disk image,
+	skipping the block cache
+********************************************************************/
+size_t read_disk_image_uncached(FAT32_volume* volume, void* buffer, size_t count, off_t offset);
+
+/********************************************************************
+Reads every request of the batch, setting each one's bytes_read.
+	With the io_uring engine the reads are all in flight at once
+	and complete in any order, otherwise they are read one after
+	the other with read_disk_image(). Batches of reads that are all
+	small enough for the block cache skip io_uring
+********************************************************************/
+void read_disk_image_batch(FAT32_volume* volume, FAT32_read_request* requests, uint32_t num_requests);
+
+/********************************************************************
+Allocates a buffer for reads of the disk image, aligned for direct
+	I/O when settings.use_direct_io is set so the reads can skip
+	the bounce buffer. Returns NULL if there is not enough memory.
+	Free it with free()
+********************************************************************/
+void* allocate_disk_buffer(FAT32_volume* volume, size_t size);
+
+/********************************************************************
+Returns a pointer to count bytes starting at byte offset of the disk
+	image mapping, or NULL if the image is not mapped or the range
+	is outside of it. The memory is read-only
+********************************************************************/
+uint8_t* get_disk_image_pointer(FAT32_volume* volume, off_t offset, size_t count);
+
+/********************************************************************
+Checks if the pointer points into the disk image mapping, meaning
+	it is not owned by the caller and must not be freed
+********************************************************************/
+bool is_disk_image_pointer(FAT32_volume* volume, void* pointer);
+
+/********************************************************************
+Tells the kernel how a range of the disk image mapping is going to be
+	accessed (MADV_RANDOM, MADV_SEQUENTIAL, MADV_WILLNEED...).
+	Does nothing if the image is not mapped
+********************************************************************/
+void advise_disk_image(FAT32_volume* volume, off_t offset, size_t count, int advice);
+
+#pragma endregion Disk_Read_Functions
+
+#pragma region Disk_Write_Functions
+
+/********************************************************************
+Writes count bytes of buffer to the disk image starting at byte
+	offset, without moving the file offset. Exits if the write
+	fails, a half written image is worse than none
+********************************************************************/
+void write_disk_image(FAT32_volume* volume, const void* buffer, size_t count, off_t offset);
+
+#pragma endregion Disk_Write_Functions
+
+#pragma region Disk_Copy_Functions
+
+/********************************************************************
+Copies count bytes starting at byte offset of the disk image to the
+	current position of output_fd without passing them through
+	user space, with copy_file_range(), then sendfile(), or splice()
+	if output_fd is a pipe. *method starts as COPY_METHOD_UNKNOWN
+	and is kept between calls for the same output. Returns the
+	number of bytes copied, which is short at the end of the image
+	or once *method is COPY_METHOD_BUFFERED, in which case the rest
+	has to be read and written by the caller
+********************************************************************/
+size_t copy_disk_image(FAT32_volume* volume, int output_fd, off_t offset, size_t count, FAT32_copy_method* method);
+
+#pragma endregion Disk_Copy_Functions
+
 #pragma region Printing_Functions
 
 /********************************************************************
 Prints out some values contained in the boot sector to a file
 	in the debug directory
 ********************************************************************/
-void print_boot_sector_info();
+void print_boot_sector_info(FAT32_volume* volume);
 
 /********************************************************************
 Prints out information about the root directory, for debugging
 ********************************************************************/
-void print_root_directory();
+void print_root_directory(FAT32_volume* volume);
 
 /********************************************************************
 Prints out information about the current directory and all the files
     and subfolders in it
 ********************************************************************/
-void print_current_directory();
+void print_current_directory(FAT32_cursor* cursor);
+
+/********************************************************************
+Prints the exact free space of the volume, how it compares with the
+	FSInfo hint, and how fragmented the free space is
+********************************************************************/
+void print_free_space(FAT32_volume* volume);
+
+/********************************************************************
+Prints how the disk image of a newly mounted volume is being read:
+	the access it was opened with, and the mapping, direct I/O and
+	io_uring engine if they are in use
+********************************************************************/
+void print_disk_image_info(FAT32_volume* volume);
 
 #pragma endregion Printing_Functions
 
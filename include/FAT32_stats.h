@@ -0,0 +1,55 @@
+/********************************************************************
+    Module: FAT32_stats.h
+    Author: Brennan Couturier
+
+    Counters and latency histograms for I/O and shell commands
+********************************************************************/
+
+#ifndef FAT32_STATS_H
+#define FAT32_STATS_H
+
+#include <inttypes.h>
+
+#include "FAT32_structs_globals.h"
+
+#pragma region Counting_Functions
+
+/********************************************************************
+Adds amount to a counter of the volume. Safe to call from any thread
+********************************************************************/
+void count_stat(FAT32_volume* volume, FAT32_stat_counter counter, uint64_t amount);
+
+/********************************************************************
+Returns a monotonic timestamp in nanoseconds, for timing an operation
+********************************************************************/
+uint64_t get_stat_time();
+
+/********************************************************************
+Adds the time since start (from get_stat_time()) to a counter
+********************************************************************/
+void count_stat_time(FAT32_volume* volume, FAT32_stat_counter counter, uint64_t start);
+
+/********************************************************************
+Records how long one shell command took in its histogram
+********************************************************************/
+void record_command_latency(FAT32_volume* volume, FAT32_stat_command command, uint64_t nanoseconds);
+
+#pragma endregion Counting_Functions
+
+#pragma region Reporting_Functions
+
+/********************************************************************
+Prints every counter, where the time of I/O went, and the latency
+	histogram of every command that was run
+********************************************************************/
+void print_stats(FAT32_volume* volume);
+
+/********************************************************************
+Writes every counter and histogram to path as a JSON object, summed
+	over the volumes
+********************************************************************/
+void write_stats_json(FAT32_volume** volumes, uint32_t num_volumes, char* path);
+
+#pragma endregion Reporting_Functions
+
+#endif
@@ -9,6 +9,10 @@
 #define FAT32_SG_H
 
 #include <inttypes.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/types.h>
 
 #define BS_OEMName_LENGTH 8
 #define BS_VolLab_LENGTH 11
@@ -16,9 +20,27 @@
 #define _FILE_OFFSET_BITS 64
 #define FAT_ENTRY_MASK 0x0FFFFFFF
 #define EOC_LOW_BOUND 0x0FFFFFF8 //If a FAT entry is >= EOC_LOW_BOUND, the entry is EOC
+#define BAD_CLUSTER 0x0FFFFFF7 //FAT entry of a cluster marked bad
 #define FILE_OUTPUT_FOLDER "./files/"
+#define DEFAULT_MAX_IO_SIZE (8 << 20) //Largest single read issued against the disk image
+#define STREAM_RING_SLOTS 4 //Number of buffers in the extraction ring
+#define STREAM_SLOT_SIZE (1 << 20) //Size of each buffer in the extraction ring
+#define DEFAULT_DIRECTORY_CACHE_BUDGET (16 << 20) //Bytes of directory entries kept in memory
+#define DIRECTORY_CACHE_BUCKETS 256 //Hash buckets of the directory cache
+#define DEFAULT_BLOCK_CACHE_BUDGET (8 << 20) //Bytes of disk blocks kept in memory
+#define BLOCK_CACHE_BLOCK_SIZE 4096 //Size and alignment of every block in the block cache
+#define BLOCK_CACHE_MAX_READ (256 << 10) //Reads larger than this are streaming data and bypass the block cache
+#define EXTRACT_QUEUE_LENGTH 64 //Files waiting for a worker during a recursive extraction
+#define URING_QUEUE_DEPTH 64 //Reads kept in flight by the io_uring engine
+#define SHA256_BLOCK_SIZE 64 //Bytes hashed by one round of the SHA-256 compression function
+#define LATENCY_BUCKETS 32 //Bucket k of a latency histogram counts commands taking [2^k, 2^(k+1)) microseconds
 
 #pragma region Structs
+
+/********************************************************************
+An opened disk image, defined below once the caches it holds are
+********************************************************************/
+typedef struct FAT32_volume_struct FAT32_volume;
 /********************************************************************
 Struct for FAT32 Boot Sector and BPB
 ********************************************************************/
@@ -100,51 +122,652 @@ typedef struct FAT32_Directory_Entry_struct{
 #pragma pack(pop)
 
 /********************************************************************
-Linked list node to keep track of all the clusters in a file
+A run of physically contiguous clusters in a file
+********************************************************************/
+typedef struct file_cluster_extent_struct{
+	uint32_t first_cluster; //Cluster number the run starts at
+	uint32_t num_clusters; //Length of the run, at least 1
+} file_cluster_extent;
+
+/********************************************************************
+Keeps track of all the clusters in a file as a growable array of
+	extents, so its size depends on how fragmented the file is
+	rather than on how big it is
+********************************************************************/
+typedef struct file_clusterchain_struct{
+	FAT32_volume* volume; //Volume whose statistics count the chain's allocations
+	file_cluster_extent* extents;
+	uint32_t num_extents;
+	uint32_t capacity; //Number of extents allocated
+	uint32_t num_clusters; //Total number of clusters over all extents
+} file_clusterchain;
+
+/********************************************************************
+How following a clusterchain through the FAT ended
+********************************************************************/
+typedef enum FAT32_chain_status_enum{
+	CHAIN_COMPLETE, //Reached an EOC marker
+	CHAIN_BROKEN, //Reached a free, bad or out of range FAT entry
+	CHAIN_LOOPS, //Came back to a cluster already in the chain
+} FAT32_chain_status;
+
+/********************************************************************
+Running digests of one extracted file, updated with each buffer of
+	file data right after it is read
+********************************************************************/
+typedef struct FAT32_digest_struct{
+	FAT32_volume* volume; //Volume whose statistics count the bytes hashed
+	bool use_crc32c;
+	bool use_sha256;
+	uint32_t crc32c; //Running value, the final one after finish_digest()
+	uint32_t sha256_state[8];
+	uint8_t sha256_block[SHA256_BLOCK_SIZE]; //Bytes not hashed yet, always less than a block
+	uint32_t sha256_block_length;
+	uint64_t length; //Bytes hashed so far
+	char crc32c_hex[9]; //Set by finish_digest()
+	char sha256_hex[65]; //Set by finish_digest()
+} FAT32_digest;
+
+/********************************************************************
+Ring of buffers used to stream a clusterchain into a file. A reader
+	thread fills slots from the disk image while the writer drains
+	them, so memory use does not depend on the size of the file
+********************************************************************/
+typedef struct FAT32_stream_ring_struct{
+	uint8_t* slots[STREAM_RING_SLOTS];
+	size_t slot_lengths[STREAM_RING_SLOTS]; //Bytes of data held in each filled slot
+	uint32_t fill_index; //Next slot the reader fills
+	uint32_t drain_index; //Next slot the writer drains
+	uint32_t num_filled; //Number of slots holding data
+	bool reader_done; //Set once the reader has queued its last slot
+	bool writer_failed; //Set if the writer gave up, so the reader stops
+	FAT32_volume* volume; //Volume the chain belongs to
+	file_clusterchain* chain; //Chain being read
+	FAT32_digest* digest; //Updated by the reader as it fills each slot, NULL for none
+	uint64_t num_bytes; //Bytes of the chain to read, the rest of the last cluster is dropped
+	pthread_mutex_t lock;
+	pthread_cond_t slot_filled;
+	pthread_cond_t slot_drained;
+} FAT32_stream_ring;
+
+/********************************************************************
+Run-time settings, chosen on the command line
+********************************************************************/
+typedef struct FAT32_settings_struct{
+	size_t max_io_size; //Bytes per read when reading contiguous clusters
+	bool use_mmap; //Map the disk image into memory instead of using read()
+	size_t directory_cache_budget; //Bytes the directory cache may hold once directories are released
+	uint32_t num_threads; //Worker threads used by recursive extraction
+	bool use_io_uring; //Submit batched reads through io_uring, falls back to pread() if unavailable
+	char* stats_path; //File the statistics are written to as JSON at exit, NULL for none
+	bool use_index; //Keep a metadata index next to the disk image and resolve paths through it
+	bool use_zero_copy; //Let the kernel copy extracted files with copy_file_range(), sendfile() or splice()
+	bool use_direct_io; //Read the disk image with O_DIRECT, bypassing the page cache
+	size_t block_cache_budget; //Bytes of disk blocks kept by the block cache, 0 turns it off
+	bool use_crc32c; //Compute the CRC32C of every extracted file while it is copied
+	bool use_sha256; //Compute the SHA-256 of every extracted file while it is copied
+	bool use_write_access; //Open the disk image for writing too, which put needs. It is opened read-only otherwise
+} FAT32_settings;
+
+/********************************************************************
+How copy_disk_image() moves data into an output file. Decided on the
+	first call for an output and carried between calls, so a call
+	that is not supported is only made once per output
+********************************************************************/
+typedef enum FAT32_copy_method_enum{
+	COPY_METHOD_UNKNOWN, //Not tried yet
+	COPY_METHOD_COPY_FILE_RANGE, //Regular output files, reflinks or copies in the kernel where the file system can
+	COPY_METHOD_SENDFILE, //Outputs copy_file_range() refuses, such as another file system on older kernels
+	COPY_METHOD_SPLICE, //Pipes
+	COPY_METHOD_BUFFERED //The kernel cannot copy into this output, read and write it instead
+} FAT32_copy_method;
+
+/********************************************************************
+One read of a batch given to read_disk_image_batch()
+********************************************************************/
+typedef struct FAT32_read_request_struct{
+	void* buffer;
+	size_t count; //Bytes to read
+	off_t offset; //Byte offset in the disk image
+	size_t bytes_read; //Set by the batch, only short at the end of the image
+	bool is_done; //Used by the io_uring engine, set once no more reads are needed
+} FAT32_read_request;
+
+/********************************************************************
+Position reached in a clusterchain by a reader that takes its reads
+	a window at a time, so they can go to read_disk_image_batch()
+	together
+********************************************************************/
+typedef struct FAT32_chain_cursor_struct{
+	file_clusterchain* chain;
+	uint32_t extent; //Extent the next read starts in
+	uint64_t extent_offset; //Bytes of that extent already taken
+	uint64_t remaining; //Bytes of the chain left to take, the rest of the last cluster is dropped
+} FAT32_chain_cursor;
+
+/********************************************************************
+Submission and completion rings shared with the kernel by io_uring,
+	set up with the raw system calls. Pointers into the rings are
+	resolved once from the offsets the kernel hands back
+********************************************************************/
+typedef struct FAT32_uring_struct{
+	int ring_fd; //-1 if the engine is not running
+	void* sq_ring;
+	size_t sq_ring_size;
+	void* cq_ring; //Same as sq_ring if the kernel maps both rings at once
+	size_t cq_ring_size;
+	struct io_uring_sqe* sqes;
+	size_t sqes_size;
+	uint32_t* sq_head;
+	uint32_t* sq_tail;
+	uint32_t* sq_mask;
+	uint32_t* sq_array;
+	uint32_t* cq_head;
+	uint32_t* cq_tail;
+	uint32_t* cq_mask;
+	struct io_uring_cqe* cqes;
+	uint32_t queue_depth; //Most reads in flight at once, never more than the submission ring holds
+	uint32_t* resubmit; //Requests whose read came back short and need another read
+	pthread_mutex_t lock; //One batch at a time uses the rings
+} FAT32_uring;
+
+/********************************************************************
+In-memory copy of the first FAT. Entries are valid per FAT sector so
+	parts of the cache can be invalidated after writes
+********************************************************************/
+typedef struct FAT32_FAT_cache_struct{
+	uint32_t* entries; //Raw FAT entries, indexed by cluster number
+	uint8_t* valid_sectors; //One bit per FAT sector, set if its entries match the disk
+	uint32_t num_sectors; //Number of FAT sectors held in entries
+	bool is_mapped; //entries points into the disk image mapping and must not be freed
+	pthread_mutex_t refresh_lock; //Held while re-reading stale sectors, lookups may come from several threads
+} FAT32_FAT_cache;
+
+/********************************************************************
+One bit per cluster, set if the cluster's FAT entry is 0 (free).
+	Built by scanning the whole FAT once, then kept up to date as
+	FAT entries are written
+********************************************************************/
+typedef struct FAT32_free_bitmap_struct{
+	uint64_t* words; //Bit c % 64 of word c / 64 belongs to cluster c, clusters 0 and 1 are never free
+	uint32_t num_words;
+	uint32_t end_cluster; //One past the last cluster of the volume
+	uint32_t num_free; //Exact number of free clusters
+} FAT32_free_bitmap;
+
+/********************************************************************
+One block of the disk image held in the block cache
+********************************************************************/
+typedef struct FAT32_cached_block_struct{
+	uint64_t block_number; //Byte offset in the disk image divided by BLOCK_CACHE_BLOCK_SIZE
+	uint8_t* data; //BLOCK_CACHE_BLOCK_SIZE bytes of the cache's arena
+	uint32_t length; //Bytes of data that are valid, only short for the last block of the image
+	uint32_t hash_next; //Index of the next block in the same bucket, UINT32_MAX at the end
+	bool is_used;
+	bool is_referenced; //Set on every hit, cleared when the clock hand passes over the block
+} FAT32_cached_block;
+
+/********************************************************************
+Fixed-size blocks of the disk image shared by every small read, such
+	as FAT sectors and directory clusters, evicted with the CLOCK
+	algorithm once the byte budget is used up
+********************************************************************/
+typedef struct FAT32_block_cache_struct{
+	FAT32_cached_block* blocks; //NULL if the cache is off
+	uint8_t* data; //Arena holding the data of every block
+	uint32_t num_blocks;
+	uint32_t* buckets; //Index of the first block of each bucket, UINT32_MAX if empty
+	uint32_t bucket_mask; //Number of buckets minus 1
+	uint32_t clock_hand; //Next block looked at for eviction
+	size_t max_read_size; //Reads larger than this bypass the cache
+	uint64_t generation; //Bumped by every write, reads that raced with one do not fill the cache
+	pthread_mutex_t lock; //Directory and extraction workers read through the cache at the same time
+} FAT32_block_cache;
+
+/********************************************************************
+Slot of a directory's name index, an open addressing hash table
+	from normalized entry name to entry
+********************************************************************/
+typedef struct FAT32_name_index_slot_struct{
+	uint32_t hash; //Hash of the normalized name
+	uint32_t entry_number; //Index of the entry plus 1, 0 if the slot is empty
+} FAT32_name_index_slot;
+
+/********************************************************************
+A directory held in the directory cache. entries always ends with
+	an end of directory (0x00) entry, so it can be scanned like the
+	on-disk directory
+********************************************************************/
+typedef struct FAT32_cached_directory_struct{
+	uint32_t first_cluster; //Cache key
+	FAT32_Directory_Entry* entries; //Entries up to and including the end marker
+	uint32_t num_entries; //Number of entries before the end marker
+	FAT32_name_index_slot* name_index; //Built on the first name lookup, NULL until then
+	uint32_t name_index_mask; //Number of slots in name_index minus 1
+	size_t size; //Bytes charged against the cache budget
+	bool is_mapped; //entries points into the disk image mapping and must not be freed
+	bool is_stale; //Invalidated while in use, freed when the last user releases it
+	uint32_t num_users; //Directories in use are never evicted
+	struct FAT32_cached_directory_struct* hash_next; //Next directory in the same bucket
+	struct FAT32_cached_directory_struct* lru_prev; //More recently used directory
+	struct FAT32_cached_directory_struct* lru_next; //Less recently used directory
+} FAT32_cached_directory;
+
+/********************************************************************
+Parsed directories keyed by first cluster, evicted least recently
+	used first once they take more than the byte budget
+********************************************************************/
+typedef struct FAT32_directory_cache_struct{
+	FAT32_cached_directory* buckets[DIRECTORY_CACHE_BUCKETS];
+	FAT32_cached_directory* lru_head; //Most recently used
+	FAT32_cached_directory* lru_tail; //Least recently used
+	size_t size; //Bytes held by all cached directories
+	uint32_t streamed_cluster; //Directory last searched without being cached, a second lookup in it caches it
+} FAT32_directory_cache;
+
+/********************************************************************
+A directory still to be walked during a recursive extraction
+********************************************************************/
+typedef struct FAT32_pending_directory_struct{
+	uint32_t first_cluster;
+	char* output_path; //Allocated host directory the entries are written to
+} FAT32_pending_directory;
+
+/********************************************************************
+A file to be copied out of the disk image by an extraction worker
+********************************************************************/
+typedef struct FAT32_extract_job_struct{
+	uint32_t first_cluster;
+	uint32_t file_size;
+	char* output_path; //Allocated, freed by the worker once the file is written
+} FAT32_extract_job;
+
+/********************************************************************
+Pool of worker threads that copy files out of the disk image. The
+	walking thread queues jobs in a bounded ring and the workers
+	each issue their own reads against the image
+********************************************************************/
+typedef struct FAT32_extract_pool_struct{
+	FAT32_volume* volume; //Volume the files are extracted from
+	pthread_t* workers;
+	uint32_t num_workers;
+	FAT32_extract_job jobs[EXTRACT_QUEUE_LENGTH];
+	uint32_t queue_head; //Next job a worker takes
+	uint32_t num_queued; //Number of jobs waiting in the ring
+	bool closing; //Set once no more jobs will be queued
+	uint64_t files_written;
+	uint64_t bytes_written;
+	uint64_t files_failed;
+	pthread_mutex_t lock;
+	pthread_cond_t job_queued;
+	pthread_cond_t job_taken;
+} FAT32_extract_pool;
+
+/********************************************************************
+First bytes of a metadata index file. The index is only used if
+	the image still has the size, modification time and boot
+	sector and FAT checksum recorded here
+********************************************************************/
+#pragma pack(push)
+#pragma pack(1)
+typedef struct FAT32_index_header_struct{
+	char magic[8]; //INDEX_MAGIC, not terminated
+	uint32_t version; //INDEX_VERSION
+	uint32_t num_nodes; //Node 0 is the root directory
+	uint32_t num_extents;
+	uint32_t num_directories;
+	uint64_t checksum; //Of the boot sector and the first FAT
+	uint64_t image_size;
+	int64_t image_mtime_nanoseconds;
+	uint64_t nodes_offset; //Byte offsets of the three tables from the start of the file
+	uint64_t extents_offset;
+	uint64_t directories_offset;
+} FAT32_index_header;
+#pragma pack(pop)
+
+/********************************************************************
+A file or directory in the metadata index. Nodes are stored in
+	breadth first order, so the children of a directory are
+	consecutive, and sorted by name so they can be binary searched
 ********************************************************************/
 #pragma pack(push)
 #pragma pack(1)
-typedef struct file_cluster_node_struct{
-	uint32_t cluster_number;
-	struct file_cluster_node_struct* next;
-} file_cluster_node;
+typedef struct FAT32_index_node_struct{
+	char name[13]; //"NAME.EXT" or "NAME", terminated
+	uint8_t attributes; //DIR_Attr
+	uint16_t reserved;
+	uint32_t first_cluster;
+	uint32_t file_size;
+	uint32_t parent; //Node of the containing directory, the root is its own parent
+	uint32_t first_child; //First node in the directory, only meaningful for directories
+	uint32_t num_children;
+	uint32_t first_extent; //First extent of the clusterchain in the extent table
+	uint32_t num_extents;
+} FAT32_index_node;
 #pragma pack(pop)
 
-#pragma endregion Structs
+/********************************************************************
+Entry of the index table that finds a directory's node from its first
+	cluster, sorted by first_cluster
+********************************************************************/
+typedef struct FAT32_index_directory_struct{
+	uint32_t first_cluster;
+	uint32_t node;
+} FAT32_index_directory;
 
+/********************************************************************
+The metadata index of the open disk image, either mapped from the
+	index file or built in memory
+********************************************************************/
+typedef struct FAT32_index_struct{
+	uint8_t* data; //Whole index file, NULL if no index is open
+	size_t size;
+	bool is_mapped; //data is a mapping of the index file and must be unmapped rather than freed
+	FAT32_index_header* header;
+	FAT32_index_node* nodes;
+	file_cluster_extent* extents;
+	FAT32_index_directory* directories;
+} FAT32_index;
+
+/********************************************************************
+Everything counted by the statistics module. Keep stat_counter_names
+	in FAT32_stats.c in the same order
+********************************************************************/
+typedef enum FAT32_stat_counter_enum{
+	STAT_READ_SYSCALLS, //pread() and io_uring_enter() calls
+	STAT_BYTES_READ, //Bytes read from the disk image, including copies out of the mapping
+	STAT_READ_NANOSECONDS, //Time spent waiting for reads
+	STAT_URING_READS, //Reads completed through io_uring
+	STAT_BOUNCED_READS, //Direct reads of unaligned ranges that went through a bounce buffer
+	STAT_WRITE_SYSCALLS, //write() calls on output files
+	STAT_BYTES_WRITTEN,
+	STAT_WRITE_NANOSECONDS, //Time spent waiting for writes
+	STAT_ZERO_COPY_SYSCALLS, //copy_file_range(), sendfile() and splice() calls
+	STAT_BYTES_ZERO_COPIED, //Bytes copied from the disk image to output files by the kernel
+	STAT_ZERO_COPY_NANOSECONDS,
+	STAT_FAT_LOOKUPS, //Calls to get_FAT_entry_contents()
+	STAT_FAT_CACHE_HITS,
+	STAT_FAT_CACHE_MISSES, //FAT entries read from the disk one at a time
+	STAT_DIRECTORY_CACHE_HITS,
+	STAT_DIRECTORY_CACHE_MISSES,
+	STAT_BLOCK_CACHE_HITS, //Blocks copied out of the block cache
+	STAT_BLOCK_CACHE_MISSES, //Blocks read from the disk image into the block cache
+	STAT_CHAINS_BUILT, //Calls to build_clusterchain()
+	STAT_CHAIN_CLUSTERS, //Clusters in all the built chains
+	STAT_CHAIN_EXTENTS, //Extents in all the built chains
+	STAT_CHAIN_NANOSECONDS, //Time spent following the FAT
+	STAT_CHAINS_READ, //Calls to read_clusterchain()
+	STAT_ALLOCATIONS, //Heap allocations made for chains, buffers and cached directories
+	STAT_BYTES_ALLOCATED,
+	STAT_BYTES_DIGESTED, //Bytes of extracted files run through CRC32C or SHA-256
+	STAT_DIGEST_NANOSECONDS, //Time spent computing digests
+	NUM_STAT_COUNTERS
+} FAT32_stat_counter;
+
+/********************************************************************
+Shell commands with their own latency histogram. Keep
+	stat_command_names in FAT32_stats.c in the same order
+********************************************************************/
+typedef enum FAT32_stat_command_enum{
+	STAT_COMMAND_INFO,
+	STAT_COMMAND_DIR,
+	STAT_COMMAND_CD,
+	STAT_COMMAND_GET,
+	STAT_COMMAND_PUT,
+	STAT_COMMAND_STATS,
+	STAT_COMMAND_FREE,
+	STAT_COMMAND_FIND,
+	STAT_COMMAND_DU,
+	STAT_COMMAND_CHECK,
+	STAT_COMMAND_OTHER, //Unknown commands
+	NUM_STAT_COMMANDS
+} FAT32_stat_command;
 
-#pragma region Globals
+/********************************************************************
+Latencies of one shell command
+********************************************************************/
+typedef struct FAT32_latency_histogram_struct{
+	uint64_t count;
+	uint64_t total_nanoseconds;
+	uint64_t max_nanoseconds;
+	uint64_t buckets[LATENCY_BUCKETS];
+} FAT32_latency_histogram;
 
 /********************************************************************
-Global variable used to store the disk image file descriptor
+Counters and histograms of one volume. Counters are updated
+	atomically since extraction workers, the stream reader thread
+	and server clients count too
 ********************************************************************/
-int disk_image_fd;
+typedef struct FAT32_stats_struct{
+	uint64_t counters[NUM_STAT_COUNTERS];
+	FAT32_latency_histogram commands[NUM_STAT_COMMANDS];
+} FAT32_stats;
 
 /********************************************************************
-Path to diskimage from root directory (where makefile is)
+Layout of the volume, computed once from the boot sector so address
+	math does not go back to the BPB for every cluster. When sectors
+	and clusters are powers of two in size, which the specification
+	requires, cluster and FAT entry addresses are shifts
 ********************************************************************/
-char* disk_image_path;
+typedef struct FAT32_geometry_struct{
+	uint32_t bytes_per_sector;
+	uint32_t sectors_per_cluster;
+	uint32_t cluster_size; //Bytes per cluster
+	uint32_t first_data_sector; //Sector of cluster 2
+	uint32_t num_clusters; //Data clusters, numbered from 2
+	uint32_t end_cluster; //One past the last cluster of the volume
+	uint32_t FAT_entries_per_sector;
+	uint32_t active_FAT; //FAT that is read and written, 0 unless mirroring is off
+	bool is_FAT_mirrored; //BPB_ExtFlags bit 7 is clear, every FAT copy is written
+	off_t FAT_size; //Bytes per FAT copy
+	off_t FAT_byte_offset; //Byte offset of the active FAT
+	off_t data_byte_offset; //Byte offset of cluster 2
+	bool is_power_of_two; //Sector and cluster sizes are powers of two, so the shifts below are valid
+	uint8_t sector_shift; //log2(bytes_per_sector)
+	uint8_t cluster_shift; //log2(cluster_size)
+	uint8_t FAT_entries_per_sector_shift; //log2(FAT_entries_per_sector)
+} FAT32_geometry;
 
 /********************************************************************
-Global reference to boot sector
+Everything known about one opened disk image: its descriptors, the
+	boot sector and FSInfo sector, and every cache built from it.
+	Every function reading or writing the image takes the volume,
+	so one process can have several images open
 ********************************************************************/
-FAT32_BS* boot_sector;
+struct FAT32_volume_struct{
+	FAT32_settings settings; //Run-time settings the volume was opened with
+	char* disk_image_path;
+	int disk_image_fd; //-1 if the image could not be opened
+	int disk_image_direct_fd; //Second, O_DIRECT, descriptor. -1 unless settings.use_direct_io is set
+	size_t direct_io_alignment; //Alignment in bytes of the offsets, lengths and buffers of direct reads
+	uint8_t* disk_image_map; //Read-only mapping of the disk image, NULL when it is accessed with read()
+	size_t disk_image_map_size;
+	FAT32_BS* boot_sector;
+	FAT32_geometry geometry; //Computed from boot_sector when it is read
+	FAT32_FSInfo* fs_info_sector;
+	FAT32_cached_directory* pinned_root_directory; //Stays in use, and so stays cached, while the volume is open
+	FAT32_Directory_Entry* root_directory; //Entries of pinned_root_directory
+	FAT32_FAT_cache FAT_cache;
+	FAT32_directory_cache directory_cache;
+	FAT32_block_cache block_cache;
+	FAT32_free_bitmap free_bitmap;
+	FAT32_index index;
+	FAT32_uring uring;
+	FAT32_stats stats; //I/O counters and command latencies of this volume
+};
 
 /********************************************************************
-Global reference to file system sector
+A position in the directory tree of a volume. Each shell session
+	has its own, so sessions on the same volume do not move each
+	other around
 ********************************************************************/
-FAT32_FSInfo* fs_info_sector;
+typedef struct FAT32_cursor_struct{
+	FAT32_volume* volume;
+	uint32_t current_directory_cluster; //First cluster of the current directory
+} FAT32_cursor;
 
 /********************************************************************
-Global reference to root directory
+Reads a directory one cluster at a time, only as far as the entries
+	asked for, instead of reading its whole clusterchain first
 ********************************************************************/
-FAT32_Directory_Entry* root_directory;
+typedef struct FAT32_directory_iterator_struct{
+	FAT32_volume* volume;
+	uint32_t first_cluster;
+	uint32_t next_cluster; //FAT entry of the current cluster, read once its entries run out unless it is EOC
+	uint32_t num_clusters_read;
+	uint32_t saved_cluster; //Brent's algorithm, as in follow_clusterchain(), so a looping chain ends
+	uint32_t power;
+	uint32_t loop_length;
+	FAT32_Directory_Entry* entries; //Entries of the current cluster, in buffer or in the disk image mapping
+	uint8_t* buffer; //Holds the current cluster when the image is not mapped, allocated on first use
+	uint32_t entries_per_cluster;
+	uint32_t next_entry; //Index in entries of the next entry looked at
+	bool is_done; //The end marker or the end of the chain was reached
+} FAT32_directory_iterator;
 
 /********************************************************************
-Global reference to the first cluster of the current directory
+What the library API tells about a file or directory
 ********************************************************************/
-uint32_t current_directory_cluster;
+typedef struct FAT32_file_info_struct{
+	char name[13]; //"NAME.EXT" or "NAME", terminated, "/" for the root directory
+	uint8_t attributes; //DIR_Attr, 0x10 for directories
+	uint32_t first_cluster; //0 for empty files
+	uint32_t file_size; //0 for directories
+} FAT32_file_info;
+
+/********************************************************************
+A directory opened with fat32_opendir(). The directory stays in use
+	in the directory cache until the stream is closed
+********************************************************************/
+typedef struct FAT32_directory_stream_struct{
+	FAT32_volume* volume;
+	FAT32_cached_directory* directory;
+	uint32_t next_entry; //Index of the next entry fat32_readdir() looks at
+} FAT32_directory_stream;
+
+/********************************************************************
+A file opened with fat32_open(). Its clusterchain is built once, so
+	reads at any offset only look up the extent holding it
+********************************************************************/
+typedef struct FAT32_file_struct{
+	FAT32_volume* volume;
+	file_clusterchain* chain; //NULL for empty files
+	uint32_t file_size;
+	uint64_t position; //Offset of the next fat32_read()
+} FAT32_file;
+
+/********************************************************************
+Header of every response the server sends, followed by length bytes
+	of payload. Both fields are in host byte order
+********************************************************************/
+#pragma pack(push)
+#pragma pack(1)
+typedef struct FAT32_server_response_struct{
+	uint32_t status; //0, or the errno value describing why the request failed
+	uint32_t length; //Bytes of payload, 0 for failed requests
+} FAT32_server_response;
+#pragma pack(pop)
+
+/********************************************************************
+Images mounted by the server, shared by every client connection
+********************************************************************/
+typedef struct FAT32_server_struct{
+	char* socket_path;
+	int listen_fd;
+	FAT32_volume** volumes;
+	pthread_mutex_t* volume_locks; //Held while looking paths up, file data is copied without it
+	uint32_t num_volumes;
+	int* client_fds; //Connections being served, shut down when the server stops
+	uint32_t num_clients;
+	uint32_t client_capacity;
+	pthread_mutex_t lock; //Guards the client list
+	pthread_cond_t client_closed;
+} FAT32_server;
+
+/********************************************************************
+One connection to the server, served by its own thread
+********************************************************************/
+typedef struct FAT32_server_client_struct{
+	FAT32_server* server;
+	int fd;
+} FAT32_server_client;
+
+/********************************************************************
+A directory still to be read by a full volume traversal
+********************************************************************/
+typedef struct FAT32_traversal_item_struct{
+	uint32_t first_cluster;
+	uint32_t subtree; //Which directory below the starting one this is in, 0 for the starting directory itself
+	char* path; //Allocated path from the starting directory, NULL when paths are not needed
+} FAT32_traversal_item;
+
+/********************************************************************
+One thread of a traversal. The thread pushes and pops directories at
+	the tail of its own deque, idle threads steal from the head, so
+	the oldest and usually largest subtrees are the ones shared
+********************************************************************/
+typedef struct FAT32_traversal_worker_struct{
+	pthread_t thread;
+	struct FAT32_traversal_struct* traversal;
+	uint32_t id;
+	FAT32_traversal_item* deque;
+	uint32_t head; //Next item stolen
+	uint32_t tail; //One past the next item popped by the owner
+	uint32_t capacity;
+	pthread_mutex_t lock; //Guards the deque, the owner and thieves rarely touch the same end
+	uint64_t* subtree_bytes; //File sizes per subtree
+	uint64_t* subtree_allocated; //Bytes of whole clusters per subtree
+	uint64_t num_files;
+	uint64_t num_directories;
+	uint64_t num_steals;
+	char** matches; //Allocated paths of the entries matching the pattern
+	uint32_t num_matches;
+	uint32_t match_capacity;
+} FAT32_traversal_worker;
+
+/********************************************************************
+State of a consistency check, shared by the threads walking the tree
+********************************************************************/
+typedef struct FAT32_check_struct{
+	FAT32_volume* volume;
+	uint32_t end_cluster; //One past the last cluster of the volume
+	uint32_t cluster_size;
+	uint64_t* owned; //One bit per cluster, set once a chain reached from a directory entry holds it
+	uint64_t num_chains; //Chains followed, one per entry with clusters
+	uint64_t num_owned_clusters; //Clusters held by at least one chain
+	uint64_t num_cross_linked; //Chains holding clusters another chain already held
+	uint64_t num_broken; //Chains ending in a free, bad or out of range FAT entry
+	uint64_t num_loops; //Chains that loop back on themselves
+	uint64_t num_size_mismatches; //Files whose chain does not match DIR_FileSize
+	uint32_t num_FAT_mismatches; //FAT copies that differ from the first
+	char** problems; //One allocated line per problem found
+	uint32_t num_problems;
+	uint32_t problem_capacity;
+	pthread_mutex_t problem_lock; //Guards problems, which are rare, the counters are atomic
+} FAT32_check;
+
+/********************************************************************
+A parallel walk of every directory below a starting directory, with
+	per-thread results merged once all the threads are done
+********************************************************************/
+typedef struct FAT32_traversal_struct{
+	FAT32_volume* volume; //Volume being walked
+	FAT32_traversal_worker* workers;
+	uint32_t num_workers;
+	char* pattern; //Glob names are matched against, NULL to only add up sizes
+	FAT32_check* check; //Every entry's clusterchain is checked against it, NULL when not checking
+	uint64_t* visited; //One bit per cluster, set once the directory starting there has been queued
+	uint32_t end_cluster;
+	char** subtree_names; //Name of each directory directly below the starting one, [0] is "."
+	uint32_t num_subtrees;
+	uint32_t num_pending; //Directories queued or being read, the walk is done once this is 0
+	uint32_t num_queued; //Directories sitting in deques
+	uint32_t num_idle; //Threads waiting for work
+	pthread_mutex_t idle_lock;
+	pthread_cond_t work_queued; //Signaled when a directory is queued while threads are idle, or when the walk is done
+} FAT32_traversal;
+
+#pragma endregion Structs
 
-#pragma endregion Globals
 
 #endif
\ No newline at end of file
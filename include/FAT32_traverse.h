@@ -0,0 +1,51 @@
+/********************************************************************
+    Module: FAT32_traverse.h
+    Author: Brennan Couturier
+
+    Parallel walk of every directory of the volume, used by
+    the find, du and check commands
+********************************************************************/
+
+#ifndef FAT32_TRAVERSE_H
+#define FAT32_TRAVERSE_H
+
+#include "FAT32_structs_globals.h"
+
+#pragma region Traversal_Functions
+
+/********************************************************************
+Walks every directory of the volume, from BPB_RootClus, with
+	settings.num_threads threads. Names are matched against pattern unless it is NULL,
+	and every entry's clusterchain is checked against check unless
+	it is NULL. Returns each thread's results, free them with
+	free_traversal()
+********************************************************************/
+FAT32_traversal* run_traversal(FAT32_volume* volume, char* pattern, FAT32_check* check);
+
+/********************************************************************
+Frees a traversal and everything its workers collected
+********************************************************************/
+void free_traversal(FAT32_traversal* traversal);
+
+/********************************************************************
+Prints how much was walked and how much work had to be shared
+********************************************************************/
+void print_traversal_summary(FAT32_traversal* traversal, uint64_t start);
+
+/********************************************************************
+Prints the path, from the root, of every file and directory on the
+	volume whose name matches the glob pattern, ignoring case.
+	Directories are read by settings.num_threads threads
+********************************************************************/
+void find_entries(FAT32_cursor* cursor, char* pattern);
+
+/********************************************************************
+Prints the size of each directory directly below the root, of the
+	files in the root directory itself, and the total,
+	both as file sizes and as whole clusters on disk
+********************************************************************/
+void print_disk_usage(FAT32_cursor* cursor);
+
+#pragma endregion Traversal_Functions
+
+#endif
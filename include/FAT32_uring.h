@@ -0,0 +1,45 @@
+/********************************************************************
+    Module: FAT32_uring.h
+    Author: Brennan Couturier
+
+    Asynchronous read engine for the disk image built on io_uring
+********************************************************************/
+
+#ifndef FAT32_URING_H
+#define FAT32_URING_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+#include "FAT32_structs_globals.h"
+
+#pragma region Uring_Engine_Functions
+
+/********************************************************************
+Sets up an io_uring instance able to keep queue_depth reads of the
+	disk image in flight. Returns false, leaving the engine stopped,
+	if the kernel does not support io_uring or does not allow it
+********************************************************************/
+bool start_uring_engine(FAT32_volume* volume, uint32_t queue_depth);
+
+/********************************************************************
+Checks if start_uring_engine() succeeded
+********************************************************************/
+bool is_uring_engine_running(FAT32_volume* volume);
+
+/********************************************************************
+Reads every request of the batch, keeping up to the queue depth of
+	reads in flight. Reads complete in any order, each straight into
+	its own buffer. Short reads are resubmitted for the rest, so a
+	request only ends short at the end of the disk image
+********************************************************************/
+void read_uring_batch(FAT32_volume* volume, FAT32_read_request* requests, uint32_t num_requests);
+
+/********************************************************************
+Tears down the io_uring instance, if there is one
+********************************************************************/
+void stop_uring_engine(FAT32_volume* volume);
+
+#pragma endregion Uring_Engine_Functions
+
+#endif
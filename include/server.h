@@ -0,0 +1,37 @@
+/********************************************************************
+    Module: server.h
+    Author: Brennan Couturier
+
+    Long-running server answering list, stat and extract requests from
+    local clients over a Unix domain socket, with every image mounted
+    once and its caches kept warm between requests
+********************************************************************/
+
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <inttypes.h>
+
+#include "FAT32_structs_globals.h"
+
+#define SERVER_MAX_REQUEST 4096 //Longest request payload accepted, longer requests close the connection
+#define SERVER_BACKLOG 64 //Connections waiting to be accepted
+
+/********************************************************************
+Mounts every image with the settings, listens on socket_path and
+	serves clients, each on its own thread, until SIGINT or SIGTERM.
+
+	A request is a 4-byte length in host byte order followed by that
+	many bytes of text, "<command> <image> <path>", where image is
+	the position of the image on the command line starting at 0 and
+	command is one of:
+		images : lists the mounted images, takes no image or path
+		stat : "NAME ATTRIBUTES FIRST_CLUSTER SIZE\n" for path
+		list : one such line per entry of the directory at path
+		extract : the contents of the file at path
+	Every request gets a FAT32_server_response followed by its
+	payload. Clients may send many requests on one connection
+********************************************************************/
+void run_server(char* socket_path, char** image_paths, uint32_t num_images, FAT32_settings* settings);
+
+#endif
@@ -8,9 +8,12 @@
 #ifndef SHELL_H
 #define SHELL_H
 
+#include "FAT32_structs_globals.h"
+
 /********************************************************************
-Loop that reads user input and executes commands
+Loop that reads user input and executes commands, moving the cursor
+	around its volume
 ********************************************************************/
-void run_shell();
+void run_shell(FAT32_cursor* cursor);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,385 @@
+/********************************************************************
+    Module: FAT32_api.c
+    Author: Brennan Couturier
+
+    Programmatic read API of libfat32, built on the volume, the
+    caches and the clusterchain helpers the shell uses
+********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "../include/FAT32_structs_globals.h"
+#include "../include/FAT32_api.h"
+#include "../include/FAT32_disk_management.h"
+#include "../include/FAT32_helpers.h"
+#include "../include/FAT32_io.h"
+#include "../include/FAT32_cache.h"
+#include "../include/FAT32_index.h"
+
+#pragma region Volume_Functions
+
+/********************************************************************
+Fills settings with the defaults the shell starts with
+********************************************************************/
+void fat32_default_settings(FAT32_settings* settings){
+
+    memset(settings, 0, sizeof(FAT32_settings));
+    settings->max_io_size = DEFAULT_MAX_IO_SIZE;
+    settings->directory_cache_budget = DEFAULT_DIRECTORY_CACHE_BUDGET;
+    settings->block_cache_budget = DEFAULT_BLOCK_CACHE_BUDGET;
+    settings->use_zero_copy = true;
+
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    settings->num_threads = (num_cpus > 0) ? num_cpus : 1;
+
+}
+
+/********************************************************************
+Opens the disk image at path. settings may be NULL to use the
+    defaults, which open it read-only
+********************************************************************/
+FAT32_volume* fat32_mount(char* path, FAT32_settings* settings){
+
+    FAT32_settings default_settings;
+
+    if(settings == NULL){
+        fat32_default_settings(&default_settings);
+        settings = &default_settings;
+    }
+
+    return open_volume(path, settings);
+
+}
+
+/********************************************************************
+Closes a volume returned by fat32_mount()
+********************************************************************/
+void fat32_unmount(FAT32_volume* volume){
+
+    close_volume(volume);
+
+}
+
+#pragma endregion Volume_Functions
+
+#pragma region Lookup_Functions
+
+/********************************************************************
+Describes the root directory, which has no entry of its own
+********************************************************************/
+static void get_root_info(FAT32_volume* volume, FAT32_file_info* info){
+
+    memset(info, 0, sizeof(FAT32_file_info));
+    strcpy(info->name, "/");
+    info->attributes = 0x10;
+    info->first_cluster = volume->boot_sector->BPB_RootClus;
+
+}
+
+/********************************************************************
+Resolves path from the root directory, through the index when one is
+    open, and fills info. *indexed is set to the entry's index node,
+    or to NULL if it came from the directory cache. Returns 0 or the
+    errno value describing why the path does not exist
+********************************************************************/
+static int resolve_path(FAT32_volume* volume, char* path, FAT32_file_info* info, FAT32_index_node** indexed){
+
+    get_root_info(volume, info);
+    *indexed = NULL;
+
+    if(is_index_open(volume)){
+        *indexed = find_index_path(volume, volume->boot_sector->BPB_RootClus, path);
+        if(*indexed == NULL){
+            return ENOENT;
+        }
+        if(*indexed != &volume->index.nodes[0]){
+            strcpy(info->name, (*indexed)->name);
+            info->attributes = (*indexed)->attributes;
+            info->first_cluster = (*indexed)->first_cluster;
+            info->file_size = (*indexed)->file_size;
+        }
+        return 0;
+    }
+
+    char path_copy[strlen(path) + 1];
+    char* save_pointer;
+    strcpy(path_copy, path);
+
+    //Walk one directory per component, each lookup is a hash probe in the cached directory
+    char* component = strtok_r(path_copy, "/", &save_pointer);
+    while(component != NULL){
+        if(!(info->attributes & 0x10)){
+            return ENOTDIR;
+        }
+        if(strcmp(component, ".") != 0){
+            FAT32_cached_directory* directory = get_cached_directory(volume, info->first_cluster);
+            FAT32_Directory_Entry* dir = find_cached_directory_entry(volume, directory, component);
+
+            if(dir == NULL){
+                release_cached_directory(volume, directory);
+                return ENOENT;
+            }
+            normalize_entry_name(dir, info->name);
+            info->attributes = dir->DIR_Attr;
+            info->first_cluster = (dir->DIR_FstClusHI << 16) | dir->DIR_FstClusLO;
+            info->file_size = dir->DIR_FileSize;
+            release_cached_directory(volume, directory);
+
+            //A '..' holding 0 is the root directory
+            if(strcmp(component, "..") == 0 && info->first_cluster == 0){
+                get_root_info(volume, info);
+            }
+        }
+        component = strtok_r(NULL, "/", &save_pointer);
+    }
+
+    return 0;
+
+}
+
+/********************************************************************
+Fills info with what is known about the file or directory at path
+********************************************************************/
+int fat32_stat(FAT32_volume* volume, char* path, FAT32_file_info* info){
+
+    FAT32_index_node* indexed;
+    int error = resolve_path(volume, path, info, &indexed);
+
+    if(error != 0){
+        errno = error;
+        return -1;
+    }
+
+    return 0;
+
+}
+
+/********************************************************************
+Opens the directory at path for reading its entries
+********************************************************************/
+FAT32_directory_stream* fat32_opendir(FAT32_volume* volume, char* path){
+
+    FAT32_file_info info;
+    FAT32_index_node* indexed;
+    int error = resolve_path(volume, path, &info, &indexed);
+
+    if(error == 0 && !(info.attributes & 0x10)){
+        error = ENOTDIR;
+    }
+    if(error != 0){
+        errno = error;
+        return NULL;
+    }
+
+    FAT32_directory_stream* stream = malloc(sizeof(FAT32_directory_stream));
+    if(stream == NULL){
+        fprintf(stderr, "\nError in fat32_opendir() : Could not allocate space for FAT32_directory_stream struct\n");
+        exit(EXIT_FAILURE);
+    }
+
+    stream->volume = volume;
+    stream->directory = get_cached_directory(volume, info.first_cluster);
+    stream->next_entry = 0;
+
+    return stream;
+
+}
+
+/********************************************************************
+Fills info with the next entry of the directory. Returns 1, or 0 once
+    there are no entries left
+********************************************************************/
+int fat32_readdir(FAT32_directory_stream* stream, FAT32_file_info* info){
+
+    while(stream->next_entry < stream->directory->num_entries){
+
+        FAT32_Directory_Entry* dir = &stream->directory->entries[stream->next_entry++];
+
+        if(!is_named_entry(dir)){
+            continue;
+        }
+
+        normalize_entry_name(dir, info->name);
+        info->attributes = dir->DIR_Attr;
+        info->first_cluster = (dir->DIR_FstClusHI << 16) | dir->DIR_FstClusLO;
+        info->file_size = dir->DIR_FileSize;
+        return 1;
+    }
+
+    return 0;
+
+}
+
+/********************************************************************
+Closes a directory returned by fat32_opendir()
+********************************************************************/
+void fat32_closedir(FAT32_directory_stream* stream){
+
+    release_cached_directory(stream->volume, stream->directory);
+    free(stream);
+
+}
+
+#pragma endregion Lookup_Functions
+
+#pragma region File_Functions
+
+/********************************************************************
+Opens the file at path for reading. The clusterchain is taken from
+    the index when it holds it, and built from the FAT otherwise
+********************************************************************/
+FAT32_file* fat32_open(FAT32_volume* volume, char* path){
+
+    FAT32_file_info info;
+    FAT32_index_node* indexed;
+    int error = resolve_path(volume, path, &info, &indexed);
+
+    if(error == 0 && (info.attributes & 0x10)){
+        error = EISDIR;
+    }
+    if(error != 0){
+        errno = error;
+        return NULL;
+    }
+
+    FAT32_file* file = malloc(sizeof(FAT32_file));
+    if(file == NULL){
+        fprintf(stderr, "\nError in fat32_open() : Could not allocate space for FAT32_file struct\n");
+        exit(EXIT_FAILURE);
+    }
+
+    file->volume = volume;
+    file->chain = NULL;
+    file->file_size = 0;
+    file->position = 0;
+    if(info.file_size > 0 && info.first_cluster >= 2){
+        file->chain = (indexed != NULL && indexed->num_extents > 0) ? get_index_clusterchain(volume, indexed)
+                                                                    : build_clusterchain(volume, info.first_cluster);
+        file->file_size = info.file_size;
+    }
+
+    return file;
+
+}
+
+/********************************************************************
+Reads up to count bytes of the file starting at offset into buffer.
+    Each extent the range touches is one read of the disk image
+********************************************************************/
+size_t fat32_pread(FAT32_file* file, void* buffer, size_t count, uint64_t offset){
+
+    FAT32_volume* volume = file->volume;
+    size_t cluster_size = volume->geometry.cluster_size;
+    uint64_t extent_start = 0; //Offset in the file of the extent being looked at
+    size_t total_read = 0;
+    uint32_t i;
+
+    if(offset >= file->file_size){
+        return 0;
+    }
+    if(count > file->file_size - offset){
+        count = file->file_size - offset;
+    }
+
+    for(i = 0; i < file->chain->num_extents && total_read < count; i++){
+
+        file_cluster_extent* extent = &file->chain->extents[i];
+        uint64_t extent_size = (uint64_t)extent->num_clusters * cluster_size;
+
+        //Skip the extents entirely before the range
+        if(offset + total_read >= extent_start + extent_size){
+            extent_start += extent_size;
+            continue;
+        }
+
+        uint64_t offset_in_extent = offset + total_read - extent_start;
+        size_t length = extent_size - offset_in_extent;
+        if(length > count - total_read){
+            length = count - total_read;
+        }
+
+        __off_t byte_offset = get_cluster_byte_offset(volume, extent->first_cluster) + offset_in_extent;
+        size_t bytes_read = read_disk_image(volume, (uint8_t*)buffer + total_read, length, byte_offset);
+        total_read += bytes_read;
+        if(bytes_read != length){
+            break;
+        }
+        extent_start += extent_size;
+    }
+
+    return total_read;
+
+}
+
+/********************************************************************
+Reads up to count bytes of the file from its position into buffer and
+    moves the position past them
+********************************************************************/
+size_t fat32_read(FAT32_file* file, void* buffer, size_t count){
+
+    size_t bytes_read = fat32_pread(file, buffer, count, file->position);
+    file->position += bytes_read;
+
+    return bytes_read;
+
+}
+
+/********************************************************************
+Closes a file returned by fat32_open()
+********************************************************************/
+void fat32_close(FAT32_file* file){
+
+    if(file->chain != NULL){
+        free_clusterchain(file->chain);
+    }
+    free(file);
+
+}
+
+/********************************************************************
+Copies the whole file into output_fd, letting the kernel copy the
+    data when it can. The copy streams a copy of the clusterchain,
+    so the file stays open
+********************************************************************/
+int64_t fat32_extract_file(FAT32_file* file, int output_fd){
+
+    file_clusterchain* chain;
+    uint32_t i;
+
+    if(file->chain == NULL){
+        return 0;
+    }
+
+    chain = create_clusterchain(file->volume);
+    for(i = 0; i < file->chain->num_extents; i++){
+        append_extent_to_chain(chain, file->chain->extents[i].first_cluster, file->chain->extents[i].num_clusters);
+    }
+
+    //Frees the copy
+    return stream_clusterchain(file->volume, chain, output_fd, file->file_size, NULL);
+
+}
+
+/********************************************************************
+Copies the whole file at path into output_fd
+********************************************************************/
+int64_t fat32_extract(FAT32_volume* volume, char* path, int output_fd){
+
+    FAT32_file* file = fat32_open(volume, path);
+    if(file == NULL){
+        return -1;
+    }
+
+    int64_t bytes_written = fat32_extract_file(file, output_fd);
+    fat32_close(file);
+
+    return bytes_written;
+
+}
+
+#pragma endregion File_Functions
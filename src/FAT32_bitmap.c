@@ -0,0 +1,294 @@
+/********************************************************************
+    Module: FAT32_bitmap.c
+    Author: Brennan Couturier
+
+    Bitmap of free clusters, used for exact free space accounting
+    and for allocation
+********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FREE_BITMAP_X86
+#endif
+
+#include "../include/FAT32_structs_globals.h"
+#include "../include/FAT32_bitmap.h"
+#include "../include/FAT32_cache.h"
+#include "../include/FAT32_helpers.h"
+#include "../include/FAT32_io.h"
+
+#define BITMAP_SCAN_CHUNK (1 << 16) //FAT entries scanned per chunk, a multiple of 64
+
+#pragma region Scan_Functions
+
+/********************************************************************
+Sets bit i of words[i / 64] for every free entry among num_words * 64
+    entries, one entry at a time
+********************************************************************/
+static void scan_FAT_scalar(const uint32_t* entries, uint32_t num_words, uint64_t* words){
+
+    uint32_t i, j;
+
+    for(i = 0; i < num_words; i++){
+        uint64_t word = 0;
+        for(j = 0; j < 64; j++){
+            if((entries[(size_t)i * 64 + j] & FAT_ENTRY_MASK) == 0){
+                word |= 1ULL << j;
+            }
+        }
+        words[i] = word;
+    }
+
+}
+
+#ifdef FREE_BITMAP_X86
+
+/********************************************************************
+SSE2 version of scan_FAT_scalar(), comparing 4 entries at a time
+********************************************************************/
+__attribute__((target("sse2")))
+static void scan_FAT_sse2(const uint32_t* entries, uint32_t num_words, uint64_t* words){
+
+    const __m128i mask = _mm_set1_epi32(FAT_ENTRY_MASK);
+    const __m128i zero = _mm_setzero_si128();
+    uint32_t i, j;
+
+    for(i = 0; i < num_words; i++){
+        const uint32_t* block = entries + (size_t)i * 64;
+        uint64_t word = 0;
+        for(j = 0; j < 16; j++){
+            __m128i values = _mm_and_si128(_mm_loadu_si128((const __m128i*)(block + j * 4)), mask);
+            uint32_t bits = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(values, zero)));
+            word |= (uint64_t)bits << (j * 4);
+        }
+        words[i] = word;
+    }
+
+}
+
+/********************************************************************
+AVX2 version of scan_FAT_scalar(), comparing 8 entries at a time
+********************************************************************/
+__attribute__((target("avx2")))
+static void scan_FAT_avx2(const uint32_t* entries, uint32_t num_words, uint64_t* words){
+
+    const __m256i mask = _mm256_set1_epi32(FAT_ENTRY_MASK);
+    const __m256i zero = _mm256_setzero_si256();
+    uint32_t i, j;
+
+    for(i = 0; i < num_words; i++){
+        const uint32_t* block = entries + (size_t)i * 64;
+        uint64_t word = 0;
+        for(j = 0; j < 8; j++){
+            __m256i values = _mm256_and_si256(_mm256_loadu_si256((const __m256i*)(block + j * 8)), mask);
+            uint32_t bits = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(values, zero)));
+            word |= (uint64_t)bits << (j * 8);
+        }
+        words[i] = word;
+    }
+
+}
+
+#endif
+
+/********************************************************************
+Picks the widest scan the CPU supports
+********************************************************************/
+static void (*choose_FAT_scan())(const uint32_t*, uint32_t, uint64_t*){
+
+#ifdef FREE_BITMAP_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")){
+        return scan_FAT_avx2;
+    }
+    if(__builtin_cpu_supports("sse2")){
+        return scan_FAT_sse2;
+    }
+#endif
+
+    return scan_FAT_scalar;
+
+}
+
+#pragma endregion Scan_Functions
+
+#pragma region Free_Bitmap_Functions
+
+/********************************************************************
+Scans the whole FAT and builds the free cluster bitmap
+********************************************************************/
+void build_free_bitmap(FAT32_volume* volume){
+
+    void (*scan_FAT)(const uint32_t*, uint32_t, uint64_t*) = choose_FAT_scan();
+    uint32_t* chunk_buffer = NULL;
+    uint32_t first_cluster, i;
+
+    //The FAT may hold a few more entries than the volume has clusters
+    uint32_t FAT_entries = (uint32_t)(((uint64_t)volume->boot_sector->BPB_FATSz32 * volume->boot_sector->BPB_BytesPerSec) / sizeof(uint32_t));
+    volume->free_bitmap.end_cluster = volume->geometry.end_cluster;
+    if(volume->free_bitmap.end_cluster > FAT_entries){
+        volume->free_bitmap.end_cluster = FAT_entries;
+    }
+    volume->free_bitmap.num_words = (volume->free_bitmap.end_cluster + 63) / 64;
+
+    free(volume->free_bitmap.words);
+    volume->free_bitmap.words = calloc(volume->free_bitmap.num_words, sizeof(uint64_t));
+    if(volume->free_bitmap.words == NULL){
+        fprintf(stderr, "\nError in build_free_bitmap() : Could not allocate space for free bitmap\n");
+        exit(EXIT_FAILURE);
+    }
+
+    //Scan in whole words of 64 entries. Sectors hold a multiple of 64 entries, so the last word is still inside the FAT
+    for(first_cluster = 0; first_cluster < volume->free_bitmap.num_words * 64; first_cluster += BITMAP_SCAN_CHUNK){
+        uint32_t count = volume->free_bitmap.num_words * 64 - first_cluster;
+        if(count > BITMAP_SCAN_CHUNK){
+            count = BITMAP_SCAN_CHUNK;
+        }
+
+        uint32_t* entries = get_FAT_cache_entries(volume, first_cluster, count);
+        if(entries == NULL){
+            //The FAT is not cached, read the chunk from the disk. Entries past the end of the image count as used
+            if(chunk_buffer == NULL){
+                chunk_buffer = malloc(BITMAP_SCAN_CHUNK * sizeof(uint32_t));
+                if(chunk_buffer == NULL){
+                    fprintf(stderr, "\nError in build_free_bitmap() : Could not allocate space for FAT chunk\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            off_t chunk_byte_location = volume->geometry.FAT_byte_offset
+                                        + (off_t)first_cluster * sizeof(uint32_t);
+            size_t bytes_read = read_disk_image(volume, chunk_buffer, (size_t)count * sizeof(uint32_t), chunk_byte_location);
+            memset((uint8_t*)chunk_buffer + bytes_read, 0xFF, (size_t)count * sizeof(uint32_t) - bytes_read);
+            entries = chunk_buffer;
+        }
+
+        scan_FAT(entries, count / 64, &volume->free_bitmap.words[first_cluster / 64]);
+    }
+    free(chunk_buffer);
+
+    //Clusters 0 and 1 are reserved, and bits past the end of the volume are not clusters
+    volume->free_bitmap.words[0] &= ~3ULL;
+    if(volume->free_bitmap.end_cluster % 64 != 0){
+        volume->free_bitmap.words[volume->free_bitmap.num_words - 1] &= (1ULL << (volume->free_bitmap.end_cluster % 64)) - 1;
+    }
+
+    volume->free_bitmap.num_free = 0;
+    for(i = 0; i < volume->free_bitmap.num_words; i++){
+        volume->free_bitmap.num_free += __builtin_popcountll(volume->free_bitmap.words[i]);
+    }
+
+}
+
+/********************************************************************
+Returns the exact number of free clusters on the volume
+********************************************************************/
+uint32_t get_free_cluster_count(FAT32_volume* volume){
+
+    if(volume->free_bitmap.words == NULL){
+        build_free_bitmap(volume);
+    }
+
+    return volume->free_bitmap.num_free;
+
+}
+
+/********************************************************************
+Records count FAT entries, starting with the entry of first_cluster,
+    that were just written
+********************************************************************/
+void update_free_bitmap(FAT32_volume* volume, uint32_t first_cluster, uint32_t* entries, uint32_t count){
+
+    uint32_t i;
+
+    //Nothing to keep up to date until the bitmap is built
+    if(volume->free_bitmap.words == NULL){
+        return;
+    }
+
+    for(i = 0; i < count; i++){
+        uint32_t cluster = first_cluster + i;
+        if(cluster < 2 || cluster >= volume->free_bitmap.end_cluster){
+            continue;
+        }
+
+        uint64_t bit = 1ULL << (cluster % 64);
+        bool was_free = (volume->free_bitmap.words[cluster / 64] & bit) != 0;
+        bool is_free = (entries[i] & FAT_ENTRY_MASK) == 0;
+        if(is_free && !was_free){
+            volume->free_bitmap.words[cluster / 64] |= bit;
+            volume->free_bitmap.num_free++;
+        }else if(!is_free && was_free){
+            volume->free_bitmap.words[cluster / 64] &= ~bit;
+            volume->free_bitmap.num_free--;
+        }
+    }
+
+}
+
+/********************************************************************
+Returns the first cluster at or after cluster_number whose bit is set
+    in words (XORed with flip), or the end of the volume
+********************************************************************/
+static uint32_t find_cluster_bit(FAT32_volume* volume, uint32_t cluster_number, uint64_t flip){
+
+    if(volume->free_bitmap.words == NULL){
+        build_free_bitmap(volume);
+    }
+    if(cluster_number >= volume->free_bitmap.end_cluster){
+        return volume->free_bitmap.end_cluster;
+    }
+
+    //Whole words with nothing to find are skipped at once
+    uint32_t word_number = cluster_number / 64;
+    uint64_t word = (volume->free_bitmap.words[word_number] ^ flip) & (~0ULL << (cluster_number % 64));
+    while(word == 0){
+        word_number++;
+        if(word_number >= volume->free_bitmap.num_words){
+            return volume->free_bitmap.end_cluster;
+        }
+        word = volume->free_bitmap.words[word_number] ^ flip;
+    }
+
+    uint32_t found = word_number * 64 + __builtin_ctzll(word);
+    return (found < volume->free_bitmap.end_cluster) ? found : volume->free_bitmap.end_cluster;
+
+}
+
+/********************************************************************
+Returns the first free cluster at or after cluster_number, or the end
+    of the volume if there is none
+********************************************************************/
+uint32_t find_free_cluster(FAT32_volume* volume, uint32_t cluster_number){
+
+    return find_cluster_bit(volume, cluster_number, 0);
+
+}
+
+/********************************************************************
+Returns the first used cluster at or after cluster_number, or the end
+    of the volume if there is none
+********************************************************************/
+uint32_t find_used_cluster(FAT32_volume* volume, uint32_t cluster_number){
+
+    return find_cluster_bit(volume, cluster_number, ~0ULL);
+
+}
+
+/********************************************************************
+Frees the memory used by the bitmap
+********************************************************************/
+void free_free_bitmap(FAT32_volume* volume){
+
+    free(volume->free_bitmap.words);
+    volume->free_bitmap.words = NULL;
+    volume->free_bitmap.num_words = 0;
+    volume->free_bitmap.num_free = 0;
+
+}
+
+#pragma endregion Free_Bitmap_Functions
@@ -0,0 +1,862 @@
+/********************************************************************
+    Module: FAT32_cache.c
+    Author: Brennan Couturier
+
+    In-memory caches for on-disk structures
+********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+
+#include "../include/FAT32_structs_globals.h"
+#include "../include/FAT32_cache.h"
+#include "../include/FAT32_io.h"
+#include "../include/FAT32_helpers.h"
+#include "../include/FAT32_stats.h"
+
+#pragma region FAT_Cache_Functions
+
+/********************************************************************
+Re-reads a single stale FAT sector from the disk into the cache
+********************************************************************/
+static bool refresh_FAT_cache_sector(FAT32_volume* volume, uint32_t sector_number){
+
+    uint16_t bytes_per_sector = volume->boot_sector->BPB_BytesPerSec;
+    off_t sector_byte_location = volume->geometry.FAT_byte_offset + (off_t)sector_number * bytes_per_sector;
+    uint8_t* destination = (uint8_t*)volume->FAT_cache.entries + ((size_t)sector_number * bytes_per_sector);
+
+    size_t bytes_read = read_disk_image(volume, destination, bytes_per_sector, sector_byte_location);
+    if(bytes_read != bytes_per_sector){
+        return false;
+    }
+
+    volume->FAT_cache.valid_sectors[sector_number / 8] |= (1 << (sector_number % 8));
+    return true;
+
+}
+
+/********************************************************************
+Reads the whole active FAT into memory using large sequential reads.
+	If the FAT is too big to cache, entries keep being read from
+	the disk one at a time
+********************************************************************/
+void load_FAT_cache(FAT32_volume* volume){
+
+    uint16_t bytes_per_sector = volume->boot_sector->BPB_BytesPerSec;
+    uint32_t num_sectors = volume->boot_sector->BPB_FATSz32;
+    size_t FAT_size = (size_t)num_sectors * bytes_per_sector;
+    off_t FAT_byte_location = volume->geometry.FAT_byte_offset;
+    uint32_t i;
+
+    //If the image is mapped, use the FAT in place instead of copying it
+    uint8_t* mapped_FAT = get_disk_image_pointer(volume, FAT_byte_location, FAT_size);
+    if(mapped_FAT != NULL){
+        volume->FAT_cache.entries = (uint32_t*)mapped_FAT;
+        volume->FAT_cache.num_sectors = num_sectors;
+        volume->FAT_cache.is_mapped = true;
+        advise_disk_image(volume, FAT_byte_location, FAT_size, MADV_WILLNEED);
+        return;
+    }
+
+    if(FAT_size > FAT_CACHE_MAX_SIZE){
+        fprintf(stderr, "Warning: FAT is %zu bytes, it will be read from the disk instead of cached\n", FAT_size);
+        return;
+    }
+
+    volume->FAT_cache.entries = allocate_disk_buffer(volume, FAT_size);
+    volume->FAT_cache.valid_sectors = calloc((num_sectors + 7) / 8, 1);
+    if(volume->FAT_cache.entries == NULL || volume->FAT_cache.valid_sectors == NULL){
+        fprintf(stderr, "\nError in load_FAT_cache() : Could not allocate space for FAT cache\n");
+        exit(EXIT_FAILURE);
+    }
+    volume->FAT_cache.num_sectors = num_sectors;
+
+    //Read the FAT in big chunks instead of one entry at a time, all of them in flight at once with io_uring
+    size_t chunk_size = volume->settings.max_io_size - (volume->settings.max_io_size % bytes_per_sector);
+    if(chunk_size == 0){
+        chunk_size = bytes_per_sector;
+    }
+    uint32_t num_requests = (FAT_size + chunk_size - 1) / chunk_size;
+    FAT32_read_request* requests = malloc(sizeof(FAT32_read_request) * num_requests);
+    if(requests == NULL){
+        fprintf(stderr, "\nError in load_FAT_cache() : Could not allocate space for read requests\n");
+        exit(EXIT_FAILURE);
+    }
+    for(i = 0; i < num_requests; i++){
+        size_t chunk_offset = (size_t)i * chunk_size;
+        requests[i].buffer = (uint8_t*)volume->FAT_cache.entries + chunk_offset;
+        requests[i].count = (FAT_size - chunk_offset > chunk_size) ? chunk_size : FAT_size - chunk_offset;
+        requests[i].offset = FAT_byte_location + chunk_offset;
+    }
+
+    read_disk_image_batch(volume, requests, num_requests);
+
+    //If the image is truncated, the missing sectors stay stale and are retried on lookup
+    for(i = 0; i < num_requests; i++){
+        uint32_t first_sector = ((size_t)i * chunk_size) / bytes_per_sector;
+        uint32_t j;
+        for(j = 0; j < requests[i].bytes_read / bytes_per_sector; j++){
+            volume->FAT_cache.valid_sectors[(first_sector + j) / 8] |= (1 << ((first_sector + j) % 8));
+        }
+    }
+
+    free(requests);
+
+}
+
+/********************************************************************
+Looks up the raw FAT entry for the given cluster in the cache. Returns
+	false if the entry is not cached, in which case the caller
+	has to read it from the disk
+********************************************************************/
+bool lookup_FAT_cache(FAT32_volume* volume, uint32_t cluster_number, uint32_t* FAT_entry){
+
+    if(volume->FAT_cache.entries == NULL){
+        return false;
+    }
+
+    uint32_t sector_number = get_FAT_sector_index(volume, cluster_number);
+    if(sector_number >= volume->FAT_cache.num_sectors){
+        return false;
+    }
+
+    //The mapping always matches the disk, other sectors may be stale
+    bool is_valid = volume->FAT_cache.is_mapped || (volume->FAT_cache.valid_sectors[sector_number / 8] & (1 << (sector_number % 8))) != 0;
+    if(!is_valid){
+        pthread_mutex_lock(&volume->FAT_cache.refresh_lock);
+        is_valid = refresh_FAT_cache_sector(volume, sector_number);
+        pthread_mutex_unlock(&volume->FAT_cache.refresh_lock);
+        if(!is_valid){
+            return false;
+        }
+    }
+
+    *FAT_entry = volume->FAT_cache.entries[cluster_number];
+    return true;
+
+}
+
+/********************************************************************
+Returns the raw FAT entries of count clusters starting at
+    cluster_number, re-reading any stale sectors among them. Returns
+    NULL if the FAT is not cached or a sector cannot be read
+********************************************************************/
+uint32_t* get_FAT_cache_entries(FAT32_volume* volume, uint32_t cluster_number, uint32_t count){
+
+    uint32_t sector_number;
+
+    if(volume->FAT_cache.entries == NULL || count == 0){
+        return NULL;
+    }
+
+    uint32_t first_sector = get_FAT_sector_index(volume, cluster_number);
+    uint32_t last_sector = get_FAT_sector_index(volume, cluster_number + (count - 1));
+    if(last_sector >= volume->FAT_cache.num_sectors){
+        return NULL;
+    }
+
+    if(!volume->FAT_cache.is_mapped){
+        pthread_mutex_lock(&volume->FAT_cache.refresh_lock);
+        for(sector_number = first_sector; sector_number <= last_sector; sector_number++){
+            bool is_valid = (volume->FAT_cache.valid_sectors[sector_number / 8] & (1 << (sector_number % 8))) != 0;
+            if(!is_valid && !refresh_FAT_cache_sector(volume, sector_number)){
+                pthread_mutex_unlock(&volume->FAT_cache.refresh_lock);
+                return NULL;
+            }
+        }
+        pthread_mutex_unlock(&volume->FAT_cache.refresh_lock);
+    }
+
+    return &volume->FAT_cache.entries[cluster_number];
+
+}
+
+/********************************************************************
+Marks the cached FAT sectors holding the entries of count clusters,
+	starting at cluster_number, as stale. They are re-read from
+	the disk the next time one of their entries is looked up.
+	Must be called after writing to the FAT
+********************************************************************/
+void invalidate_FAT_cache(FAT32_volume* volume, uint32_t cluster_number, uint32_t count){
+
+    uint32_t sector_number;
+
+    if(volume->FAT_cache.entries == NULL || volume->FAT_cache.is_mapped || count == 0){
+        return;
+    }
+
+    uint32_t first_sector = get_FAT_sector_index(volume, cluster_number);
+    uint32_t last_sector = get_FAT_sector_index(volume, cluster_number + (count - 1));
+    if(last_sector >= volume->FAT_cache.num_sectors){
+        last_sector = volume->FAT_cache.num_sectors - 1;
+    }
+
+    for(sector_number = first_sector; sector_number <= last_sector; sector_number++){
+        volume->FAT_cache.valid_sectors[sector_number / 8] &= ~(1 << (sector_number % 8));
+    }
+
+}
+
+/********************************************************************
+Frees the memory used by the FAT cache
+********************************************************************/
+void free_FAT_cache(FAT32_volume* volume){
+
+    if(!volume->FAT_cache.is_mapped){
+        free(volume->FAT_cache.entries);
+    }
+    free(volume->FAT_cache.valid_sectors);
+    volume->FAT_cache.entries = NULL;
+    volume->FAT_cache.valid_sectors = NULL;
+    volume->FAT_cache.num_sectors = 0;
+    volume->FAT_cache.is_mapped = false;
+
+}
+
+#pragma endregion FAT_Cache_Functions
+
+#pragma region Directory_Cache_Functions
+
+/********************************************************************
+Unlinks a directory from the LRU list
+********************************************************************/
+static void unlink_lru_directory(FAT32_volume* volume, FAT32_cached_directory* directory){
+
+    if(directory->lru_prev != NULL){
+        directory->lru_prev->lru_next = directory->lru_next;
+    }else{
+        volume->directory_cache.lru_head = directory->lru_next;
+    }
+    if(directory->lru_next != NULL){
+        directory->lru_next->lru_prev = directory->lru_prev;
+    }else{
+        volume->directory_cache.lru_tail = directory->lru_prev;
+    }
+    directory->lru_prev = NULL;
+    directory->lru_next = NULL;
+
+}
+
+/********************************************************************
+Puts a directory at the most recently used end of the LRU list
+********************************************************************/
+static void push_lru_directory(FAT32_volume* volume, FAT32_cached_directory* directory){
+
+    directory->lru_prev = NULL;
+    directory->lru_next = volume->directory_cache.lru_head;
+    if(volume->directory_cache.lru_head != NULL){
+        volume->directory_cache.lru_head->lru_prev = directory;
+    }else{
+        volume->directory_cache.lru_tail = directory;
+    }
+    volume->directory_cache.lru_head = directory;
+
+}
+
+/********************************************************************
+Takes a directory out of the hash table and the LRU list, and stops
+    charging it against the budget
+********************************************************************/
+static void remove_cached_directory(FAT32_volume* volume, FAT32_cached_directory* directory){
+
+    FAT32_cached_directory** link = &volume->directory_cache.buckets[directory->first_cluster % DIRECTORY_CACHE_BUCKETS];
+    while(*link != NULL && *link != directory){
+        link = &(*link)->hash_next;
+    }
+    if(*link != NULL){
+        *link = directory->hash_next;
+    }
+    directory->hash_next = NULL;
+
+    unlink_lru_directory(volume, directory);
+    volume->directory_cache.size -= directory->size;
+
+}
+
+/********************************************************************
+Frees a directory that is no longer in the cache
+********************************************************************/
+static void free_cached_directory(FAT32_cached_directory* directory){
+
+    if(!directory->is_mapped){
+        free(directory->entries);
+    }
+    free(directory->name_index);
+    free(directory);
+
+}
+
+/********************************************************************
+Reads a directory from the disk and keeps its entries up to the end
+    marker. Contiguous directories of a mapped image are used in place
+********************************************************************/
+static FAT32_cached_directory* load_cached_directory(FAT32_volume* volume, uint32_t first_cluster){
+
+    size_t data_size;
+    uint32_t max_entries;
+    uint32_t i;
+
+    FAT32_cached_directory* directory = calloc(1, sizeof(FAT32_cached_directory));
+    if(directory == NULL){
+        fprintf(stderr, "\nError in load_cached_directory() : Could not allocate space for cached directory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    uint8_t* directory_data = read_directory(volume, first_cluster, &data_size);
+    FAT32_Directory_Entry* entries = (FAT32_Directory_Entry*)directory_data;
+    max_entries = data_size / sizeof(FAT32_Directory_Entry);
+
+    //Count the entries in use, the first 0x00 entry marks the end of the directory
+    for(i = 0; i < max_entries && entries[i].DIR_Name[0] != 0x00; i++);
+
+    directory->first_cluster = first_cluster;
+    directory->num_entries = i;
+
+    if(is_disk_image_pointer(volume, directory_data) && i < max_entries){
+        //The mapping already holds the end marker, nothing to copy
+        directory->entries = entries;
+        directory->is_mapped = true;
+        directory->size = sizeof(FAT32_cached_directory);
+        return directory;
+    }
+
+    //Keep a copy trimmed to the entries in use, plus an end marker
+    size_t entries_size = ((size_t)directory->num_entries + 1) * sizeof(FAT32_Directory_Entry);
+    if(is_disk_image_pointer(volume, directory_data)){
+        directory->entries = malloc(entries_size);
+        if(directory->entries != NULL){
+            memcpy(directory->entries, entries, entries_size - sizeof(FAT32_Directory_Entry));
+        }
+    }else{
+        directory->entries = realloc(directory_data, entries_size);
+    }
+    if(directory->entries == NULL){
+        fprintf(stderr, "\nError in load_cached_directory() : Could not allocate space for directory entries\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(&directory->entries[directory->num_entries], 0, sizeof(FAT32_Directory_Entry));
+    directory->size = sizeof(FAT32_cached_directory) + entries_size;
+    count_stat(volume, STAT_ALLOCATIONS, 2);
+    count_stat(volume, STAT_BYTES_ALLOCATED, directory->size);
+
+    return directory;
+
+}
+
+/********************************************************************
+Evicts least recently used directories that are not in use until the
+    cache fits in its budget
+********************************************************************/
+static void evict_cached_directories(FAT32_volume* volume){
+
+    FAT32_cached_directory* directory = volume->directory_cache.lru_tail;
+
+    while(directory != NULL && volume->directory_cache.size > volume->settings.directory_cache_budget){
+        FAT32_cached_directory* previous = directory->lru_prev;
+        if(directory->num_users == 0){
+            remove_cached_directory(volume, directory);
+            free_cached_directory(directory);
+        }
+        directory = previous;
+    }
+
+}
+
+/********************************************************************
+Returns the directory starting at first_cluster if it is cached, the
+    same way get_cached_directory() does, or NULL without reading it
+********************************************************************/
+FAT32_cached_directory* lookup_cached_directory(FAT32_volume* volume, uint32_t first_cluster){
+
+    FAT32_cached_directory* directory = volume->directory_cache.buckets[first_cluster % DIRECTORY_CACHE_BUCKETS];
+
+    while(directory != NULL && directory->first_cluster != first_cluster){
+        directory = directory->hash_next;
+    }
+
+    if(directory != NULL){
+        count_stat(volume, STAT_DIRECTORY_CACHE_HITS, 1);
+        unlink_lru_directory(volume, directory);
+        push_lru_directory(volume, directory);
+        directory->num_users++;
+    }
+
+    return directory;
+
+}
+
+/********************************************************************
+Returns the directory starting at first_cluster, reading and parsing
+    it only if it is not cached yet. The directory stays valid until
+    it is given back with release_cached_directory()
+********************************************************************/
+FAT32_cached_directory* get_cached_directory(FAT32_volume* volume, uint32_t first_cluster){
+
+    uint32_t bucket = first_cluster % DIRECTORY_CACHE_BUCKETS;
+
+    FAT32_cached_directory* directory = lookup_cached_directory(volume, first_cluster);
+    if(directory != NULL){
+        return directory;
+    }
+
+    count_stat(volume, STAT_DIRECTORY_CACHE_MISSES, 1);
+    directory = load_cached_directory(volume, first_cluster);
+    directory->num_users = 1;
+    directory->hash_next = volume->directory_cache.buckets[bucket];
+    volume->directory_cache.buckets[bucket] = directory;
+    push_lru_directory(volume, directory);
+    volume->directory_cache.size += directory->size;
+
+    evict_cached_directories(volume);
+
+    return directory;
+
+}
+
+/********************************************************************
+Gives back a directory returned by get_cached_directory(), which then
+    becomes a candidate for eviction
+********************************************************************/
+void release_cached_directory(FAT32_volume* volume, FAT32_cached_directory* directory){
+
+    directory->num_users--;
+
+    if(directory->is_stale){
+        if(directory->num_users == 0){
+            free_cached_directory(directory);
+        }
+        return;
+    }
+
+    evict_cached_directories(volume);
+
+}
+
+/********************************************************************
+FNV-1a hash of a name, ignoring case
+********************************************************************/
+static uint32_t hash_entry_name(char* name){
+
+    uint32_t hash = 2166136261u;
+
+    while(*name != '\0'){
+        hash ^= (uint8_t)toupper((unsigned char)*name);
+        hash *= 16777619u;
+        name++;
+    }
+
+    return hash;
+
+}
+
+/********************************************************************
+Builds the name index of a directory. Deleted entries, long name
+    entries and the volume label are left out
+********************************************************************/
+static void build_name_index(FAT32_volume* volume, FAT32_cached_directory* directory){
+
+    char name[NORMALIZED_NAME_LENGTH];
+    uint32_t num_slots = 16;
+    uint32_t i;
+
+    //Keep the table at most half full so probe sequences stay short
+    while(num_slots < directory->num_entries * 2){
+        num_slots *= 2;
+    }
+
+    directory->name_index = calloc(num_slots, sizeof(FAT32_name_index_slot));
+    if(directory->name_index == NULL){
+        fprintf(stderr, "\nError in build_name_index() : Could not allocate space for name index\n");
+        exit(EXIT_FAILURE);
+    }
+    directory->name_index_mask = num_slots - 1;
+
+    for(i = 0; i < directory->num_entries; i++){
+        FAT32_Directory_Entry* entry = &directory->entries[i];
+        if((uint8_t)entry->DIR_Name[0] == 0xE5 || entry->DIR_Attr == 0x0F || (entry->DIR_Attr & 0x08)){
+            continue;
+        }
+
+        normalize_entry_name(entry, name);
+        uint32_t hash = hash_entry_name(name);
+        uint32_t slot = hash & directory->name_index_mask;
+        while(directory->name_index[slot].entry_number != 0){
+            slot = (slot + 1) & directory->name_index_mask;
+        }
+        directory->name_index[slot].hash = hash;
+        directory->name_index[slot].entry_number = i + 1;
+    }
+
+    //Charge the index against the budget along with the entries
+    size_t index_size = (size_t)num_slots * sizeof(FAT32_name_index_slot);
+    directory->size += index_size;
+    if(!directory->is_stale){
+        volume->directory_cache.size += index_size;
+    }
+
+}
+
+/********************************************************************
+Finds the entry called name ("NAME.EXT" or "NAME", any case) in a
+    cached directory, or returns NULL. The directory's name index
+    is built on the first call, later lookups take constant time
+********************************************************************/
+FAT32_Directory_Entry* find_cached_directory_entry(FAT32_volume* volume, FAT32_cached_directory* directory, char* name){
+
+    char entry_name[NORMALIZED_NAME_LENGTH];
+
+    if(strlen(name) >= NORMALIZED_NAME_LENGTH){
+        //Longer than any 8.3 name
+        return NULL;
+    }
+    if(directory->name_index == NULL){
+        build_name_index(volume, directory);
+    }
+
+    uint32_t hash = hash_entry_name(name);
+    uint32_t slot = hash & directory->name_index_mask;
+    while(directory->name_index[slot].entry_number != 0){
+        if(directory->name_index[slot].hash == hash){
+            FAT32_Directory_Entry* entry = &directory->entries[directory->name_index[slot].entry_number - 1];
+            normalize_entry_name(entry, entry_name);
+            if(strcasecmp(entry_name, name) == 0){
+                return entry;
+            }
+        }
+        slot = (slot + 1) & directory->name_index_mask;
+    }
+
+    return NULL;
+
+}
+
+/********************************************************************
+Drops the directory starting at first_cluster from the cache so the
+    next lookup re-reads it. Must be called after writing to it
+********************************************************************/
+void invalidate_cached_directory(FAT32_volume* volume, uint32_t first_cluster){
+
+    FAT32_cached_directory* directory = volume->directory_cache.buckets[first_cluster % DIRECTORY_CACHE_BUCKETS];
+
+    while(directory != NULL && directory->first_cluster != first_cluster){
+        directory = directory->hash_next;
+    }
+    if(directory == NULL){
+        return;
+    }
+
+    remove_cached_directory(volume, directory);
+    if(directory->num_users > 0){
+        //Still in use, free it once it is released
+        directory->is_stale = true;
+    }else{
+        free_cached_directory(directory);
+    }
+
+}
+
+/********************************************************************
+Frees every directory in the cache
+********************************************************************/
+void free_directory_cache(FAT32_volume* volume){
+
+    while(volume->directory_cache.lru_head != NULL){
+        FAT32_cached_directory* directory = volume->directory_cache.lru_head;
+        remove_cached_directory(volume, directory);
+        free_cached_directory(directory);
+    }
+
+}
+
+#pragma endregion Directory_Cache_Functions
+
+#pragma region Block_Cache_Functions
+
+/********************************************************************
+Sets up the block cache with settings.block_cache_budget bytes
+********************************************************************/
+void create_block_cache(FAT32_volume* volume){
+
+    uint32_t i;
+    uint32_t num_buckets = 1;
+
+    //A mapped image is already cached by the kernel, and a budget below one block cannot hold anything
+    if(volume->disk_image_map != NULL || volume->settings.block_cache_budget < BLOCK_CACHE_BLOCK_SIZE){
+        return;
+    }
+
+    volume->block_cache.num_blocks = volume->settings.block_cache_budget / BLOCK_CACHE_BLOCK_SIZE;
+    while(num_buckets < volume->block_cache.num_blocks){
+        num_buckets <<= 1;
+    }
+    volume->block_cache.bucket_mask = num_buckets - 1;
+
+    volume->block_cache.blocks = calloc(volume->block_cache.num_blocks, sizeof(FAT32_cached_block));
+    volume->block_cache.buckets = malloc(sizeof(uint32_t) * num_buckets);
+    volume->block_cache.data = allocate_disk_buffer(volume, (size_t)volume->block_cache.num_blocks * BLOCK_CACHE_BLOCK_SIZE);
+    if(volume->block_cache.blocks == NULL || volume->block_cache.buckets == NULL || volume->block_cache.data == NULL){
+        fprintf(stderr, "\nError in create_block_cache() : Could not allocate space for the block cache\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for(i = 0; i < num_buckets; i++){
+        volume->block_cache.buckets[i] = UINT32_MAX;
+    }
+    for(i = 0; i < volume->block_cache.num_blocks; i++){
+        volume->block_cache.blocks[i].data = volume->block_cache.data + (size_t)i * BLOCK_CACHE_BLOCK_SIZE;
+    }
+
+    //A read may take a quarter of a small cache at most, so it cannot flush everything else
+    volume->block_cache.max_read_size = volume->settings.block_cache_budget / 4;
+    if(volume->block_cache.max_read_size > BLOCK_CACHE_MAX_READ){
+        volume->block_cache.max_read_size = BLOCK_CACHE_MAX_READ;
+    }
+
+}
+
+/********************************************************************
+Returns true if a read of count bytes goes through the block cache
+********************************************************************/
+bool is_block_cache_read(FAT32_volume* volume, size_t count){
+
+    return volume->block_cache.blocks != NULL && count > 0 && count <= volume->block_cache.max_read_size;
+
+}
+
+/********************************************************************
+Returns the bucket of a block number
+********************************************************************/
+static uint32_t hash_block_number(FAT32_volume* volume, uint64_t block_number){
+
+    return (uint32_t)((block_number * 0x9E3779B97F4A7C15ULL) >> 32) & volume->block_cache.bucket_mask;
+
+}
+
+/********************************************************************
+Returns the index of the cached block, or UINT32_MAX if it is not
+    cached. The cache lock must be held
+********************************************************************/
+static uint32_t find_cached_block(FAT32_volume* volume, uint64_t block_number){
+
+    uint32_t index = volume->block_cache.buckets[hash_block_number(volume, block_number)];
+
+    while(index != UINT32_MAX && volume->block_cache.blocks[index].block_number != block_number){
+        index = volume->block_cache.blocks[index].hash_next;
+    }
+
+    return index;
+
+}
+
+/********************************************************************
+Takes a block out of its bucket and marks it unused. The cache lock
+    must be held
+********************************************************************/
+static void remove_cached_block(FAT32_volume* volume, uint32_t index){
+
+    FAT32_cached_block* block = &volume->block_cache.blocks[index];
+    uint32_t* link = &volume->block_cache.buckets[hash_block_number(volume, block->block_number)];
+
+    while(*link != index){
+        link = &volume->block_cache.blocks[*link].hash_next;
+    }
+    *link = block->hash_next;
+
+    block->is_used = false;
+    block->is_referenced = false;
+
+}
+
+/********************************************************************
+Adds a block read from the disk image unless it was cached meanwhile,
+    evicting the first unreferenced block the clock hand finds.
+    The cache lock must be held
+********************************************************************/
+static void insert_cached_block(FAT32_volume* volume, uint64_t block_number, const uint8_t* data, uint32_t length){
+
+    if(find_cached_block(volume, block_number) != UINT32_MAX){
+        return;
+    }
+
+    //Referenced blocks get a second chance, so a full sweep always ends on one
+    uint32_t index;
+    while(true){
+        index = volume->block_cache.clock_hand;
+        volume->block_cache.clock_hand = (volume->block_cache.clock_hand + 1) % volume->block_cache.num_blocks;
+
+        FAT32_cached_block* block = &volume->block_cache.blocks[index];
+        if(!block->is_used){
+            break;
+        }
+        if(block->is_referenced){
+            block->is_referenced = false;
+            continue;
+        }
+        remove_cached_block(volume, index);
+        break;
+    }
+
+    FAT32_cached_block* block = &volume->block_cache.blocks[index];
+    uint32_t bucket = hash_block_number(volume, block_number);
+
+    memcpy(block->data, data, length);
+    block->block_number = block_number;
+    block->length = length;
+    block->is_used = true;
+    block->is_referenced = true;
+    block->hash_next = volume->block_cache.buckets[bucket];
+    volume->block_cache.buckets[bucket] = index;
+
+}
+
+/********************************************************************
+Reads count bytes starting at byte offset of the disk image into
+    buffer, copying cached blocks and reading each run of missing
+    blocks with a single read
+********************************************************************/
+size_t read_block_cache(FAT32_volume* volume, void* buffer, size_t count, off_t offset){
+
+    uint8_t* output = (uint8_t*)buffer;
+    uint64_t end = (uint64_t)offset + count;
+    uint64_t block_number = offset / BLOCK_CACHE_BLOCK_SIZE;
+    uint64_t last_block = (end - 1) / BLOCK_CACHE_BLOCK_SIZE;
+
+    while(block_number <= last_block){
+        uint64_t run_end;
+        uint64_t generation;
+        uint32_t index;
+
+        //Copy every cached block up to the next missing one
+        pthread_mutex_lock(&volume->block_cache.lock);
+        while(block_number <= last_block && (index = find_cached_block(volume, block_number)) != UINT32_MAX){
+            FAT32_cached_block* block = &volume->block_cache.blocks[index];
+            uint64_t block_start = block_number * BLOCK_CACHE_BLOCK_SIZE;
+            uint64_t copy_start = (block_start > (uint64_t)offset) ? block_start : (uint64_t)offset;
+            uint64_t copy_end = (block_start + block->length < end) ? block_start + block->length : end;
+
+            if(copy_end > copy_start){
+                memcpy(output + (copy_start - offset), block->data + (copy_start - block_start), copy_end - copy_start);
+            }
+            block->is_referenced = true;
+            count_stat(volume, STAT_BLOCK_CACHE_HITS, 1);
+
+            //A short block is the end of the image
+            if(block->length < BLOCK_CACHE_BLOCK_SIZE && copy_end < end){
+                pthread_mutex_unlock(&volume->block_cache.lock);
+                return (copy_end > (uint64_t)offset) ? copy_end - offset : 0;
+            }
+            block_number++;
+        }
+
+        run_end = block_number;
+        while(run_end <= last_block && find_cached_block(volume, run_end) == UINT32_MAX){
+            run_end++;
+        }
+        generation = volume->block_cache.generation;
+        pthread_mutex_unlock(&volume->block_cache.lock);
+
+        if(block_number > last_block){
+            break;
+        }
+
+        //Read the missing blocks whole, so they can be cached
+        uint64_t run_start = block_number * BLOCK_CACHE_BLOCK_SIZE;
+        size_t run_size = (run_end - block_number) * BLOCK_CACHE_BLOCK_SIZE;
+        uint8_t* run_buffer = allocate_disk_buffer(volume, run_size);
+        if(run_buffer == NULL){
+            fprintf(stderr, "\nError in read_block_cache() : Could not allocate space for missing blocks\n");
+            exit(EXIT_FAILURE);
+        }
+
+        size_t bytes_read = read_disk_image_uncached(volume, run_buffer, run_size, run_start);
+        count_stat(volume, STAT_BLOCK_CACHE_MISSES, run_end - block_number);
+
+        //Blocks read while the image was being written to may already be stale
+        pthread_mutex_lock(&volume->block_cache.lock);
+        if(generation == volume->block_cache.generation){
+            uint64_t i;
+            for(i = 0; i * BLOCK_CACHE_BLOCK_SIZE < bytes_read; i++){
+                size_t length = bytes_read - i * BLOCK_CACHE_BLOCK_SIZE;
+                insert_cached_block(volume, block_number + i, run_buffer + i * BLOCK_CACHE_BLOCK_SIZE,
+                                    (length < BLOCK_CACHE_BLOCK_SIZE) ? length : BLOCK_CACHE_BLOCK_SIZE);
+            }
+        }
+        pthread_mutex_unlock(&volume->block_cache.lock);
+
+        uint64_t copy_start = (run_start > (uint64_t)offset) ? run_start : (uint64_t)offset;
+        uint64_t copy_end = (run_start + bytes_read < end) ? run_start + bytes_read : end;
+        if(copy_end > copy_start){
+            memcpy(output + (copy_start - offset), run_buffer + (copy_start - run_start), copy_end - copy_start);
+        }
+        free(run_buffer);
+
+        if(bytes_read < run_size && copy_end < end){
+            return (copy_end > (uint64_t)offset) ? copy_end - offset : 0;
+        }
+        block_number = run_end;
+    }
+
+    return count;
+
+}
+
+/********************************************************************
+Copies count bytes written at byte offset of the disk image into the
+    cached blocks they overlap, so they are not read again
+********************************************************************/
+void update_block_cache(FAT32_volume* volume, const void* buffer, size_t count, off_t offset){
+
+    if(volume->block_cache.blocks == NULL || count == 0){
+        return;
+    }
+
+    uint64_t end = (uint64_t)offset + count;
+    uint64_t block_number;
+
+    pthread_mutex_lock(&volume->block_cache.lock);
+    volume->block_cache.generation++;
+    for(block_number = offset / BLOCK_CACHE_BLOCK_SIZE; block_number <= (end - 1) / BLOCK_CACHE_BLOCK_SIZE; block_number++){
+        uint32_t index = find_cached_block(volume, block_number);
+        if(index == UINT32_MAX){
+            continue;
+        }
+
+        FAT32_cached_block* block = &volume->block_cache.blocks[index];
+        uint64_t block_start = block_number * BLOCK_CACHE_BLOCK_SIZE;
+        uint64_t copy_start = (block_start > (uint64_t)offset) ? block_start : (uint64_t)offset;
+        uint64_t copy_end = (block_start + BLOCK_CACHE_BLOCK_SIZE < end) ? block_start + BLOCK_CACHE_BLOCK_SIZE : end;
+
+        //A write past the end of a short block grows the image, read the block again next time
+        if(copy_end > block_start + block->length){
+            remove_cached_block(volume, index);
+            continue;
+        }
+        memcpy(block->data + (copy_start - block_start), (const uint8_t*)buffer + (copy_start - offset), copy_end - copy_start);
+    }
+    pthread_mutex_unlock(&volume->block_cache.lock);
+
+}
+
+/********************************************************************
+Frees the memory used by the block cache
+********************************************************************/
+void free_block_cache(FAT32_volume* volume){
+
+    free(volume->block_cache.blocks);
+    free(volume->block_cache.buckets);
+    free(volume->block_cache.data);
+    volume->block_cache.blocks = NULL;
+    volume->block_cache.buckets = NULL;
+    volume->block_cache.data = NULL;
+
+}
+
+#pragma endregion Block_Cache_Functions
@@ -0,0 +1,448 @@
+/********************************************************************
+    Module: FAT32_check.c
+    Author: Brennan Couturier
+
+    Consistency check of a whole volume: FAT copies, cross-linked,
+    broken, looping and lost clusterchains, and file sizes
+********************************************************************/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "../include/FAT32_structs_globals.h"
+#include "../include/FAT32_check.h"
+#include "../include/FAT32_traverse.h"
+#include "../include/FAT32_disk_management.h"
+#include "../include/FAT32_bitmap.h"
+#include "../include/FAT32_cache.h"
+#include "../include/FAT32_helpers.h"
+#include "../include/FAT32_io.h"
+#include "../include/FAT32_stats.h"
+
+#define CHECK_MAX_PRINTED_PROBLEMS 1000 //Problems listed by check_volume(), the rest are only counted
+
+#pragma region Problem_Functions
+
+/********************************************************************
+Adds one line to the problems of the check. The line starts with the
+    path of the entry, from the root directory, unless
+    directory_path is NULL
+********************************************************************/
+static void add_check_problem(FAT32_check* check, char* directory_path, char* name, const char* format, ...){
+
+    char* detail;
+    char* line;
+    va_list arguments;
+
+    va_start(arguments, format);
+    int length = vasprintf(&detail, format, arguments);
+    va_end(arguments);
+    if(length != -1){
+        if(directory_path == NULL){
+            line = detail;
+        }else{
+            length = asprintf(&line, "/%s%s%s : %s", directory_path, (directory_path[0] != '\0') ? "/" : "", name, detail);
+            free(detail);
+        }
+    }
+    if(length == -1){
+        fprintf(stderr, "\nError in add_check_problem() : Could not allocate space for problem\n");
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_mutex_lock(&check->problem_lock);
+    if(check->num_problems == check->problem_capacity){
+        check->problem_capacity = (check->problem_capacity == 0) ? 64 : check->problem_capacity * 2;
+        check->problems = realloc(check->problems, check->problem_capacity * sizeof(char*));
+        if(check->problems == NULL){
+            fprintf(stderr, "\nError in add_check_problem() : Could not grow problem list\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    check->problems[check->num_problems++] = line;
+    pthread_mutex_unlock(&check->problem_lock);
+
+}
+
+/********************************************************************
+qsort() comparison for the problem list
+********************************************************************/
+static int compare_problems(const void* a, const void* b){
+
+    return strcmp(*(char**)a, *(char**)b);
+
+}
+
+#pragma endregion Problem_Functions
+
+#pragma region Check_Functions
+
+/********************************************************************
+Sets the owned bit of every cluster in the chain, 64 clusters at a
+    time. Returns how many of them another chain already held, and
+    the first such cluster in first_shared
+********************************************************************/
+static uint32_t mark_owned_clusters(FAT32_check* check, file_clusterchain* chain, uint32_t* first_shared){
+
+    uint32_t num_shared = 0, num_marked = 0;
+    uint32_t i;
+
+    for(i = 0; i < chain->num_extents; i++){
+        uint32_t cluster = chain->extents[i].first_cluster;
+        uint32_t remaining = chain->extents[i].num_clusters;
+
+        while(remaining > 0){
+            uint32_t bit = cluster % 64;
+            uint32_t span = (64 - bit < remaining) ? 64 - bit : remaining;
+            uint64_t mask = ((span == 64) ? ~0ULL : ((1ULL << span) - 1)) << bit;
+
+            uint64_t old = __atomic_fetch_or(&check->owned[cluster / 64], mask, __ATOMIC_RELAXED);
+            uint64_t shared = old & mask;
+            if(shared != 0){
+                if(num_shared == 0){
+                    *first_shared = (cluster / 64) * 64 + __builtin_ctzll(shared);
+                }
+                num_shared += __builtin_popcountll(shared);
+            }
+            num_marked += span - __builtin_popcountll(shared);
+
+            cluster += span;
+            remaining -= span;
+        }
+    }
+
+    __atomic_add_fetch(&check->num_owned_clusters, num_marked, __ATOMIC_RELAXED);
+
+    return num_shared;
+
+}
+
+/********************************************************************
+Checks the clusterchain starting at first_cluster, held by the entry
+    name in directory_path
+********************************************************************/
+static void check_clusterchain(FAT32_check* check, char* directory_path, char* name,
+                                uint32_t first_cluster, uint32_t file_size, bool is_directory){
+
+    FAT32_chain_status status;
+    uint32_t first_shared = 0;
+
+    //Only empty files may have no clusters
+    if(first_cluster == 0){
+        if(is_directory){
+            __atomic_add_fetch(&check->num_broken, 1, __ATOMIC_RELAXED);
+            add_check_problem(check, directory_path, name, "directory has no clusters");
+        }else if(file_size > 0){
+            __atomic_add_fetch(&check->num_size_mismatches, 1, __ATOMIC_RELAXED);
+            add_check_problem(check, directory_path, name, "size is %u bytes but the file has no clusters", file_size);
+        }
+        return;
+    }
+    if(first_cluster < 2 || first_cluster >= check->end_cluster){
+        __atomic_add_fetch(&check->num_broken, 1, __ATOMIC_RELAXED);
+        add_check_problem(check, directory_path, name, "starts at cluster %u, which is not on the volume", first_cluster);
+        return;
+    }
+
+    file_clusterchain* chain = follow_clusterchain(check->volume, first_cluster, &status);
+    __atomic_add_fetch(&check->num_chains, 1, __ATOMIC_RELAXED);
+
+    if(status == CHAIN_BROKEN){
+        file_cluster_extent* last = &chain->extents[chain->num_extents - 1];
+        uint32_t last_cluster = last->first_cluster + last->num_clusters - 1;
+        __atomic_add_fetch(&check->num_broken, 1, __ATOMIC_RELAXED);
+        add_check_problem(check, directory_path, name, "chain is broken after %u clusters, the FAT entry of cluster %u is 0x%08X",
+                            chain->num_clusters, last_cluster, get_FAT_entry_contents(check->volume, last_cluster));
+    }else if(status == CHAIN_LOOPS){
+        __atomic_add_fetch(&check->num_loops, 1, __ATOMIC_RELAXED);
+        add_check_problem(check, directory_path, name, "chain loops back on itself after %u clusters", chain->num_clusters);
+    }
+
+    uint32_t num_shared = mark_owned_clusters(check, chain, &first_shared);
+    if(num_shared > 0){
+        __atomic_add_fetch(&check->num_cross_linked, 1, __ATOMIC_RELAXED);
+        add_check_problem(check, directory_path, name, "cross-linked, %u clusters are also in another chain, the first is cluster %u",
+                            num_shared, first_shared);
+    }
+
+    //Sizes only mean something for files whose chain is whole
+    if(!is_directory && status == CHAIN_COMPLETE){
+        uint64_t num_needed = ((uint64_t)file_size + check->cluster_size - 1) / check->cluster_size;
+        if(num_needed != chain->num_clusters){
+            __atomic_add_fetch(&check->num_size_mismatches, 1, __ATOMIC_RELAXED);
+            add_check_problem(check, directory_path, name, "size is %u bytes, which needs %" PRIu64 " clusters, but the chain has %u",
+                                file_size, num_needed, chain->num_clusters);
+        }
+    }
+
+    free_clusterchain(chain);
+
+}
+
+/********************************************************************
+Follows the clusterchain of one directory entry found by a traversal
+    and records the clusters it holds
+********************************************************************/
+void check_entry_clusterchain(FAT32_check* check, FAT32_Directory_Entry* entry, char* directory_path, char* name){
+
+    uint32_t first_cluster = (entry->DIR_FstClusHI << 16) | entry->DIR_FstClusLO;
+
+    check_clusterchain(check, directory_path, name, first_cluster, entry->DIR_FileSize, (entry->DIR_Attr & 0x10) != 0);
+
+}
+
+/********************************************************************
+Thread comparing every FAT copy with the first one, a chunk of
+    settings.max_io_size bytes at a time. Chunks are compared with
+    memcmp(), which uses the widest vector instructions the CPU
+    has, and only chunks that differ are compared entry by entry
+********************************************************************/
+static void* compare_FAT_copies(void* argument){
+
+    FAT32_check* check = (FAT32_check*)argument;
+    FAT32_volume* volume = check->volume;
+    uint16_t bytes_per_sector = volume->boot_sector->BPB_BytesPerSec;
+    uint64_t FAT_size = (uint64_t)volume->boot_sector->BPB_FATSz32 * bytes_per_sector;
+    off_t FAT_byte_location = (off_t)volume->boot_sector->BPB_RsvdSecCnt * bytes_per_sector;
+    uint32_t copy;
+
+    size_t chunk_size = volume->settings.max_io_size - (volume->settings.max_io_size % bytes_per_sector);
+    if(chunk_size == 0){
+        chunk_size = bytes_per_sector;
+    }
+    uint8_t* first_buffer = allocate_disk_buffer(volume, chunk_size);
+    uint8_t* copy_buffer = allocate_disk_buffer(volume, chunk_size);
+    if(first_buffer == NULL || copy_buffer == NULL){
+        fprintf(stderr, "\nError in compare_FAT_copies() : Could not allocate space for FAT chunks\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for(copy = 1; copy < volume->boot_sector->BPB_NumFATs; copy++){
+        uint64_t num_differing = 0;
+        uint32_t first_differing = 0;
+        uint64_t offset;
+
+        for(offset = 0; offset < FAT_size; offset += chunk_size){
+            size_t count = (FAT_size - offset < chunk_size) ? FAT_size - offset : chunk_size;
+            size_t bytes_read;
+
+            //The first FAT is usually cached already
+            uint8_t* first_entries = (uint8_t*)get_FAT_cache_entries(volume, offset / sizeof(uint32_t), count / sizeof(uint32_t));
+            if(first_entries == NULL){
+                bytes_read = read_disk_image(volume, first_buffer, count, FAT_byte_location + offset);
+                memset(first_buffer + bytes_read, 0, count - bytes_read);
+                first_entries = first_buffer;
+            }
+            bytes_read = read_disk_image(volume, copy_buffer, count, FAT_byte_location + copy * FAT_size + offset);
+            memset(copy_buffer + bytes_read, 0, count - bytes_read);
+
+            if(memcmp(first_entries, copy_buffer, count) == 0){
+                continue;
+            }
+            uint32_t* first_words = (uint32_t*)first_entries;
+            uint32_t* copy_words = (uint32_t*)copy_buffer;
+            size_t i;
+            for(i = 0; i < count / sizeof(uint32_t); i++){
+                if(first_words[i] != copy_words[i]){
+                    if(num_differing == 0){
+                        first_differing = offset / sizeof(uint32_t) + i;
+                    }
+                    num_differing++;
+                }
+            }
+        }
+
+        if(num_differing > 0){
+            __atomic_add_fetch(&check->num_FAT_mismatches, 1, __ATOMIC_RELAXED);
+            add_check_problem(check, NULL, NULL, "FAT %u differs from FAT 0 in %" PRIu64 " entries, the first is the entry of cluster %u",
+                                copy, num_differing, first_differing);
+        }
+    }
+
+    free(first_buffer);
+    free(copy_buffer);
+
+    return NULL;
+
+}
+
+/********************************************************************
+Counts the clusters used in the FAT but held by no chain, and the
+    lost chains they form. A lost cluster no other lost cluster
+    links to starts a lost chain. Clusters marked bad are counted
+    apart, they are used without belonging to a file
+********************************************************************/
+static void find_lost_clusters(FAT32_check* check, uint32_t* num_lost, uint32_t* num_lost_chains, uint32_t* first_lost_chain,
+                                uint32_t* num_bad){
+
+    FAT32_volume* volume = check->volume;
+    uint32_t i;
+
+    *num_lost = 0;
+    *num_lost_chains = 0;
+    *first_lost_chain = 0;
+    *num_bad = 0;
+
+    get_free_cluster_count(volume);
+    uint32_t num_words = volume->free_bitmap.num_words;
+    uint32_t end_cluster = volume->free_bitmap.end_cluster;
+    uint64_t* lost = calloc(num_words, sizeof(uint64_t));
+    uint64_t* linked = calloc(num_words, sizeof(uint64_t));
+    if(lost == NULL || linked == NULL){
+        fprintf(stderr, "\nError in find_lost_clusters() : Could not allocate space for lost cluster bitmaps\n");
+        exit(EXIT_FAILURE);
+    }
+
+    //Used and unowned, 64 clusters at a time. Free bits past the end of the volume are already clear
+    for(i = 0; i < num_words; i++){
+        uint64_t unowned = ~volume->free_bitmap.words[i] & ~check->owned[i];
+        if(i == 0){
+            unowned &= ~3ULL;
+        }
+        if(i == num_words - 1 && end_cluster % 64 != 0){
+            unowned &= (1ULL << (end_cluster % 64)) - 1;
+        }
+
+        while(unowned != 0){
+            uint32_t cluster = i * 64 + __builtin_ctzll(unowned);
+            unowned &= unowned - 1;
+
+            uint32_t FAT_entry = get_FAT_entry_contents(volume, cluster);
+            if(FAT_entry == BAD_CLUSTER){
+                (*num_bad)++;
+                continue;
+            }
+            lost[i] |= 1ULL << (cluster % 64);
+            (*num_lost)++;
+            if(FAT_entry >= 2 && FAT_entry < end_cluster){
+                linked[FAT_entry / 64] |= 1ULL << (FAT_entry % 64);
+            }
+        }
+    }
+
+    for(i = 0; i < num_words; i++){
+        uint64_t heads = lost[i] & ~linked[i];
+        if(heads != 0 && *num_lost_chains == 0){
+            *first_lost_chain = i * 64 + __builtin_ctzll(heads);
+        }
+        *num_lost_chains += __builtin_popcountll(heads);
+    }
+
+    free(lost);
+    free(linked);
+
+}
+
+/********************************************************************
+Checks the whole volume and prints every problem found. Returns the
+    number of problems
+********************************************************************/
+uint64_t check_volume(FAT32_volume* volume){
+
+    uint64_t start = get_stat_time();
+    uint32_t root_cluster = volume->boot_sector->BPB_RootClus;
+    uint32_t num_lost, num_lost_chains, first_lost_chain, num_bad;
+    pthread_t compare_thread;
+    uint32_t i;
+
+    FAT32_check* check = calloc(1, sizeof(FAT32_check));
+    if(check == NULL){
+        fprintf(stderr, "\nError in check_volume() : Could not allocate space for FAT32_check struct\n");
+        exit(EXIT_FAILURE);
+    }
+    check->volume = volume;
+    check->end_cluster = volume->geometry.end_cluster;
+    check->cluster_size = volume->geometry.cluster_size;
+    check->owned = calloc((check->end_cluster + 63) / 64, sizeof(uint64_t));
+    if(check->owned == NULL){
+        fprintf(stderr, "\nError in check_volume() : Could not allocate space for cluster ownership bitmap\n");
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_init(&check->problem_lock, NULL);
+
+    //With mirroring off only the active FAT is kept up to date, the others may legitimately differ
+    bool is_mirrored = (volume->boot_sector->BPB_ExtFlags & 0x80) == 0;
+    if(is_mirrored){
+        int error = pthread_create(&compare_thread, NULL, compare_FAT_copies, check);
+        if(error != 0){
+            fprintf(stderr, "\nError in check_volume() : pthread_create() failed : %s\n", strerror(error));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    //Walk the tree from the root
+    FAT32_traversal* traversal = NULL;
+    if(root_cluster < 2 || root_cluster >= check->end_cluster){
+        check->num_broken++;
+        add_check_problem(check, "", "", "root directory starts at cluster %u, which is not on the volume", root_cluster);
+    }else{
+        check_clusterchain(check, "", "", root_cluster, 0, true);
+        traversal = run_traversal(volume, NULL, check);
+    }
+
+    if(is_mirrored){
+        pthread_join(compare_thread, NULL);
+    }
+
+    find_lost_clusters(check, &num_lost, &num_lost_chains, &first_lost_chain, &num_bad);
+
+    //Sorted so the output does not depend on which thread found what
+    qsort(check->problems, check->num_problems, sizeof(char*), compare_problems);
+
+    fprintf(stdout, "\nCHECK\n");
+    for(i = 0; i < check->num_problems; i++){
+        if(i == CHECK_MAX_PRINTED_PROBLEMS){
+            fprintf(stdout, "... and %u more\n", check->num_problems - CHECK_MAX_PRINTED_PROBLEMS);
+            break;
+        }
+        fprintf(stdout, "%s\n", check->problems[i]);
+    }
+    if(is_mirrored){
+        fprintf(stdout, "FAT copies differing from FAT 0: %u of %u\n", check->num_FAT_mismatches,
+                        (volume->boot_sector->BPB_NumFATs > 0) ? volume->boot_sector->BPB_NumFATs - 1 : 0);
+    }else{
+        fprintf(stdout, "FAT copies: not compared, mirroring is off and FAT %u is active\n", volume->boot_sector->BPB_ExtFlags & 0x0F);
+    }
+    fprintf(stdout, "Chains: %" PRIu64 " holding %" PRIu64 " clusters\n", check->num_chains, check->num_owned_clusters);
+    fprintf(stdout, "Cross-linked chains: %" PRIu64 "\n", check->num_cross_linked);
+    fprintf(stdout, "Broken chains: %" PRIu64 "\n", check->num_broken);
+    fprintf(stdout, "Looping chains: %" PRIu64 "\n", check->num_loops);
+    fprintf(stdout, "Size mismatches: %" PRIu64 "\n", check->num_size_mismatches);
+    if(num_lost_chains > 0){
+        fprintf(stdout, "Lost clusters: %u in %u chains, the first starting at cluster %u\n", num_lost, num_lost_chains, first_lost_chain);
+    }else{
+        //Lost clusters that only link to each other form loops with no start
+        fprintf(stdout, "Lost clusters: %u\n", num_lost);
+    }
+    fprintf(stdout, "Bad clusters: %u\n", num_bad);
+    if(traversal != NULL){
+        print_traversal_summary(traversal, start);
+        free_traversal(traversal);
+    }
+
+    uint64_t num_problems = check->num_FAT_mismatches + check->num_cross_linked + check->num_broken + check->num_loops
+                            + check->num_size_mismatches + ((num_lost_chains > 0) ? num_lost_chains : (num_lost > 0));
+    if(num_problems == 0){
+        fprintf(stdout, "---CLEAN\n");
+    }else{
+        fprintf(stdout, "---%" PRIu64 " problems\n", num_problems);
+    }
+
+    for(i = 0; i < check->num_problems; i++){
+        free(check->problems[i]);
+    }
+    pthread_mutex_destroy(&check->problem_lock);
+    free(check->problems);
+    free(check->owned);
+    free(check);
+
+    return num_problems;
+
+}
+
+#pragma endregion Check_Functions
@@ -0,0 +1,401 @@
+/********************************************************************
+    Module: FAT32_digest.c
+    Author: Brennan Couturier
+
+    CRC32C and SHA-256 digests of extracted files, computed on the
+    buffers of the extraction data path
+********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#include "../include/FAT32_structs_globals.h"
+#include "../include/FAT32_digest.h"
+#include "../include/FAT32_stats.h"
+
+#define CRC32C_POLYNOMIAL 0x82F63B78 //Castagnoli polynomial, bit reversed
+
+static const uint32_t sha256_initial_state[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static const uint32_t sha256_round_constants[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static uint32_t crc32c_table[8][256]; //Slicing-by-8 tables of the software CRC32C
+static pthread_once_t digest_setup = PTHREAD_ONCE_INIT;
+
+//Picked once by choose_digest_functions(), depending on the instructions the CPU has
+static uint32_t (*update_crc32c)(uint32_t crc, const uint8_t* data, size_t length);
+static void (*compress_sha256)(uint32_t* state, const uint8_t* data, size_t num_blocks);
+
+#pragma region CRC32C_Functions
+
+/********************************************************************
+CRC32C eight bytes at a time with a table per byte position, for
+    CPUs without the SSE4.2 CRC32 instruction
+********************************************************************/
+static uint32_t update_crc32c_software(uint32_t crc, const uint8_t* data, size_t length){
+
+    while(length >= 8){
+        uint64_t word;
+        memcpy(&word, data, 8);
+        word ^= crc;
+        crc = crc32c_table[7][word & 0xFF] ^ crc32c_table[6][(word >> 8) & 0xFF]
+            ^ crc32c_table[5][(word >> 16) & 0xFF] ^ crc32c_table[4][(word >> 24) & 0xFF]
+            ^ crc32c_table[3][(word >> 32) & 0xFF] ^ crc32c_table[2][(word >> 40) & 0xFF]
+            ^ crc32c_table[1][(word >> 48) & 0xFF] ^ crc32c_table[0][word >> 56];
+        data += 8;
+        length -= 8;
+    }
+    while(length > 0){
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *data++) & 0xFF];
+        length--;
+    }
+
+    return crc;
+
+}
+
+#if defined(__x86_64__)
+/********************************************************************
+CRC32C with the SSE4.2 CRC32 instruction, which computes exactly
+    this polynomial, eight bytes per instruction
+********************************************************************/
+__attribute__((target("sse4.2")))
+static uint32_t update_crc32c_hardware(uint32_t crc, const uint8_t* data, size_t length){
+
+    uint64_t crc64 = crc;
+
+    while(length >= 8){
+        uint64_t word;
+        memcpy(&word, data, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+        data += 8;
+        length -= 8;
+    }
+    crc = (uint32_t)crc64;
+    while(length > 0){
+        crc = _mm_crc32_u8(crc, *data++);
+        length--;
+    }
+
+    return crc;
+
+}
+#endif
+
+#pragma endregion CRC32C_Functions
+
+#pragma region SHA256_Functions
+
+#define ROTATE_RIGHT(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+/********************************************************************
+Runs the SHA-256 compression function over num_blocks blocks of
+    data, for CPUs without the SHA extensions
+********************************************************************/
+static void compress_sha256_software(uint32_t* state, const uint8_t* data, size_t num_blocks){
+
+    uint32_t schedule[64];
+    uint32_t i;
+
+    while(num_blocks > 0){
+        for(i = 0; i < 16; i++){
+            schedule[i] = ((uint32_t)data[4 * i] << 24) | ((uint32_t)data[4 * i + 1] << 16)
+                        | ((uint32_t)data[4 * i + 2] << 8) | data[4 * i + 3];
+        }
+        for(i = 16; i < 64; i++){
+            uint32_t s0 = ROTATE_RIGHT(schedule[i - 15], 7) ^ ROTATE_RIGHT(schedule[i - 15], 18) ^ (schedule[i - 15] >> 3);
+            uint32_t s1 = ROTATE_RIGHT(schedule[i - 2], 17) ^ ROTATE_RIGHT(schedule[i - 2], 19) ^ (schedule[i - 2] >> 10);
+            schedule[i] = schedule[i - 16] + s0 + schedule[i - 7] + s1;
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for(i = 0; i < 64; i++){
+            uint32_t S1 = ROTATE_RIGHT(e, 6) ^ ROTATE_RIGHT(e, 11) ^ ROTATE_RIGHT(e, 25);
+            uint32_t choice = (e & f) ^ (~e & g);
+            uint32_t temp1 = h + S1 + choice + sha256_round_constants[i] + schedule[i];
+            uint32_t S0 = ROTATE_RIGHT(a, 2) ^ ROTATE_RIGHT(a, 13) ^ ROTATE_RIGHT(a, 22);
+            uint32_t majority = (a & b) ^ (a & c) ^ (b & c);
+            uint32_t temp2 = S0 + majority;
+
+            h = g;
+            g = f;
+            f = e;
+            e = d + temp1;
+            d = c;
+            c = b;
+            b = a;
+            a = temp1 + temp2;
+        }
+
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+
+        data += SHA256_BLOCK_SIZE;
+        num_blocks--;
+    }
+
+}
+
+#if defined(__x86_64__)
+/********************************************************************
+Runs the SHA-256 compression function with the SHA extensions. The
+    state is kept as the ABEF and CDGH halves the SHA256RNDS2
+    instruction works on, and each step does four rounds and
+    extends the message schedule by four words
+********************************************************************/
+__attribute__((target("sha,sse4.1,ssse3")))
+static void compress_sha256_hardware(uint32_t* state, const uint8_t* data, size_t num_blocks){
+
+    const __m128i byte_swap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i messages[4];
+    uint32_t i;
+
+    __m128i temp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[0]), 0xB1); //CDAB
+    __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[4]), 0x1B); //EFGH
+    __m128i state0 = _mm_alignr_epi8(temp, state1, 8); //ABEF
+    state1 = _mm_blend_epi16(state1, temp, 0xF0); //CDGH
+
+    while(num_blocks > 0){
+        __m128i saved_state0 = state0;
+        __m128i saved_state1 = state1;
+
+        #pragma GCC unroll 16
+        for(i = 0; i < 16; i++){
+            if(i < 4){
+                messages[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 16 * i)), byte_swap);
+            }else{
+                //W[t..t+3] from W[t-16..t-13], W[t-12..t-9], W[t-7..t-4] and W[t-4..t-1]
+                __m128i message = _mm_sha256msg1_epu32(messages[i % 4], messages[(i + 1) % 4]);
+                message = _mm_add_epi32(message, _mm_alignr_epi8(messages[(i + 3) % 4], messages[(i + 2) % 4], 4));
+                messages[i % 4] = _mm_sha256msg2_epu32(message, messages[(i + 3) % 4]);
+            }
+
+            __m128i rounds = _mm_add_epi32(messages[i % 4], _mm_loadu_si128((const __m128i*)&sha256_round_constants[4 * i]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, rounds);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(rounds, 0x0E));
+        }
+
+        state0 = _mm_add_epi32(state0, saved_state0);
+        state1 = _mm_add_epi32(state1, saved_state1);
+
+        data += SHA256_BLOCK_SIZE;
+        num_blocks--;
+    }
+
+    temp = _mm_shuffle_epi32(state0, 0x1B); //FEBA
+    state1 = _mm_shuffle_epi32(state1, 0xB1); //DCHG
+    _mm_storeu_si128((__m128i*)&state[0], _mm_blend_epi16(temp, state1, 0xF0)); //DCBA
+    _mm_storeu_si128((__m128i*)&state[4], _mm_alignr_epi8(state1, temp, 8)); //HGFE
+
+}
+#endif
+
+#pragma endregion SHA256_Functions
+
+#pragma region Digest_Functions
+
+/********************************************************************
+Builds the CRC32C tables and picks the fastest implementation of
+    each digest the CPU can run. Called once through pthread_once()
+********************************************************************/
+static void choose_digest_functions(){
+
+    uint32_t i, j;
+
+    for(i = 0; i < 256; i++){
+        uint32_t crc = i;
+        for(j = 0; j < 8; j++){
+            crc = (crc >> 1) ^ (CRC32C_POLYNOMIAL & -(crc & 1));
+        }
+        crc32c_table[0][i] = crc;
+    }
+    for(i = 0; i < 256; i++){
+        for(j = 1; j < 8; j++){
+            crc32c_table[j][i] = (crc32c_table[j - 1][i] >> 8) ^ crc32c_table[0][crc32c_table[j - 1][i] & 0xFF];
+        }
+    }
+
+    update_crc32c = update_crc32c_software;
+    compress_sha256 = compress_sha256_software;
+
+#if defined(__x86_64__)
+    uint32_t eax, ebx, ecx, edx;
+    if(__get_cpuid(1, &eax, &ebx, &ecx, &edx)){
+        if(ecx & bit_SSE4_2){
+            update_crc32c = update_crc32c_hardware;
+        }
+        bool has_sse4_1 = (ecx & bit_SSE4_1) && (ecx & bit_SSSE3);
+        if(has_sse4_1 && __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_SHA)){
+            compress_sha256 = compress_sha256_hardware;
+        }
+    }
+#endif
+
+}
+
+/********************************************************************
+Starts the digests the volume's settings ask for. Returns digest, or
+    NULL if no digest is wanted
+********************************************************************/
+FAT32_digest* start_digest(FAT32_volume* volume, FAT32_digest* digest){
+
+    if(!volume->settings.use_crc32c && !volume->settings.use_sha256){
+        return NULL;
+    }
+    pthread_once(&digest_setup, choose_digest_functions);
+
+    memset(digest, 0, sizeof(FAT32_digest));
+    digest->volume = volume;
+    digest->use_crc32c = volume->settings.use_crc32c;
+    digest->use_sha256 = volume->settings.use_sha256;
+    digest->crc32c = 0xFFFFFFFF;
+    memcpy(digest->sha256_state, sha256_initial_state, sizeof(sha256_initial_state));
+
+    return digest;
+
+}
+
+/********************************************************************
+Adds length bytes of file data to the digests. Whole SHA-256 blocks
+    are hashed straight from data, only the ends are copied
+********************************************************************/
+void update_digest(FAT32_digest* digest, const uint8_t* data, size_t length){
+
+    uint64_t start = get_stat_time();
+
+    if(digest->use_crc32c){
+        digest->crc32c = update_crc32c(digest->crc32c, data, length);
+    }
+
+    if(digest->use_sha256){
+        const uint8_t* remaining = data;
+        size_t remaining_length = length;
+
+        //Top up a block left over from the last update
+        if(digest->sha256_block_length > 0){
+            size_t to_copy = SHA256_BLOCK_SIZE - digest->sha256_block_length;
+            if(to_copy > remaining_length){
+                to_copy = remaining_length;
+            }
+            memcpy(digest->sha256_block + digest->sha256_block_length, remaining, to_copy);
+            digest->sha256_block_length += to_copy;
+            remaining += to_copy;
+            remaining_length -= to_copy;
+            if(digest->sha256_block_length == SHA256_BLOCK_SIZE){
+                compress_sha256(digest->sha256_state, digest->sha256_block, 1);
+                digest->sha256_block_length = 0;
+            }
+        }
+
+        size_t num_blocks = remaining_length / SHA256_BLOCK_SIZE;
+        if(num_blocks > 0){
+            compress_sha256(digest->sha256_state, remaining, num_blocks);
+            remaining += num_blocks * SHA256_BLOCK_SIZE;
+            remaining_length -= num_blocks * SHA256_BLOCK_SIZE;
+        }
+        if(remaining_length > 0){
+            memcpy(digest->sha256_block, remaining, remaining_length);
+            digest->sha256_block_length = remaining_length;
+        }
+    }
+
+    digest->length += length;
+    count_stat(digest->volume, STAT_BYTES_DIGESTED, length);
+    count_stat_time(digest->volume, STAT_DIGEST_NANOSECONDS, start);
+
+}
+
+/********************************************************************
+Finishes the digests and writes them in hex
+********************************************************************/
+void finish_digest(FAT32_digest* digest){
+
+    uint32_t i;
+
+    if(digest->use_crc32c){
+        sprintf(digest->crc32c_hex, "%08" PRIx32, digest->crc32c ^ 0xFFFFFFFF);
+    }
+
+    if(digest->use_sha256){
+        //Pad with a 1 bit, zeros, and the length in bits as a big endian 64-bit number
+        uint8_t padding[2 * SHA256_BLOCK_SIZE] = { 0 };
+        uint32_t padding_length = (digest->sha256_block_length < SHA256_BLOCK_SIZE - 8) ? SHA256_BLOCK_SIZE : 2 * SHA256_BLOCK_SIZE;
+        uint64_t length_bits = digest->length * 8;
+
+        memcpy(padding, digest->sha256_block, digest->sha256_block_length);
+        padding[digest->sha256_block_length] = 0x80;
+        for(i = 0; i < 8; i++){
+            padding[padding_length - 1 - i] = (uint8_t)(length_bits >> (8 * i));
+        }
+        compress_sha256(digest->sha256_state, padding, padding_length / SHA256_BLOCK_SIZE);
+
+        for(i = 0; i < 8; i++){
+            sprintf(digest->sha256_hex + 8 * i, "%08" PRIx32, digest->sha256_state[i]);
+        }
+    }
+
+}
+
+/********************************************************************
+Writes "<hex>  <name>\n" to path
+********************************************************************/
+static void write_digest_file(char* path, char* hex, char* name){
+
+    FILE* digest_file = fopen(path, "w");
+    if(digest_file == NULL){
+        fprintf(stderr, "\nError in write_digest_file() : Could not create %s : %s\n", path, strerror(errno));
+        return;
+    }
+    fprintf(digest_file, "%s  %s\n", hex, name);
+    fclose(digest_file);
+
+}
+
+/********************************************************************
+Writes each finished digest next to the extracted file at
+    output_path
+********************************************************************/
+void write_digest_files(FAT32_digest* digest, char* output_path){
+
+    char path[strlen(output_path) + strlen(CRC32C_SUFFIX) + strlen(SHA256_SUFFIX) + 1];
+    char* name = strrchr(output_path, '/');
+    name = (name == NULL) ? output_path : name + 1;
+
+    if(digest->use_crc32c){
+        sprintf(path, "%s%s", output_path, CRC32C_SUFFIX);
+        write_digest_file(path, digest->crc32c_hex, name);
+    }
+    if(digest->use_sha256){
+        sprintf(path, "%s%s", output_path, SHA256_SUFFIX);
+        write_digest_file(path, digest->sha256_hex, name);
+    }
+
+}
+
+#pragma endregion Digest_Functions
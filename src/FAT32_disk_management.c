@@ -15,184 +15,532 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <time.h>
+#include <libgen.h>
 
 #include "../include/FAT32_structs_globals.h"
 #include "../include/FAT32_disk_management.h"
 #include "../include/FAT32_helpers.h"
+#include "../include/FAT32_io.h"
+#include "../include/FAT32_cache.h"
+#include "../include/FAT32_extract.h"
+#include "../include/FAT32_bitmap.h"
+#include "../include/FAT32_index.h"
+#include "../include/FAT32_digest.h"
 
-#pragma region Read_Functions
+#define SHORT_NAME_CHARACTERS "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789$%'-_@~`!(){}^#&"
+
+#pragma region Volume_Functions
 
 /********************************************************************
-Reads sizeof(FAT32_BS) bytes from the provided disk image file pointer
-    and puts them into an allocated FAT32_BS struct.
+Closes a volume that failed to open, keeping the errno of the failure
 ********************************************************************/
-void read_boot_sector(){
+static FAT32_volume* abandon_volume(FAT32_volume* volume){
 
-    boot_sector = malloc(sizeof(FAT32_BS));
-    if(boot_sector == NULL){
-        fprintf(stderr, "\nError in read_boot_sector() : Could not allocate space for FAT32_BS struct\n");
+    int saved_errno = errno;
+    close_volume(volume);
+    errno = saved_errno;
+
+    return NULL;
+
+}
+
+/********************************************************************
+Opens the disk image with a copy of the settings and reads everything
+    the other functions rely on: the boot sector, the FSInfo sector,
+    the FAT and the root directory. Returns NULL with errno set if
+    the image cannot be opened or is not a FAT32 volume
+********************************************************************/
+FAT32_volume* open_volume(char* disk_image_path, FAT32_settings* settings){
+
+    FAT32_volume* volume = calloc(1, sizeof(FAT32_volume));
+    if(volume == NULL){
+        fprintf(stderr, "\nError in open_volume() : Could not allocate space for FAT32_volume struct\n");
         exit(EXIT_FAILURE);
     }
 
-    ssize_t bytes_read = read(disk_image_fd, (void*)boot_sector, sizeof(FAT32_BS));
-    if(bytes_read == -1){
-        fprintf(stderr, "\nError in read_boot_sector() : read() returned -1 : %s\n", strerror(errno));
+    volume->settings = *settings;
+    volume->disk_image_fd = -1;
+    volume->disk_image_direct_fd = -1;
+    volume->uring.ring_fd = -1;
+    pthread_mutex_init(&volume->uring.lock, NULL);
+    pthread_mutex_init(&volume->FAT_cache.refresh_lock, NULL);
+    pthread_mutex_init(&volume->block_cache.lock, NULL);
+
+    //The kernel copies files through the page cache, which direct I/O is there to stay out of
+    if(volume->settings.use_direct_io){
+        volume->settings.use_zero_copy = false;
+    }
+
+    //open the disk image, for writing too if the caller asked for it
+    if(!open_disk_image(volume, disk_image_path)){
+        return abandon_volume(volume);
+    }
+    create_block_cache(volume);
+
+    //Read the important stuff
+    if(!read_boot_sector(volume) || !read_FS_info(volume)){
+        return abandon_volume(volume);
+    }
+    load_FAT_cache(volume);
+    read_root_directory(volume);
+    if(volume->settings.use_index){
+        open_index(volume);
+    }
+
+    return volume;
+
+}
+
+/********************************************************************
+Frees every cache of the volume and closes the disk image
+********************************************************************/
+void close_volume(FAT32_volume* volume){
+
+    //The boot sector and FSInfo sector may point into the mapping, which closing the image removes
+    if(!is_disk_image_pointer(volume, volume->boot_sector)){
+        free(volume->boot_sector);
+    }
+    if(!is_disk_image_pointer(volume, volume->fs_info_sector)){
+        free(volume->fs_info_sector);
+    }
+    close_index(volume);
+    free_directory_cache(volume);
+    free_free_bitmap(volume);
+    free_FAT_cache(volume);
+    free_block_cache(volume);
+
+    close_disk_image(volume);
+
+    pthread_mutex_destroy(&volume->uring.lock);
+    pthread_mutex_destroy(&volume->FAT_cache.refresh_lock);
+    pthread_mutex_destroy(&volume->block_cache.lock);
+    free(volume);
+
+}
+
+/********************************************************************
+Allocates a cursor on the volume, starting in the root directory
+********************************************************************/
+FAT32_cursor* open_cursor(FAT32_volume* volume){
+
+    FAT32_cursor* cursor = malloc(sizeof(FAT32_cursor));
+    if(cursor == NULL){
+        fprintf(stderr, "\nError in open_cursor() : Could not allocate space for FAT32_cursor struct\n");
         exit(EXIT_FAILURE);
     }
 
+    cursor->volume = volume;
+    cursor->current_directory_cluster = volume->boot_sector->BPB_RootClus;
+
+    return cursor;
+
+}
+
+/********************************************************************
+Frees a cursor returned by open_cursor()
+********************************************************************/
+void close_cursor(FAT32_cursor* cursor){
+
+    free(cursor);
+
+}
+
+#pragma endregion Volume_Functions
+
+#pragma region Read_Functions
+
+/********************************************************************
+Reads sizeof(FAT32_BS) bytes from the provided disk image file pointer
+    and puts them into an allocated FAT32_BS struct. Returns false
+    with errno set to EINVAL if it is not a FAT32 boot sector
+********************************************************************/
+bool read_boot_sector(FAT32_volume* volume){
+
+    //Use the boot sector in place if the image is mapped
+    volume->boot_sector = (FAT32_BS*)get_disk_image_pointer(volume, 0, sizeof(FAT32_BS));
+    if(volume->boot_sector == NULL){
+        volume->boot_sector = malloc(sizeof(FAT32_BS));
+        if(volume->boot_sector == NULL){
+            fprintf(stderr, "\nError in read_boot_sector() : Could not allocate space for FAT32_BS struct\n");
+            exit(EXIT_FAILURE);
+        }
+
+        size_t bytes_read = read_disk_image(volume, (void*)volume->boot_sector, sizeof(FAT32_BS), 0);
+        if(bytes_read != sizeof(FAT32_BS)){
+            fprintf(stderr, "\nError in read_boot_sector() : Disk image is too small to hold a boot sector\n");
+            errno = EINVAL;
+            return false;
+        }
+    }
+
     //Make sure that all the values that need to be 0 are zero. If not, there was a problem reading BS
-    if(boot_sector->BPB_RootEntCnt != 0){
+    if(volume->boot_sector->BPB_RootEntCnt != 0){
         fprintf(stderr, "\nError in read_boot_sector() : Expected 0 but value is non-zero : BPB_RootEntCnt - %#x\n",
-                        boot_sector->BPB_RootEntCnt);
-        exit(EXIT_FAILURE);
+                        volume->boot_sector->BPB_RootEntCnt);
+        errno = EINVAL;
+        return false;
     }
-    if(boot_sector->BPB_TotSec16 != 0){
+    if(volume->boot_sector->BPB_TotSec16 != 0){
         fprintf(stderr, "\nError in read_boot_sector() : Expected 0 but value is non-zero : BPB_TotSec16 - %#x\n",
-                        boot_sector->BPB_TotSec16);
-        exit(EXIT_FAILURE);
+                        volume->boot_sector->BPB_TotSec16);
+        errno = EINVAL;
+        return false;
     }
-    if(boot_sector->BPB_FATSz16 != 0){
+    if(volume->boot_sector->BPB_FATSz16 != 0){
         fprintf(stderr, "\nError in read_boot_sector() : Expected 0 but value is non-zero : BPB_FATSz16 - %#x\n",
-                        boot_sector->BPB_FATSz16);
-        exit(EXIT_FAILURE);
+                        volume->boot_sector->BPB_FATSz16);
+        errno = EINVAL;
+        return false;
     }
     
     //Check signatures to ensure proper read
-    if(boot_sector->BS_SigA != 0x55 || boot_sector->BS_SigB != 0xAA){
+    if(volume->boot_sector->BS_SigA != 0x55 || volume->boot_sector->BS_SigB != 0xAA){
         fprintf(stderr, "\nError in read_boot_sector() : Bad signature : BS_SigA(0x55) was read as %#x : BS_SigB(0xAA) was read as %#x\n",
-                        boot_sector->BS_SigA, boot_sector->BS_SigB);
-        exit(EXIT_FAILURE);
+                        volume->boot_sector->BS_SigA, volume->boot_sector->BS_SigB);
+        errno = EINVAL;
+        return false;
     }
 
+    return compute_volume_geometry(volume);
+
 }
 
 /********************************************************************
-Reads the FSInfo data into an allocated FAT32_FSInfo struct
+Reads the FSInfo data into an allocated FAT32_FSInfo struct. Returns
+    false with errno set to EINVAL if its signatures are wrong
 ********************************************************************/
-void read_FS_info(){
+bool read_FS_info(FAT32_volume* volume){
 
-    fs_info_sector = malloc(sizeof(FAT32_FSInfo));
-    if(fs_info_sector == NULL){
-        fprintf(stderr, "\nError in read_FS_info() : Could not allocate space for FAT32_FSInfo struct\n");
-        exit(EXIT_FAILURE);
-    }
-    
-    ssize_t bytes_read = read(disk_image_fd, (void*)fs_info_sector, sizeof(FAT32_FSInfo));
-    if(bytes_read == -1){
-        fprintf(stderr, "\nError in read_FS_info() : read() returned -1 : %s\n", strerror(errno));
-        exit(EXIT_FAILURE);
+    __off_t fs_info_byte_location = (__off_t)volume->boot_sector->BPB_FSInfo * volume->boot_sector->BPB_BytesPerSec;
+
+    //Use the FSInfo sector in place if the image is mapped
+    volume->fs_info_sector = (FAT32_FSInfo*)get_disk_image_pointer(volume, fs_info_byte_location, sizeof(FAT32_FSInfo));
+    if(volume->fs_info_sector == NULL){
+        volume->fs_info_sector = malloc(sizeof(FAT32_FSInfo));
+        if(volume->fs_info_sector == NULL){
+            fprintf(stderr, "\nError in read_FS_info() : Could not allocate space for FAT32_FSInfo struct\n");
+            exit(EXIT_FAILURE);
+        }
+
+        size_t bytes_read = read_disk_image(volume, (void*)volume->fs_info_sector, sizeof(FAT32_FSInfo), fs_info_byte_location);
+        if(bytes_read != sizeof(FAT32_FSInfo)){
+            fprintf(stderr, "\nError in read_FS_info() : Disk image is too small to hold the FSInfo sector\n");
+            errno = EINVAL;
+            return false;
+        }
     }
 
     //Check signature to ensure successful read
-    if(fs_info_sector->FSI_LeadSig != 0x41615252){
+    if(volume->fs_info_sector->FSI_LeadSig != 0x41615252){
         fprintf(stderr, "\nError in read_FS_info() : Bad signature : FSI_LeadSig(0x41615252) was read as %#x\n",
-                        fs_info_sector->FSI_LeadSig);
-        exit(EXIT_FAILURE);
+                        volume->fs_info_sector->FSI_LeadSig);
+        errno = EINVAL;
+        return false;
     }
-    if(fs_info_sector->FSI_StrucSig != 0x61417272){
+    if(volume->fs_info_sector->FSI_StrucSig != 0x61417272){
         fprintf(stderr, "\nError in read_FS_info() : Bad signature : FSI_LeadSig(0x61417272) was read as %#x\n",
-                        fs_info_sector->FSI_StrucSig);
-        exit(EXIT_FAILURE);
+                        volume->fs_info_sector->FSI_StrucSig);
+        errno = EINVAL;
+        return false;
     }
-    if(fs_info_sector->FSI_TrailSig != 0xAA550000){
+    if(volume->fs_info_sector->FSI_TrailSig != 0xAA550000){
         fprintf(stderr, "\nError in read_FS_info() : Bad signature : FSI_LeadSig(0xAA550000) was read as %#x\n",
-                        fs_info_sector->FSI_TrailSig);
-        exit(EXIT_FAILURE);
+                        volume->fs_info_sector->FSI_TrailSig);
+        errno = EINVAL;
+        return false;
     }
 
-    //NULL terminate the label string
-    boot_sector->BS_VolLab[BS_VolLab_LENGTH] = '\0';
-    
+    return true;
+
 }
 
 /********************************************************************
 Reads the root directory into an allocated FAT32_Directory_Entry struct
 ********************************************************************/
-void read_root_directory(){
+void read_root_directory(FAT32_volume* volume){
 
     uint32_t root_dir_cluster_number;
-    file_cluster_node* chain_head;
-    uint8_t* bulk_data_buffer;
 
-    //Allocate space for root directory
-    root_directory = malloc(sizeof(FAT32_Directory_Entry));
-    if(root_directory == NULL){
-        fprintf(stderr, "\nError in read_root_directory() : Could not allocate space for root directory\n");
-        exit(EXIT_FAILURE);
+    root_dir_cluster_number = volume->boot_sector->BPB_RootClus;
+    volume->pinned_root_directory = get_cached_directory(volume, root_dir_cluster_number);
+    volume->root_directory = volume->pinned_root_directory->entries;
+    
+}
+
+/********************************************************************
+Looks name up in the current directory, through the index when one
+    is open, and copies what is known about the entry into entry.
+    *indexed is set to the entry's index node, or to NULL if it
+    came from the directory cache. Returns false if there is none
+********************************************************************/
+static bool find_entry(FAT32_cursor* cursor, char* name, FAT32_index_node* entry, FAT32_index_node** indexed){
+
+    FAT32_volume* volume = cursor->volume;
+
+    *indexed = NULL;
+    if(is_index_open(volume)){
+        *indexed = find_index_path(volume, cursor->current_directory_cluster, name);
+        if(*indexed != NULL){
+            *entry = **indexed;
+        }
+        return *indexed != NULL;
     }
 
-    //Read the cluster into a buffer
-    root_dir_cluster_number = boot_sector->BPB_RootClus;
-    chain_head = build_clusterchain(root_dir_cluster_number);
-    bulk_data_buffer = read_clusterchain(chain_head);
+    bool found = false;
+    memset(entry, 0, sizeof(FAT32_index_node));
+
+    //The first lookup in a directory that is not cached reads it only as far as the name.
+    //Any later one caches it, so its name index answers every lookup after that
+    FAT32_cached_directory* directory = lookup_cached_directory(volume, cursor->current_directory_cluster);
+    if(directory == NULL && volume->directory_cache.streamed_cluster == cursor->current_directory_cluster){
+        directory = get_cached_directory(volume, cursor->current_directory_cluster);
+    }
+
+    if(directory != NULL){
+        FAT32_Directory_Entry* dir = find_cached_directory_entry(volume, directory, name);
+        if(dir != NULL){
+            normalize_entry_name(dir, entry->name);
+            entry->attributes = dir->DIR_Attr;
+            entry->first_cluster = (dir->DIR_FstClusHI << 16) | dir->DIR_FstClusLO;
+            entry->file_size = dir->DIR_FileSize;
+            found = true;
+        }
+        release_cached_directory(volume, directory);
+    }else{
+        FAT32_directory_iterator iterator;
+        FAT32_file_info info;
+        volume->directory_cache.streamed_cluster = cursor->current_directory_cluster;
+        open_directory_iterator(volume, cursor->current_directory_cluster, &iterator);
+        while(!found && next_directory_entry(&iterator, &info)){
+            if(strcasecmp(info.name, name) == 0){
+                strcpy(entry->name, info.name);
+                entry->attributes = info.attributes;
+                entry->first_cluster = info.first_cluster;
+                entry->file_size = info.file_size;
+                found = true;
+            }
+        }
+        close_directory_iterator(&iterator);
+    }
+
+    //If name is '..' and the value there is 0, '..' is the root directory
+    if(found && strcmp(name, "..") == 0 && entry->first_cluster == 0){
+        entry->first_cluster = volume->boot_sector->BPB_RootClus;
+    }
+
+    return found;
 
-    //Copy the buffer into the allocated struct
-    root_directory = (FAT32_Directory_Entry*)(&bulk_data_buffer[0]);
-    current_directory_cluster = root_dir_cluster_number;
-    
 }
 
 /********************************************************************
 Searches the current directory for a file with the provided name
     If the file is found, write the clusterchain to a file in memory
 ********************************************************************/
-void download_file(char* file_name){
+void download_file(FAT32_cursor* cursor, char* file_name){
 
+    FAT32_volume* volume = cursor->volume;
     int file_descriptor;
-    uint8_t* directory_data = read_clusterchain(build_clusterchain(current_directory_cluster));
-    FAT32_Directory_Entry* dir = (FAT32_Directory_Entry*)&directory_data[0];
+    FAT32_index_node entry;
+    FAT32_index_node* indexed;
+    FAT32_digest digest_state;
 
     //Search for the file in the current directory
-    bool continue_parsing = true;
-    bool found_file = false;
-    
-    while(continue_parsing){
+    bool found_file = find_entry(cursor, file_name, &entry, &indexed) && !(entry.attributes & 0x10);
 
-        //check some FAT32-specific things
-        if(dir->DIR_Name[0] == 0x00){
-            //No more entries, stop searching
-            continue_parsing = false;
-            continue;
-        }
-        if(dir->DIR_Name[0] == 0xE5){
-            //empty entry, skip it
-            dir++;
-            continue;
+    if(found_file){
+
+        //The name of the entry rather than file_name, which may be a path when the index is open
+        char path[strlen(entry.name) + strlen(FILE_OUTPUT_FOLDER) + 1];
+        sprintf(path, "%s%s", FILE_OUTPUT_FOLDER, entry.name);
+
+        file_descriptor = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0777);
+        if(file_descriptor == -1){
+            fprintf(stderr, "\nError in download_file() : Could not create output file : %s\n", strerror(errno));
+        }else{
+            //Empty files have no clusters. The index already holds the chain, so the FAT is only followed without one
+            uint64_t bytes_written = 0;
+            FAT32_digest* digest = start_digest(volume, &digest_state);
+            if(entry.file_size > 0 && entry.first_cluster >= 2){
+                file_clusterchain* chain = (indexed != NULL && indexed->num_extents > 0) ? get_index_clusterchain(volume, indexed)
+                                                                                         : build_clusterchain(volume, entry.first_cluster);
+                bytes_written = stream_clusterchain(volume, chain, file_descriptor, entry.file_size, digest);
+            }
+            close(file_descriptor);
+            fprintf(stdout, "Downloaded %" PRIu64 " bytes to %s\n", bytes_written, path);
+
+            if(digest != NULL){
+                finish_digest(digest);
+                if(digest->use_crc32c){
+                    fprintf(stdout, "CRC32C %s\n", digest->crc32c_hex);
+                }
+                if(digest->use_sha256){
+                    fprintf(stdout, "SHA-256 %s\n", digest->sha256_hex);
+                }
+                write_digest_files(digest, path);
+            }
         }
+    }else{
+        fprintf(stderr, "Error: No such file\n");
+    }
 
-        //format dir->DIR_Name to look like user input (name.extension)
-        char trimmed_name[strlen(dir->DIR_Name) + 1];
-        trim_file_name(dir->DIR_Name, trimmed_name);
+}
 
-        if(strcmp(file_name, trimmed_name) == 0 && dir->DIR_Attr != 0x10){
-            continue_parsing = false;
-            found_file = true;
-            continue;
+/********************************************************************
+Checks that the name of an entry can be used as one component of a
+    host path. An image may hold any bytes in DIR_Name, and a '/' or
+    a NUL would let an extraction write outside the output folder or
+    over another file
+********************************************************************/
+static bool is_safe_output_name(FAT32_Directory_Entry* entry, char* name){
+
+    uint32_t i;
+
+    for(i = 0; i < SHORT_NAME_LENGTH; i++){
+        if(entry->DIR_Name[i] == '/' || entry->DIR_Name[i] == '\0'){
+            return false;
         }
+    }
+
+    return name[0] != '\0';
+
+}
+
+/********************************************************************
+Joins a host directory path and an entry name into an allocated path
+********************************************************************/
+static char* join_output_path(char* directory_path, char* name){
 
-        dir++;
+    char* path = malloc(strlen(directory_path) + strlen(name) + 2);
+    if(path == NULL){
+        fprintf(stderr, "\nError in join_output_path() : Could not allocate space for path\n");
+        exit(EXIT_FAILURE);
     }
+    sprintf(path, "%s/%s", directory_path, name);
 
-    if(found_file){
+    return path;
 
-        uint32_t file_cluster_number = (dir->DIR_FstClusHI << 16) | dir->DIR_FstClusLO;
-        uint8_t* file_data = read_clusterchain(build_clusterchain(file_cluster_number));
+}
 
-        char path[strlen(file_name) + strlen(FILE_OUTPUT_FOLDER)];
-        sprintf(path, "%s%s", FILE_OUTPUT_FOLDER, file_name);
+/********************************************************************
+Searches the current directory for a directory with the provided name
+    and copies the whole subtree into the output folder, keeping the
+    hierarchy. Directories are walked on this thread while a pool of
+    workers writes the files
+********************************************************************/
+void download_directory(FAT32_cursor* cursor, char* directory_name){
 
-        file_descriptor = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0777);
-        if(file_descriptor == -1){
-            fprintf(stderr, "\nError in download_file() : Could not create output file : %s\n", strerror(errno));
+    FAT32_volume* volume = cursor->volume;
+    uint32_t end_cluster = volume->geometry.end_cluster;
+    uint32_t num_pending = 0, pending_capacity = 16;
+    FAT32_pending_directory pending;
+    FAT32_extract_pool* pool;
+    char* output_root;
+
+    //Find where the walk starts. '.' and '..' have no name of their own, so they are written into the output folder itself
+    if(strcmp(directory_name, ".") == 0){
+        pending.first_cluster = cursor->current_directory_cluster;
+        output_root = strdup(FILE_OUTPUT_FOLDER);
+    }else{
+        FAT32_index_node entry;
+        FAT32_index_node* indexed;
+
+        if(!find_entry(cursor, directory_name, &entry, &indexed) || !(entry.attributes & 0x10)
+            || entry.first_cluster < 2 || entry.first_cluster >= end_cluster){
+            fprintf(stderr, "Error: No such directory\n");
+            return;
+        }
+        pending.first_cluster = entry.first_cluster;
+        if(strcmp(directory_name, "..") == 0){
+            output_root = strdup(FILE_OUTPUT_FOLDER);
         }else{
-            write(file_descriptor, (void*)file_data, dir->DIR_FileSize);
-            close(file_descriptor);
-            fprintf(stdout, "Downloaded %d bytes to %s\n", dir->DIR_FileSize, path);
+            output_root = malloc(strlen(FILE_OUTPUT_FOLDER) + strlen(entry.name) + 1);
+            if(output_root != NULL){
+                sprintf(output_root, "%s%s", FILE_OUTPUT_FOLDER, entry.name);
+            }
         }
-        free(file_data);
-    }else{
-        fprintf(stderr, "Error: No such file\n");
     }
+    if(output_root == NULL){
+        fprintf(stderr, "\nError in download_directory() : Could not allocate space for path\n");
+        exit(EXIT_FAILURE);
+    }
+    pending.output_path = output_root;
+
+    FAT32_pending_directory* stack = malloc(sizeof(FAT32_pending_directory) * pending_capacity);
+    if(stack == NULL){
+        fprintf(stderr, "\nError in download_directory() : Could not allocate space for directory stack\n");
+        exit(EXIT_FAILURE);
+    }
+    stack[num_pending++] = pending;
+
+    uint64_t* visited = calloc((end_cluster + 63) / 64, sizeof(uint64_t));
+    if(visited == NULL){
+        fprintf(stderr, "\nError in download_directory() : Could not allocate space for visited directories\n");
+        exit(EXIT_FAILURE);
+    }
+    claim_directory(visited, pending.first_cluster, end_cluster);
+
+    pool = start_extract_pool(volume, volume->settings.num_threads);
+
+    //Walk the tree with an explicit stack, only ever reading the directory cache from this thread
+    while(num_pending > 0){
+
+        pending = stack[--num_pending];
+
+        if(mkdir(pending.output_path, 0777) == -1 && errno != EEXIST){
+            fprintf(stderr, "\nError in download_directory() : Could not create %s : %s\n", pending.output_path, strerror(errno));
+            free(pending.output_path);
+            continue;
+        }
+
+        FAT32_cached_directory* directory = get_cached_directory(volume, pending.first_cluster);
+        uint32_t i;
+
+        for(i = 0; i < directory->num_entries; i++){
+
+            FAT32_Directory_Entry* dir = &directory->entries[i];
+            char name[NORMALIZED_NAME_LENGTH];
+
+            if(!is_named_entry(dir)){
+                continue;
+            }
+
+            uint32_t first_cluster = (dir->DIR_FstClusHI << 16) | dir->DIR_FstClusLO;
+            normalize_entry_name(dir, name);
+
+            if(!is_safe_output_name(dir, name)){
+                fprintf(stderr, "Warning: skipping an entry of %s whose name cannot be a host file name\n", pending.output_path);
+                continue;
+            }
+
+            if(dir->DIR_Attr & 0x10){
+                if(!claim_directory(visited, first_cluster, end_cluster)){
+                    continue;
+                }
+                if(num_pending == pending_capacity){
+                    pending_capacity *= 2;
+                    stack = realloc(stack, sizeof(FAT32_pending_directory) * pending_capacity);
+                    if(stack == NULL){
+                        fprintf(stderr, "\nError in download_directory() : Could not grow directory stack\n");
+                        exit(EXIT_FAILURE);
+                    }
+                }
+                stack[num_pending].first_cluster = first_cluster;
+                stack[num_pending].output_path = join_output_path(pending.output_path, name);
+                num_pending++;
+            }else{
+                queue_extract_job(pool, first_cluster, dir->DIR_FileSize, join_output_path(pending.output_path, name));
+            }
+        }
+
+        release_cached_directory(volume, directory);
+        free(pending.output_path);
+    }
+
+    finish_extract_pool(pool);
+    free(visited);
+    free(stack);
+
 }
 
 #pragma endregion Read_Functions
@@ -201,75 +549,501 @@ void download_file(char* file_name){
 
 /********************************************************************
 Searches the current directory for the specified directory
-    If it exists, get its cluster number and set the global variable
+    If it exists, move the cursor into it
+********************************************************************/
+void change_directory(FAT32_cursor* cursor, char* destination){
+
+    FAT32_index_node entry;
+    FAT32_index_node* indexed;
+
+    //Look the name up, and make sure it is a directory
+    bool found_folder = find_entry(cursor, destination, &entry, &indexed) && (entry.attributes & 0x10);
+
+    //A corrupt entry may point outside of the volume, where there is nothing to read
+    if(found_folder && (entry.first_cluster < 2 || entry.first_cluster >= cursor->volume->geometry.end_cluster)){
+        fprintf(stderr, "Error: %s starts at cluster %u, which is not on the volume\n", destination, entry.first_cluster);
+        return;
+    }
+
+    //If destination is '.', do nothing
+    if(found_folder && strcmp(destination, ".") != 0){
+        cursor->current_directory_cluster = entry.first_cluster;
+    }
+    
+    if(!found_folder){
+        fprintf(stderr, "Error: No such directory\n");
+    }
+
+}
+
+#pragma endregion Set_Functions
+
+#pragma region Write_Functions
+
+/********************************************************************
+Writes count consecutive FAT entries, starting with the entry of
+    first_cluster, to every copy of the FAT, or only the active one
+    when mirroring is off, and marks them stale in the FAT cache.
+    The reserved high 4 bits of each entry on the disk are kept
 ********************************************************************/
-void change_directory(char* destination){
+static void write_FAT_entries(FAT32_volume* volume, uint32_t first_cluster, uint32_t* entries, uint32_t count){
 
-    uint8_t* directory_data = read_clusterchain(build_clusterchain(current_directory_cluster));
-    FAT32_Directory_Entry* dir = (FAT32_Directory_Entry*)&directory_data[0];
+    size_t entries_size = (size_t)count * sizeof(uint32_t);
+    uint32_t i, j;
 
-    bool continue_parsing = true;
-    bool found_folder = false;
-    while(continue_parsing){
+    uint32_t* merged = malloc(entries_size);
+    if(merged == NULL){
+        fprintf(stderr, "\nError in write_FAT_entries() : Could not allocate space for FAT entries\n");
+        exit(EXIT_FAILURE);
+    }
 
-        //Check some FAT32-specific values
-        if(dir->DIR_Name[0] == 0x00){
-            //No more directory entries to search
-            continue_parsing = false;
+    for(i = 0; i < volume->boot_sector->BPB_NumFATs; i++){
+        if(!volume->geometry.is_FAT_mirrored && i != volume->geometry.active_FAT){
             continue;
         }
-        if(dir->DIR_Name[0] == 0xE5){
-            //Entry is empty, skip it
-            dir++;
-            continue;
+        __off_t FAT_byte_location = (__off_t)volume->boot_sector->BPB_RsvdSecCnt * volume->geometry.bytes_per_sector
+                                    + (__off_t)i * volume->geometry.FAT_size + (__off_t)first_cluster * sizeof(uint32_t);
+
+        //Entries past the end of the image have no high bits to keep
+        size_t bytes_read = read_disk_image(volume, merged, entries_size, FAT_byte_location);
+        memset((uint8_t*)merged + bytes_read, 0, entries_size - bytes_read);
+        for(j = 0; j < count; j++){
+            merged[j] = (merged[j] & ~FAT_ENTRY_MASK) | (entries[j] & FAT_ENTRY_MASK);
         }
 
-        //Remove whitespaces from dir->DIR_Name
-        int num_characters = 0;
-        int j;
-        while(dir->DIR_Name[num_characters] != ' '){
-            num_characters++;
+        write_disk_image(volume, merged, entries_size, FAT_byte_location);
+    }
+
+    free(merged);
+
+    invalidate_FAT_cache(volume, first_cluster, count);
+    update_free_bitmap(volume, first_cluster, entries, count);
+
+}
+
+/********************************************************************
+Links the clusters of a chain together in the FAT, ending with EOC.
+    If previous_cluster is not 0, its entry is pointed at the start
+    of the chain. Each extent is written with one write per FAT copy
+********************************************************************/
+static void link_clusterchain(FAT32_volume* volume, file_clusterchain* chain, uint32_t previous_cluster){
+
+    uint32_t i, j;
+
+    for(i = 0; i < chain->num_extents; i++){
+        file_cluster_extent* extent = &chain->extents[i];
+        uint32_t* entries = malloc(sizeof(uint32_t) * extent->num_clusters);
+        if(entries == NULL){
+            fprintf(stderr, "\nError in link_clusterchain() : Could not allocate space for FAT entries\n");
+            exit(EXIT_FAILURE);
         }
-        char no_space_name[num_characters];
-        for(j = 0; j < num_characters; j++){
-            no_space_name[j] = dir->DIR_Name[j];
+
+        for(j = 0; j + 1 < extent->num_clusters; j++){
+            entries[j] = extent->first_cluster + j + 1;
         }
-        no_space_name[j] = '\0';
+        entries[j] = (i + 1 < chain->num_extents) ? chain->extents[i + 1].first_cluster : FAT_ENTRY_MASK;
+
+        write_FAT_entries(volume, extent->first_cluster, entries, extent->num_clusters);
+        free(entries);
+    }
+
+    if(previous_cluster != 0 && chain->num_extents > 0){
+        write_FAT_entries(volume, previous_cluster, &chain->extents[0].first_cluster, 1);
+    }
 
-        //Special case for Japanese characters. 0x05 means the character is actually 0xE5
-        if(dir->DIR_Name[0] == 0x05){
-            no_space_name[0] = 0xE5;
+}
+
+/********************************************************************
+Looks for a run of at least num_needed free clusters that starts
+    between from_cluster and to_cluster. Sets run_start and returns
+    true if there is one
+********************************************************************/
+static bool find_free_run(FAT32_volume* volume, uint32_t from_cluster, uint32_t to_cluster, uint32_t num_needed, uint32_t* run_start){
+
+    uint32_t cluster = find_free_cluster(volume, from_cluster);
+
+    while(cluster < to_cluster){
+        uint32_t run_end = find_used_cluster(volume, cluster);
+        if(run_end - cluster >= num_needed){
+            *run_start = cluster;
+            return true;
         }
+        cluster = find_free_cluster(volume, run_end);
+    }
 
-        //Compare no_space_name to destination, and make sure it is a directory
-        if((strcmp(no_space_name, destination) == 0) && (dir->DIR_Attr == 0x10)){
+    return false;
 
-            found_folder = true;
-            continue_parsing = false;
-            
-            //If destination is '.', do nothing
-            if(strcmp(destination, ".") == 0){
-                continue;
-            }
+}
 
-            //Build the new cluster number
-            uint32_t new_cluster_number = (dir->DIR_FstClusHI << 16) | dir->DIR_FstClusLO;
+/********************************************************************
+Finds num_needed free clusters in the free bitmap, starting the search
+    at FSI_Nxt_Free. A single contiguous run is preferred so the file
+    reads back as one extent; if there is none, free runs are taken
+    in order. Returns NULL if the volume does not have enough free
+    clusters. Nothing is marked as used until the chain is linked
+********************************************************************/
+static file_clusterchain* allocate_clusters(FAT32_volume* volume, uint32_t num_needed){
+
+    uint32_t end_cluster = volume->geometry.end_cluster;
+    uint32_t run_start;
+
+    if(get_free_cluster_count(volume) < num_needed){
+        return NULL;
+    }
+
+    //FSI_Nxt_Free is only a hint, and 0xFFFFFFFF means there is none
+    uint32_t hint = volume->fs_info_sector->FSI_Nxt_Free;
+    if(hint < 2 || hint >= end_cluster){
+        hint = 2;
+    }
+
+    //First look for one run long enough, after the hint and then anywhere
+    if(find_free_run(volume, hint, end_cluster, num_needed, &run_start) || find_free_run(volume, 2, hint, num_needed, &run_start)){
+        file_clusterchain* chain = create_clusterchain(volume);
+        append_extent_to_chain(chain, run_start, num_needed);
+        return chain;
+    }
 
-            //If destination is '..' and the value there is 0, '..' is the root directory
-            if(strcmp(destination, "..") == 0 && new_cluster_number == 0){
-                new_cluster_number = boot_sector->BPB_RootClus;
+    //Otherwise take whole free runs in order, wrapping around once
+    file_clusterchain* chain = create_clusterchain(volume);
+    uint32_t cluster = find_free_cluster(volume, hint);
+    bool wrapped = false;
+    while(chain->num_clusters < num_needed){
+        if(cluster >= end_cluster || (wrapped && cluster >= hint)){
+            if(wrapped){
+                break;
             }
+            wrapped = true;
+            cluster = find_free_cluster(volume, 2);
+            continue;
+        }
 
-            current_directory_cluster = new_cluster_number;
+        //After wrapping, stop at the hint where the first pass started
+        uint32_t run_end = find_used_cluster(volume, cluster);
+        if(wrapped && run_end > hint){
+            run_end = hint;
         }
+        uint32_t run_length = run_end - cluster;
+        if(run_length > num_needed - chain->num_clusters){
+            run_length = num_needed - chain->num_clusters;
+        }
+        append_extent_to_chain(chain, cluster, run_length);
+        cluster = find_free_cluster(volume, cluster + run_length);
+    }
+
+    return chain;
+
+}
+
+/********************************************************************
+Writes the exact free cluster count and a new FSI_Nxt_Free to the disk
+    and to the in-memory copy of the FSInfo sector
+********************************************************************/
+static void update_FS_info(FAT32_volume* volume, uint32_t next_free){
+
+    FAT32_FSInfo new_fs_info = *volume->fs_info_sector;
+    __off_t fs_info_byte_location = (__off_t)volume->boot_sector->BPB_FSInfo * volume->boot_sector->BPB_BytesPerSec;
+
+    //The bitmap knows the real count, which also repairs a stale or unknown (0xFFFFFFFF) one
+    new_fs_info.FSI_Free_Count = get_free_cluster_count(volume);
+    new_fs_info.FSI_Nxt_Free = (next_free < volume->geometry.end_cluster) ? next_free : 2;
+
+    write_disk_image(volume, &new_fs_info, sizeof(FAT32_FSInfo), fs_info_byte_location);
 
-        dir++;
+    //A mapped FSInfo sector already sees the write
+    if(!is_disk_image_pointer(volume, volume->fs_info_sector)){
+        *volume->fs_info_sector = new_fs_info;
     }
-    
-    if(!found_folder){
-        fprintf(stderr, "Error: No such directory\n");
+
+}
+
+/********************************************************************
+Converts a host file name into a padded 8.3 short name. Returns false
+    if the name does not fit in 8.3 or uses characters a short name
+    cannot hold
+********************************************************************/
+static bool make_short_name(char* name, char* short_name){
+
+    char* dot = strrchr(name, '.');
+    size_t base_length = (dot != NULL) ? (size_t)(dot - name) : strlen(name);
+    size_t extension_length = (dot != NULL) ? strlen(dot + 1) : 0;
+    size_t i;
+
+    if(base_length == 0 || base_length > 8 || extension_length > 3 || (dot != NULL && extension_length == 0)){
+        return false;
     }
 
+    memset(short_name, ' ', SHORT_NAME_LENGTH);
+    for(i = 0; i < base_length; i++){
+        short_name[i] = toupper((unsigned char)name[i]);
+    }
+    for(i = 0; i < extension_length; i++){
+        short_name[8 + i] = toupper((unsigned char)dot[1 + i]);
+    }
+
+    for(i = 0; i < SHORT_NAME_LENGTH; i++){
+        if(short_name[i] != ' ' && strchr(SHORT_NAME_CHARACTERS, short_name[i]) == NULL){
+            return false;
+        }
+    }
+
+    //0xE5 as the first byte would mark the entry deleted
+    if((uint8_t)short_name[0] == 0xE5){
+        short_name[0] = 0x05;
+    }
+
+    return true;
+
+}
+
+/********************************************************************
+Fills in the creation, write and access stamps of an entry with the
+    current local time
+********************************************************************/
+static void stamp_directory_entry(FAT32_Directory_Entry* entry){
+
+    time_t now = time(NULL);
+    struct tm local;
+    localtime_r(&now, &local);
+
+    uint16_t date = ((local.tm_year - 80) << 9) | ((local.tm_mon + 1) << 5) | local.tm_mday;
+    uint16_t time_of_day = (local.tm_hour << 11) | (local.tm_min << 5) | (local.tm_sec / 2);
+
+    entry->DIR_CrtTimeTenth = (local.tm_sec % 2) * 100;
+    entry->DIR_CrtTime = time_of_day;
+    entry->DIR_CrtDate = date;
+    entry->DIR_LstAccDate = date;
+    entry->DIR_WrtTime = time_of_day;
+    entry->DIR_WrtDate = date;
+
+}
+
+/********************************************************************
+Finds the first free slot of the directory starting at
+    directory_cluster and sets slot_byte_location to where it is in
+    the image. A full directory grows by one zeroed cluster. Returns
+    false if it is full and no cluster is left to grow it
+********************************************************************/
+static bool reserve_directory_slot(FAT32_volume* volume, uint32_t directory_cluster, __off_t* slot_byte_location){
+
+    uint32_t cluster_size = volume->geometry.cluster_size;
+    uint32_t entries_per_cluster = cluster_size / sizeof(FAT32_Directory_Entry);
+    uint32_t slot;
+
+    //Reuse a deleted entry, or take the end marker's place
+    FAT32_cached_directory* directory = get_cached_directory(volume, directory_cluster);
+    for(slot = 0; slot < directory->num_entries; slot++){
+        if((uint8_t)directory->entries[slot].DIR_Name[0] == 0xE5){
+            break;
+        }
+    }
+    release_cached_directory(volume, directory);
+
+    file_clusterchain* chain = build_clusterchain(volume, directory_cluster);
+    uint32_t slot_cluster_index = slot / entries_per_cluster;
+
+    if(slot_cluster_index >= chain->num_clusters){
+        //Every slot is used, grow the directory by one zeroed cluster
+        file_clusterchain* extension = allocate_clusters(volume, 1);
+        if(extension == NULL){
+            fprintf(stderr, "Error: No free cluster left to grow the directory\n");
+            free_clusterchain(chain);
+            return false;
+        }
+
+        uint8_t* zeroes = calloc(1, cluster_size);
+        if(zeroes == NULL){
+            fprintf(stderr, "\nError in reserve_directory_slot() : Could not allocate space for cluster\n");
+            exit(EXIT_FAILURE);
+        }
+        uint32_t new_cluster = extension->extents[0].first_cluster;
+        write_disk_image(volume, zeroes, cluster_size, get_cluster_byte_offset(volume, new_cluster));
+        free(zeroes);
+
+        file_cluster_extent* last_extent = &chain->extents[chain->num_extents - 1];
+        link_clusterchain(volume, extension, last_extent->first_cluster + last_extent->num_clusters - 1);
+        update_FS_info(volume, new_cluster + 1);
+
+        append_cluster_to_chain(chain, new_cluster);
+        free_clusterchain(extension);
+    }
+
+    //Find which cluster of the chain holds the slot
+    uint32_t cluster_index = slot / entries_per_cluster;
+    uint32_t slot_cluster = 0;
+    uint32_t i;
+    for(i = 0; i < chain->num_extents; i++){
+        if(cluster_index < chain->extents[i].num_clusters){
+            slot_cluster = chain->extents[i].first_cluster + cluster_index;
+            break;
+        }
+        cluster_index -= chain->extents[i].num_clusters;
+    }
+    free_clusterchain(chain);
+
+    *slot_byte_location = get_cluster_byte_offset(volume, slot_cluster) + (__off_t)(slot % entries_per_cluster) * sizeof(FAT32_Directory_Entry);
+
+    return true;
+
+}
+
+/********************************************************************
+Writes an entry into a slot found by reserve_directory_slot() and
+    drops the stale copy of the directory from the cache
+********************************************************************/
+static void write_directory_entry(FAT32_volume* volume, uint32_t directory_cluster, FAT32_Directory_Entry* new_entry, __off_t slot_byte_location){
+
+    write_disk_image(volume, new_entry, sizeof(FAT32_Directory_Entry), slot_byte_location);
+
+    invalidate_cached_directory(volume, directory_cluster);
+
+    //Keep the pinned root directory current
+    if(directory_cluster == volume->boot_sector->BPB_RootClus){
+        release_cached_directory(volume, volume->pinned_root_directory);
+        volume->pinned_root_directory = get_cached_directory(volume, directory_cluster);
+        volume->root_directory = volume->pinned_root_directory->entries;
+    }
+
+}
+
+/********************************************************************
+Copies a file from the host into the current directory. Its clusters
+    are allocated as one contiguous run when possible, written, then
+    linked in every FAT before the directory entry is added
+********************************************************************/
+void upload_file(FAT32_cursor* cursor, char* host_path){
+
+    FAT32_volume* volume = cursor->volume;
+    struct stat host_stat;
+    char short_name[SHORT_NAME_LENGTH];
+    char name[NORMALIZED_NAME_LENGTH];
+    uint32_t cluster_size = volume->geometry.cluster_size;
+    uint32_t i;
+
+    char path_copy[strlen(host_path) + 1];
+    strcpy(path_copy, host_path);
+    char* host_name = basename(path_copy);
+
+    if(!volume->settings.use_write_access){
+        fprintf(stderr, "Error: %s was opened read-only\n", volume->disk_image_path);
+        return;
+    }
+    if(!make_short_name(host_name, short_name)){
+        fprintf(stderr, "Error: %s is not a valid 8.3 file name\n", host_name);
+        return;
+    }
+
+    int host_fd = open(host_path, O_RDONLY);
+    if(host_fd == -1){
+        fprintf(stderr, "Error: Could not open %s : %s\n", host_path, strerror(errno));
+        return;
+    }
+    if(fstat(host_fd, &host_stat) == -1 || !S_ISREG(host_stat.st_mode)){
+        fprintf(stderr, "Error: %s is not a regular file\n", host_path);
+        close(host_fd);
+        return;
+    }
+    if((uint64_t)host_stat.st_size > UINT32_MAX){
+        fprintf(stderr, "Error: %s is larger than the 4 GiB FAT32 limit\n", host_path);
+        close(host_fd);
+        return;
+    }
+
+    //Refuse to overwrite an existing entry
+    FAT32_Directory_Entry probe;
+    memcpy(probe.DIR_Name, short_name, SHORT_NAME_LENGTH);
+    normalize_entry_name(&probe, name);
+    FAT32_cached_directory* directory = get_cached_directory(volume, cursor->current_directory_cluster);
+    bool name_taken = (find_cached_directory_entry(volume, directory, name) != NULL);
+    release_cached_directory(volume, directory);
+    if(name_taken){
+        fprintf(stderr, "Error: %s already exists\n", name);
+        close(host_fd);
+        return;
+    }
+
+    //Make room for the entry first, a directory grown for nothing is harmless
+    __off_t slot_byte_location;
+    if(!reserve_directory_slot(volume, cursor->current_directory_cluster, &slot_byte_location)){
+        close(host_fd);
+        return;
+    }
+
+    FAT32_Directory_Entry new_entry;
+    memset(&new_entry, 0, sizeof(FAT32_Directory_Entry));
+    memcpy(new_entry.DIR_Name, short_name, SHORT_NAME_LENGTH);
+    new_entry.DIR_Attr = 0x20;
+    new_entry.DIR_FileSize = host_stat.st_size;
+    stamp_directory_entry(&new_entry);
+
+    //Empty files have no clusters
+    if(host_stat.st_size > 0){
+        uint32_t num_needed = (host_stat.st_size + cluster_size - 1) / cluster_size;
+        file_clusterchain* chain = allocate_clusters(volume, num_needed);
+        if(chain == NULL){
+            fprintf(stderr, "Error: Not enough free space for %s\n", host_path);
+            close(host_fd);
+            return;
+        }
+
+        //Write the data first, so a failure leaves no entry pointing at garbage
+        uint8_t* buffer = malloc(STREAM_SLOT_SIZE);
+        if(buffer == NULL){
+            fprintf(stderr, "\nError in upload_file() : Could not allocate space for copy buffer\n");
+            exit(EXIT_FAILURE);
+        }
+        uint64_t remaining = host_stat.st_size;
+        for(i = 0; i < chain->num_extents; i++){
+            __off_t byte_offset = get_cluster_byte_offset(volume, chain->extents[i].first_cluster);
+            uint64_t extent_remaining = (uint64_t)chain->extents[i].num_clusters * cluster_size;
+
+            while(extent_remaining > 0){
+                size_t to_copy = (extent_remaining > STREAM_SLOT_SIZE) ? STREAM_SLOT_SIZE : extent_remaining;
+                size_t data_length = (remaining < to_copy) ? remaining : to_copy;
+                size_t filled = 0;
+
+                while(filled < data_length){
+                    ssize_t bytes_read = read(host_fd, buffer + filled, data_length - filled);
+                    if(bytes_read == -1 && errno == EINTR){
+                        continue;
+                    }
+                    if(bytes_read <= 0){
+                        //The file shrank while it was copied, pad it with zeroes
+                        break;
+                    }
+                    filled += bytes_read;
+                }
+
+                //Zero the slack at the end of the last cluster
+                memset(buffer + filled, 0, to_copy - filled);
+                write_disk_image(volume, buffer, to_copy, byte_offset);
+
+                remaining -= data_length;
+                byte_offset += to_copy;
+                extent_remaining -= to_copy;
+            }
+        }
+        free(buffer);
+
+        file_cluster_extent* last_extent = &chain->extents[chain->num_extents - 1];
+        link_clusterchain(volume, chain, 0);
+        update_FS_info(volume, last_extent->first_cluster + last_extent->num_clusters);
+
+        new_entry.DIR_FstClusHI = chain->extents[0].first_cluster >> 16;
+        new_entry.DIR_FstClusLO = chain->extents[0].first_cluster & 0xFFFF;
+        fprintf(stdout, "Uploaded %" PRIu64 " bytes to %s in %u extent%s\n", (uint64_t)host_stat.st_size, name,
+                        chain->num_extents, (chain->num_extents == 1) ? "" : "s");
+        free_clusterchain(chain);
+    }else{
+        fprintf(stdout, "Uploaded 0 bytes to %s\n", name);
+    }
+    close(host_fd);
+
+    write_directory_entry(volume, cursor->current_directory_cluster, &new_entry, slot_byte_location);
+
+    //The index no longer matches the image
+    invalidate_index(volume);
+
 }
 
-#pragma endregion Set_Functions
\ No newline at end of file
+#pragma endregion Write_Functions
@@ -0,0 +1,204 @@
+/********************************************************************
+    Module: FAT32_extract.c
+    Author: Brennan Couturier
+
+    Worker pool used to copy many files out of the disk image at once
+********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "../include/FAT32_structs_globals.h"
+#include "../include/FAT32_extract.h"
+#include "../include/FAT32_helpers.h"
+#include "../include/FAT32_io.h"
+#include "../include/FAT32_digest.h"
+
+#pragma region Extract_Pool_Functions
+
+/********************************************************************
+Writes one file of a job to the host, and its digests next to it if
+    any are wanted. Returns the number of bytes written, or -1 if the
+    output file could not be created
+********************************************************************/
+static int64_t run_extract_job(FAT32_volume* volume, FAT32_extract_job* job, uint8_t* buffer){
+
+    FAT32_digest digest_state;
+
+    int file_descriptor = open(job->output_path, O_CREAT | O_TRUNC | O_WRONLY, 0777);
+    if(file_descriptor == -1){
+        fprintf(stderr, "\nError in run_extract_job() : Could not create %s : %s\n", job->output_path, strerror(errno));
+        return -1;
+    }
+
+    //Empty files have no clusters
+    uint64_t bytes_written = 0;
+    FAT32_digest* digest = start_digest(volume, &digest_state);
+    if(job->file_size > 0 && job->first_cluster >= 2){
+        bytes_written = copy_clusterchain(volume, build_clusterchain(volume, job->first_cluster), file_descriptor,
+                                            job->file_size, buffer, STREAM_SLOT_SIZE, digest);
+    }
+    close(file_descriptor);
+
+    if(digest != NULL){
+        finish_digest(digest);
+        write_digest_files(digest, job->output_path);
+    }
+
+    return (int64_t)bytes_written;
+
+}
+
+/********************************************************************
+Worker thread: takes jobs off the queue until the pool is closing
+    and the queue is empty
+********************************************************************/
+static void* run_extract_worker(void* argument){
+
+    FAT32_extract_pool* pool = (FAT32_extract_pool*)argument;
+    FAT32_volume* volume = pool->volume;
+    FAT32_extract_job job;
+
+    uint8_t* buffer = allocate_disk_buffer(volume, STREAM_SLOT_SIZE);
+    if(buffer == NULL){
+        fprintf(stderr, "\nError in run_extract_worker() : Could not allocate read buffer\n");
+        exit(EXIT_FAILURE);
+    }
+
+    while(true){
+
+        //Take the next job
+        pthread_mutex_lock(&pool->lock);
+        while(pool->num_queued == 0 && !pool->closing){
+            pthread_cond_wait(&pool->job_queued, &pool->lock);
+        }
+        if(pool->num_queued == 0){
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        job = pool->jobs[pool->queue_head];
+        pool->queue_head = (pool->queue_head + 1) % EXTRACT_QUEUE_LENGTH;
+        pool->num_queued--;
+        pthread_cond_signal(&pool->job_taken);
+        pthread_mutex_unlock(&pool->lock);
+
+        int64_t bytes_written = run_extract_job(volume, &job, buffer);
+        free(job.output_path);
+
+        pthread_mutex_lock(&pool->lock);
+        if(bytes_written < 0 || (uint64_t)bytes_written != job.file_size){
+            pool->files_failed++;
+        }else{
+            pool->files_written++;
+        }
+        if(bytes_written > 0){
+            pool->bytes_written += bytes_written;
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    free(buffer);
+
+    return NULL;
+
+}
+
+/********************************************************************
+Allocates a pool and starts num_workers threads waiting for jobs
+    to extract from the volume
+********************************************************************/
+FAT32_extract_pool* start_extract_pool(FAT32_volume* volume, uint32_t num_workers){
+
+    uint32_t i;
+
+    FAT32_extract_pool* pool = calloc(1, sizeof(FAT32_extract_pool));
+    if(pool == NULL){
+        fprintf(stderr, "\nError in start_extract_pool() : Could not allocate space for FAT32_extract_pool struct\n");
+        exit(EXIT_FAILURE);
+    }
+    if(num_workers == 0){
+        num_workers = 1;
+    }
+    pool->volume = volume;
+
+    pool->workers = malloc(sizeof(pthread_t) * num_workers);
+    if(pool->workers == NULL){
+        fprintf(stderr, "\nError in start_extract_pool() : Could not allocate space for worker threads\n");
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->job_queued, NULL);
+    pthread_cond_init(&pool->job_taken, NULL);
+
+    for(i = 0; i < num_workers; i++){
+        int error = pthread_create(&pool->workers[i], NULL, run_extract_worker, pool);
+        if(error != 0){
+            fprintf(stderr, "\nError in start_extract_pool() : pthread_create() failed : %s\n", strerror(error));
+            exit(EXIT_FAILURE);
+        }
+        pool->num_workers++;
+    }
+
+    return pool;
+
+}
+
+/********************************************************************
+Queues a file to be written to output_path, which the pool takes
+    ownership of. Blocks while the queue is full
+********************************************************************/
+void queue_extract_job(FAT32_extract_pool* pool, uint32_t first_cluster, uint32_t file_size, char* output_path){
+
+    pthread_mutex_lock(&pool->lock);
+    while(pool->num_queued == EXTRACT_QUEUE_LENGTH){
+        pthread_cond_wait(&pool->job_taken, &pool->lock);
+    }
+
+    FAT32_extract_job* job = &pool->jobs[(pool->queue_head + pool->num_queued) % EXTRACT_QUEUE_LENGTH];
+    job->first_cluster = first_cluster;
+    job->file_size = file_size;
+    job->output_path = output_path;
+    pool->num_queued++;
+
+    pthread_cond_signal(&pool->job_queued);
+    pthread_mutex_unlock(&pool->lock);
+
+}
+
+/********************************************************************
+Waits for every queued job to be written, stops the workers, prints
+    a summary and frees the pool
+********************************************************************/
+void finish_extract_pool(FAT32_extract_pool* pool){
+
+    uint32_t i;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->closing = true;
+    pthread_cond_broadcast(&pool->job_queued);
+    pthread_mutex_unlock(&pool->lock);
+
+    for(i = 0; i < pool->num_workers; i++){
+        pthread_join(pool->workers[i], NULL);
+    }
+
+    fprintf(stdout, "Downloaded %" PRIu64 " files (%" PRIu64 " bytes) using %u threads\n",
+                    pool->files_written, pool->bytes_written, pool->num_workers);
+    if(pool->files_failed > 0){
+        fprintf(stderr, "Error: %" PRIu64 " files could not be downloaded\n", pool->files_failed);
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->job_queued);
+    pthread_cond_destroy(&pool->job_taken);
+    free(pool->workers);
+    free(pool);
+
+}
+
+#pragma endregion Extract_Pool_Functions
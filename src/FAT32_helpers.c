@@ -10,9 +10,17 @@
 #include <unistd.h>
 #include <inttypes.h>
 #include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
 
 #include "../include/FAT32_structs_globals.h"
 #include "../include/FAT32_helpers.h"
+#include "../include/FAT32_cache.h"
+#include "../include/FAT32_io.h"
+#include "../include/FAT32_uring.h"
+#include "../include/FAT32_stats.h"
+#include "../include/FAT32_digest.h"
 
 #pragma region Get_Functions
 
@@ -21,10 +29,10 @@ Calculate how many root directory sectors there are. If FAT32 this
 	will be 0, otherwise we should stop the program because we
 	aren't operating on FAT12/16.
 ********************************************************************/
-uint16_t get_root_dir_sectors(){
+uint16_t get_root_dir_sectors(FAT32_volume* volume){
 
-    uint16_t root_entry_count = boot_sector->BPB_RootEntCnt;
-    uint16_t bytes_per_sector = boot_sector->BPB_BytesPerSec;
+    uint16_t root_entry_count = volume->boot_sector->BPB_RootEntCnt;
+    uint16_t bytes_per_sector = volume->boot_sector->BPB_BytesPerSec;
 
     uint16_t root_dir_sectors = ((root_entry_count * 32) + (bytes_per_sector - 1)) / bytes_per_sector;
 
@@ -36,28 +44,18 @@ uint16_t get_root_dir_sectors(){
 Calculate the sector number of the first data sector relative
 	to the sector that contains the BPB
 ********************************************************************/
-uint32_t get_first_data_sector(){
+uint32_t get_first_data_sector(FAT32_volume* volume){
 
-    uint16_t root_dir_sectors = get_root_dir_sectors();
-    uint16_t reserved_sector_count = boot_sector->BPB_RsvdSecCnt;
-    uint8_t num_FATs = boot_sector->BPB_NumFATs;
-    uint32_t FAT_size = boot_sector->BPB_FATSz32;
-
-    uint32_t first_data_sector = reserved_sector_count + (num_FATs * FAT_size) + root_dir_sectors;
-
-    return first_data_sector;
+    return volume->geometry.first_data_sector;
 
 }
 
 /********************************************************************
 Calculate the first sector of a given cluster number
 ********************************************************************/
-uint32_t get_first_sector_of_cluster(uint32_t cluster_number){
-
-    uint32_t first_data_sector = get_first_data_sector();
-    uint8_t sectors_per_cluster = boot_sector->BPB_SecPerClus;
+uint32_t get_first_sector_of_cluster(FAT32_volume* volume, uint32_t cluster_number){
 
-    uint32_t first_sector_of_cluster = ((cluster_number - 2) * sectors_per_cluster) + first_data_sector;
+    uint32_t first_sector_of_cluster = ((cluster_number - 2) * volume->geometry.sectors_per_cluster) + volume->geometry.first_data_sector;
 
     return first_sector_of_cluster;
 
@@ -66,13 +64,13 @@ uint32_t get_first_sector_of_cluster(uint32_t cluster_number){
 /********************************************************************
 Calculate the number of sectors in the data region of the volume
 ********************************************************************/
-uint32_t get_num_data_region_sectors(){
+uint32_t get_num_data_region_sectors(FAT32_volume* volume){
 
-    uint16_t root_dir_sectors = get_root_dir_sectors();
-    uint32_t total_sectors = boot_sector->BPB_TotSec32;
-    uint16_t reserved_sector_count = boot_sector->BPB_RsvdSecCnt;
-    uint8_t num_FATs = boot_sector->BPB_NumFATs;
-    uint32_t FAT_size = boot_sector->BPB_FATSz32;
+    uint16_t root_dir_sectors = get_root_dir_sectors(volume);
+    uint32_t total_sectors = volume->boot_sector->BPB_TotSec32;
+    uint16_t reserved_sector_count = volume->boot_sector->BPB_RsvdSecCnt;
+    uint8_t num_FATs = volume->boot_sector->BPB_NumFATs;
+    uint32_t FAT_size = volume->boot_sector->BPB_FATSz32;
     
     uint32_t num_data_region_sectors = total_sectors - (reserved_sector_count + (num_FATs * FAT_size) + root_dir_sectors);
 
@@ -84,14 +82,74 @@ uint32_t get_num_data_region_sectors(){
 Calculate the number of data clusters in total starting at cluster 2
     This computation rounds down
 ********************************************************************/
-uint32_t get_num_clusters(){
+uint32_t get_num_clusters(FAT32_volume* volume){
+
+    return volume->geometry.num_clusters;
+
+}
+
+/********************************************************************
+Computes the geometry of the volume from its boot sector. Returns
+    false with errno set to EINVAL if the BPB describes a layout that
+    cannot be addressed
+********************************************************************/
+bool compute_volume_geometry(FAT32_volume* volume){
+
+    FAT32_BS* boot_sector = volume->boot_sector;
+    FAT32_geometry* geometry = &volume->geometry;
 
-    uint32_t num_data_region_sectors = get_num_data_region_sectors();
-    uint8_t sectors_per_cluster = boot_sector->BPB_SecPerClus;
+    //Directory entries and FAT entries must tile a sector, and clusters must hold something
+    if(boot_sector->BPB_BytesPerSec == 0 || boot_sector->BPB_BytesPerSec % sizeof(FAT32_Directory_Entry) != 0){
+        fprintf(stderr, "\nError in compute_volume_geometry() : Bad sector size : BPB_BytesPerSec - %u\n", boot_sector->BPB_BytesPerSec);
+        errno = EINVAL;
+        return false;
+    }
+    if(boot_sector->BPB_SecPerClus == 0){
+        fprintf(stderr, "\nError in compute_volume_geometry() : Bad cluster size : BPB_SecPerClus - 0\n");
+        errno = EINVAL;
+        return false;
+    }
+
+    uint64_t first_data_sector = boot_sector->BPB_RsvdSecCnt + (uint64_t)boot_sector->BPB_NumFATs * boot_sector->BPB_FATSz32
+                                 + get_root_dir_sectors(volume);
+    if(first_data_sector > boot_sector->BPB_TotSec32){
+        fprintf(stderr, "\nError in compute_volume_geometry() : FATs end at sector %" PRIu64 ", past the end of the volume : BPB_TotSec32 - %u\n",
+                        first_data_sector, boot_sector->BPB_TotSec32);
+        errno = EINVAL;
+        return false;
+    }
+
+    //With mirroring off, bits 0-3 of BPB_ExtFlags pick the only FAT that is kept up to date
+    geometry->is_FAT_mirrored = (boot_sector->BPB_ExtFlags & 0x80) == 0;
+    geometry->active_FAT = geometry->is_FAT_mirrored ? 0 : (boot_sector->BPB_ExtFlags & 0x0F);
+    if(geometry->active_FAT >= boot_sector->BPB_NumFATs){
+        fprintf(stderr, "\nError in compute_volume_geometry() : Active FAT %u does not exist : BPB_NumFATs - %u\n",
+                        geometry->active_FAT, boot_sector->BPB_NumFATs);
+        errno = EINVAL;
+        return false;
+    }
 
-    uint32_t num_clusters = num_data_region_sectors / sectors_per_cluster;
+    geometry->bytes_per_sector = boot_sector->BPB_BytesPerSec;
+    geometry->sectors_per_cluster = boot_sector->BPB_SecPerClus;
+    geometry->cluster_size = geometry->bytes_per_sector * geometry->sectors_per_cluster;
+    geometry->first_data_sector = first_data_sector;
+    geometry->num_clusters = get_num_data_region_sectors(volume) / geometry->sectors_per_cluster;
+    geometry->end_cluster = geometry->num_clusters + 2;
+    geometry->FAT_entries_per_sector = geometry->bytes_per_sector / sizeof(uint32_t);
+    geometry->FAT_size = (off_t)boot_sector->BPB_FATSz32 * geometry->bytes_per_sector;
+    geometry->FAT_byte_offset = (off_t)boot_sector->BPB_RsvdSecCnt * geometry->bytes_per_sector
+                                + geometry->active_FAT * geometry->FAT_size;
+    geometry->data_byte_offset = (off_t)geometry->first_data_sector * geometry->bytes_per_sector;
+
+    geometry->is_power_of_two = (geometry->bytes_per_sector & (geometry->bytes_per_sector - 1)) == 0
+                                && (geometry->sectors_per_cluster & (geometry->sectors_per_cluster - 1)) == 0;
+    if(geometry->is_power_of_two){
+        geometry->sector_shift = __builtin_ctz(geometry->bytes_per_sector);
+        geometry->cluster_shift = __builtin_ctz(geometry->cluster_size);
+        geometry->FAT_entries_per_sector_shift = __builtin_ctz(geometry->FAT_entries_per_sector);
+    }
 
-    return num_clusters;
+    return true;
 
 }
 
@@ -100,13 +158,11 @@ Calculate FAT entry number for given cluster number N
 	This is the sector number of the FAT sector that contains the 
 	entry for cluster N in the first FAT
 ********************************************************************/
-uint32_t get_FAT_sector_number_for_cluster(uint32_t cluster_number){
+uint32_t get_FAT_sector_number_for_cluster(FAT32_volume* volume, uint32_t cluster_number){
 
-    uint32_t FAT_offset = cluster_number * 4;
-    uint16_t reserved_sector_count = boot_sector->BPB_RsvdSecCnt;
-    uint16_t bytes_per_sector = boot_sector->BPB_BytesPerSec;
+    uint32_t reserved_sector_count = volume->boot_sector->BPB_RsvdSecCnt;
 
-    uint32_t FAT_sector_number_for_cluster = reserved_sector_count + (FAT_offset / bytes_per_sector);
+    uint32_t FAT_sector_number_for_cluster = reserved_sector_count + get_FAT_sector_index(volume, cluster_number);
 
     return FAT_sector_number_for_cluster;
 
@@ -115,33 +171,42 @@ uint32_t get_FAT_sector_number_for_cluster(uint32_t cluster_number){
 /********************************************************************
 Calculate FAT entry offset value for given cluster number
 ********************************************************************/
-uint32_t get_FAT_entry_offset_for_cluster(uint32_t cluster_number){
+uint32_t get_FAT_entry_offset_for_cluster(FAT32_volume* volume, uint32_t cluster_number){
 
     uint32_t FAT_offset = cluster_number * 4;
-    uint16_t bytes_per_sector = boot_sector->BPB_BytesPerSec;
 
-    uint32_t FAT_entry_offset_for_cluster = FAT_offset % bytes_per_sector; //Remainder of FAT_offset / bytes_per_sector
+    if(volume->geometry.is_power_of_two){
+        return FAT_offset & (volume->geometry.bytes_per_sector - 1);
+    }
 
-    return FAT_entry_offset_for_cluster;
+    return FAT_offset % volume->geometry.bytes_per_sector; //Remainder of FAT_offset / bytes_per_sector
 
 }
 
 /********************************************************************
 Fetch the contents of the given cluster's FAT entry
 ********************************************************************/
-uint32_t get_FAT_entry_contents(uint32_t cluster_number){
+uint32_t get_FAT_entry_contents(FAT32_volume* volume, uint32_t cluster_number){
 
-    ssize_t bytes_read;
+    size_t bytes_read;
     uint32_t FAT_entry;
-    uint32_t FAT_sector_number = get_FAT_sector_number_for_cluster(cluster_number);
-    uint32_t FAT_entry_offset = get_FAT_entry_offset_for_cluster(cluster_number);
-    __off_t FAT_entry_byte_location = (FAT_sector_number * boot_sector->BPB_BytesPerSec) + FAT_entry_offset;
-
-    lseek(disk_image_fd, FAT_entry_byte_location, SEEK_SET);
-    bytes_read = read(disk_image_fd, (void*)(&FAT_entry), sizeof(uint32_t));
-    if(bytes_read == -1){
-        fprintf(stderr, "\nError in get_FAT_entry_contents() : Read returned -1\n");
-        exit(EXIT_FAILURE);
+
+    count_stat(volume, STAT_FAT_LOOKUPS, 1);
+
+    //Serve the entry from memory if the FAT is cached
+    if(lookup_FAT_cache(volume, cluster_number, &FAT_entry)){
+        count_stat(volume, STAT_FAT_CACHE_HITS, 1);
+        return FAT_entry & FAT_ENTRY_MASK;
+    }
+    count_stat(volume, STAT_FAT_CACHE_MISSES, 1);
+
+    __off_t FAT_entry_byte_location = volume->geometry.FAT_byte_offset + (__off_t)cluster_number * sizeof(uint32_t);
+
+    //Goes through the bounce buffer with direct I/O, a FAT entry is never a whole block
+    bytes_read = read_disk_image(volume, (void*)(&FAT_entry), sizeof(uint32_t), FAT_entry_byte_location);
+    if(bytes_read != sizeof(uint32_t)){
+        //The image is truncated inside the FAT, end the chain here
+        FAT_entry = FAT_ENTRY_MASK;
     }
 
     //The actual entry is only 28-bits, so mask out the high four bits
@@ -152,9 +217,9 @@ uint32_t get_FAT_entry_contents(uint32_t cluster_number){
 /********************************************************************
 Returns a string representing the FAT version we're using
 ********************************************************************/
-char* get_FAT_type(){
+char* get_FAT_type(FAT32_volume* volume){
 
-    uint32_t count_of_clusters = get_num_clusters();
+    uint32_t count_of_clusters = get_num_clusters(volume);
     char* return_value = "";
 
     if(count_of_clusters < 4085){
@@ -189,58 +254,242 @@ bool is_FAT_entry_EOC(uint32_t FAT_entry){
 
 }
 
+/********************************************************************
+Checks if the directory entry names a file or a subdirectory, and
+    is not a deleted entry, a long name entry, the volume label, '.'
+    or '..', which every walk of the tree skips
+********************************************************************/
+bool is_named_entry(FAT32_Directory_Entry* entry){
+
+    //Long name entries and the volume label both have the volume ID bit
+    return (uint8_t)entry->DIR_Name[0] != 0xE5 && !(entry->DIR_Attr & 0x08) && entry->DIR_Name[0] != '.';
+
+}
+
+/********************************************************************
+Sets the bit of first_cluster in visited, one bit per cluster of the
+    volume. Returns false if the cluster is not on the volume or the
+    bit was already set, so each directory of a cross-linked or
+    looping tree is walked only once. Safe to call from any thread
+********************************************************************/
+bool claim_directory(uint64_t* visited, uint32_t first_cluster, uint32_t end_cluster){
+
+    if(first_cluster < 2 || first_cluster >= end_cluster){
+        return false;
+    }
+
+    uint64_t bit = 1ULL << (first_cluster % 64);
+    return !(__atomic_fetch_or(&visited[first_cluster / 64], bit, __ATOMIC_RELAXED) & bit);
+
+}
+
 #pragma endregion Value_Check_Functions
 
 #pragma region Clusterchain_Functions
 
-file_cluster_node* build_clusterchain(uint32_t cluster_number_in){
+/********************************************************************
+Appends a cluster to the chain, extending the last extent if the
+    cluster directly follows it
+********************************************************************/
+void append_cluster_to_chain(file_clusterchain* chain, uint32_t cluster_number){
+
+    if(chain->num_extents > 0){
+        file_cluster_extent* last = &chain->extents[chain->num_extents - 1];
+        if(last->first_cluster + last->num_clusters == cluster_number){
+            last->num_clusters++;
+            chain->num_clusters++;
+            return;
+        }
+    }
 
-    uint32_t FAT_entry;
-    bool is_EOC;
-    
-    file_cluster_node* to_return = malloc(sizeof(file_cluster_node));
-    if(to_return == NULL){
-        fprintf(stderr, "\nError in build_clusterchain() : Could not allocate space for first cluster node\n");
+    //Start a new extent, growing the array if it is full
+    if(chain->num_extents == chain->capacity){
+        uint32_t new_capacity = chain->capacity * 2;
+        file_cluster_extent* new_extents = realloc(chain->extents, new_capacity * sizeof(file_cluster_extent));
+        if(new_extents == NULL){
+            fprintf(stderr, "\nError in append_cluster_to_chain() : Could not grow extent array\n");
+            exit(EXIT_FAILURE);
+        }
+        chain->extents = new_extents;
+        chain->capacity = new_capacity;
+        count_stat(chain->volume, STAT_ALLOCATIONS, 1);
+        count_stat(chain->volume, STAT_BYTES_ALLOCATED, new_capacity * sizeof(file_cluster_extent));
+    }
+
+    chain->extents[chain->num_extents].first_cluster = cluster_number;
+    chain->extents[chain->num_extents].num_clusters = 1;
+    chain->num_extents++;
+    chain->num_clusters++;
+
+}
+
+/********************************************************************
+Allocates an empty chain with room for a few extents. Its
+    allocations are counted in the volume's statistics
+********************************************************************/
+file_clusterchain* create_clusterchain(FAT32_volume* volume){
+
+    file_clusterchain* chain = malloc(sizeof(file_clusterchain));
+    if(chain == NULL){
+        fprintf(stderr, "\nError in create_clusterchain() : Could not allocate space for clusterchain\n");
         exit(EXIT_FAILURE);
     }
 
-    to_return->cluster_number = cluster_number_in;
-    to_return->next = NULL;
+    chain->volume = volume;
+    chain->capacity = 4;
+    chain->num_extents = 0;
+    chain->num_clusters = 0;
+    chain->extents = malloc(chain->capacity * sizeof(file_cluster_extent));
+    if(chain->extents == NULL){
+        fprintf(stderr, "\nError in create_clusterchain() : Could not allocate space for extent array\n");
+        exit(EXIT_FAILURE);
+    }
+    count_stat(volume, STAT_ALLOCATIONS, 2);
+    count_stat(volume, STAT_BYTES_ALLOCATED, sizeof(file_clusterchain) + chain->capacity * sizeof(file_cluster_extent));
 
-    file_cluster_node* curr = to_return;
+    return chain;
 
-    FAT_entry = get_FAT_entry_contents(to_return->cluster_number);
-    is_EOC = is_FAT_entry_EOC(FAT_entry);
-    while(!is_EOC){
-        //FAT entry is the next cluster number
-        file_cluster_node* to_add = malloc(sizeof(file_cluster_node));
-        if(to_add == NULL){
-            fprintf(stderr, "\nError in build_clusterchain() : Could not allocate space for to_add cluster node\n");
-            exit(EXIT_FAILURE);
+}
+
+/********************************************************************
+Appends num_clusters consecutive clusters starting at first_cluster
+    to the chain
+********************************************************************/
+void append_extent_to_chain(file_clusterchain* chain, uint32_t first_cluster, uint32_t num_clusters){
+
+    if(num_clusters == 0){
+        return;
+    }
+
+    append_cluster_to_chain(chain, first_cluster);
+    chain->extents[chain->num_extents - 1].num_clusters += num_clusters - 1;
+    chain->num_clusters += num_clusters - 1;
+
+}
+
+/********************************************************************
+Drops clusters off the end of the chain until num_clusters are left
+********************************************************************/
+static void truncate_clusterchain(file_clusterchain* chain, uint32_t num_clusters){
+
+    while(chain->num_clusters > num_clusters){
+        file_cluster_extent* last = &chain->extents[chain->num_extents - 1];
+        uint32_t excess = chain->num_clusters - num_clusters;
+        if(last->num_clusters > excess){
+            last->num_clusters -= excess;
+            chain->num_clusters -= excess;
+        }else{
+            chain->num_clusters -= last->num_clusters;
+            chain->num_extents--;
+        }
+    }
+
+}
+
+/********************************************************************
+Follows the FAT from cluster_number_in like build_clusterchain(), but
+    stops at a FAT entry that is not a cluster of the volume (free,
+    bad or out of range), or once the chain comes back to a cluster
+    it already holds. Loops are found with Brent's algorithm, which
+    only compares each next cluster with one saved cluster, so the
+    walk does no extra FAT lookups. The chain is cut after its last
+    distinct cluster, and status says how the walk ended
+********************************************************************/
+file_clusterchain* follow_clusterchain(FAT32_volume* volume, uint32_t cluster_number_in, FAT32_chain_status* status){
+
+    uint32_t end_cluster = volume->geometry.end_cluster;
+    uint32_t FAT_entry;
+    uint64_t start = get_stat_time();
+
+    //Brent's algorithm: saved is the cluster the chain is checked against, moved every power of two steps
+    uint32_t saved_cluster = cluster_number_in;
+    uint32_t power = 1, loop_length = 1;
+
+    file_clusterchain* to_return = create_clusterchain(volume);
+    append_cluster_to_chain(to_return, cluster_number_in);
+    *status = CHAIN_COMPLETE;
+
+    FAT_entry = get_FAT_entry_contents(volume, cluster_number_in);
+    while(!is_FAT_entry_EOC(FAT_entry)){
+        if(FAT_entry < 2 || FAT_entry >= end_cluster){
+            *status = CHAIN_BROKEN;
+            break;
+        }
+        if(FAT_entry == saved_cluster){
+            //The loop is loop_length clusters long. The clusters before it are found by walking two
+            //cursors loop_length apart from the start until they meet where the loop begins
+            uint32_t behind = cluster_number_in, ahead = cluster_number_in, num_before_loop = 0, i;
+            for(i = 0; i < loop_length; i++){
+                ahead = get_FAT_entry_contents(volume, ahead);
+            }
+            while(behind != ahead){
+                behind = get_FAT_entry_contents(volume, behind);
+                ahead = get_FAT_entry_contents(volume, ahead);
+                num_before_loop++;
+            }
+            truncate_clusterchain(to_return, num_before_loop + loop_length);
+            *status = CHAIN_LOOPS;
+            break;
         }
 
-        to_add->cluster_number = FAT_entry;
-        to_add->next = NULL;
-        curr->next = to_add;
-        curr = curr->next;
+        //FAT entry is the next cluster number
+        append_cluster_to_chain(to_return, FAT_entry);
+
+        if(loop_length == power){
+            saved_cluster = FAT_entry;
+            power *= 2;
+            loop_length = 0;
+        }
+        loop_length++;
 
-        FAT_entry = get_FAT_entry_contents(curr->cluster_number);
-        is_EOC = is_FAT_entry_EOC(FAT_entry);
+        FAT_entry = get_FAT_entry_contents(volume, FAT_entry);
     }
 
+    count_stat_time(volume, STAT_CHAIN_NANOSECONDS, start);
+    count_stat(volume, STAT_CHAINS_BUILT, 1);
+    count_stat(volume, STAT_CHAIN_CLUSTERS, to_return->num_clusters);
+    count_stat(volume, STAT_CHAIN_EXTENTS, to_return->num_extents);
+
     return to_return;
 
 }
 
 /********************************************************************
-Print out all the cluster numbers in the chain, ending with EOC
+This function builds the chain of clusters of a file. It starts at
+    the cluster specified by cluster_number, then follows the FAT
+    until it finds an EOC marker, merging consecutive cluster
+    numbers into extents. It then returns a pointer to the chain.
+    A chain that is broken or loops is cut short with a warning
 ********************************************************************/
-void print_clusterchain(file_cluster_node* chain_head){
+file_clusterchain* build_clusterchain(FAT32_volume* volume, uint32_t cluster_number_in){
+
+    FAT32_chain_status status;
+
+    file_clusterchain* to_return = follow_clusterchain(volume, cluster_number_in, &status);
 
-    file_cluster_node* curr = chain_head;
-    while(curr != NULL){
-        fprintf(stdout, "%d->", curr->cluster_number);
-        curr = curr->next;
+    if(status == CHAIN_BROKEN){
+        fprintf(stderr, "Warning: clusterchain starting at cluster %u is broken after %u clusters\n", cluster_number_in, to_return->num_clusters);
+    }else if(status == CHAIN_LOOPS){
+        fprintf(stderr, "Warning: clusterchain starting at cluster %u loops after %u clusters\n", cluster_number_in, to_return->num_clusters);
+    }
+
+    return to_return;
+
+}
+
+/********************************************************************
+Print out all the extents in the chain, ending with EOC
+********************************************************************/
+void print_clusterchain(file_clusterchain* chain){
+
+    uint32_t i;
+    for(i = 0; i < chain->num_extents; i++){
+        file_cluster_extent* extent = &chain->extents[i];
+        if(extent->num_clusters == 1){
+            fprintf(stdout, "%u->", extent->first_cluster);
+        }else{
+            fprintf(stdout, "%u-%u->", extent->first_cluster, extent->first_cluster + extent->num_clusters - 1);
+        }
     }
     fprintf(stdout, "EOC\n");
 
@@ -248,73 +497,708 @@ void print_clusterchain(file_cluster_node* chain_head){
 
 /********************************************************************
 Read all the clusters into one bit char array (byte array), to be
-	formatted by the caller
+    formatted by the caller. Frees the chain
 ********************************************************************/
-uint8_t* read_clusterchain(file_cluster_node* chain_head){
+uint8_t* read_clusterchain(FAT32_volume* volume, file_clusterchain* chain){
 
     //Declare variables
-    file_cluster_node* curr = chain_head;
-    int num_nodes = 0;
-    int cluster_offset = 0;
+    size_t buffer_offset = 0;
+    uint32_t i, num_requests = 0;
 
-    size_t cluster_size = boot_sector->BPB_BytesPerSec * boot_sector->BPB_SecPerClus;
-    ssize_t bytes_read;
+    size_t cluster_size = volume->geometry.cluster_size;
     uint8_t* bulk_buffer;
+    FAT32_read_request* requests;
     __off_t byte_offset;
 
-
-    //count number of nodes in chain
-    while(curr != NULL){
-        num_nodes++;
-        curr = curr->next;
-    }
-    curr = chain_head;
-
     //Allocate the bulk buffer
-    bulk_buffer = malloc(cluster_size * num_nodes);
+    bulk_buffer = allocate_disk_buffer(volume, cluster_size * chain->num_clusters);
     if(bulk_buffer == NULL){
         fprintf(stderr, "\nError in read_clusterchain() : Could not allocate space for bulk buffer\n");
         exit(EXIT_FAILURE);
     }
 
-    //Go through each cluster in the chain, move their contents into the bulk buffer
-    while(curr != NULL){
-        byte_offset = get_first_sector_of_cluster(curr->cluster_number) * boot_sector->BPB_BytesPerSec;
-        lseek(disk_image_fd, byte_offset, SEEK_SET);
+    //Each extent is contiguous on the disk, so it only needs to be split into reads of max_io_size bytes
+    uint32_t max_requests = chain->num_extents + (cluster_size * chain->num_clusters) / volume->settings.max_io_size;
+    requests = malloc(sizeof(FAT32_read_request) * max_requests);
+    if(requests == NULL){
+        fprintf(stderr, "\nError in read_clusterchain() : Could not allocate space for read requests\n");
+        exit(EXIT_FAILURE);
+    }
+    count_stat(volume, STAT_CHAINS_READ, 1);
+    count_stat(volume, STAT_ALLOCATIONS, 2);
+    count_stat(volume, STAT_BYTES_ALLOCATED, cluster_size * chain->num_clusters + sizeof(FAT32_read_request) * max_requests);
+
+    for(i = 0; i < chain->num_extents; i++){
+        size_t extent_size = cluster_size * chain->extents[i].num_clusters;
+        byte_offset = get_cluster_byte_offset(volume, chain->extents[i].first_cluster);
+
+        advise_disk_image(volume, byte_offset, extent_size, MADV_WILLNEED);
+        while(extent_size > 0){
+            size_t request_size = (extent_size > volume->settings.max_io_size) ? volume->settings.max_io_size : extent_size;
+            requests[num_requests].buffer = bulk_buffer + buffer_offset;
+            requests[num_requests].count = request_size;
+            requests[num_requests].offset = byte_offset;
+            num_requests++;
+
+            buffer_offset += request_size;
+            byte_offset += request_size;
+            extent_size -= request_size;
+        }
+    }
+
+    //Every read can be in flight at once, they land at their own place in the buffer
+    read_disk_image_batch(volume, requests, num_requests);
+
+    for(i = 0; i < num_requests; i++){
+        if(requests[i].bytes_read < requests[i].count){
+            //Clusters past the end of the image read as zeroes
+            memset((uint8_t*)requests[i].buffer + requests[i].bytes_read, 0, requests[i].count - requests[i].bytes_read);
+        }
+    }
+
+    free(requests);
+    free_clusterchain(chain);
+
+    return bulk_buffer;
+
+}
+
+/********************************************************************
+Takes the next read of up to count bytes off the chain into buffer.
+    A read never crosses the end of an extent. Returns false once
+    every byte of the chain has been taken
+********************************************************************/
+static bool next_chain_read(FAT32_volume* volume, FAT32_chain_cursor* cursor, void* buffer, size_t count,
+                            FAT32_read_request* request){
+
+    file_clusterchain* chain = cursor->chain;
+    uint64_t extent_size = 0;
+
+    //Skip the extents already read in full
+    while(cursor->extent < chain->num_extents){
+        extent_size = (uint64_t)volume->geometry.cluster_size * chain->extents[cursor->extent].num_clusters;
+        if(cursor->extent_offset < extent_size){
+            break;
+        }
+        cursor->extent++;
+        cursor->extent_offset = 0;
+    }
+    if(cursor->extent >= chain->num_extents || cursor->remaining == 0){
+        return false;
+    }
+
+    if(count > extent_size - cursor->extent_offset){
+        count = extent_size - cursor->extent_offset;
+    }
+    if(count > cursor->remaining){
+        count = cursor->remaining;
+    }
+
+    request->buffer = buffer;
+    request->count = count;
+    request->offset = get_cluster_byte_offset(volume, chain->extents[cursor->extent].first_cluster) + cursor->extent_offset;
+    cursor->extent_offset += count;
+    cursor->remaining -= count;
+
+    return true;
+
+}
+
+/********************************************************************
+Reader side of stream_clusterchain(). Walks the extents of the chain,
+    filling ring slots with up to STREAM_SLOT_SIZE contiguous bytes
+    each, and stops after ring->num_bytes bytes. With the io_uring
+    engine every free slot is read in one batch, otherwise one slot
+    at a time so the writer can start sooner
+********************************************************************/
+static void* fill_stream_ring(void* argument){
+
+    FAT32_stream_ring* ring = (FAT32_stream_ring*)argument;
+    FAT32_volume* volume = ring->volume;
+    FAT32_chain_cursor cursor = {ring->chain, 0, 0, ring->num_bytes};
+    FAT32_read_request requests[STREAM_RING_SLOTS];
+    bool is_image_end = false;
+    uint32_t num_requests;
+    uint32_t i;
+
+    while(!is_image_end){
+
+        //Wait for the writer to free up a slot
+        pthread_mutex_lock(&ring->lock);
+        while(ring->num_filled == STREAM_RING_SLOTS && !ring->writer_failed){
+            pthread_cond_wait(&ring->slot_drained, &ring->lock);
+        }
+        if(ring->writer_failed){
+            pthread_mutex_unlock(&ring->lock);
+            return NULL;
+        }
+        uint32_t first_slot = ring->fill_index;
+        uint32_t num_free = STREAM_RING_SLOTS - ring->num_filled;
+        pthread_mutex_unlock(&ring->lock);
+
+        if(!is_uring_engine_running(volume)){
+            num_free = 1;
+        }
+        for(num_requests = 0; num_requests < num_free; num_requests++){
+            uint8_t* slot_buffer = ring->slots[(first_slot + num_requests) % STREAM_RING_SLOTS];
+            if(!next_chain_read(volume, &cursor, slot_buffer, STREAM_SLOT_SIZE, &requests[num_requests])){
+                break;
+            }
+        }
+        if(num_requests == 0){
+            break;
+        }
+
+        read_disk_image_batch(volume, requests, num_requests);
+
+        for(i = 0; i < num_requests; i++){
+            uint32_t slot = (first_slot + i) % STREAM_RING_SLOTS;
+
+            //Hash the slot while it is still in the cache, in parallel with the writer
+            if(ring->digest != NULL){
+                update_digest(ring->digest, ring->slots[slot], requests[i].bytes_read);
+            }
+
+            //Hand the slot over to the writer
+            pthread_mutex_lock(&ring->lock);
+            ring->slot_lengths[slot] = requests[i].bytes_read;
+            ring->fill_index = (slot + 1) % STREAM_RING_SLOTS;
+            ring->num_filled++;
+            pthread_cond_signal(&ring->slot_filled);
+            pthread_mutex_unlock(&ring->lock);
+
+            if(requests[i].bytes_read < requests[i].count){
+                //Reached the end of the disk image
+                is_image_end = true;
+                break;
+            }
+        }
+    }
+
+    pthread_mutex_lock(&ring->lock);
+    ring->reader_done = true;
+    pthread_cond_signal(&ring->slot_filled);
+    pthread_mutex_unlock(&ring->lock);
+
+    return NULL;
+
+}
+
+/********************************************************************
+Write the whole buffer to the file descriptor, retrying short writes
+********************************************************************/
+static bool write_fully(FAT32_volume* volume, int file_descriptor, uint8_t* buffer, size_t count){
+
+    while(count > 0){
+        uint64_t start = get_stat_time();
+        ssize_t bytes_written = write(file_descriptor, buffer, count);
+        count_stat_time(volume, STAT_WRITE_NANOSECONDS, start);
+        count_stat(volume, STAT_WRITE_SYSCALLS, 1);
+        if(bytes_written == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            return false;
+        }
+        buffer += bytes_written;
+        count -= bytes_written;
+        count_stat(volume, STAT_BYTES_WRITTEN, bytes_written);
+    }
+
+    return true;
+
+}
 
-        bytes_read = read(disk_image_fd, (void*)bulk_buffer + (cluster_size * cluster_offset), cluster_size);
-        if(bytes_read == -1){
-            fprintf(stderr, "\nError in read_clusterchain() : Read returned -1\n");
+/********************************************************************
+stream_clusterchain() and copy_clusterchain() for outputs the kernel
+    can copy into: every extent goes from the disk image to output_fd
+    with copy_disk_image(). Returns false, with nothing written and
+    the chain left to the caller, if the kernel cannot copy into
+    output_fd at all. Otherwise frees the chain and sets
+    *total_written. If the kernel gives up part way, the rest is
+    read and written through buffer, or a buffer allocated here
+    if buffer is NULL
+********************************************************************/
+static bool zero_copy_clusterchain(FAT32_volume* volume, file_clusterchain* chain, int output_fd, uint64_t num_bytes,
+                                    uint8_t* buffer, size_t buffer_size, uint64_t* total_written){
+
+    size_t cluster_size = volume->geometry.cluster_size;
+    FAT32_copy_method method = COPY_METHOD_UNKNOWN;
+    uint8_t* allocated_buffer = NULL;
+    uint64_t total_copied = 0;
+    bool is_image_end = false;
+    uint32_t i;
+
+    for(i = 0; i < chain->num_extents && total_copied < num_bytes && !is_image_end; i++){
+        __off_t byte_offset = get_cluster_byte_offset(volume, chain->extents[i].first_cluster);
+        uint64_t extent_remaining = (uint64_t)cluster_size * chain->extents[i].num_clusters;
+        if(extent_remaining > num_bytes - total_copied){
+            //Last extent, the partial cluster at the end of the file is cut by the copy length
+            extent_remaining = num_bytes - total_copied;
+        }
+
+        size_t bytes_copied = copy_disk_image(volume, output_fd, byte_offset, extent_remaining, &method);
+        if(method == COPY_METHOD_BUFFERED && total_copied == 0 && bytes_copied == 0){
+            return false;
+        }
+        total_copied += bytes_copied;
+        byte_offset += bytes_copied;
+        extent_remaining -= bytes_copied;
+        if(extent_remaining > 0 && method != COPY_METHOD_BUFFERED){
+            //Reached the end of the disk image
+            break;
+        }
+
+        //The kernel gave up part way through, finish with reads and writes
+        while(extent_remaining > 0){
+            if(buffer == NULL){
+                buffer_size = STREAM_SLOT_SIZE;
+                buffer = allocated_buffer = malloc(buffer_size);
+                if(buffer == NULL){
+                    fprintf(stderr, "\nError in zero_copy_clusterchain() : Could not allocate copy buffer\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            size_t to_read = (extent_remaining > buffer_size) ? buffer_size : extent_remaining;
+            size_t bytes_read = read_disk_image(volume, buffer, to_read, byte_offset);
+
+            if(!write_fully(volume, output_fd, buffer, bytes_read)){
+                fprintf(stderr, "\nError in zero_copy_clusterchain() : write() returned -1 : %s\n", strerror(errno));
+                is_image_end = true;
+                break;
+            }
+            total_copied += bytes_read;
+            if(bytes_read < to_read){
+                is_image_end = true;
+                break;
+            }
+            byte_offset += bytes_read;
+            extent_remaining -= bytes_read;
+        }
+    }
+
+    free(allocated_buffer);
+    free_clusterchain(chain);
+    *total_written = total_copied;
+
+    return true;
+
+}
+
+/********************************************************************
+stream_clusterchain() for a mapped image: every extent is written
+    directly from the mapping, with a sequential access hint, and
+    hashed from the mapping right after
+********************************************************************/
+static uint64_t write_mapped_clusterchain(FAT32_volume* volume, file_clusterchain* chain, int output_fd, uint64_t num_bytes,
+                                            FAT32_digest* digest){
+
+    size_t cluster_size = volume->geometry.cluster_size;
+    uint64_t total_written = 0;
+    uint32_t i;
+
+    for(i = 0; i < chain->num_extents && total_written < num_bytes; i++){
+        __off_t byte_offset = get_cluster_byte_offset(volume, chain->extents[i].first_cluster);
+        uint64_t extent_size = (uint64_t)cluster_size * chain->extents[i].num_clusters;
+        if(extent_size > num_bytes - total_written){
+            extent_size = num_bytes - total_written;
+        }
+
+        uint8_t* extent_data = get_disk_image_pointer(volume, byte_offset, extent_size);
+        if(extent_data == NULL){
+            //Extent runs past the end of the image
+            break;
+        }
+
+        advise_disk_image(volume, byte_offset, extent_size, MADV_SEQUENTIAL);
+        if(!write_fully(volume, output_fd, extent_data, extent_size)){
+            fprintf(stderr, "\nError in stream_clusterchain() : write() returned -1 : %s\n", strerror(errno));
+            break;
+        }
+        if(digest != NULL){
+            update_digest(digest, extent_data, extent_size);
+        }
+        advise_disk_image(volume, byte_offset, extent_size, MADV_RANDOM);
+        total_written += extent_size;
+    }
+
+    free_clusterchain(chain);
+
+    return total_written;
+
+}
+
+/********************************************************************
+Copy the first num_bytes bytes of the clusterchain into output_fd on
+    the calling thread, reading through the caller's buffer and
+    adding each buffer to digest unless it is NULL. Each buffer is
+    filled by one batch of reads, which the io_uring engine keeps in
+    flight together. Frees the chain and returns the bytes written
+********************************************************************/
+uint64_t copy_clusterchain(FAT32_volume* volume, file_clusterchain* chain, int output_fd, uint64_t num_bytes,
+                            uint8_t* buffer, size_t buffer_size, FAT32_digest* digest){
+
+    FAT32_chain_cursor cursor = {chain, 0, 0, num_bytes};
+    FAT32_read_request requests[URING_QUEUE_DEPTH];
+    uint64_t total_written = 0;
+    bool is_image_end = false;
+    uint32_t num_requests;
+    uint32_t i;
+
+    //Data the kernel copies never passes through a buffer that could be hashed
+    if(volume->settings.use_zero_copy && digest == NULL
+       && zero_copy_clusterchain(volume, chain, output_fd, num_bytes, buffer, buffer_size, &total_written)){
+        return total_written;
+    }
+    if(volume->disk_image_map != NULL){
+        return write_mapped_clusterchain(volume, chain, output_fd, num_bytes, digest);
+    }
+
+    while(!is_image_end){
+        size_t window_size = 0;
+
+        //Fill the buffer from as many extents as fit, so fragmented files still read in one batch
+        for(num_requests = 0; num_requests < URING_QUEUE_DEPTH && window_size < buffer_size; num_requests++){
+            size_t to_read = buffer_size - window_size;
+            if(to_read > volume->settings.max_io_size){
+                to_read = volume->settings.max_io_size;
+            }
+            if(!next_chain_read(volume, &cursor, buffer + window_size, to_read, &requests[num_requests])){
+                break;
+            }
+            window_size += requests[num_requests].count;
+        }
+        if(num_requests == 0){
+            break;
+        }
+
+        read_disk_image_batch(volume, requests, num_requests);
+
+        //Only the data up to the first short read is there, it stopped at the end of the disk image
+        size_t bytes_read = 0;
+        for(i = 0; i < num_requests && !is_image_end; i++){
+            bytes_read += requests[i].bytes_read;
+            is_image_end = requests[i].bytes_read < requests[i].count;
+        }
+
+        if(digest != NULL){
+            update_digest(digest, buffer, bytes_read);
+        }
+        if(!write_fully(volume, output_fd, buffer, bytes_read)){
+            fprintf(stderr, "\nError in copy_clusterchain() : write() returned -1 : %s\n", strerror(errno));
+            break;
+        }
+        total_written += bytes_read;
+    }
+
+    free_clusterchain(chain);
+
+    return total_written;
+
+}
+
+/********************************************************************
+Copy the first num_bytes bytes of the clusterchain into output_fd
+    through a fixed ring of buffers, so memory use stays constant
+    however large the file is, adding the data to digest unless it
+    is NULL. Frees the chain and returns the number of bytes written
+********************************************************************/
+uint64_t stream_clusterchain(FAT32_volume* volume, file_clusterchain* chain, int output_fd, uint64_t num_bytes,
+                                FAT32_digest* digest){
+
+    FAT32_stream_ring ring;
+    pthread_t reader;
+    uint64_t total_written = 0;
+    uint32_t i;
+
+    //Nothing needs to be buffered if the kernel can copy the extents itself, unless the data has to be hashed
+    if(volume->settings.use_zero_copy && digest == NULL
+       && zero_copy_clusterchain(volume, chain, output_fd, num_bytes, NULL, 0, &total_written)){
+        return total_written;
+    }
+
+    //A mapped image needs no buffering either, write each extent straight out of the mapping
+    if(volume->disk_image_map != NULL){
+        return write_mapped_clusterchain(volume, chain, output_fd, num_bytes, digest);
+    }
+
+    memset(&ring, 0, sizeof(FAT32_stream_ring));
+    ring.volume = volume;
+    ring.chain = chain;
+    ring.digest = digest;
+    ring.num_bytes = num_bytes;
+    for(i = 0; i < STREAM_RING_SLOTS; i++){
+        ring.slots[i] = allocate_disk_buffer(volume, STREAM_SLOT_SIZE);
+        if(ring.slots[i] == NULL){
+            fprintf(stderr, "\nError in stream_clusterchain() : Could not allocate space for ring slot\n");
             exit(EXIT_FAILURE);
         }
+    }
+    count_stat(volume, STAT_ALLOCATIONS, STREAM_RING_SLOTS);
+    count_stat(volume, STAT_BYTES_ALLOCATED, (uint64_t)STREAM_RING_SLOTS * STREAM_SLOT_SIZE);
+    pthread_mutex_init(&ring.lock, NULL);
+    pthread_cond_init(&ring.slot_filled, NULL);
+    pthread_cond_init(&ring.slot_drained, NULL);
+
+    int err = pthread_create(&reader, NULL, fill_stream_ring, &ring);
+    if(err != 0){
+        fprintf(stderr, "\nError in stream_clusterchain() : Could not start reader thread : %s\n", strerror(err));
+        exit(EXIT_FAILURE);
+    }
+
+    //Drain the slots in order until the reader is done
+    while(true){
+        pthread_mutex_lock(&ring.lock);
+        while(ring.num_filled == 0 && !ring.reader_done){
+            pthread_cond_wait(&ring.slot_filled, &ring.lock);
+        }
+        if(ring.num_filled == 0){
+            pthread_mutex_unlock(&ring.lock);
+            break;
+        }
+        uint32_t slot = ring.drain_index;
+        pthread_mutex_unlock(&ring.lock);
+
+        if(!write_fully(volume, output_fd, ring.slots[slot], ring.slot_lengths[slot])){
+            fprintf(stderr, "\nError in stream_clusterchain() : write() returned -1 : %s\n", strerror(errno));
+            pthread_mutex_lock(&ring.lock);
+            ring.writer_failed = true;
+            pthread_cond_signal(&ring.slot_drained);
+            pthread_mutex_unlock(&ring.lock);
+            break;
+        }
+        total_written += ring.slot_lengths[slot];
 
-        cluster_offset++;
-        curr = curr->next;
+        pthread_mutex_lock(&ring.lock);
+        ring.drain_index = (slot + 1) % STREAM_RING_SLOTS;
+        ring.num_filled--;
+        pthread_cond_signal(&ring.slot_drained);
+        pthread_mutex_unlock(&ring.lock);
     }
 
-    free_clusterchain(chain_head);
+    pthread_join(reader, NULL);
 
-    return bulk_buffer;
+    for(i = 0; i < STREAM_RING_SLOTS; i++){
+        free(ring.slots[i]);
+    }
+    pthread_mutex_destroy(&ring.lock);
+    pthread_cond_destroy(&ring.slot_filled);
+    pthread_cond_destroy(&ring.slot_drained);
+    free_clusterchain(chain);
+
+    return total_written;
 
 }
 
 /********************************************************************
-Free all the nodes in the clusterchain
+Free the clusterchain and its extents
 ********************************************************************/
-void free_clusterchain(file_cluster_node* chain_head){
+void free_clusterchain(file_clusterchain* chain){
 
-    file_cluster_node* tmp;
+    if(chain == NULL){
+        return;
+    }
+
+    free(chain->extents);
+    free(chain);
 
-    while(chain_head != NULL){
-        tmp = chain_head;
-        chain_head = chain_head->next;
-        free(tmp);
+}
+
+/********************************************************************
+Returns the contents of the directory starting at cluster_number, and
+    their size in bytes. If the image is mapped and the directory is
+    contiguous this points straight into the mapping, otherwise the
+    clusters are read into a new buffer. A directory that does not
+    start on the volume is read as one empty cluster, with a warning
+********************************************************************/
+uint8_t* read_directory(FAT32_volume* volume, uint32_t cluster_number, size_t* size){
+
+    size_t cluster_size = volume->geometry.cluster_size;
+
+    if(cluster_number < 2 || cluster_number >= volume->geometry.end_cluster){
+        fprintf(stderr, "Warning: directory starts at cluster %u, which is not on the volume\n", cluster_number);
+        uint8_t* empty_directory = calloc(1, cluster_size);
+        if(empty_directory == NULL){
+            fprintf(stderr, "\nError in read_directory() : Could not allocate space for directory\n");
+            exit(EXIT_FAILURE);
+        }
+        *size = cluster_size;
+        return empty_directory;
+    }
+
+    file_clusterchain* chain = build_clusterchain(volume, cluster_number);
+
+    *size = cluster_size * chain->num_clusters;
+
+    if(chain->num_extents == 1){
+        __off_t byte_offset = get_cluster_byte_offset(volume, cluster_number);
+        uint8_t* directory_data = get_disk_image_pointer(volume, byte_offset, *size);
+        if(directory_data != NULL){
+            free_clusterchain(chain);
+            return directory_data;
+        }
+    }
+
+    return read_clusterchain(volume, chain);
+
+}
+
+/********************************************************************
+Releases directory contents returned by read_directory()
+********************************************************************/
+void release_directory(FAT32_volume* volume, uint8_t* directory_data){
+
+    if(!is_disk_image_pointer(volume, directory_data)){
+        free(directory_data);
     }
 
 }
 
 #pragma endregion Clusterchain_Functions
 
+#pragma region Directory_Iterator_Functions
+
+/********************************************************************
+Starts iterating over the directory starting at first_cluster. No
+    cluster is read until the first entry is asked for
+********************************************************************/
+void open_directory_iterator(FAT32_volume* volume, uint32_t first_cluster, FAT32_directory_iterator* iterator){
+
+    memset(iterator, 0, sizeof(FAT32_directory_iterator));
+    iterator->volume = volume;
+    iterator->first_cluster = first_cluster;
+    iterator->next_cluster = first_cluster;
+    iterator->saved_cluster = first_cluster;
+    iterator->power = 1;
+    iterator->loop_length = 1;
+    iterator->entries_per_cluster = volume->geometry.cluster_size / sizeof(FAT32_Directory_Entry);
+    iterator->next_entry = iterator->entries_per_cluster; //Makes the first call read the first cluster
+
+}
+
+/********************************************************************
+Starts iterating over the entries of a directory from the directory
+    cache, which must stay in use until the iterator is closed
+********************************************************************/
+void open_cached_directory_iterator(FAT32_volume* volume, FAT32_cached_directory* directory, FAT32_directory_iterator* iterator){
+
+    memset(iterator, 0, sizeof(FAT32_directory_iterator));
+    iterator->volume = volume;
+    iterator->first_cluster = directory->first_cluster;
+    iterator->next_cluster = EOC_LOW_BOUND; //The cached entries are all there is
+    iterator->entries = directory->entries;
+    iterator->entries_per_cluster = directory->num_entries + 1; //Including the end marker
+
+}
+
+/********************************************************************
+Reads the next cluster of the directory. Returns false at the end of
+    the chain, at a free, bad or out of range link, when the chain
+    loops back on itself, or when the image ends inside the cluster
+********************************************************************/
+static bool read_directory_iterator_cluster(FAT32_directory_iterator* iterator){
+
+    FAT32_volume* volume = iterator->volume;
+    uint32_t cluster = iterator->next_cluster;
+    uint32_t cluster_size = volume->geometry.cluster_size;
+
+    if(is_FAT_entry_EOC(cluster)){
+        return false;
+    }
+    if(cluster < 2 || cluster == BAD_CLUSTER || cluster >= volume->geometry.end_cluster){
+        fprintf(stderr, "Warning: directory starting at cluster %u is broken after %u clusters\n", iterator->first_cluster, iterator->num_clusters_read);
+        return false;
+    }
+
+    //Brent's algorithm, each cluster after the first is compared with the saved one
+    if(iterator->num_clusters_read > 0){
+        if(cluster == iterator->saved_cluster){
+            fprintf(stderr, "Warning: directory starting at cluster %u loops back to cluster %u\n", iterator->first_cluster, cluster);
+            return false;
+        }
+        if(iterator->loop_length == iterator->power){
+            iterator->saved_cluster = cluster;
+            iterator->power *= 2;
+            iterator->loop_length = 0;
+        }
+        iterator->loop_length++;
+    }
+    iterator->num_clusters_read++;
+
+    off_t byte_offset = get_cluster_byte_offset(volume, cluster);
+    iterator->entries = (FAT32_Directory_Entry*)get_disk_image_pointer(volume, byte_offset, cluster_size);
+    if(iterator->entries == NULL){
+        if(iterator->buffer == NULL){
+            iterator->buffer = allocate_disk_buffer(volume, cluster_size);
+            if(iterator->buffer == NULL){
+                fprintf(stderr, "\nError in read_directory_iterator_cluster() : Could not allocate space for cluster\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        if(read_disk_image(volume, iterator->buffer, cluster_size, byte_offset) != cluster_size){
+            return false;
+        }
+        iterator->entries = (FAT32_Directory_Entry*)iterator->buffer;
+    }
+
+    iterator->next_cluster = get_FAT_entry_contents(volume, cluster);
+    iterator->next_entry = 0;
+
+    return true;
+
+}
+
+/********************************************************************
+Decodes the next entry of the directory into info, reading the next
+    cluster only when the entries of the current one run out.
+    Returns false at the end marker or the end of the chain
+********************************************************************/
+bool next_directory_entry(FAT32_directory_iterator* iterator, FAT32_file_info* info){
+
+    while(!iterator->is_done){
+
+        if(iterator->next_entry == iterator->entries_per_cluster){
+            iterator->is_done = !read_directory_iterator_cluster(iterator);
+            continue;
+        }
+
+        FAT32_Directory_Entry* entry = &iterator->entries[iterator->next_entry++];
+
+        //Nothing is used past the end of directory marker
+        if(entry->DIR_Name[0] == 0x00){
+            iterator->is_done = true;
+            break;
+        }
+        //Skip deleted entries, and long name entries and the volume label, which both have the volume ID bit
+        if((uint8_t)entry->DIR_Name[0] == 0xE5 || (entry->DIR_Attr & 0x08)){
+            continue;
+        }
+
+        normalize_entry_name(entry, info->name);
+        info->attributes = entry->DIR_Attr;
+        info->first_cluster = (entry->DIR_FstClusHI << 16) | entry->DIR_FstClusLO;
+        info->file_size = entry->DIR_FileSize;
+        return true;
+    }
+
+    return false;
+
+}
+
+/********************************************************************
+Frees what the iterator holds. It may be closed before the end
+********************************************************************/
+void close_directory_iterator(FAT32_directory_iterator* iterator){
+
+    free(iterator->buffer);
+    iterator->buffer = NULL;
+    iterator->entries = NULL;
+    iterator->is_done = true;
+
+}
+
+#pragma endregion Directory_Iterator_Functions
+
 #pragma region String_Trim_Functions
 
 /********************************************************************
@@ -322,10 +1206,9 @@ Gets rid of all the trailing whitespace in the file name
 ********************************************************************/
 void trim_directory_name(char* name_in, char* name_out){
 
-    strncpy(name_out, name_in, strlen(name_in));
-
     int i = 0;
-    while(name_out[i] != ' '){
+    while(i < SHORT_NAME_LENGTH && name_in[i] != ' '){
+        name_out[i] = name_in[i];
         i++;
     }
     name_out[i] = '\0';
@@ -337,48 +1220,42 @@ Gets rid of the whitespace between the file name and the extension,
 ********************************************************************/
 void trim_file_name(char* name_in, char* name_out){
 
-    char name[strlen(name_in) - 1];
-    strncpy(name, name_in, strlen(name_in) - 1);
-
     int i;
-    //Get the file name
-    int file_name_length = 0;
-    while(name[file_name_length] != ' '){
-        file_name_length++;
+    int length = 0;
+
+    //Get the file name, the first 8 characters padded with spaces
+    for(i = 0; i < 8 && name_in[i] != ' '; i++){
+        name_out[length++] = name_in[i];
     }
-    char file_name[file_name_length];
-    file_name[file_name_length] = '\0';
 
-    for(i = 0; i < file_name_length; i++){
-        file_name[i] = name[i];
+    //Get extension, the last 3 characters padded with spaces
+    int extension_length = 3;
+    while(extension_length > 0 && name_in[8 + extension_length - 1] == ' '){
+        extension_length--;
     }
 
-    //Get extension
-    i = strlen(name) - 1;
-    int extension_length = 0;
-    while(name[i] != ' '){
-        i--;
-        extension_length++;
+    //Combine the two
+    if(extension_length > 0){
+        name_out[length++] = '.';
+        for(i = 0; i < extension_length; i++){
+            name_out[length++] = name_in[8 + i];
+        }
     }
-    i++;
+    name_out[length] = '\0';
+}
 
-    char extension[extension_length];
-    extension[extension_length] = '\0';
+/********************************************************************
+Writes the name of the entry the way a user types it, "NAME.EXT" or
+	"NAME", with a leading 0x05 turned back into 0xE5
+********************************************************************/
+void normalize_entry_name(FAT32_Directory_Entry* entry, char* name_out){
 
-    int j;
-    for(j = 0; j < extension_length; j++){
-        extension[j] = name[i];
-        i++;
-    }
+    trim_file_name(entry->DIR_Name, name_out);
 
-    //Combine the two
-    char combined[file_name_length + extension_length + 1];
-    strncpy(combined, file_name, file_name_length);
-    strncpy(combined + file_name_length, ".", 1);
-    strncpy(combined + file_name_length + 1, extension, extension_length);
-    combined[file_name_length + extension_length + 1] = '\0';
-    
-    strncpy(name_out, combined, strlen(combined) + 1);
+    //Special case for Japanese characters. 0x05 means the character is actually 0xE5
+    if(name_out[0] == 0x05){
+        name_out[0] = (char)0xE5;
+    }
 }
 
 #pragma endregion String_Trim_Functions
\ No newline at end of file
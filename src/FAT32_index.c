@@ -0,0 +1,553 @@
+/********************************************************************
+    Module: FAT32_index.c
+    Author: Brennan Couturier
+
+    Metadata index of the whole directory tree, kept in a file next
+    to the disk image
+********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "../include/FAT32_structs_globals.h"
+#include "../include/FAT32_index.h"
+#include "../include/FAT32_helpers.h"
+#include "../include/FAT32_io.h"
+#include "../include/FAT32_cache.h"
+#include "../include/FAT32_stats.h"
+
+#define INDEX_CHECKSUM_CHUNK (1 << 16) //FAT entries hashed per step
+#define INDEX_TABLE_ALIGNMENT 8 //Tables start at multiples of this many bytes
+
+#pragma region Helper_Functions
+
+/********************************************************************
+Returns the path of the index file of the disk image, allocated
+********************************************************************/
+static char* get_index_path(FAT32_volume* volume){
+
+    char* path = malloc(strlen(volume->disk_image_path) + strlen(INDEX_SUFFIX) + 1);
+    if(path == NULL){
+        fprintf(stderr, "\nError in get_index_path() : Could not allocate space for path\n");
+        exit(EXIT_FAILURE);
+    }
+    sprintf(path, "%s%s", volume->disk_image_path, INDEX_SUFFIX);
+
+    return path;
+
+}
+
+/********************************************************************
+64-bit FNV-1a hash of the boot sector and of every entry of the
+    first FAT, read from the FAT cache when it holds them
+********************************************************************/
+static uint64_t checksum_image(FAT32_volume* volume){
+
+    uint64_t checksum = 14695981039346656037ULL;
+    uint8_t* boot_sector_bytes = (uint8_t*)volume->boot_sector;
+    uint32_t end_cluster = volume->geometry.end_cluster;
+    uint32_t* chunk_buffer = NULL;
+    uint32_t first_cluster, i;
+
+    for(i = 0; i < sizeof(FAT32_BS); i++){
+        checksum = (checksum ^ boot_sector_bytes[i]) * 1099511628211ULL;
+    }
+
+    for(first_cluster = 0; first_cluster < end_cluster; first_cluster += INDEX_CHECKSUM_CHUNK){
+        uint32_t count = end_cluster - first_cluster;
+        if(count > INDEX_CHECKSUM_CHUNK){
+            count = INDEX_CHECKSUM_CHUNK;
+        }
+
+        uint32_t* entries = get_FAT_cache_entries(volume, first_cluster, count);
+        if(entries == NULL){
+            //The FAT is not cached, read the chunk from the disk
+            if(chunk_buffer == NULL){
+                chunk_buffer = malloc(INDEX_CHECKSUM_CHUNK * sizeof(uint32_t));
+                if(chunk_buffer == NULL){
+                    fprintf(stderr, "\nError in checksum_image() : Could not allocate space for FAT chunk\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            off_t chunk_byte_location = volume->geometry.FAT_byte_offset
+                                        + (off_t)first_cluster * sizeof(uint32_t);
+            size_t bytes_read = read_disk_image(volume, chunk_buffer, (size_t)count * sizeof(uint32_t), chunk_byte_location);
+            memset((uint8_t*)chunk_buffer + bytes_read, 0xFF, (size_t)count * sizeof(uint32_t) - bytes_read);
+            entries = chunk_buffer;
+        }
+
+        for(i = 0; i < count; i++){
+            checksum = (checksum ^ entries[i]) * 1099511628211ULL;
+        }
+    }
+    free(chunk_buffer);
+
+    return checksum;
+
+}
+
+/********************************************************************
+Makes room for at least needed elements in a growable array
+********************************************************************/
+static void grow_index_array(void** array, uint32_t* capacity, size_t element_size, uint32_t needed){
+
+    if(needed <= *capacity){
+        return;
+    }
+    while(*capacity < needed){
+        *capacity *= 2;
+    }
+
+    *array = realloc(*array, element_size * *capacity);
+    if(*array == NULL){
+        fprintf(stderr, "\nError in grow_index_array() : Could not grow index table\n");
+        exit(EXIT_FAILURE);
+    }
+
+}
+
+/********************************************************************
+qsort() comparisons for the children of a directory and for the
+    directory table
+********************************************************************/
+static int compare_index_nodes(const void* a, const void* b){
+
+    return strcasecmp(((FAT32_index_node*)a)->name, ((FAT32_index_node*)b)->name);
+
+}
+
+static int compare_index_directories(const void* a, const void* b){
+
+    uint32_t cluster_a = ((FAT32_index_directory*)a)->first_cluster;
+    uint32_t cluster_b = ((FAT32_index_directory*)b)->first_cluster;
+
+    return (cluster_a > cluster_b) - (cluster_a < cluster_b);
+
+}
+
+/********************************************************************
+Rounds a table offset up to INDEX_TABLE_ALIGNMENT
+********************************************************************/
+static uint64_t align_index_offset(uint64_t offset){
+
+    return (offset + INDEX_TABLE_ALIGNMENT - 1) & ~(uint64_t)(INDEX_TABLE_ALIGNMENT - 1);
+
+}
+
+/********************************************************************
+Points the table references at the index data
+********************************************************************/
+static void resolve_index_tables(FAT32_volume* volume){
+
+    volume->index.header = (FAT32_index_header*)volume->index.data;
+    volume->index.nodes = (FAT32_index_node*)(volume->index.data + volume->index.header->nodes_offset);
+    volume->index.extents = (file_cluster_extent*)(volume->index.data + volume->index.header->extents_offset);
+    volume->index.directories = (FAT32_index_directory*)(volume->index.data + volume->index.header->directories_offset);
+
+}
+
+#pragma endregion Helper_Functions
+
+#pragma region Build_Functions
+
+/********************************************************************
+Walks the whole tree breadth first and lays the index out in memory
+    exactly as it is stored in the file
+********************************************************************/
+static void build_index(FAT32_volume* volume, uint64_t checksum, struct stat* image_stat){
+
+    uint32_t end_cluster = volume->geometry.end_cluster;
+    uint32_t num_nodes = 1, node_capacity = 1024;
+    uint32_t num_extents = 0, extent_capacity = 1024;
+    uint32_t num_directories = 0;
+    uint32_t i, j;
+
+    FAT32_index_node* nodes = calloc(node_capacity, sizeof(FAT32_index_node));
+    file_cluster_extent* extents = malloc(extent_capacity * sizeof(file_cluster_extent));
+    uint64_t* visited = calloc((end_cluster + 63) / 64, sizeof(uint64_t));
+    if(nodes == NULL || extents == NULL || visited == NULL){
+        fprintf(stderr, "\nError in build_index() : Could not allocate space for index tables\n");
+        exit(EXIT_FAILURE);
+    }
+
+    //Node 0 is the root, which has no entry of its own
+    strcpy(nodes[0].name, "/");
+    nodes[0].attributes = 0x10;
+    nodes[0].first_cluster = volume->boot_sector->BPB_RootClus;
+
+    //Nodes are appended while walking, so every directory is reached after the one that holds it
+    for(i = 0; i < num_nodes; i++){
+
+        uint32_t first_cluster = nodes[i].first_cluster;
+
+        //Record the clusterchain of everything that has one
+        if(first_cluster >= 2 && first_cluster < end_cluster && ((nodes[i].attributes & 0x10) || nodes[i].file_size > 0)){
+            file_clusterchain* chain = build_clusterchain(volume, first_cluster);
+            grow_index_array((void**)&extents, &extent_capacity, sizeof(file_cluster_extent), num_extents + chain->num_extents);
+            memcpy(&extents[num_extents], chain->extents, chain->num_extents * sizeof(file_cluster_extent));
+            nodes[i].first_extent = num_extents;
+            nodes[i].num_extents = chain->num_extents;
+            num_extents += chain->num_extents;
+            free_clusterchain(chain);
+        }
+
+        //A directory reached twice, through a cross-linked entry, is only listed the first time
+        if(!(nodes[i].attributes & 0x10) || !claim_directory(visited, first_cluster, end_cluster)){
+            continue;
+        }
+        num_directories++;
+
+        FAT32_cached_directory* directory = get_cached_directory(volume, first_cluster);
+        nodes[i].first_child = num_nodes;
+
+        for(j = 0; j < directory->num_entries; j++){
+
+            FAT32_Directory_Entry* entry = &directory->entries[j];
+
+            if(!is_named_entry(entry)){
+                continue;
+            }
+
+            grow_index_array((void**)&nodes, &node_capacity, sizeof(FAT32_index_node), num_nodes + 1);
+            FAT32_index_node* node = &nodes[num_nodes++];
+            memset(node, 0, sizeof(FAT32_index_node));
+            normalize_entry_name(entry, node->name);
+            node->attributes = entry->DIR_Attr;
+            node->first_cluster = (entry->DIR_FstClusHI << 16) | entry->DIR_FstClusLO;
+            node->file_size = entry->DIR_FileSize;
+            node->parent = i;
+        }
+
+        release_cached_directory(volume, directory);
+
+        nodes[i].num_children = num_nodes - nodes[i].first_child;
+        qsort(&nodes[nodes[i].first_child], nodes[i].num_children, sizeof(FAT32_index_node), compare_index_nodes);
+    }
+    free(visited);
+
+    //Lay the header and the three tables out in one buffer
+    uint64_t nodes_offset = align_index_offset(sizeof(FAT32_index_header));
+    uint64_t extents_offset = align_index_offset(nodes_offset + (uint64_t)num_nodes * sizeof(FAT32_index_node));
+    uint64_t directories_offset = align_index_offset(extents_offset + (uint64_t)num_extents * sizeof(file_cluster_extent));
+    volume->index.size = directories_offset + (uint64_t)num_directories * sizeof(FAT32_index_directory);
+    volume->index.data = calloc(1, volume->index.size);
+    if(volume->index.data == NULL){
+        fprintf(stderr, "\nError in build_index() : Could not allocate space for index\n");
+        exit(EXIT_FAILURE);
+    }
+    volume->index.is_mapped = false;
+
+    FAT32_index_header* header = (FAT32_index_header*)volume->index.data;
+    memcpy(header->magic, INDEX_MAGIC, sizeof(header->magic));
+    header->version = INDEX_VERSION;
+    header->num_nodes = num_nodes;
+    header->num_extents = num_extents;
+    header->num_directories = num_directories;
+    header->checksum = checksum;
+    header->image_size = image_stat->st_size;
+    header->image_mtime_nanoseconds = (int64_t)image_stat->st_mtim.tv_sec * 1000000000LL + image_stat->st_mtim.tv_nsec;
+    header->nodes_offset = nodes_offset;
+    header->extents_offset = extents_offset;
+    header->directories_offset = directories_offset;
+    resolve_index_tables(volume);
+
+    memcpy(volume->index.nodes, nodes, (size_t)num_nodes * sizeof(FAT32_index_node));
+    memcpy(volume->index.extents, extents, (size_t)num_extents * sizeof(file_cluster_extent));
+    free(nodes);
+    free(extents);
+
+    //Each listed directory is in the table once, under the node that was walked. Only walked nodes have a first child, node 0 never is one
+    num_directories = 0;
+    for(i = 0; i < num_nodes; i++){
+        FAT32_index_node* node = &volume->index.nodes[i];
+        if((node->attributes & 0x10) && node->first_child != 0){
+            volume->index.directories[num_directories].first_cluster = node->first_cluster;
+            volume->index.directories[num_directories].node = i;
+            num_directories++;
+        }
+    }
+    qsort(volume->index.directories, num_directories, sizeof(FAT32_index_directory), compare_index_directories);
+
+}
+
+/********************************************************************
+Writes the index next to the disk image. It is written to a
+    temporary file first so a reader never sees half an index
+********************************************************************/
+static void write_index(FAT32_volume* volume, char* path){
+
+    char temporary_path[strlen(path) + strlen(".tmp") + 1];
+    sprintf(temporary_path, "%s.tmp", path);
+
+    FILE* output_file = fopen(temporary_path, "wb");
+    if(output_file == NULL){
+        fprintf(stderr, "Warning: Could not create %s, the index is kept in memory only : %s\n", temporary_path, strerror(errno));
+        return;
+    }
+
+    bool is_written = (fwrite(volume->index.data, 1, volume->index.size, output_file) == volume->index.size);
+    if(fclose(output_file) != 0){
+        is_written = false;
+    }
+    if(!is_written || rename(temporary_path, path) == -1){
+        fprintf(stderr, "Warning: Could not write %s, the index is kept in memory only : %s\n", path, strerror(errno));
+        unlink(temporary_path);
+    }
+
+}
+
+#pragma endregion Build_Functions
+
+#pragma region Index_Functions
+
+/********************************************************************
+Maps the index file at path and checks that it is well formed and
+    matches the disk image. Returns false, with nothing mapped, if
+    it cannot be used
+********************************************************************/
+static bool load_index(FAT32_volume* volume, char* path, uint64_t checksum, struct stat* image_stat){
+
+    struct stat index_stat;
+    uint32_t i;
+
+    int index_fd = open(path, O_RDONLY);
+    if(index_fd == -1){
+        return false;
+    }
+    if(fstat(index_fd, &index_stat) == -1 || (uint64_t)index_stat.st_size < sizeof(FAT32_index_header)){
+        close(index_fd);
+        return false;
+    }
+
+    void* map = mmap(NULL, index_stat.st_size, PROT_READ, MAP_PRIVATE, index_fd, 0);
+    close(index_fd);
+    if(map == MAP_FAILED){
+        return false;
+    }
+    volume->index.data = map;
+    volume->index.size = index_stat.st_size;
+    volume->index.is_mapped = true;
+    resolve_index_tables(volume);
+
+    //The tables must lie inside the file, and the image must not have changed since the index was built
+    FAT32_index_header* header = volume->index.header;
+    bool is_valid = memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) == 0
+                    && header->version == INDEX_VERSION
+                    && header->num_nodes > 0
+                    && header->nodes_offset + (uint64_t)header->num_nodes * sizeof(FAT32_index_node) <= volume->index.size
+                    && header->extents_offset + (uint64_t)header->num_extents * sizeof(file_cluster_extent) <= volume->index.size
+                    && header->directories_offset + (uint64_t)header->num_directories * sizeof(FAT32_index_directory) <= volume->index.size
+                    && header->nodes_offset % INDEX_TABLE_ALIGNMENT == 0
+                    && header->extents_offset % INDEX_TABLE_ALIGNMENT == 0
+                    && header->directories_offset % INDEX_TABLE_ALIGNMENT == 0
+                    && header->image_size == (uint64_t)image_stat->st_size
+                    && header->image_mtime_nanoseconds == (int64_t)image_stat->st_mtim.tv_sec * 1000000000LL + image_stat->st_mtim.tv_nsec
+                    && header->checksum == checksum;
+
+    //Every reference between tables must stay inside them, so lookups never need to check
+    for(i = 0; is_valid && i < header->num_nodes; i++){
+        FAT32_index_node* node = &volume->index.nodes[i];
+        is_valid = node->parent < header->num_nodes
+                   && (uint64_t)node->first_child + node->num_children <= header->num_nodes
+                   && (uint64_t)node->first_extent + node->num_extents <= header->num_extents
+                   && memchr(node->name, '\0', sizeof(node->name)) != NULL;
+    }
+    for(i = 0; is_valid && i < header->num_directories; i++){
+        is_valid = volume->index.directories[i].node < header->num_nodes;
+    }
+
+    if(!is_valid){
+        close_index(volume);
+    }
+
+    return is_valid;
+
+}
+
+/********************************************************************
+Maps the index file of the disk image and checks it still matches
+    the image. A missing or stale index is rebuilt by walking the
+    whole tree and written back
+********************************************************************/
+void open_index(FAT32_volume* volume){
+
+    struct stat image_stat;
+    char* path = get_index_path(volume);
+
+    if(fstat(volume->disk_image_fd, &image_stat) == -1){
+        fprintf(stderr, "\nError in open_index() : Could not stat %s : %s\n", volume->disk_image_path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    uint64_t checksum = checksum_image(volume);
+
+    if(load_index(volume, path, checksum, &image_stat)){
+        fprintf(stdout, "Loaded %u entries from %s\n", volume->index.header->num_nodes - 1, path);
+    }else{
+        uint64_t start = get_stat_time();
+        build_index(volume, checksum, &image_stat);
+        write_index(volume, path);
+        fprintf(stdout, "Indexed %u entries into %s in %.3f ms\n", volume->index.header->num_nodes - 1, path,
+                        (get_stat_time() - start) / 1e6);
+    }
+
+    free(path);
+
+}
+
+/********************************************************************
+Returns true if an index is open
+********************************************************************/
+bool is_index_open(FAT32_volume* volume){
+
+    return volume->index.data != NULL;
+
+}
+
+/********************************************************************
+Finds the node listing the directory starting at first_cluster, or
+    returns NULL
+********************************************************************/
+static FAT32_index_node* find_index_directory(FAT32_volume* volume, uint32_t first_cluster){
+
+    uint32_t low = 0, high = volume->index.header->num_directories;
+
+    while(low < high){
+        uint32_t middle = low + (high - low) / 2;
+        if(volume->index.directories[middle].first_cluster < first_cluster){
+            low = middle + 1;
+        }else{
+            high = middle;
+        }
+    }
+    if(low == volume->index.header->num_directories || volume->index.directories[low].first_cluster != first_cluster){
+        return NULL;
+    }
+
+    return &volume->index.nodes[volume->index.directories[low].node];
+
+}
+
+/********************************************************************
+Binary searches the children of a directory node for name, ignoring
+    case. Returns NULL if there is no such child
+********************************************************************/
+static FAT32_index_node* find_index_child(FAT32_volume* volume, FAT32_index_node* directory, char* name){
+
+    uint32_t low = 0, high = directory->num_children;
+    FAT32_index_node* children = &volume->index.nodes[directory->first_child];
+
+    while(low < high){
+        uint32_t middle = low + (high - low) / 2;
+        int comparison = strcasecmp(children[middle].name, name);
+        if(comparison == 0){
+            return &children[middle];
+        }
+        if(comparison < 0){
+            low = middle + 1;
+        }else{
+            high = middle;
+        }
+    }
+
+    return NULL;
+
+}
+
+/********************************************************************
+Resolves a path, relative to the directory starting at
+    directory_cluster unless it starts with '/'. Returns NULL if
+    the path does not exist or no index is open
+********************************************************************/
+FAT32_index_node* find_index_path(FAT32_volume* volume, uint32_t directory_cluster, char* path){
+
+    if(!is_index_open(volume)){
+        return NULL;
+    }
+
+    FAT32_index_node* node = (path[0] == '/') ? &volume->index.nodes[0] : find_index_directory(volume, directory_cluster);
+    char path_copy[strlen(path) + 1];
+    char* save_pointer;
+    strcpy(path_copy, path);
+
+    char* component = strtok_r(path_copy, "/", &save_pointer);
+    while(node != NULL && component != NULL){
+        if(!(node->attributes & 0x10)){
+            //Only directories have anything below them
+            return NULL;
+        }
+        if(strcmp(component, "..") == 0){
+            //The root has no '..' entry
+            node = (node == &volume->index.nodes[0]) ? NULL : find_index_directory(volume, volume->index.nodes[node->parent].first_cluster);
+        }else if(strcmp(component, ".") != 0){
+            //A directory reached through a cross-link is listed under the node that was walked
+            node = find_index_directory(volume, node->first_cluster);
+            node = (node == NULL) ? NULL : find_index_child(volume, node, component);
+        }
+        component = strtok_r(NULL, "/", &save_pointer);
+    }
+
+    return node;
+
+}
+
+/********************************************************************
+Builds the clusterchain of a node from its extents, without reading
+    the FAT
+********************************************************************/
+file_clusterchain* get_index_clusterchain(FAT32_volume* volume, FAT32_index_node* node){
+
+    file_clusterchain* chain = create_clusterchain(volume);
+    uint32_t i;
+
+    for(i = 0; i < node->num_extents; i++){
+        file_cluster_extent* extent = &volume->index.extents[node->first_extent + i];
+        append_extent_to_chain(chain, extent->first_cluster, extent->num_clusters);
+    }
+
+    return chain;
+
+}
+
+/********************************************************************
+Closes the index and deletes its file, so the next session builds a
+    new one
+********************************************************************/
+void invalidate_index(FAT32_volume* volume){
+
+    if(!is_index_open(volume)){
+        return;
+    }
+
+    char* path = get_index_path(volume);
+    if(unlink(path) == -1 && errno != ENOENT){
+        fprintf(stderr, "Warning: Could not delete stale index %s : %s\n", path, strerror(errno));
+    }
+    free(path);
+
+    close_index(volume);
+
+}
+
+/********************************************************************
+Closes the index, leaving its file in place
+********************************************************************/
+void close_index(FAT32_volume* volume){
+
+    if(volume->index.is_mapped){
+        munmap(volume->index.data, volume->index.size);
+    }else{
+        free(volume->index.data);
+    }
+    memset(&volume->index, 0, sizeof(FAT32_index));
+
+}
+
+#pragma endregion Index_Functions
@@ -5,65 +5,535 @@
     Functions for opening/closing files and printing information
 ********************************************************************/
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 #include <fcntl.h>
 #include <string.h>
 
 #include "../include/FAT32_io.h"
 #include "../include/FAT32_helpers.h"
 #include "../include/FAT32_structs_globals.h"
+#include "../include/FAT32_cache.h"
+#include "../include/FAT32_uring.h"
+#include "../include/FAT32_stats.h"
+#include "../include/FAT32_bitmap.h"
 
-#define _GNU_SOURCE
+#define MAX_ZERO_COPY_SIZE (1 << 30) //Largest single copy asked of the kernel
+#define DIRECT_IO_BOUNCE_SIZE (1 << 20) //Largest unaligned range read through one bounce buffer
 
 
 #pragma region File_Descriptor_Functions
 
 /********************************************************************
-Open the formatted FAT32 disk image for reading and writing
+Maps the opened disk image into memory, read-only. Block devices and
+    images that cannot be mapped keep using read()
 ********************************************************************/
-void open_disk_image(char* disk_image_path_in){
+static void map_disk_image(FAT32_volume* volume){
 
-    disk_image_path = disk_image_path_in;
+    struct stat image_stat;
 
-    disk_image_fd = open(disk_image_path, O_RDWR);
-    if(disk_image_fd == -1){
-        fprintf(stderr, "\nError in open_disk_image() : Failed to open %s : %s\n", disk_image_path, strerror(errno));
+    if(fstat(volume->disk_image_fd, &image_stat) == -1){
+        fprintf(stderr, "\nError in map_disk_image() : fstat() returned -1 : %s\n", strerror(errno));
         exit(EXIT_FAILURE);
     }
+    if(!S_ISREG(image_stat.st_mode) || image_stat.st_size == 0){
+        fprintf(stdout, "%s is not a regular file, using read() instead of mmap()\n", volume->disk_image_path);
+        return;
+    }
+
+    void* map = mmap(NULL, image_stat.st_size, PROT_READ, MAP_SHARED, volume->disk_image_fd, 0);
+    if(map == MAP_FAILED){
+        fprintf(stdout, "Could not map %s, using read() instead : %s\n", volume->disk_image_path, strerror(errno));
+        return;
+    }
+
+    volume->disk_image_map = (uint8_t*)map;
+    volume->disk_image_map_size = image_stat.st_size;
 
-    fprintf(stdout, "Opened %s for reading and writing\n", disk_image_path);
+    //Most accesses are small reads of the FAT and directories, data reads advise separately
+    advise_disk_image(volume, 0, volume->disk_image_map_size, MADV_RANDOM);
+
+}
+
+/********************************************************************
+Opens a second, read-only descriptor of the disk image with O_DIRECT
+    and finds out how direct reads must be aligned: the logical
+    block size of a block device, or the file system block size of
+    an image file. Leaves direct I/O off if it is not supported
+********************************************************************/
+static void open_direct_disk_image(FAT32_volume* volume){
+
+    struct stat image_stat;
+    int logical_block_size;
+
+    volume->disk_image_direct_fd = open(volume->disk_image_path, O_RDONLY | O_DIRECT);
+    if(volume->disk_image_direct_fd == -1){
+        fprintf(stdout, "Could not open %s for direct I/O, using the page cache instead : %s\n", volume->disk_image_path, strerror(errno));
+        volume->settings.use_direct_io = false;
+        return;
+    }
+
+    if(fstat(volume->disk_image_direct_fd, &image_stat) == -1){
+        fprintf(stderr, "\nError in open_direct_disk_image() : fstat() returned -1 : %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if(S_ISBLK(image_stat.st_mode) && ioctl(volume->disk_image_direct_fd, BLKSSZGET, &logical_block_size) == 0 && logical_block_size > 0){
+        volume->direct_io_alignment = logical_block_size;
+    }else{
+        volume->direct_io_alignment = (image_stat.st_blksize > 0) ? image_stat.st_blksize : 4096;
+    }
+
+}
+
+/********************************************************************
+Open the formatted FAT32 disk image, for writing too if
+    settings.use_write_access is set. Returns false with the errno
+    of open() if it cannot be opened
+********************************************************************/
+bool open_disk_image(FAT32_volume* volume, char* disk_image_path_in){
+
+    volume->disk_image_path = strdup(disk_image_path_in);
+    if(volume->disk_image_path == NULL){
+        fprintf(stderr, "\nError in open_disk_image() : Could not allocate space for path\n");
+        exit(EXIT_FAILURE);
+    }
+
+    volume->disk_image_fd = open(volume->disk_image_path, volume->settings.use_write_access ? O_RDWR : O_RDONLY);
+    if(volume->disk_image_fd == -1){
+        return false;
+    }
+
+    //Direct reads bypass the page cache, a mapping would only fill it again
+    if(volume->settings.use_direct_io){
+        open_direct_disk_image(volume);
+    }else if(volume->settings.use_mmap){
+        map_disk_image(volume);
+    }
+
+    //A mapped image is read with memcpy(), so there is nothing to submit
+    if(volume->settings.use_io_uring && volume->disk_image_map == NULL){
+        start_uring_engine(volume, URING_QUEUE_DEPTH);
+    }
+
+    return true;
 
 }
 
 /********************************************************************
 Closes the disk image file descriptor that was opened at the beginning
 ********************************************************************/
-void close_disk_image(){
+void close_disk_image(FAT32_volume* volume){
 
-    int err = close(disk_image_fd);
-    if(err == -1){
+    stop_uring_engine(volume);
+
+    if(volume->disk_image_map != NULL){
+        munmap(volume->disk_image_map, volume->disk_image_map_size);
+        volume->disk_image_map = NULL;
+        volume->disk_image_map_size = 0;
+    }
+
+    if(volume->disk_image_direct_fd != -1){
+        close(volume->disk_image_direct_fd);
+    }
+
+    //The image may have failed to open
+    if(volume->disk_image_fd != -1 && close(volume->disk_image_fd) == -1){
         fprintf(stdout, "Error in close_disk_image() : Could not close file descriptor : %s\n", strerror(errno));
         exit(EXIT_FAILURE);
     }
 
-    fprintf(stdout, "Closed %s\n", disk_image_path);
+    free(volume->disk_image_path);
+    volume->disk_image_path = NULL;
 
 }
 
 #pragma endregion File_Descriptor_Functions
 
+#pragma region Disk_Read_Functions
+
+/********************************************************************
+pread() from fd until count bytes are read or the end of the image is
+    reached, in reads of at most max_read_size bytes
+********************************************************************/
+static size_t read_fully(FAT32_volume* volume, int fd, void* buffer, size_t count, off_t offset, size_t max_read_size){
+
+    size_t total_read = 0;
+
+    while(total_read < count){
+        size_t to_read = count - total_read;
+        if(to_read > max_read_size){
+            to_read = max_read_size;
+        }
+
+        uint64_t start = get_stat_time();
+        ssize_t bytes_read = pread(fd, (uint8_t*)buffer + total_read, to_read, offset + total_read);
+        count_stat_time(volume, STAT_READ_NANOSECONDS, start);
+        count_stat(volume, STAT_READ_SYSCALLS, 1);
+        if(bytes_read == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            fprintf(stderr, "\nError in read_disk_image() : pread() returned -1 : %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        if(bytes_read == 0){
+            //End of the disk image
+            break;
+        }
+
+        total_read += bytes_read;
+        count_stat(volume, STAT_BYTES_READ, bytes_read);
+    }
+
+    return total_read;
+
+}
+
+/********************************************************************
+read_disk_image() with O_DIRECT. The aligned part of the range is
+    read straight into buffer if buffer and offset are aligned,
+    the rest goes through a bounce buffer covering the aligned
+    blocks around it
+********************************************************************/
+static size_t read_direct_disk_image(FAT32_volume* volume, void* buffer, size_t count, off_t offset){
+
+    size_t alignment = volume->direct_io_alignment;
+    size_t max_read_size = volume->settings.max_io_size - (volume->settings.max_io_size % alignment);
+    uint8_t* bounce_buffer = NULL;
+    size_t total_read = 0;
+
+    if(max_read_size == 0){
+        max_read_size = alignment;
+    }
+
+    if(offset % alignment == 0 && (uintptr_t)buffer % alignment == 0){
+        size_t aligned_count = count - (count % alignment);
+        total_read = read_fully(volume, volume->disk_image_direct_fd, buffer, aligned_count, offset, max_read_size);
+        if(total_read < aligned_count){
+            return total_read;
+        }
+    }
+
+    while(total_read < count){
+        off_t position = offset + total_read;
+        off_t aligned_position = position - (position % alignment);
+        size_t head = position - aligned_position;
+        size_t span = head + (count - total_read);
+        span = (span + alignment - 1) / alignment * alignment;
+        if(span > DIRECT_IO_BOUNCE_SIZE){
+            span = DIRECT_IO_BOUNCE_SIZE;
+        }
+
+        if(bounce_buffer == NULL){
+            bounce_buffer = allocate_disk_buffer(volume, DIRECT_IO_BOUNCE_SIZE);
+            if(bounce_buffer == NULL){
+                fprintf(stderr, "\nError in read_disk_image() : Could not allocate bounce buffer\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        size_t bytes_read = read_fully(volume, volume->disk_image_direct_fd, bounce_buffer, span, aligned_position, max_read_size);
+        count_stat(volume, STAT_BOUNCED_READS, 1);
+        if(bytes_read <= head){
+            break;
+        }
+        size_t bytes_used = bytes_read - head;
+        if(bytes_used > count - total_read){
+            bytes_used = count - total_read;
+        }
+        memcpy((uint8_t*)buffer + total_read, bounce_buffer + head, bytes_used);
+        total_read += bytes_used;
+
+        if(bytes_read < span){
+            //End of the disk image
+            break;
+        }
+    }
+    free(bounce_buffer);
+
+    return total_read;
+
+}
+
+/********************************************************************
+Reads count bytes starting at byte offset of the disk image into
+    buffer, without moving the file offset. Small reads, such as FAT
+    sectors and directory clusters, are served by the block cache
+********************************************************************/
+size_t read_disk_image(FAT32_volume* volume, void* buffer, size_t count, off_t offset){
+
+    if(is_block_cache_read(volume, count)){
+        return read_block_cache(volume, buffer, count, offset);
+    }
+
+    return read_disk_image_uncached(volume, buffer, count, offset);
+
+}
+
+/********************************************************************
+Reads count bytes starting at byte offset of the disk image into
+    buffer, skipping the block cache. Large reads are split into
+    reads of at most settings.max_io_size bytes
+********************************************************************/
+size_t read_disk_image_uncached(FAT32_volume* volume, void* buffer, size_t count, off_t offset){
+
+    //Copy straight out of the mapping when there is one
+    if(volume->disk_image_map != NULL){
+        if(offset < 0 || (size_t)offset >= volume->disk_image_map_size){
+            return 0;
+        }
+        if(count > volume->disk_image_map_size - offset){
+            count = volume->disk_image_map_size - offset;
+        }
+        memcpy(buffer, volume->disk_image_map + offset, count);
+        count_stat(volume, STAT_BYTES_READ, count);
+        return count;
+    }
+
+    if(volume->settings.use_direct_io){
+        return read_direct_disk_image(volume, buffer, count, offset);
+    }
+
+    return read_fully(volume, volume->disk_image_fd, buffer, count, offset, volume->settings.max_io_size);
+
+}
+
+/********************************************************************
+Reads every request of the batch. With the io_uring engine the reads
+    are all in flight at once and complete in any order, otherwise
+    they are read one after the other
+********************************************************************/
+void read_disk_image_batch(FAT32_volume* volume, FAT32_read_request* requests, uint32_t num_requests){
+
+    uint32_t i;
+
+    //A lone small read is better served by the block cache, whose blocks io_uring would not fill,
+    //but several small reads, like the extents of a fragmented file, gain more from being in flight together
+    bool use_uring = is_uring_engine_running(volume) && num_requests > 1;
+    for(i = 0; is_uring_engine_running(volume) && !use_uring && i < num_requests; i++){
+        use_uring = !is_block_cache_read(volume, requests[i].count);
+    }
+
+    //Direct reads only go through io_uring if none of them needs a bounce buffer
+    for(i = 0; use_uring && volume->settings.use_direct_io && i < num_requests; i++){
+        use_uring = requests[i].offset % volume->direct_io_alignment == 0 && requests[i].count % volume->direct_io_alignment == 0
+                    && (uintptr_t)requests[i].buffer % volume->direct_io_alignment == 0;
+    }
+
+    if(use_uring){
+        uint64_t start = get_stat_time();
+        read_uring_batch(volume, requests, num_requests);
+        count_stat_time(volume, STAT_READ_NANOSECONDS, start);
+        return;
+    }
+
+    for(i = 0; i < num_requests; i++){
+        requests[i].bytes_read = read_disk_image(volume, requests[i].buffer, requests[i].count, requests[i].offset);
+        requests[i].is_done = true;
+    }
+
+}
+
+/********************************************************************
+Allocates a buffer for reads of the disk image, aligned for direct
+    I/O when it is on. Returns NULL if there is not enough memory.
+    Free it with free()
+********************************************************************/
+void* allocate_disk_buffer(FAT32_volume* volume, size_t size){
+
+    void* buffer;
+
+    if(!volume->settings.use_direct_io){
+        return malloc(size);
+    }
+    if(posix_memalign(&buffer, volume->direct_io_alignment, (size > 0) ? size : 1) != 0){
+        return NULL;
+    }
+
+    return buffer;
+
+}
+
+/********************************************************************
+Returns a pointer to count bytes starting at byte offset of the disk
+    image mapping, or NULL if the image is not mapped or the range
+    is outside of it. The memory is read-only
+********************************************************************/
+uint8_t* get_disk_image_pointer(FAT32_volume* volume, off_t offset, size_t count){
+
+    if(volume->disk_image_map == NULL || offset < 0 || (size_t)offset > volume->disk_image_map_size
+            || count > volume->disk_image_map_size - offset){
+        return NULL;
+    }
+
+    return volume->disk_image_map + offset;
+
+}
+
+/********************************************************************
+Checks if the pointer points into the disk image mapping, meaning
+    it is not owned by the caller and must not be freed
+********************************************************************/
+bool is_disk_image_pointer(FAT32_volume* volume, void* pointer){
+
+    return volume->disk_image_map != NULL
+            && (uint8_t*)pointer >= volume->disk_image_map
+            && (uint8_t*)pointer < volume->disk_image_map + volume->disk_image_map_size;
+
+}
+
+/********************************************************************
+Tells the kernel how a range of the disk image mapping is going to be
+    accessed. The range is widened to page boundaries
+********************************************************************/
+void advise_disk_image(FAT32_volume* volume, off_t offset, size_t count, int advice){
+
+    if(volume->disk_image_map == NULL || offset < 0 || (size_t)offset >= volume->disk_image_map_size){
+        return;
+    }
+
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t start = offset - (offset % page_size);
+    size_t end = offset + count;
+    if(end > volume->disk_image_map_size){
+        end = volume->disk_image_map_size;
+    }
+
+    madvise(volume->disk_image_map + start, end - start, advice);
+
+}
+
+#pragma endregion Disk_Read_Functions
+
+#pragma region Disk_Write_Functions
+
+/********************************************************************
+Writes count bytes of buffer to the disk image starting at byte
+    offset, without moving the file offset. A mapping of the image
+    is shared, so it sees the new data too, and cached blocks are
+    updated in place
+********************************************************************/
+void write_disk_image(FAT32_volume* volume, const void* buffer, size_t count, off_t offset){
+
+    size_t total_written = 0;
+
+    while(total_written < count){
+        uint64_t start = get_stat_time();
+        ssize_t bytes_written = pwrite(volume->disk_image_fd, (const uint8_t*)buffer + total_written, count - total_written, offset + total_written);
+        count_stat_time(volume, STAT_WRITE_NANOSECONDS, start);
+        count_stat(volume, STAT_WRITE_SYSCALLS, 1);
+        if(bytes_written == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            fprintf(stderr, "\nError in write_disk_image() : pwrite() returned -1 : %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+
+        total_written += bytes_written;
+        count_stat(volume, STAT_BYTES_WRITTEN, bytes_written);
+    }
+
+    update_block_cache(volume, buffer, count, offset);
+
+}
+
+#pragma endregion Disk_Write_Functions
+
+#pragma region Disk_Copy_Functions
+
+//Set once copy_file_range() turns out to be missing from the kernel, so later outputs go straight to sendfile()
+static bool is_copy_file_range_missing;
+
+/********************************************************************
+Copies count bytes starting at byte offset of the disk image to the
+    current position of output_fd without passing them through
+    user space. Returns the number of bytes copied, which is short
+    at the end of the image or once *method is COPY_METHOD_BUFFERED
+********************************************************************/
+size_t copy_disk_image(FAT32_volume* volume, int output_fd, off_t offset, size_t count, FAT32_copy_method* method){
+
+    struct stat output_stat;
+    size_t total_copied = 0;
+
+    if(*method == COPY_METHOD_UNKNOWN){
+        if(fstat(output_fd, &output_stat) == 0 && S_ISFIFO(output_stat.st_mode)){
+            *method = COPY_METHOD_SPLICE;
+        }else{
+            *method = __atomic_load_n(&is_copy_file_range_missing, __ATOMIC_RELAXED) ? COPY_METHOD_SENDFILE : COPY_METHOD_COPY_FILE_RANGE;
+        }
+    }
+
+    while(total_copied < count && *method != COPY_METHOD_BUFFERED){
+        size_t to_copy = (count - total_copied > MAX_ZERO_COPY_SIZE) ? MAX_ZERO_COPY_SIZE : count - total_copied;
+        loff_t input_offset = offset + total_copied;
+        off_t sendfile_offset = offset + total_copied;
+        ssize_t bytes_copied = -1;
+
+        uint64_t start = get_stat_time();
+        switch(*method){
+            case COPY_METHOD_COPY_FILE_RANGE:
+                bytes_copied = copy_file_range(volume->disk_image_fd, &input_offset, output_fd, NULL, to_copy, 0);
+                break;
+            case COPY_METHOD_SENDFILE:
+                bytes_copied = sendfile(output_fd, volume->disk_image_fd, &sendfile_offset, to_copy);
+                break;
+            case COPY_METHOD_SPLICE:
+                bytes_copied = splice(volume->disk_image_fd, &input_offset, output_fd, NULL, to_copy, SPLICE_F_MOVE);
+                break;
+            default:
+                break;
+        }
+        count_stat_time(volume, STAT_ZERO_COPY_NANOSECONDS, start);
+        count_stat(volume, STAT_ZERO_COPY_SYSCALLS, 1);
+
+        if(bytes_copied == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            //Try the next way of copying, whatever was copied so far stays in the output
+            if(*method == COPY_METHOD_COPY_FILE_RANGE){
+                if(errno == ENOSYS){
+                    __atomic_store_n(&is_copy_file_range_missing, true, __ATOMIC_RELAXED);
+                }
+                *method = COPY_METHOD_SENDFILE;
+            }else{
+                *method = COPY_METHOD_BUFFERED;
+            }
+            continue;
+        }
+        if(bytes_copied == 0){
+            //Reached the end of the disk image
+            break;
+        }
+
+        total_copied += bytes_copied;
+        count_stat(volume, STAT_BYTES_ZERO_COPIED, bytes_copied);
+    }
+
+    return total_copied;
+
+}
+
+#pragma endregion Disk_Copy_Functions
+
 #pragma region Printing_Functions
 
 /********************************************************************
 Prints out some values contained in the boot sector to a file
 	in the debug directory
 ********************************************************************/
-void print_boot_sector_info(){
+void print_boot_sector_info(FAT32_volume* volume){
 
     /*
     char* boot_sector_output_filename = "./debug/boot_sector_output.txt";
@@ -77,38 +547,38 @@ void print_boot_sector_info(){
     */
     
     //Device info
-    char* OEM_name = boot_sector->BS_OEMName;
-    char* label = boot_sector->BS_VolLab;
-    char* file_system_type = get_FAT_type();
-    uint8_t media_type = boot_sector->BPB_Media;
-    long long size = (long long)boot_sector->BPB_BytesPerSec * (long long)boot_sector->BPB_TotSec32;
-    uint8_t drive_number = boot_sector->BS_DrvNum;
+    char* OEM_name = volume->boot_sector->BS_OEMName;
+    char* label = volume->boot_sector->BS_VolLab;
+    char* file_system_type = get_FAT_type(volume);
+    uint8_t media_type = volume->boot_sector->BPB_Media;
+    long long size = (long long)volume->boot_sector->BPB_BytesPerSec * (long long)volume->boot_sector->BPB_TotSec32;
+    uint8_t drive_number = volume->boot_sector->BS_DrvNum;
 
     //Geometry
-    uint16_t bytes_per_sector = boot_sector->BPB_BytesPerSec;
-    uint8_t sectors_per_cluster = boot_sector->BPB_SecPerClus;
-    uint32_t total_sectors = boot_sector->BPB_TotSec32;
-    uint16_t sectors_per_track = boot_sector->BPB_SecPerTrk;
-    uint16_t heads = boot_sector->BPB_NumHeads;
-    uint32_t hidden_sectors = boot_sector->BPB_HiddSec;
+    uint16_t bytes_per_sector = volume->boot_sector->BPB_BytesPerSec;
+    uint8_t sectors_per_cluster = volume->boot_sector->BPB_SecPerClus;
+    uint32_t total_sectors = volume->boot_sector->BPB_TotSec32;
+    uint16_t sectors_per_track = volume->boot_sector->BPB_SecPerTrk;
+    uint16_t heads = volume->boot_sector->BPB_NumHeads;
+    uint32_t hidden_sectors = volume->boot_sector->BPB_HiddSec;
 
     //FS Info
-    char* volume_id = root_directory->DIR_Name;
-    uint8_t version_high = boot_sector->BPB_FSVerHigh;
-    uint8_t version_low = boot_sector->BPB_FSVerLow;
-    uint16_t reserved_sectors = boot_sector->BPB_RsvdSecCnt;
-    uint8_t number_of_FATs = boot_sector->BPB_NumFATs;
-    uint32_t FAT_size = boot_sector->BPB_FATSz32;
-    char* mirrored_FAT = (((boot_sector->BPB_ExtFlags & 0x80) == 0) ? "0 (yes)" : "1 (no)"); //0x80 is just a mask used to isolate bit 7
-    uint16_t boot_sector_backup_sector_no = boot_sector->BPB_BkBootSec;
+    char* volume_id = volume->root_directory->DIR_Name;
+    uint8_t version_high = volume->boot_sector->BPB_FSVerHigh;
+    uint8_t version_low = volume->boot_sector->BPB_FSVerLow;
+    uint16_t reserved_sectors = volume->boot_sector->BPB_RsvdSecCnt;
+    uint8_t number_of_FATs = volume->boot_sector->BPB_NumFATs;
+    uint32_t FAT_size = volume->boot_sector->BPB_FATSz32;
+    char* mirrored_FAT = (((volume->boot_sector->BPB_ExtFlags & 0x80) == 0) ? "0 (yes)" : "1 (no)"); //0x80 is just a mask used to isolate bit 7
+    uint16_t boot_sector_backup_sector_no = volume->boot_sector->BPB_BkBootSec;
 
-    fprintf(stdout, "%s\n", root_directory->DIR_Name);
+    fprintf(stdout, "%s\n", volume->root_directory->DIR_Name);
 
     //Print all that info
     fprintf(stdout, 
         "---- Device Info ----\n"
-        " OEM Name: %s\n"
-        " Label: %s\n"
+        " OEM Name: %.*s\n"
+        " Label: %.*s\n"
         " File System Type: %s\n"
         " Media Type: %#x\n"
         " Size: %lld\n"
@@ -128,7 +598,7 @@ void print_boot_sector_info(){
         " FAT Size: %d\n"
         " Mirrored FAT: %s\n"
         " Boot Sector Backup Sector No: %d\n",
-        OEM_name, label, file_system_type, media_type,
+        BS_OEMName_LENGTH, OEM_name, BS_VolLab_LENGTH, label, file_system_type, media_type,
         size, drive_number, bytes_per_sector, sectors_per_cluster,
         total_sectors, sectors_per_track, heads, hidden_sectors,
         volume_id, version_high, version_low, reserved_sectors, number_of_FATs,
@@ -149,19 +619,19 @@ void print_boot_sector_info(){
 /********************************************************************
 Prints out information about the root directory, for debugging
 ********************************************************************/
-void print_root_directory(){
-
-    uint8_t dir_attr = root_directory->DIR_Attr;
-    uint16_t crt_date = root_directory->DIR_CrtDate;
-    uint16_t crt_time = root_directory->DIR_CrtTime;
-    uint32_t file_size = root_directory->DIR_FileSize;
-    uint16_t fst_clus_hi = root_directory->DIR_FstClusHI;
-    uint16_t fst_clus_lo = root_directory->DIR_FstClusLO;
-    uint16_t lst_acc_date = root_directory->DIR_LstAccDate;
-    char* dir_name = root_directory->DIR_Name;
-    uint8_t ntres = root_directory->DIR_NTRes;
-    uint16_t wrt_date = root_directory->DIR_WrtDate;
-    uint16_t wrt_time = root_directory->DIR_WrtTime;
+void print_root_directory(FAT32_volume* volume){
+
+    uint8_t dir_attr = volume->root_directory->DIR_Attr;
+    uint16_t crt_date = volume->root_directory->DIR_CrtDate;
+    uint16_t crt_time = volume->root_directory->DIR_CrtTime;
+    uint32_t file_size = volume->root_directory->DIR_FileSize;
+    uint16_t fst_clus_hi = volume->root_directory->DIR_FstClusHI;
+    uint16_t fst_clus_lo = volume->root_directory->DIR_FstClusLO;
+    uint16_t lst_acc_date = volume->root_directory->DIR_LstAccDate;
+    char* dir_name = volume->root_directory->DIR_Name;
+    uint8_t ntres = volume->root_directory->DIR_NTRes;
+    uint16_t wrt_date = volume->root_directory->DIR_WrtDate;
+    uint16_t wrt_time = volume->root_directory->DIR_WrtTime;
 
     fprintf(stdout,
         "dir_attr: %#x\n"
@@ -187,63 +657,98 @@ void print_root_directory(){
 Prints out information about the current directory and all the files
     and subfolders in it
 ********************************************************************/
-void print_current_directory(){
+void print_current_directory(FAT32_cursor* cursor){
 
-    fprintf(stdout, "\nDIRECTORY LISTING\n");
-    fprintf(stdout, "Volume ID: %s\n\n", root_directory->DIR_Name);
-
-    uint8_t* data_buffer = read_clusterchain(build_clusterchain(current_directory_cluster));
-    FAT32_Directory_Entry* dir = (FAT32_Directory_Entry*)&data_buffer[0];
-    int dirs_parsed = 0;
-
-    //Do not print the first 2 entries of the root directory, they are garbage
-    if(current_directory_cluster == boot_sector->BPB_RootClus){
-        dir++;
-        dir++;
-        dirs_parsed = 2;
-    }
+    FAT32_volume* volume = cursor->volume;
 
-    bool continue_parsing = true;
-    while(continue_parsing){
-        if(dir->DIR_Name[0] == 0x00){
-            //No more entries
-            continue_parsing = false;
-            continue;
-        }
-        if(dir->DIR_Name[0] == 0xE5){
-            //An empty entry
-            continue;
-        }
-        if(dir->DIR_Name[0] == 0x05){
-            //Byte is actually 0xE5
-            dir->DIR_Name[0] = 0xE5;
-        }
-        char dir_name[strlen(dir->DIR_Name) + 1];
-        if(dir->DIR_Attr == 0x10){
-            //entry is a directory
-            trim_directory_name(dir->DIR_Name, dir_name);
-            fprintf(stdout, "<%s>\t\t%d\n", dir_name, dir->DIR_FileSize);
+    fprintf(stdout, "\nDIRECTORY LISTING\n");
+    fprintf(stdout, "Volume ID: %.*s\n\n", SHORT_NAME_LENGTH, volume->root_directory->DIR_Name);
+
+    FAT32_directory_iterator iterator;
+    FAT32_file_info info;
+
+    //The whole directory is read anyway, so list it from the cache for the next dir, cd and get.
+    //The volume label and long name entries are skipped by the iterator
+    FAT32_cached_directory* directory = get_cached_directory(volume, cursor->current_directory_cluster);
+    open_cached_directory_iterator(volume, directory, &iterator);
+    while(next_directory_entry(&iterator, &info)){
+        if(info.attributes & 0x10){
+            fprintf(stdout, "<%s>\t\t%u\n", info.name, info.file_size);
         }else{
-            trim_file_name(dir->DIR_Name, dir_name);
-            fprintf(stdout, "%s\t\t%d\n", dir_name, dir->DIR_FileSize);
+            fprintf(stdout, "%s\t\t%u\n", info.name, info.file_size);
         }
+    }
+    close_directory_iterator(&iterator);
+    release_cached_directory(volume, directory);
 
+    //prnt free space, counted from the FAT since FSI_Free_Count is only a hint
+    long long bytes_free = ((long long)get_free_cluster_count(volume)) * volume->geometry.cluster_size;
+    fprintf(stdout, "---Bytes Free: %lld\n", bytes_free);
 
-        dir++;
-        dirs_parsed++;
+    //print done message
+    fprintf(stdout, "---DONE\n");
+}
 
-        //print the . and .. entries, then skip every other entry (they are garbage)
-        if(dirs_parsed >= 2){
-            dir++;
+/********************************************************************
+Prints the exact free space of the volume, how it compares with the
+    FSInfo hint, and how fragmented the free space is
+********************************************************************/
+void print_free_space(FAT32_volume* volume){
+
+    uint32_t cluster_size = volume->geometry.cluster_size;
+    uint32_t end_cluster = volume->geometry.end_cluster;
+    uint32_t num_runs = 0, largest_run = 0;
+    uint32_t num_free = get_free_cluster_count(volume);
+
+    //Walk the free runs of the bitmap
+    uint32_t cluster = find_free_cluster(volume, 2);
+    while(cluster < end_cluster){
+        uint32_t run_end = find_used_cluster(volume, cluster);
+        if(run_end - cluster > largest_run){
+            largest_run = run_end - cluster;
         }
+        num_runs++;
+        cluster = find_free_cluster(volume, run_end);
     }
 
-    //prnt free space
-    long long bytes_free = ((long long)fs_info_sector->FSI_Free_Count) * ((long)boot_sector->BPB_SecPerClus * (long)boot_sector->BPB_BytesPerSec);
-    fprintf(stdout, "---Bytes Free: %lld\n", bytes_free);
-
-    //print done message
+    fprintf(stdout, "\nFREE SPACE\n");
+    fprintf(stdout, "Clusters: %u of %u free (%u bytes each)\n", num_free, end_cluster - 2, cluster_size);
+    fprintf(stdout, "Bytes Free: %" PRIu64 "\n", (uint64_t)num_free * cluster_size);
+    if(volume->fs_info_sector->FSI_Free_Count == 0xFFFFFFFF){
+        fprintf(stdout, "FSInfo free count: unknown\n");
+    }else if(volume->fs_info_sector->FSI_Free_Count != num_free){
+        fprintf(stdout, "FSInfo free count: %u (stale)\n", volume->fs_info_sector->FSI_Free_Count);
+    }else{
+        fprintf(stdout, "FSInfo free count: %u\n", volume->fs_info_sector->FSI_Free_Count);
+    }
+    fprintf(stdout, "Free runs: %u\n", num_runs);
+    fprintf(stdout, "Largest free run: %u clusters (%" PRIu64 " bytes)\n", largest_run, (uint64_t)largest_run * cluster_size);
+    if(num_runs > 0){
+        fprintf(stdout, "Average free run: %.1f clusters\n", (double)num_free / num_runs);
+        //0% when all the free space is one run, close to 100% when it is scattered in single clusters
+        fprintf(stdout, "Free space fragmentation: %.1f%%\n", 100.0 * (1.0 - (double)largest_run / num_free));
+    }
     fprintf(stdout, "---DONE\n");
+
+}
+
+/********************************************************************
+Prints how the disk image of a newly mounted volume is being read
+********************************************************************/
+void print_disk_image_info(FAT32_volume* volume){
+
+    fprintf(stdout, "Opened %s for %s\n", volume->disk_image_path,
+                    volume->settings.use_write_access ? "reading and writing" : "reading");
+    if(volume->disk_image_map != NULL){
+        fprintf(stdout, "Mapped %zu bytes of %s\n", volume->disk_image_map_size, volume->disk_image_path);
+    }
+    if(volume->settings.use_direct_io){
+        fprintf(stdout, "Reading %s with O_DIRECT, aligned to %zu bytes\n", volume->disk_image_path, volume->direct_io_alignment);
+    }
+    if(is_uring_engine_running(volume)){
+        fprintf(stdout, "Using io_uring with %u reads in flight\n", volume->uring.queue_depth);
+    }
+
 }
 
-#pragma endregion Printing_Functions
\ No newline at end of file
+#pragma endregion Printing_Functions
@@ -0,0 +1,220 @@
+/********************************************************************
+    Module: FAT32_stats.c
+    Author: Brennan Couturier
+
+    Counters and latency histograms for I/O and shell commands
+********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include "../include/FAT32_structs_globals.h"
+#include "../include/FAT32_stats.h"
+
+static const char* stat_counter_names[NUM_STAT_COUNTERS] = {
+    "read_syscalls",
+    "bytes_read",
+    "read_nanoseconds",
+    "uring_reads",
+    "bounced_reads",
+    "write_syscalls",
+    "bytes_written",
+    "write_nanoseconds",
+    "zero_copy_syscalls",
+    "bytes_zero_copied",
+    "zero_copy_nanoseconds",
+    "FAT_lookups",
+    "FAT_cache_hits",
+    "FAT_cache_misses",
+    "directory_cache_hits",
+    "directory_cache_misses",
+    "block_cache_hits",
+    "block_cache_misses",
+    "chains_built",
+    "chain_clusters",
+    "chain_extents",
+    "chain_nanoseconds",
+    "chains_read",
+    "allocations",
+    "bytes_allocated",
+    "bytes_digested",
+    "digest_nanoseconds",
+};
+
+static const char* stat_command_names[NUM_STAT_COMMANDS] = {
+    "info",
+    "dir",
+    "cd",
+    "get",
+    "put",
+    "stats",
+    "free",
+    "find",
+    "du",
+    "check",
+    "other",
+};
+
+#pragma region Counting_Functions
+
+/********************************************************************
+Adds amount to a counter of the volume. Safe to call from any thread
+********************************************************************/
+void count_stat(FAT32_volume* volume, FAT32_stat_counter counter, uint64_t amount){
+
+    __atomic_fetch_add(&volume->stats.counters[counter], amount, __ATOMIC_RELAXED);
+
+}
+
+/********************************************************************
+Returns a monotonic timestamp in nanoseconds
+********************************************************************/
+uint64_t get_stat_time(){
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+
+}
+
+/********************************************************************
+Adds the time since start to a counter
+********************************************************************/
+void count_stat_time(FAT32_volume* volume, FAT32_stat_counter counter, uint64_t start){
+
+    count_stat(volume, counter, get_stat_time() - start);
+
+}
+
+/********************************************************************
+Records how long one shell command took in its histogram. Commands
+    only run on the shell thread, so no atomics are needed here
+********************************************************************/
+void record_command_latency(FAT32_volume* volume, FAT32_stat_command command, uint64_t nanoseconds){
+
+    FAT32_latency_histogram* histogram = &volume->stats.commands[command];
+    uint64_t microseconds = nanoseconds / 1000;
+    uint32_t bucket = 0;
+
+    while(bucket < LATENCY_BUCKETS - 1 && microseconds >= (2ULL << bucket)){
+        bucket++;
+    }
+
+    histogram->count++;
+    histogram->total_nanoseconds += nanoseconds;
+    if(nanoseconds > histogram->max_nanoseconds){
+        histogram->max_nanoseconds = nanoseconds;
+    }
+    histogram->buckets[bucket]++;
+
+}
+
+#pragma endregion Counting_Functions
+
+#pragma region Reporting_Functions
+
+/********************************************************************
+Prints every counter, where the time of I/O went, and the latency
+    histogram of every command that was run
+********************************************************************/
+void print_stats(FAT32_volume* volume){
+
+    FAT32_stats* stats = &volume->stats;
+    uint32_t i, j;
+
+    fprintf(stdout, "\nCOUNTERS\n");
+    for(i = 0; i < NUM_STAT_COUNTERS; i++){
+        fprintf(stdout, "%-24s %" PRIu64 "\n", stat_counter_names[i], __atomic_load_n(&stats->counters[i], __ATOMIC_RELAXED));
+    }
+
+    //Following the FAT, reading, writing, copying in the kernel and hashing are where a slow get can spend its time
+    fprintf(stdout, "\nI/O TIME\n");
+    fprintf(stdout, "%-24s %.3f ms\n", "following the FAT", stats->counters[STAT_CHAIN_NANOSECONDS] / 1e6);
+    fprintf(stdout, "%-24s %.3f ms\n", "reading", stats->counters[STAT_READ_NANOSECONDS] / 1e6);
+    fprintf(stdout, "%-24s %.3f ms\n", "writing", stats->counters[STAT_WRITE_NANOSECONDS] / 1e6);
+    fprintf(stdout, "%-24s %.3f ms\n", "copying in the kernel", stats->counters[STAT_ZERO_COPY_NANOSECONDS] / 1e6);
+    fprintf(stdout, "%-24s %.3f ms\n", "computing digests", stats->counters[STAT_DIGEST_NANOSECONDS] / 1e6);
+
+    fprintf(stdout, "\nCOMMAND LATENCIES\n");
+    for(i = 0; i < NUM_STAT_COMMANDS; i++){
+        FAT32_latency_histogram* histogram = &stats->commands[i];
+        if(histogram->count == 0){
+            continue;
+        }
+
+        fprintf(stdout, "%s: %" PRIu64 " runs, average %.3f ms, max %.3f ms\n", stat_command_names[i], histogram->count,
+                        histogram->total_nanoseconds / 1e6 / histogram->count, histogram->max_nanoseconds / 1e6);
+        for(j = 0; j < LATENCY_BUCKETS; j++){
+            if(histogram->buckets[j] > 0){
+                fprintf(stdout, "    < %" PRIu64 " us\t%" PRIu64 "\n", (uint64_t)2 << j, histogram->buckets[j]);
+            }
+        }
+    }
+
+    fprintf(stdout, "---DONE\n");
+
+}
+
+/********************************************************************
+Writes every counter and histogram to path as a JSON object, summed
+    over the volumes
+********************************************************************/
+void write_stats_json(FAT32_volume** volumes, uint32_t num_volumes, char* path){
+
+    FAT32_stats total;
+    uint32_t i, j, k;
+
+    //Add up the volumes, a server can have several mounted
+    memset(&total, 0, sizeof(FAT32_stats));
+    for(k = 0; k < num_volumes; k++){
+        FAT32_stats* stats = &volumes[k]->stats;
+        for(i = 0; i < NUM_STAT_COUNTERS; i++){
+            total.counters[i] += __atomic_load_n(&stats->counters[i], __ATOMIC_RELAXED);
+        }
+        for(i = 0; i < NUM_STAT_COMMANDS; i++){
+            total.commands[i].count += stats->commands[i].count;
+            total.commands[i].total_nanoseconds += stats->commands[i].total_nanoseconds;
+            if(stats->commands[i].max_nanoseconds > total.commands[i].max_nanoseconds){
+                total.commands[i].max_nanoseconds = stats->commands[i].max_nanoseconds;
+            }
+            for(j = 0; j < LATENCY_BUCKETS; j++){
+                total.commands[i].buckets[j] += stats->commands[i].buckets[j];
+            }
+        }
+    }
+
+    FILE* json_file = fopen(path, "w");
+    if(json_file == NULL){
+        fprintf(stderr, "\nError in write_stats_json() : Could not create %s : %s\n", path, strerror(errno));
+        return;
+    }
+
+    fprintf(json_file, "{\n  \"counters\": {\n");
+    for(i = 0; i < NUM_STAT_COUNTERS; i++){
+        fprintf(json_file, "    \"%s\": %" PRIu64 "%s\n", stat_counter_names[i],
+                total.counters[i], (i + 1 < NUM_STAT_COUNTERS) ? "," : "");
+    }
+
+    fprintf(json_file, "  },\n  \"commands\": {\n");
+    for(i = 0; i < NUM_STAT_COMMANDS; i++){
+        FAT32_latency_histogram* histogram = &total.commands[i];
+
+        fprintf(json_file, "    \"%s\": {\"count\": %" PRIu64 ", \"total_nanoseconds\": %" PRIu64
+                ", \"max_nanoseconds\": %" PRIu64 ", \"histogram_microseconds\": [",
+                stat_command_names[i], histogram->count, histogram->total_nanoseconds, histogram->max_nanoseconds);
+        for(j = 0; j < LATENCY_BUCKETS; j++){
+            fprintf(json_file, "%" PRIu64 "%s", histogram->buckets[j], (j + 1 < LATENCY_BUCKETS) ? ", " : "");
+        }
+        fprintf(json_file, "]}%s\n", (i + 1 < NUM_STAT_COMMANDS) ? "," : "");
+    }
+
+    fprintf(json_file, "  }\n}\n");
+    fclose(json_file);
+
+}
+
+#pragma endregion Reporting_Functions
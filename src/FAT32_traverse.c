@@ -0,0 +1,470 @@
+/********************************************************************
+    Module: FAT32_traverse.c
+    Author: Brennan Couturier
+
+    Parallel walk of every directory of the volume, used by
+    the find, du and check commands
+********************************************************************/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <fnmatch.h>
+#include <pthread.h>
+
+#include "../include/FAT32_structs_globals.h"
+#include "../include/FAT32_traverse.h"
+#include "../include/FAT32_helpers.h"
+#include "../include/FAT32_stats.h"
+#include "../include/FAT32_check.h"
+
+#define TRAVERSAL_DEQUE_CAPACITY 64 //Directories a deque starts with room for
+
+#pragma region Deque_Functions
+
+/********************************************************************
+Pushes a directory onto the tail of a worker's own deque and wakes an
+    idle thread if there is one
+********************************************************************/
+static void push_traversal_item(FAT32_traversal_worker* worker, FAT32_traversal_item* item){
+
+    FAT32_traversal* traversal = worker->traversal;
+
+    __atomic_add_fetch(&traversal->num_pending, 1, __ATOMIC_SEQ_CST);
+
+    pthread_mutex_lock(&worker->lock);
+    if(worker->tail == worker->capacity){
+        if(worker->head > 0){
+            //Reuse the room left by stolen items before growing
+            memmove(worker->deque, &worker->deque[worker->head], (worker->tail - worker->head) * sizeof(FAT32_traversal_item));
+            worker->tail -= worker->head;
+            worker->head = 0;
+        }else{
+            worker->capacity *= 2;
+            worker->deque = realloc(worker->deque, worker->capacity * sizeof(FAT32_traversal_item));
+            if(worker->deque == NULL){
+                fprintf(stderr, "\nError in push_traversal_item() : Could not grow deque\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    worker->deque[worker->tail++] = *item;
+    pthread_mutex_unlock(&worker->lock);
+
+    //Seen by a thread about to wait, or that thread sees num_queued go up, never neither
+    __atomic_add_fetch(&traversal->num_queued, 1, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&traversal->num_idle, __ATOMIC_SEQ_CST) > 0){
+        pthread_mutex_lock(&traversal->idle_lock);
+        pthread_cond_signal(&traversal->work_queued);
+        pthread_mutex_unlock(&traversal->idle_lock);
+    }
+
+}
+
+/********************************************************************
+Pops the most recently pushed directory of a worker's own deque.
+    Returns false if the deque is empty
+********************************************************************/
+static bool pop_traversal_item(FAT32_traversal_worker* worker, FAT32_traversal_item* item){
+
+    bool found = false;
+
+    pthread_mutex_lock(&worker->lock);
+    if(worker->tail > worker->head){
+        *item = worker->deque[--worker->tail];
+        found = true;
+    }
+    pthread_mutex_unlock(&worker->lock);
+
+    return found;
+
+}
+
+/********************************************************************
+Takes the oldest directory of another worker's deque, trying every
+    other worker once. Returns false if they are all empty
+********************************************************************/
+static bool steal_traversal_item(FAT32_traversal_worker* thief, FAT32_traversal_item* item){
+
+    FAT32_traversal* traversal = thief->traversal;
+    uint32_t i;
+
+    for(i = 1; i < traversal->num_workers; i++){
+        FAT32_traversal_worker* victim = &traversal->workers[(thief->id + i) % traversal->num_workers];
+        bool found = false;
+
+        pthread_mutex_lock(&victim->lock);
+        if(victim->tail > victim->head){
+            *item = victim->deque[victim->head++];
+            found = true;
+        }
+        pthread_mutex_unlock(&victim->lock);
+
+        if(found){
+            thief->num_steals++;
+            return true;
+        }
+    }
+
+    return false;
+
+}
+
+#pragma endregion Deque_Functions
+
+#pragma region Traversal_Functions
+
+/********************************************************************
+Joins a path and an entry name into an allocated path. An empty path
+    is the starting directory
+********************************************************************/
+static char* join_traversal_path(char* path, char* name){
+
+    char* joined = malloc(strlen(path) + strlen(name) + 2);
+    if(joined == NULL){
+        fprintf(stderr, "\nError in join_traversal_path() : Could not allocate space for path\n");
+        exit(EXIT_FAILURE);
+    }
+    sprintf(joined, (path[0] == '\0') ? "%s%s" : "%s/%s", path, name);
+
+    return joined;
+
+}
+
+/********************************************************************
+Records the entries of one directory in the worker's results and
+    queues its subdirectories. Subdirectories of the starting
+    directory each get a subtree of their own
+********************************************************************/
+static void scan_traversal_directory(FAT32_traversal_worker* worker, FAT32_traversal_item* item,
+                                        FAT32_Directory_Entry* entries, uint32_t num_entries){
+
+    FAT32_traversal* traversal = worker->traversal;
+    FAT32_volume* volume = traversal->volume;
+    uint32_t cluster_size = volume->geometry.cluster_size;
+    char name[NORMALIZED_NAME_LENGTH];
+    uint32_t i;
+
+    for(i = 0; i < num_entries; i++){
+
+        FAT32_Directory_Entry* entry = &entries[i];
+
+        //Nothing is used past the end of directory marker
+        if(entry->DIR_Name[0] == 0x00){
+            break;
+        }
+        if(!is_named_entry(entry)){
+            continue;
+        }
+
+        uint32_t first_cluster = (entry->DIR_FstClusHI << 16) | entry->DIR_FstClusLO;
+        normalize_entry_name(entry, name);
+
+        if(traversal->check != NULL){
+            check_entry_clusterchain(traversal->check, entry, item->path, name);
+        }
+
+        if(traversal->pattern != NULL && fnmatch(traversal->pattern, name, FNM_CASEFOLD) == 0){
+            if(worker->num_matches == worker->match_capacity){
+                worker->match_capacity = (worker->match_capacity == 0) ? 64 : worker->match_capacity * 2;
+                worker->matches = realloc(worker->matches, worker->match_capacity * sizeof(char*));
+                if(worker->matches == NULL){
+                    fprintf(stderr, "\nError in scan_traversal_directory() : Could not grow match list\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            worker->matches[worker->num_matches++] = join_traversal_path(item->path, name);
+        }
+
+        if(!(entry->DIR_Attr & 0x10)){
+            worker->num_files++;
+            worker->subtree_bytes[item->subtree] += entry->DIR_FileSize;
+            worker->subtree_allocated[item->subtree] += (entry->DIR_FileSize + (uint64_t)cluster_size - 1) / cluster_size * cluster_size;
+            continue;
+        }
+
+        worker->num_directories++;
+
+        if(!claim_directory(traversal->visited, first_cluster, traversal->end_cluster)){
+            continue;
+        }
+
+        FAT32_traversal_item child;
+        child.first_cluster = first_cluster;
+        child.subtree = item->subtree;
+        child.path = (item->path != NULL) ? join_traversal_path(item->path, name) : NULL;
+        if(item->subtree == 0){
+            //Only the root directory has subtree 0, and it is scanned before the threads start
+            child.subtree = traversal->num_subtrees++;
+            traversal->subtree_names[child.subtree] = strdup(name);
+        }
+        push_traversal_item(worker, &child);
+    }
+
+}
+
+/********************************************************************
+Worker thread: reads directories from its own deque, steals when it
+    runs dry, and waits while others still have directories that
+    may produce more work
+********************************************************************/
+static void* run_traversal_worker(void* argument){
+
+    FAT32_traversal_worker* worker = (FAT32_traversal_worker*)argument;
+    FAT32_traversal* traversal = worker->traversal;
+    FAT32_volume* volume = traversal->volume;
+    FAT32_traversal_item item;
+
+    while(true){
+
+        if(pop_traversal_item(worker, &item) || steal_traversal_item(worker, &item)){
+            __atomic_sub_fetch(&traversal->num_queued, 1, __ATOMIC_SEQ_CST);
+
+            size_t size;
+            uint8_t* directory_data = read_directory(volume, item.first_cluster, &size);
+            scan_traversal_directory(worker, &item, (FAT32_Directory_Entry*)directory_data, size / sizeof(FAT32_Directory_Entry));
+            release_directory(volume, directory_data);
+            free(item.path);
+
+            //The last directory read ends the walk
+            if(__atomic_sub_fetch(&traversal->num_pending, 1, __ATOMIC_SEQ_CST) == 0){
+                pthread_mutex_lock(&traversal->idle_lock);
+                pthread_cond_broadcast(&traversal->work_queued);
+                pthread_mutex_unlock(&traversal->idle_lock);
+            }
+            continue;
+        }
+
+        //Nothing to take, wait until a directory is queued or the walk is over
+        pthread_mutex_lock(&traversal->idle_lock);
+        __atomic_add_fetch(&traversal->num_idle, 1, __ATOMIC_SEQ_CST);
+        while(__atomic_load_n(&traversal->num_queued, __ATOMIC_SEQ_CST) == 0
+              && __atomic_load_n(&traversal->num_pending, __ATOMIC_SEQ_CST) > 0){
+            pthread_cond_wait(&traversal->work_queued, &traversal->idle_lock);
+        }
+        __atomic_sub_fetch(&traversal->num_idle, 1, __ATOMIC_SEQ_CST);
+        bool is_done = (__atomic_load_n(&traversal->num_pending, __ATOMIC_SEQ_CST) == 0);
+        pthread_mutex_unlock(&traversal->idle_lock);
+
+        if(is_done){
+            break;
+        }
+    }
+
+    return NULL;
+
+}
+
+/********************************************************************
+Walks every directory of the volume, starting at BPB_RootClus, with
+    settings.num_threads threads. The root directory is scanned
+    first, on this thread, so each directory directly below it gets
+    a subtree. Returns the traversal with each worker's results,
+    free it with free_traversal()
+********************************************************************/
+FAT32_traversal* run_traversal(FAT32_volume* volume, char* pattern, FAT32_check* check){
+
+    uint32_t root_cluster = volume->boot_sector->BPB_RootClus;
+    uint32_t i;
+    size_t size;
+
+    FAT32_traversal* traversal = calloc(1, sizeof(FAT32_traversal));
+    if(traversal == NULL){
+        fprintf(stderr, "\nError in run_traversal() : Could not allocate space for FAT32_traversal struct\n");
+        exit(EXIT_FAILURE);
+    }
+    traversal->volume = volume;
+    traversal->pattern = pattern;
+    traversal->check = check;
+    traversal->num_workers = (volume->settings.num_threads > 0) ? volume->settings.num_threads : 1;
+    traversal->end_cluster = volume->geometry.end_cluster;
+    traversal->visited = calloc((traversal->end_cluster + 63) / 64, sizeof(uint64_t));
+    traversal->workers = calloc(traversal->num_workers, sizeof(FAT32_traversal_worker));
+    if(traversal->visited == NULL || traversal->workers == NULL){
+        fprintf(stderr, "\nError in run_traversal() : Could not allocate space for traversal state\n");
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_init(&traversal->idle_lock, NULL);
+    pthread_cond_init(&traversal->work_queued, NULL);
+
+    //There can be no more subtrees than the root directory has entries
+    uint8_t* directory_data = read_directory(volume, root_cluster, &size);
+    uint32_t num_entries = size / sizeof(FAT32_Directory_Entry);
+    traversal->subtree_names = calloc(num_entries + 1, sizeof(char*));
+    if(traversal->subtree_names == NULL){
+        fprintf(stderr, "\nError in run_traversal() : Could not allocate space for subtree names\n");
+        exit(EXIT_FAILURE);
+    }
+    traversal->subtree_names[0] = strdup(".");
+    traversal->num_subtrees = 1;
+
+    for(i = 0; i < traversal->num_workers; i++){
+        FAT32_traversal_worker* worker = &traversal->workers[i];
+        worker->traversal = traversal;
+        worker->id = i;
+        worker->capacity = TRAVERSAL_DEQUE_CAPACITY;
+        worker->deque = malloc(worker->capacity * sizeof(FAT32_traversal_item));
+        worker->subtree_bytes = calloc(num_entries + 1, sizeof(uint64_t));
+        worker->subtree_allocated = calloc(num_entries + 1, sizeof(uint64_t));
+        if(worker->deque == NULL || worker->subtree_bytes == NULL || worker->subtree_allocated == NULL){
+            fprintf(stderr, "\nError in run_traversal() : Could not allocate space for worker state\n");
+            exit(EXIT_FAILURE);
+        }
+        pthread_mutex_init(&worker->lock, NULL);
+    }
+
+    //Seed the first worker's deque, the others start by stealing from it
+    FAT32_traversal_item start = { root_cluster, 0, (pattern != NULL || check != NULL) ? "" : NULL };
+    claim_directory(traversal->visited, root_cluster, traversal->end_cluster);
+    scan_traversal_directory(&traversal->workers[0], &start, (FAT32_Directory_Entry*)directory_data, num_entries);
+    release_directory(volume, directory_data);
+
+    for(i = 0; i < traversal->num_workers; i++){
+        int error = pthread_create(&traversal->workers[i].thread, NULL, run_traversal_worker, &traversal->workers[i]);
+        if(error != 0){
+            fprintf(stderr, "\nError in run_traversal() : pthread_create() failed : %s\n", strerror(error));
+            exit(EXIT_FAILURE);
+        }
+    }
+    for(i = 0; i < traversal->num_workers; i++){
+        pthread_join(traversal->workers[i].thread, NULL);
+    }
+
+    return traversal;
+
+}
+
+/********************************************************************
+Frees a traversal and everything its workers collected
+********************************************************************/
+void free_traversal(FAT32_traversal* traversal){
+
+    uint32_t i, j;
+
+    for(i = 0; i < traversal->num_workers; i++){
+        FAT32_traversal_worker* worker = &traversal->workers[i];
+        for(j = 0; j < worker->num_matches; j++){
+            free(worker->matches[j]);
+        }
+        free(worker->matches);
+        free(worker->deque);
+        free(worker->subtree_bytes);
+        free(worker->subtree_allocated);
+        pthread_mutex_destroy(&worker->lock);
+    }
+    for(i = 0; i < traversal->num_subtrees; i++){
+        free(traversal->subtree_names[i]);
+    }
+
+    pthread_mutex_destroy(&traversal->idle_lock);
+    pthread_cond_destroy(&traversal->work_queued);
+    free(traversal->subtree_names);
+    free(traversal->visited);
+    free(traversal->workers);
+    free(traversal);
+
+}
+
+/********************************************************************
+Prints how much was walked and how much work had to be shared
+********************************************************************/
+void print_traversal_summary(FAT32_traversal* traversal, uint64_t start){
+
+    uint64_t num_files = 0, num_directories = 0, num_steals = 0;
+    uint32_t i;
+
+    for(i = 0; i < traversal->num_workers; i++){
+        num_files += traversal->workers[i].num_files;
+        num_directories += traversal->workers[i].num_directories;
+        num_steals += traversal->workers[i].num_steals;
+    }
+
+    fprintf(stdout, "Walked %" PRIu64 " files and %" PRIu64 " directories in %.3f ms using %u threads (%" PRIu64 " steals)\n",
+                    num_files, num_directories, (get_stat_time() - start) / 1e6, traversal->num_workers, num_steals);
+
+}
+
+/********************************************************************
+qsort() comparison for the merged match list
+********************************************************************/
+static int compare_match_paths(const void* a, const void* b){
+
+    return strcmp(*(char**)a, *(char**)b);
+
+}
+
+/********************************************************************
+Prints the path, from the root, of every file and directory on the
+    volume whose name matches the glob pattern, ignoring case
+********************************************************************/
+void find_entries(FAT32_cursor* cursor, char* pattern){
+
+    uint64_t start = get_stat_time();
+    uint32_t num_matches = 0;
+    uint32_t i, j;
+
+    FAT32_traversal* traversal = run_traversal(cursor->volume, pattern, NULL);
+
+    //Merge the matches of every thread, sorted so the output does not depend on who found what
+    for(i = 0; i < traversal->num_workers; i++){
+        num_matches += traversal->workers[i].num_matches;
+    }
+    char** matches = malloc((num_matches + 1) * sizeof(char*));
+    if(matches == NULL){
+        fprintf(stderr, "\nError in find_entries() : Could not allocate space for matches\n");
+        exit(EXIT_FAILURE);
+    }
+    num_matches = 0;
+    for(i = 0; i < traversal->num_workers; i++){
+        for(j = 0; j < traversal->workers[i].num_matches; j++){
+            matches[num_matches++] = traversal->workers[i].matches[j];
+        }
+    }
+    qsort(matches, num_matches, sizeof(char*), compare_match_paths);
+
+    for(i = 0; i < num_matches; i++){
+        fprintf(stdout, "/%s\n", matches[i]);
+    }
+    fprintf(stdout, "---%u matches\n", num_matches);
+    print_traversal_summary(traversal, start);
+
+    free(matches);
+    free_traversal(traversal);
+
+}
+
+/********************************************************************
+Prints the size of each directory directly below the root, of the
+    files in the root directory itself, and the total
+********************************************************************/
+void print_disk_usage(FAT32_cursor* cursor){
+
+    uint64_t start = get_stat_time();
+    uint64_t total_bytes = 0, total_allocated = 0;
+    uint32_t i, j;
+
+    FAT32_traversal* traversal = run_traversal(cursor->volume, NULL, NULL);
+
+    fprintf(stdout, "\n%16s %16s  %s\n", "BYTES", "ON DISK", "DIRECTORY");
+    for(i = 0; i < traversal->num_subtrees; i++){
+        uint64_t bytes = 0, allocated = 0;
+        for(j = 0; j < traversal->num_workers; j++){
+            bytes += traversal->workers[j].subtree_bytes[i];
+            allocated += traversal->workers[j].subtree_allocated[i];
+        }
+        total_bytes += bytes;
+        total_allocated += allocated;
+
+        fprintf(stdout, "%16" PRIu64 " %16" PRIu64 "  %s\n", bytes, allocated, traversal->subtree_names[i]);
+    }
+    fprintf(stdout, "%16" PRIu64 " %16" PRIu64 "  %s\n", total_bytes, total_allocated, "total");
+    print_traversal_summary(traversal, start);
+
+    free_traversal(traversal);
+
+}
+
+#pragma endregion Traversal_Functions
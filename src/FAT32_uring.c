@@ -0,0 +1,249 @@
+/********************************************************************
+    Module: FAT32_uring.c
+    Author: Brennan Couturier
+
+    Asynchronous read engine for the disk image built on io_uring
+********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "../include/FAT32_structs_globals.h"
+#include "../include/FAT32_uring.h"
+#include "../include/FAT32_stats.h"
+
+#pragma region Uring_Engine_Functions
+
+/********************************************************************
+Sets up an io_uring instance able to keep queue_depth reads of the
+    disk image in flight
+********************************************************************/
+bool start_uring_engine(FAT32_volume* volume, uint32_t queue_depth){
+
+    struct io_uring_params params;
+
+    memset(&params, 0, sizeof(struct io_uring_params));
+    int ring_fd = syscall(__NR_io_uring_setup, queue_depth, &params);
+    if(ring_fd == -1){
+        fprintf(stdout, "io_uring is not available, using pread() instead : %s\n", strerror(errno));
+        return false;
+    }
+
+    //Map the submission ring, the completion ring and the submission entries
+    volume->uring.sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    volume->uring.cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if(params.features & IORING_FEAT_SINGLE_MMAP){
+        if(volume->uring.cq_ring_size > volume->uring.sq_ring_size){
+            volume->uring.sq_ring_size = volume->uring.cq_ring_size;
+        }
+        volume->uring.cq_ring_size = volume->uring.sq_ring_size;
+    }
+    volume->uring.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    volume->uring.sq_ring = mmap(NULL, volume->uring.sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring_fd, IORING_OFF_SQ_RING);
+    if(volume->uring.sq_ring == MAP_FAILED){
+        fprintf(stdout, "Could not map the io_uring rings, using pread() instead : %s\n", strerror(errno));
+        close(ring_fd);
+        return false;
+    }
+    if(params.features & IORING_FEAT_SINGLE_MMAP){
+        volume->uring.cq_ring = volume->uring.sq_ring;
+    }else{
+        volume->uring.cq_ring = mmap(NULL, volume->uring.cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             ring_fd, IORING_OFF_CQ_RING);
+        if(volume->uring.cq_ring == MAP_FAILED){
+            fprintf(stdout, "Could not map the io_uring rings, using pread() instead : %s\n", strerror(errno));
+            munmap(volume->uring.sq_ring, volume->uring.sq_ring_size);
+            close(ring_fd);
+            return false;
+        }
+    }
+    volume->uring.sqes = mmap(NULL, volume->uring.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring_fd, IORING_OFF_SQES);
+    if(volume->uring.sqes == MAP_FAILED){
+        fprintf(stdout, "Could not map the io_uring rings, using pread() instead : %s\n", strerror(errno));
+        if(volume->uring.cq_ring != volume->uring.sq_ring){
+            munmap(volume->uring.cq_ring, volume->uring.cq_ring_size);
+        }
+        munmap(volume->uring.sq_ring, volume->uring.sq_ring_size);
+        close(ring_fd);
+        return false;
+    }
+
+    uint8_t* sq_ring = (uint8_t*)volume->uring.sq_ring;
+    uint8_t* cq_ring = (uint8_t*)volume->uring.cq_ring;
+    volume->uring.sq_head = (uint32_t*)(sq_ring + params.sq_off.head);
+    volume->uring.sq_tail = (uint32_t*)(sq_ring + params.sq_off.tail);
+    volume->uring.sq_mask = (uint32_t*)(sq_ring + params.sq_off.ring_mask);
+    volume->uring.sq_array = (uint32_t*)(sq_ring + params.sq_off.array);
+    volume->uring.cq_head = (uint32_t*)(cq_ring + params.cq_off.head);
+    volume->uring.cq_tail = (uint32_t*)(cq_ring + params.cq_off.tail);
+    volume->uring.cq_mask = (uint32_t*)(cq_ring + params.cq_off.ring_mask);
+    volume->uring.cqes = (struct io_uring_cqe*)(cq_ring + params.cq_off.cqes);
+
+    //The completion ring is at least as big as the submission ring, so it never overflows
+    volume->uring.queue_depth = params.sq_entries;
+    volume->uring.resubmit = malloc(sizeof(uint32_t) * volume->uring.queue_depth);
+    if(volume->uring.resubmit == NULL){
+        fprintf(stderr, "\nError in start_uring_engine() : Could not allocate space for resubmit list\n");
+        exit(EXIT_FAILURE);
+    }
+    volume->uring.ring_fd = ring_fd;
+
+    return true;
+
+}
+
+/********************************************************************
+Checks if start_uring_engine() succeeded
+********************************************************************/
+bool is_uring_engine_running(FAT32_volume* volume){
+
+    return volume->uring.ring_fd != -1;
+
+}
+
+/********************************************************************
+Queues a read for the rest of one request. The request's index is
+    stored in the entry so its completion can be matched to it
+********************************************************************/
+static void queue_uring_read(FAT32_volume* volume, FAT32_read_request* request, uint32_t request_number){
+
+    uint32_t tail = *volume->uring.sq_tail;
+    uint32_t index = tail & *volume->uring.sq_mask;
+    struct io_uring_sqe* sqe = &volume->uring.sqes[index];
+
+    size_t length = request->count - request->bytes_read;
+    if(length > volume->settings.max_io_size){
+        length = volume->settings.max_io_size;
+    }
+
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = volume->settings.use_direct_io ? volume->disk_image_direct_fd : volume->disk_image_fd;
+    sqe->off = request->offset + request->bytes_read;
+    sqe->addr = (uint64_t)(uintptr_t)((uint8_t*)request->buffer + request->bytes_read);
+    sqe->len = length;
+    sqe->user_data = request_number;
+
+    volume->uring.sq_array[index] = index;
+    __atomic_store_n(volume->uring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+}
+
+/********************************************************************
+Reads every request of the batch, keeping up to the queue depth of
+    reads in flight
+********************************************************************/
+void read_uring_batch(FAT32_volume* volume, FAT32_read_request* requests, uint32_t num_requests){
+
+    uint32_t next_request = 0, num_resubmit = 0, num_in_flight = 0, num_queued = 0;
+    uint32_t i;
+
+    for(i = 0; i < num_requests; i++){
+        requests[i].bytes_read = 0;
+        requests[i].is_done = (requests[i].count == 0);
+    }
+
+    pthread_mutex_lock(&volume->uring.lock);
+
+    while(true){
+
+        //Fill the queue, finishing short reads before starting new requests
+        while(num_in_flight + num_queued < volume->uring.queue_depth && num_resubmit > 0){
+            num_resubmit--;
+            queue_uring_read(volume, &requests[volume->uring.resubmit[num_resubmit]], volume->uring.resubmit[num_resubmit]);
+            num_queued++;
+        }
+        while(num_in_flight + num_queued < volume->uring.queue_depth && next_request < num_requests){
+            if(!requests[next_request].is_done){
+                queue_uring_read(volume, &requests[next_request], next_request);
+                num_queued++;
+            }
+            next_request++;
+        }
+
+        if(num_in_flight + num_queued == 0){
+            break;
+        }
+
+        //Submit the new reads and wait for at least one completion
+        int submitted = syscall(__NR_io_uring_enter, volume->uring.ring_fd, num_queued, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        count_stat(volume, STAT_READ_SYSCALLS, 1);
+        if(submitted == -1){
+            if(errno == EINTR || errno == EAGAIN || errno == EBUSY){
+                continue;
+            }
+            fprintf(stderr, "\nError in read_uring_batch() : io_uring_enter() returned -1 : %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        num_in_flight += submitted;
+        num_queued -= submitted;
+
+        //Reap completions, which can come back in any order
+        uint32_t head = *volume->uring.cq_head;
+        uint32_t tail = __atomic_load_n(volume->uring.cq_tail, __ATOMIC_ACQUIRE);
+        while(head != tail){
+            struct io_uring_cqe* cqe = &volume->uring.cqes[head & *volume->uring.cq_mask];
+            uint32_t request_number = (uint32_t)cqe->user_data;
+            FAT32_read_request* request = &requests[request_number];
+
+            if(cqe->res < 0 && cqe->res != -EINTR && cqe->res != -EAGAIN){
+                fprintf(stderr, "\nError in read_uring_batch() : read returned %d : %s\n", cqe->res, strerror(-cqe->res));
+                exit(EXIT_FAILURE);
+            }
+            if(cqe->res == 0){
+                //End of the disk image
+                request->is_done = true;
+            }else{
+                if(cqe->res > 0){
+                    request->bytes_read += cqe->res;
+                    count_stat(volume, STAT_BYTES_READ, cqe->res);
+                }
+                if(request->bytes_read >= request->count){
+                    request->is_done = true;
+                }else{
+                    volume->uring.resubmit[num_resubmit++] = request_number;
+                }
+            }
+
+            count_stat(volume, STAT_URING_READS, 1);
+            num_in_flight--;
+            head++;
+        }
+        __atomic_store_n(volume->uring.cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    pthread_mutex_unlock(&volume->uring.lock);
+
+}
+
+/********************************************************************
+Tears down the io_uring instance, if there is one
+********************************************************************/
+void stop_uring_engine(FAT32_volume* volume){
+
+    if(volume->uring.ring_fd == -1){
+        return;
+    }
+
+    munmap(volume->uring.sqes, volume->uring.sqes_size);
+    if(volume->uring.cq_ring != volume->uring.sq_ring){
+        munmap(volume->uring.cq_ring, volume->uring.cq_ring_size);
+    }
+    munmap(volume->uring.sq_ring, volume->uring.sq_ring_size);
+    close(volume->uring.ring_fd);
+    free(volume->uring.resubmit);
+
+    volume->uring.ring_fd = -1;
+
+}
+
+#pragma endregion Uring_Engine_Functions
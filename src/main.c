@@ -2,43 +2,120 @@
     Module: main.c
     Author: Brennan Couturier
 
-    Program that starts the shell
+    Program that starts the shell or the server, both clients of libfat32
 ********************************************************************/
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
 
-#include "../include/FAT32_io.h"
+#include "../include/FAT32_api.h"
 #include "../include/FAT32_disk_management.h"
+#include "../include/FAT32_io.h"
 #include "../include/FAT32_structs_globals.h"
+#include "../include/FAT32_stats.h"
 #include "../include/shell.h"
+#include "../include/server.h"
 
 int main(int argc, char* argv[]){
 
 
+    int option;
+    FAT32_settings settings;
+    char* socket_path = NULL;
+    char* digest_name;
+
+    //Parse the options
+    fat32_default_settings(&settings);
+    while((option = getopt(argc, argv, "m:Mc:b:j:uJ:iZDS:H:")) != -1){
+        switch(option){
+            case 'm':
+                settings.max_io_size = strtoull(optarg, NULL, 10);
+                break;
+            case 'M':
+                settings.use_mmap = true;
+                break;
+            case 'c':
+                settings.directory_cache_budget = strtoull(optarg, NULL, 10);
+                break;
+            case 'b':
+                settings.block_cache_budget = strtoull(optarg, NULL, 10);
+                break;
+            case 'j':
+                settings.num_threads = strtoul(optarg, NULL, 10);
+                break;
+            case 'u':
+                settings.use_io_uring = true;
+                break;
+            case 'J':
+                settings.stats_path = optarg;
+                break;
+            case 'i':
+                settings.use_index = true;
+                break;
+            case 'Z':
+                settings.use_zero_copy = false;
+                break;
+            case 'D':
+                settings.use_direct_io = true;
+                break;
+            case 'S':
+                socket_path = optarg;
+                break;
+            case 'H':
+                //A comma separated list of digests
+                for(digest_name = strtok(optarg, ","); digest_name != NULL; digest_name = strtok(NULL, ",")){
+                    if(strcmp(digest_name, "crc32c") == 0){
+                        settings.use_crc32c = true;
+                    }else if(strcmp(digest_name, "sha256") == 0){
+                        settings.use_sha256 = true;
+                    }else{
+                        optind = argc; //Force the usage message
+                    }
+                }
+                break;
+            default:
+                optind = argc; //Force the usage message
+                break;
+        }
+    }
+
     //Check if enough arguments were supplied
-    if(argc < 2){
-        fprintf(stderr, "Usage: \"%s <disk image file>\"\n", argv[0]);
+    if(optind >= argc || settings.max_io_size == 0 || settings.num_threads == 0){
+        fprintf(stderr, "Usage: \"%s [-m max read size in bytes] [-M] [-c directory cache size in bytes] [-b block cache size in bytes] [-j extraction threads] [-u] [-J statistics file] [-i] [-Z] [-D] [-H crc32c,sha256] <disk image file>\"\n", argv[0]);
+        fprintf(stderr, "       \"%s [options] -S <socket> <disk image file>...\"\n", argv[0]);
         exit(EXIT_FAILURE);
     }
-    
-    //open the disk image for reading and writing
-    open_disk_image(argv[1]);
 
-    //Read the important stuff
-    read_boot_sector();
-    read_FS_info();
-    read_root_directory();
+    //Serve every image given over the socket instead of starting the shell
+    if(socket_path != NULL){
+        run_server(socket_path, &argv[optind], argc - optind, &settings);
+        return EXIT_SUCCESS;
+    }
+
+    //open the disk image and read the important stuff, put needs to write to it
+    settings.use_write_access = true;
+    FAT32_volume* volume = fat32_mount(argv[optind], &settings);
+    if(volume == NULL){
+        fprintf(stderr, "\nError in main() : Could not mount %s : %s\n", argv[optind], strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    print_disk_image_info(volume);
+    FAT32_cursor* cursor = open_cursor(volume);
 
     //go into the shell loop
-    run_shell();
+    run_shell(cursor);
 
-    //Free memory and close files
-    free(boot_sector);
-    free(fs_info_sector);
-    free(root_directory);
+    if(settings.stats_path != NULL){
+        write_stats_json(&volume, 1, settings.stats_path);
+    }
 
-    close_disk_image();
+    //Free memory and close files
+    close_cursor(cursor);
+    fat32_unmount(volume);
+    fprintf(stdout, "Closed %s\n", argv[optind]);
 
     return EXIT_SUCCESS;
 }
\ No newline at end of file
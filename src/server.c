@@ -0,0 +1,494 @@
+/********************************************************************
+    Module: server.c
+    Author: Brennan Couturier
+
+    Long-running server answering list, stat and extract requests from
+    local clients over a Unix domain socket
+********************************************************************/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdbool.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "../include/server.h"
+#include "../include/FAT32_api.h"
+#include "../include/FAT32_io.h"
+#include "../include/FAT32_stats.h"
+
+static volatile sig_atomic_t stop_requested = 0;
+
+#pragma region Connection_Functions
+
+/********************************************************************
+Signal handler for SIGINT and SIGTERM, the accept loop checks the
+    flag when ppoll() is interrupted
+********************************************************************/
+static void request_stop(int signal_number){
+
+    stop_requested = 1;
+
+}
+
+/********************************************************************
+Reads exactly count bytes from the socket. Returns false if the
+    client closed the connection or the read failed
+********************************************************************/
+static bool read_fully(int fd, void* buffer, size_t count){
+
+    size_t total_read = 0;
+
+    while(total_read < count){
+        ssize_t bytes_read = read(fd, (uint8_t*)buffer + total_read, count - total_read);
+        if(bytes_read == -1 && errno == EINTR){
+            continue;
+        }
+        if(bytes_read <= 0){
+            return false;
+        }
+        total_read += bytes_read;
+    }
+
+    return true;
+
+}
+
+/********************************************************************
+Writes all count bytes of buffer to the socket. Returns false if the
+    client went away
+********************************************************************/
+static bool write_fully(int fd, const void* buffer, size_t count){
+
+    size_t total_written = 0;
+
+    while(total_written < count){
+        ssize_t bytes_written = write(fd, (const uint8_t*)buffer + total_written, count - total_written);
+        if(bytes_written == -1 && errno == EINTR){
+            continue;
+        }
+        if(bytes_written <= 0){
+            return false;
+        }
+        total_written += bytes_written;
+    }
+
+    return true;
+
+}
+
+/********************************************************************
+Sends the response header and length bytes of payload
+********************************************************************/
+static bool send_response(int fd, uint32_t status, const void* payload, uint32_t length){
+
+    FAT32_server_response response = { status, length };
+
+    return write_fully(fd, &response, sizeof(FAT32_server_response)) && (length == 0 || write_fully(fd, payload, length));
+
+}
+
+/********************************************************************
+Opens a memory stream the text of a response is written to. Returns
+    NULL if there is not enough memory, the server keeps running
+    and the request is answered with ENOMEM
+********************************************************************/
+static FILE* open_text_response(char** text_buffer, size_t* text_size){
+
+    FILE* text = open_memstream(text_buffer, text_size);
+    if(text == NULL){
+        fprintf(stderr, "\nError in open_text_response() : open_memstream() failed : %s\n", strerror(errno));
+    }
+
+    return text;
+
+}
+
+/********************************************************************
+Sends the text written to a memory stream as the payload of a
+    successful response, and frees it. If the stream ran out of
+    memory the request is answered with ENOMEM instead
+********************************************************************/
+static bool send_text_response(int fd, FILE* text, char** text_buffer, size_t* text_size){
+
+    bool is_sent;
+
+    if(fclose(text) != 0){
+        fprintf(stderr, "\nError in send_text_response() : Could not write the response : %s\n", strerror(errno));
+        is_sent = send_response(fd, ENOMEM, NULL, 0);
+    }else{
+        is_sent = send_response(fd, 0, *text_buffer, *text_size);
+    }
+    free(*text_buffer);
+
+    return is_sent;
+
+}
+
+/********************************************************************
+Adds a connection to the list shut down when the server stops
+********************************************************************/
+static void add_client(FAT32_server* server, int fd){
+
+    pthread_mutex_lock(&server->lock);
+
+    if(server->num_clients == server->client_capacity){
+        server->client_capacity = (server->client_capacity == 0) ? 16 : server->client_capacity * 2;
+        server->client_fds = realloc(server->client_fds, sizeof(int) * server->client_capacity);
+        if(server->client_fds == NULL){
+            fprintf(stderr, "\nError in add_client() : Could not grow client list\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    server->client_fds[server->num_clients++] = fd;
+
+    pthread_mutex_unlock(&server->lock);
+
+}
+
+/********************************************************************
+Removes a connection from the list and closes it. Closing under the
+    lock keeps the server from shutting down a reused descriptor
+********************************************************************/
+static void remove_client(FAT32_server* server, int fd){
+
+    uint32_t i;
+
+    pthread_mutex_lock(&server->lock);
+
+    for(i = 0; i < server->num_clients; i++){
+        if(server->client_fds[i] == fd){
+            server->client_fds[i] = server->client_fds[--server->num_clients];
+            break;
+        }
+    }
+    close(fd);
+    pthread_cond_signal(&server->client_closed);
+
+    pthread_mutex_unlock(&server->lock);
+
+}
+
+#pragma endregion Connection_Functions
+
+#pragma region Request_Functions
+
+/********************************************************************
+Writes one "NAME ATTRIBUTES FIRST_CLUSTER SIZE" line
+********************************************************************/
+static void write_file_info(FILE* text, FAT32_file_info* info){
+
+    fprintf(text, "%s %u %" PRIu32 " %" PRIu32 "\n", info->name, info->attributes, info->first_cluster, info->file_size);
+
+}
+
+/********************************************************************
+Answers one request. Lookups hold the lock of the volume, file data
+    is copied without it so one slow client does not hold up the
+    others. Returns false if the connection has to be closed
+********************************************************************/
+static bool handle_request(FAT32_server* server, int fd, char* request){
+
+    char* save_pointer;
+    char* command = strtok_r(request, " ", &save_pointer);
+    char* image = strtok_r(NULL, " ", &save_pointer);
+    char* path = strtok_r(NULL, "", &save_pointer);
+    char* text_buffer;
+    size_t text_size;
+    uint32_t i;
+
+    if(command == NULL){
+        return send_response(fd, EINVAL, NULL, 0);
+    }
+
+    if(strcmp(command, "images") == 0){
+        FILE* text = open_text_response(&text_buffer, &text_size);
+        if(text == NULL){
+            return send_response(fd, ENOMEM, NULL, 0);
+        }
+        for(i = 0; i < server->num_volumes; i++){
+            fprintf(text, "%" PRIu32 " %s\n", i, server->volumes[i]->disk_image_path);
+        }
+        return send_text_response(fd, text, &text_buffer, &text_size);
+    }
+
+    //Every other command works on one image, and the root directory if no path is given
+    char* end;
+    unsigned long volume_number = (image == NULL) ? server->num_volumes : strtoul(image, &end, 10);
+    if(volume_number >= server->num_volumes || *end != '\0'){
+        return send_response(fd, ENODEV, NULL, 0);
+    }
+    FAT32_volume* volume = server->volumes[volume_number];
+    pthread_mutex_t* volume_lock = &server->volume_locks[volume_number];
+    if(path == NULL){
+        path = "/";
+    }
+
+    if(strcmp(command, "stat") == 0){
+
+        FAT32_file_info info;
+
+        pthread_mutex_lock(volume_lock);
+        int error = (fat32_stat(volume, path, &info) == 0) ? 0 : errno;
+        pthread_mutex_unlock(volume_lock);
+
+        if(error != 0){
+            return send_response(fd, error, NULL, 0);
+        }
+        FILE* text = open_text_response(&text_buffer, &text_size);
+        if(text == NULL){
+            return send_response(fd, ENOMEM, NULL, 0);
+        }
+        write_file_info(text, &info);
+        return send_text_response(fd, text, &text_buffer, &text_size);
+
+    }else if(strcmp(command, "list") == 0){
+
+        FAT32_file_info info;
+
+        pthread_mutex_lock(volume_lock);
+        FAT32_directory_stream* stream = fat32_opendir(volume, path);
+        if(stream == NULL){
+            int error = errno;
+            pthread_mutex_unlock(volume_lock);
+            return send_response(fd, error, NULL, 0);
+        }
+        FILE* text = open_text_response(&text_buffer, &text_size);
+        if(text == NULL){
+            fat32_closedir(stream);
+            pthread_mutex_unlock(volume_lock);
+            return send_response(fd, ENOMEM, NULL, 0);
+        }
+        while(fat32_readdir(stream, &info)){
+            write_file_info(text, &info);
+        }
+        fat32_closedir(stream);
+        pthread_mutex_unlock(volume_lock);
+
+        return send_text_response(fd, text, &text_buffer, &text_size);
+
+    }else if(strcmp(command, "extract") == 0){
+
+        pthread_mutex_lock(volume_lock);
+        FAT32_file* file = fat32_open(volume, path);
+        int error = (file != NULL) ? 0 : errno;
+        pthread_mutex_unlock(volume_lock);
+
+        if(file == NULL){
+            return send_response(fd, error, NULL, 0);
+        }
+
+        //The payload is streamed, the connection is dropped if all of it could not be sent
+        FAT32_server_response response = { 0, file->file_size };
+        bool is_sent = write_fully(fd, &response, sizeof(FAT32_server_response))
+                    && fat32_extract_file(file, fd) == file->file_size;
+        fat32_close(file);
+
+        return is_sent;
+
+    }
+
+    return send_response(fd, EINVAL, NULL, 0);
+
+}
+
+/********************************************************************
+Thread serving one connection until the client closes it or sends
+    a malformed request
+********************************************************************/
+static void* serve_client(void* argument){
+
+    FAT32_server_client* client = (FAT32_server_client*)argument;
+    char request[SERVER_MAX_REQUEST + 1];
+    uint32_t length;
+
+    while(read_fully(client->fd, &length, sizeof(uint32_t)) && length <= SERVER_MAX_REQUEST
+          && read_fully(client->fd, request, length)){
+
+        //Accept requests typed with a trailing newline
+        request[length] = '\0';
+        if(length > 0 && request[length - 1] == '\n'){
+            request[length - 1] = '\0';
+        }
+
+        if(!handle_request(client->server, client->fd, request)){
+            break;
+        }
+    }
+
+    remove_client(client->server, client->fd);
+    free(client);
+
+    return NULL;
+
+}
+
+#pragma endregion Request_Functions
+
+#pragma region Server_Functions
+
+/********************************************************************
+Creates the listening socket at socket_path, replacing a socket left
+    behind by a server that did not stop cleanly
+********************************************************************/
+static int open_server_socket(char* socket_path){
+
+    struct sockaddr_un address;
+    struct stat socket_stat;
+
+    memset(&address, 0, sizeof(struct sockaddr_un));
+    address.sun_family = AF_UNIX;
+    if(strlen(socket_path) >= sizeof(address.sun_path)){
+        fprintf(stderr, "\nError in open_server_socket() : Socket path is too long : %s\n", socket_path);
+        exit(EXIT_FAILURE);
+    }
+    strcpy(address.sun_path, socket_path);
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(listen_fd == -1){
+        fprintf(stderr, "\nError in open_server_socket() : socket() failed : %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    if(stat(socket_path, &socket_stat) == 0 && S_ISSOCK(socket_stat.st_mode)){
+        unlink(socket_path);
+    }
+    if(bind(listen_fd, (struct sockaddr*)&address, sizeof(struct sockaddr_un)) == -1){
+        fprintf(stderr, "\nError in open_server_socket() : Could not bind %s : %s\n", socket_path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if(listen(listen_fd, SERVER_BACKLOG) == -1){
+        fprintf(stderr, "\nError in open_server_socket() : listen() failed : %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    return listen_fd;
+
+}
+
+/********************************************************************
+Mounts every image, then accepts connections until SIGINT or SIGTERM
+    and serves each on its own thread
+********************************************************************/
+void run_server(char* socket_path, char** image_paths, uint32_t num_images, FAT32_settings* settings){
+
+    FAT32_server server;
+    struct sigaction action;
+    sigset_t stop_signals, original_signals;
+    uint32_t i;
+
+    memset(&server, 0, sizeof(FAT32_server));
+    server.socket_path = socket_path;
+    server.num_volumes = num_images;
+    server.volumes = malloc(sizeof(FAT32_volume*) * num_images);
+    server.volume_locks = malloc(sizeof(pthread_mutex_t) * num_images);
+    if(server.volumes == NULL || server.volume_locks == NULL){
+        fprintf(stderr, "\nError in run_server() : Could not allocate space for the volumes\n");
+        exit(EXIT_FAILURE);
+    }
+    for(i = 0; i < num_images; i++){
+        server.volumes[i] = fat32_mount(image_paths[i], settings);
+        if(server.volumes[i] == NULL){
+            fprintf(stderr, "\nError in run_server() : Could not mount %s : %s\n", image_paths[i], strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        print_disk_image_info(server.volumes[i]);
+        pthread_mutex_init(&server.volume_locks[i], NULL);
+    }
+    pthread_mutex_init(&server.lock, NULL);
+    pthread_cond_init(&server.client_closed, NULL);
+
+    //Client threads inherit the blocked signals, so only ppoll() below is interrupted by them
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, &original_signals);
+    memset(&action, 0, sizeof(struct sigaction));
+    action.sa_handler = request_stop;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN); //Clients that go away mid-response make writes fail instead
+
+    server.listen_fd = open_server_socket(socket_path);
+    fprintf(stdout, "Serving %" PRIu32 " image(s) on %s\n", num_images, socket_path);
+    fflush(stdout);
+
+    struct pollfd listen_poll = { server.listen_fd, POLLIN, 0 };
+    while(!stop_requested){
+
+        if(ppoll(&listen_poll, 1, NULL, &original_signals) == -1){
+            if(errno != EINTR){
+                fprintf(stderr, "\nError in run_server() : ppoll() failed : %s\n", strerror(errno));
+                break;
+            }
+            continue;
+        }
+
+        int client_fd = accept4(server.listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if(client_fd == -1){
+            continue;
+        }
+
+        FAT32_server_client* client = malloc(sizeof(FAT32_server_client));
+        if(client == NULL){
+            fprintf(stderr, "\nError in run_server() : Could not allocate space for FAT32_server_client struct\n");
+            exit(EXIT_FAILURE);
+        }
+        client->server = &server;
+        client->fd = client_fd;
+        add_client(&server, client_fd);
+
+        pthread_t thread;
+        int error = pthread_create(&thread, NULL, serve_client, client);
+        if(error != 0){
+            fprintf(stderr, "\nError in run_server() : pthread_create() failed : %s\n", strerror(error));
+            remove_client(&server, client_fd);
+            free(client);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+
+    fprintf(stdout, "Stopping server\n");
+    close(server.listen_fd);
+    unlink(socket_path);
+
+    //Wake every connection up and wait for its thread to be done with the volumes
+    pthread_mutex_lock(&server.lock);
+    for(i = 0; i < server.num_clients; i++){
+        shutdown(server.client_fds[i], SHUT_RDWR);
+    }
+    while(server.num_clients > 0){
+        pthread_cond_wait(&server.client_closed, &server.lock);
+    }
+    pthread_mutex_unlock(&server.lock);
+
+    if(settings->stats_path != NULL){
+        write_stats_json(server.volumes, num_images, settings->stats_path);
+    }
+
+    for(i = 0; i < num_images; i++){
+        fat32_unmount(server.volumes[i]);
+        fprintf(stdout, "Closed %s\n", image_paths[i]);
+        pthread_mutex_destroy(&server.volume_locks[i]);
+    }
+    pthread_mutex_destroy(&server.lock);
+    pthread_cond_destroy(&server.client_closed);
+    pthread_sigmask(SIG_SETMASK, &original_signals, NULL);
+    free(server.volumes);
+    free(server.volume_locks);
+    free(server.client_fds);
+
+}
+
+#pragma endregion Server_Functions
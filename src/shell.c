@@ -14,23 +14,34 @@
 #include "../include/shell.h"
 #include "../include/FAT32_io.h"
 #include "../include/FAT32_disk_management.h"
+#include "../include/FAT32_stats.h"
+#include "../include/FAT32_traverse.h"
+#include "../include/FAT32_check.h"
 
 #define BUFFER_SIZE 256
 #define CMD_INFO "INFO"
 #define CMD_DIR "DIR"
 #define CMD_CD "CD"
 #define CMD_GET "GET"
+#define CMD_GET_RECURSIVE "-R" //Input is uppercased before it is parsed
 #define CMD_PUT "PUT"
+#define CMD_STATS "STATS"
+#define CMD_FREE "FREE"
+#define CMD_FIND "FIND"
+#define CMD_DU "DU"
+#define CMD_CHECK "CHECK"
 #define CMD_EXIT "EXIT"
 
 /********************************************************************
-Loop that reads user input and executes commands
+Loop that reads user input and executes commands, moving the cursor
+    around its volume
 ********************************************************************/
-void run_shell(){
+void run_shell(FAT32_cursor* cursor){
 
     int i;
     bool running = true;
     char input[BUFFER_SIZE];
+    char raw_input[BUFFER_SIZE]; //Input before it is uppercased, host paths are case sensitive
 
     while(running){
 
@@ -46,11 +57,15 @@ void run_shell(){
 
         //remove newline and make input uppercase
         input[strlen(input) - 1] = '\0';
+        strcpy(raw_input, input);
         for(i = 0; i < strlen(input) + 1; i++){
             input[i] = toupper(input[i]);
         }
 
-        //check input
+        //check input, timing everything but exit
+        uint64_t command_start = get_stat_time();
+        FAT32_stat_command command = STAT_COMMAND_OTHER;
+
         if(strncmp(input, CMD_EXIT , strlen(CMD_EXIT )) == 0){
 
             running = false;
@@ -58,6 +73,8 @@ void run_shell(){
 
         }else if(strncmp(input, CMD_CD , strlen(CMD_CD)) == 0){
 
+            command = STAT_COMMAND_CD;
+
             //Tokenize input
             char* save_ptr;
             __strtok_r(input, " ", &save_ptr); //diregard first token
@@ -66,33 +83,91 @@ void run_shell(){
             if(destination == NULL){
                 fprintf(stderr, "Usage: \"cd <directory>\"\n");
             }else{
-                change_directory(destination);
+                change_directory(cursor, destination);
             }
 
         }else if(strncmp(input, CMD_DIR , strlen(CMD_DIR )) == 0){
 
-            print_current_directory();
+            command = STAT_COMMAND_DIR;
+            print_current_directory(cursor);
 
         }else if(strncmp(input, CMD_INFO , strlen(CMD_INFO )) == 0){
 
-            print_boot_sector_info();
+            command = STAT_COMMAND_INFO;
+            print_boot_sector_info(cursor->volume);
 
         }else if(strncmp(input, CMD_GET , strlen(CMD_GET )) == 0){
 
+            command = STAT_COMMAND_GET;
+
             //Tokenize input
             char* save_ptr;
             __strtok_r(input, " ", &save_ptr); //diregard first token
             char* file_name = __strtok_r(NULL, " ", &save_ptr);
 
-            if(file_name == NULL){
-                fprintf(stderr, "Usage: \"get <file name>\"\n");
+            //"get -r <directory>" copies a whole subtree
+            if(file_name != NULL && strcmp(file_name, CMD_GET_RECURSIVE) == 0){
+                char* directory_name = __strtok_r(NULL, " ", &save_ptr);
+                if(directory_name == NULL){
+                    fprintf(stderr, "Usage: \"get -r <directory>\"\n");
+                }else{
+                    download_directory(cursor, directory_name);
+                }
+            }else if(file_name == NULL){
+                fprintf(stderr, "Usage: \"get <file name>\" or \"get -r <directory>\"\n");
             }else{
-                download_file(file_name);
+                download_file(cursor, file_name);
             }
 
         }else if(strncmp(input, CMD_PUT , strlen(CMD_PUT )) == 0){
 
-            fprintf(stderr, "\nCommand not implemented\n");
+            command = STAT_COMMAND_PUT;
+
+            //Tokenize the original input, keeping the case of the host path
+            char* save_ptr;
+            __strtok_r(raw_input, " ", &save_ptr); //diregard first token
+            char* host_path = __strtok_r(NULL, " ", &save_ptr);
+
+            if(host_path == NULL){
+                fprintf(stderr, "Usage: \"put <host file>\"\n");
+            }else{
+                upload_file(cursor, host_path);
+            }
+
+        }else if(strncmp(input, CMD_FREE , strlen(CMD_FREE )) == 0){
+
+            command = STAT_COMMAND_FREE;
+            print_free_space(cursor->volume);
+
+        }else if(strncmp(input, CMD_FIND , strlen(CMD_FIND )) == 0){
+
+            command = STAT_COMMAND_FIND;
+
+            //Tokenize input
+            char* save_ptr;
+            __strtok_r(input, " ", &save_ptr); //diregard first token
+            char* pattern = __strtok_r(NULL, " ", &save_ptr);
+
+            if(pattern == NULL){
+                fprintf(stderr, "Usage: \"find <pattern>\"\n");
+            }else{
+                find_entries(cursor, pattern);
+            }
+
+        }else if(strncmp(input, CMD_DU , strlen(CMD_DU )) == 0){
+
+            command = STAT_COMMAND_DU;
+            print_disk_usage(cursor);
+
+        }else if(strncmp(input, CMD_CHECK , strlen(CMD_CHECK )) == 0){
+
+            command = STAT_COMMAND_CHECK;
+            check_volume(cursor->volume);
+
+        }else if(strncmp(input, CMD_STATS , strlen(CMD_STATS )) == 0){
+
+            command = STAT_COMMAND_STATS;
+            print_stats(cursor->volume);
 
         }else{
 
@@ -100,6 +175,8 @@ void run_shell(){
 
         }
 
+        record_command_latency(cursor->volume, command, get_stat_time() - command_start);
+
     }
 
     fprintf(stdout, "\nExiting...\n");
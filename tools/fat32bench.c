@@ -0,0 +1,317 @@
+/********************************************************************
+    Module: fat32bench.c
+    Author: Brennan Couturier
+
+    Runs the file manager against a disk image with a fixed set of
+        shell scripts and reports time, throughput, system calls
+        and peak memory use for each of them
+********************************************************************/
+
+#define _GNU_SOURCE
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#define WORK_DIRECTORY_TEMPLATE "/tmp/fat32bench.XXXXXX" //The program runs here, so its ./files is not the user's
+#define CD_REPEATS 200
+
+#pragma region Structs
+
+/********************************************************************
+A shell script timed as one benchmark
+********************************************************************/
+typedef struct bench_scenario_struct{
+    char* name;
+    char* script; //NULL for the cd scenario, which is generated
+} bench_scenario;
+
+/********************************************************************
+What was measured for one run of a scenario
+********************************************************************/
+typedef struct bench_result_struct{
+    double wall_ms;
+    double user_ms;
+    double system_ms;
+    uint64_t read_syscalls; //syscr from /proc/<pid>/io
+    uint64_t write_syscalls; //syscw from /proc/<pid>/io
+    uint64_t bytes_read; //rchar from /proc/<pid>/io
+    uint64_t bytes_extracted; //Size of everything left in the output folder
+    long peak_rss_kb;
+} bench_result;
+
+#pragma endregion Structs
+
+static bench_scenario scenarios[] = {
+    { "info", "info\nexit\n" },
+    { "dir", "dir\nexit\n" },
+    { "cd", NULL },
+    { "get", "get F000000.BIN\nexit\n" },
+    { "traversal", "get -r .\nexit\n" },
+    { "du", "du\nexit\n" },
+};
+
+static uint64_t output_bytes;
+static char work_directory[] = WORK_DIRECTORY_TEMPLATE;
+static char output_folder[sizeof(WORK_DIRECTORY_TEMPLATE) + sizeof("/files")];
+
+#pragma region Helper_Functions
+
+/********************************************************************
+nftw() callback that removes everything under the folder it walks
+********************************************************************/
+static int remove_output_entry(const char* path, const struct stat* entry_stat, int type, struct FTW* ftw_info){
+
+    //Keep the folder itself
+    if(ftw_info->level == 0){
+        return 0;
+    }
+    if(remove(path) == -1){
+        fprintf(stderr, "\nError in remove_output_entry() : Could not remove %s : %s\n", path, strerror(errno));
+    }
+
+    return 0;
+
+}
+
+/********************************************************************
+nftw() callback that adds up the size of the extracted files
+********************************************************************/
+static int count_output_entry(const char* path, const struct stat* entry_stat, int type, struct FTW* ftw_info){
+
+    if(type == FTW_F){
+        output_bytes += entry_stat->st_size;
+    }
+
+    return 0;
+
+}
+
+/********************************************************************
+Reads the I/O counters of a process that has exited but not yet been
+    reaped. Leaves the counters at 0 if the kernel does not provide them
+********************************************************************/
+static void read_process_io(pid_t pid, bench_result* result){
+
+    char path[64];
+    char key[32];
+    uint64_t value;
+
+    snprintf(path, sizeof(path), "/proc/%d/io", (int)pid);
+    FILE* io_file = fopen(path, "r");
+    if(io_file == NULL){
+        return;
+    }
+
+    while(fscanf(io_file, "%31[^:]: %" SCNu64 "\n", key, &value) == 2){
+        if(strcmp(key, "syscr") == 0){
+            result->read_syscalls = value;
+        }else if(strcmp(key, "syscw") == 0){
+            result->write_syscalls = value;
+        }else if(strcmp(key, "rchar") == 0){
+            result->bytes_read = value;
+        }
+    }
+
+    fclose(io_file);
+
+}
+
+/********************************************************************
+Builds the cd script: walk into the first directory and back out
+    CD_REPEATS times
+********************************************************************/
+static char* build_cd_script(){
+
+    size_t step_length = strlen("cd DIR0001\ncd ..\n");
+    char* script = malloc(step_length * CD_REPEATS + strlen("exit\n") + 1);
+    int i;
+
+    if(script == NULL){
+        fprintf(stderr, "\nError in build_cd_script() : Could not allocate script\n");
+        exit(EXIT_FAILURE);
+    }
+
+    script[0] = '\0';
+    for(i = 0; i < CD_REPEATS; i++){
+        strcat(script, "cd DIR0001\ncd ..\n");
+    }
+    strcat(script, "exit\n");
+
+    return script;
+
+}
+
+#pragma endregion Helper_Functions
+
+#pragma region Bench_Functions
+
+/********************************************************************
+Runs the file manager once with script on its standard input and
+    measures it. It runs in the work directory, so it extracts into
+    a files folder of its own. Output from the program is thrown away
+********************************************************************/
+static void run_scenario(char** program_argv, char* script, bench_result* result){
+
+    int script_pipe[2];
+    struct timespec start, end;
+    struct rusage usage;
+    siginfo_t info;
+    int status;
+
+    memset(result, 0, sizeof(bench_result));
+    nftw(output_folder, remove_output_entry, 16, FTW_DEPTH | FTW_PHYS);
+
+    if(pipe(script_pipe) == -1){
+        fprintf(stderr, "\nError in run_scenario() : pipe() returned -1 : %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pid_t pid = fork();
+    if(pid == -1){
+        fprintf(stderr, "\nError in run_scenario() : fork() returned -1 : %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if(pid == 0){
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(script_pipe[0], STDIN_FILENO);
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        close(script_pipe[0]);
+        close(script_pipe[1]);
+        close(null_fd);
+        if(chdir(work_directory) == -1){
+            _exit(127);
+        }
+        execv(program_argv[0], program_argv);
+        _exit(127);
+    }
+
+    //The script is small enough to fit in the pipe, so this never blocks on the child
+    close(script_pipe[0]);
+    signal(SIGPIPE, SIG_IGN);
+    if(write(script_pipe[1], script, strlen(script)) == -1 && errno != EPIPE){
+        fprintf(stderr, "\nError in run_scenario() : write() returned -1 : %s\n", strerror(errno));
+    }
+    close(script_pipe[1]);
+
+    //Wait without reaping so /proc/<pid>/io can still be read
+    if(waitid(P_PID, pid, &info, WEXITED | WNOWAIT) == 0){
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        read_process_io(pid, result);
+    }else{
+        clock_gettime(CLOCK_MONOTONIC, &end);
+    }
+    wait4(pid, &status, 0, &usage);
+
+    if(!WIFEXITED(status) || WEXITSTATUS(status) != 0){
+        fprintf(stderr, "Warning: %s did not exit cleanly (status %#x)\n", program_argv[0], status);
+    }
+
+    result->wall_ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+    result->user_ms = usage.ru_utime.tv_sec * 1e3 + usage.ru_utime.tv_usec / 1e3;
+    result->system_ms = usage.ru_stime.tv_sec * 1e3 + usage.ru_stime.tv_usec / 1e3;
+    result->peak_rss_kb = usage.ru_maxrss;
+
+    output_bytes = 0;
+    nftw(output_folder, count_output_entry, 16, FTW_PHYS);
+    result->bytes_extracted = output_bytes;
+
+}
+
+#pragma endregion Bench_Functions
+
+int main(int argc, char* argv[]){
+
+    int option;
+    int num_runs = 3;
+    uint32_t i;
+    int run;
+
+    while((option = getopt(argc, argv, "+n:")) != -1){
+        switch(option){
+            case 'n':
+                num_runs = atoi(optarg);
+                break;
+            default:
+                optind = argc;
+                break;
+        }
+    }
+
+    //Everything after the program is passed through to it, the disk image last
+    if(argc - optind < 2 || num_runs <= 0){
+        fprintf(stderr, "Usage: \"%s [-n runs] <fat32 program> [program options] <disk image file>\"\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    char** program_argv = &argv[optind];
+    char* cd_script = build_cd_script();
+    char program_path[PATH_MAX], image_path[PATH_MAX];
+
+    //The program runs in the work directory, so it gets absolute paths to itself and the image
+    if(realpath(program_argv[0], program_path) == NULL || realpath(argv[argc - 1], image_path) == NULL){
+        fprintf(stderr, "\nError in main() : Could not resolve %s or %s : %s\n", program_argv[0], argv[argc - 1], strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    program_argv[0] = program_path;
+    argv[argc - 1] = image_path;
+
+    if(mkdtemp(work_directory) == NULL){
+        fprintf(stderr, "\nError in main() : Could not create a work directory : %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    sprintf(output_folder, "%s/files", work_directory);
+    if(mkdir(output_folder, 0777) == -1){
+        fprintf(stderr, "\nError in main() : Could not create %s : %s\n", output_folder, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    fprintf(stdout, "%s: best of %d runs\n", argv[argc - 1], num_runs);
+    fprintf(stdout, "%-10s %10s %10s %10s %10s %10s %12s %10s %10s\n",
+            "scenario", "wall ms", "user ms", "sys ms", "read sc", "write sc", "extracted", "MB/s", "peak KB");
+
+    for(i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++){
+        char* script = (scenarios[i].script != NULL) ? scenarios[i].script : cd_script;
+        bench_result best;
+        bench_result result;
+
+        //Keep the fastest run, the others are mostly noise from the page cache warming up
+        for(run = 0; run < num_runs; run++){
+            run_scenario(program_argv, script, &result);
+            if(run == 0 || result.wall_ms < best.wall_ms){
+                best = result;
+            }
+        }
+
+        double throughput = (best.wall_ms > 0) ? (best.bytes_extracted / (1024.0 * 1024.0)) / (best.wall_ms / 1e3) : 0;
+        fprintf(stdout, "%-10s %10.2f %10.2f %10.2f %10" PRIu64 " %10" PRIu64 " %12" PRIu64 " %10.1f %10ld\n",
+                scenarios[i].name, best.wall_ms, best.user_ms, best.system_ms, best.read_syscalls,
+                best.write_syscalls, best.bytes_extracted, throughput, best.peak_rss_kb);
+    }
+
+    //Remove the work directory and everything the program left in it
+    nftw(work_directory, remove_output_entry, 16, FTW_DEPTH | FTW_PHYS);
+    if(rmdir(work_directory) == -1){
+        fprintf(stderr, "\nError in main() : Could not remove %s : %s\n", work_directory, strerror(errno));
+    }
+    free(cd_script);
+
+    return EXIT_SUCCESS;
+
+}
@@ -0,0 +1,174 @@
+/********************************************************************
+    Module: fat32client.c
+    Author: Brennan Couturier
+
+    Sends requests to a file manager started with -S and writes the
+        payload of each response to stdout
+********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <inttypes.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "FAT32_structs_globals.h"
+
+#define REQUEST_SIZE 4096
+#define COPY_BUFFER_SIZE (1 << 20)
+
+#pragma region Connection_Functions
+
+/********************************************************************
+Reads exactly count bytes from the socket. Returns false if the
+    server closed the connection
+********************************************************************/
+static bool read_fully(int fd, void* buffer, size_t count){
+
+    size_t total_read = 0;
+
+    while(total_read < count){
+        ssize_t bytes_read = read(fd, (uint8_t*)buffer + total_read, count - total_read);
+        if(bytes_read == -1 && errno == EINTR){
+            continue;
+        }
+        if(bytes_read <= 0){
+            return false;
+        }
+        total_read += bytes_read;
+    }
+
+    return true;
+
+}
+
+/********************************************************************
+Writes all count bytes of buffer to fd
+********************************************************************/
+static bool write_fully(int fd, const void* buffer, size_t count){
+
+    size_t total_written = 0;
+
+    while(total_written < count){
+        ssize_t bytes_written = write(fd, (const uint8_t*)buffer + total_written, count - total_written);
+        if(bytes_written == -1 && errno == EINTR){
+            continue;
+        }
+        if(bytes_written <= 0){
+            return false;
+        }
+        total_written += bytes_written;
+    }
+
+    return true;
+
+}
+
+/********************************************************************
+Connects to the server listening on socket_path
+********************************************************************/
+static int connect_server(char* socket_path){
+
+    struct sockaddr_un address;
+
+    memset(&address, 0, sizeof(struct sockaddr_un));
+    address.sun_family = AF_UNIX;
+    if(strlen(socket_path) >= sizeof(address.sun_path)){
+        fprintf(stderr, "Socket path is too long : %s\n", socket_path);
+        exit(EXIT_FAILURE);
+    }
+    strcpy(address.sun_path, socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd == -1 || connect(fd, (struct sockaddr*)&address, sizeof(struct sockaddr_un)) == -1){
+        fprintf(stderr, "Could not connect to %s : %s\n", socket_path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    return fd;
+
+}
+
+/********************************************************************
+Sends one request and copies the payload of its response to stdout.
+    Returns false if the request failed
+********************************************************************/
+static bool send_request(int fd, char* request){
+
+    FAT32_server_response response;
+    uint32_t length = strlen(request);
+    static uint8_t buffer[COPY_BUFFER_SIZE];
+
+    if(!write_fully(fd, &length, sizeof(uint32_t)) || !write_fully(fd, request, length)
+       || !read_fully(fd, &response, sizeof(FAT32_server_response))){
+        fprintf(stderr, "Connection to the server was lost\n");
+        exit(EXIT_FAILURE);
+    }
+
+    while(response.length > 0){
+        size_t count = (response.length < COPY_BUFFER_SIZE) ? response.length : COPY_BUFFER_SIZE;
+        if(!read_fully(fd, buffer, count)){
+            fprintf(stderr, "Connection to the server was lost\n");
+            exit(EXIT_FAILURE);
+        }
+        write_fully(STDOUT_FILENO, buffer, count);
+        response.length -= count;
+    }
+
+    if(response.status != 0){
+        fprintf(stderr, "%s : %s\n", request, strerror(response.status));
+        return false;
+    }
+
+    return true;
+
+}
+
+#pragma endregion Connection_Functions
+
+int main(int argc, char* argv[]){
+
+    char request[REQUEST_SIZE];
+    bool all_succeeded = true;
+    int i;
+
+    if(argc < 3){
+        fprintf(stderr, "Usage: \"%s <socket> <images|stat|list|extract> [image] [path]\"\n", argv[0]);
+        fprintf(stderr, "       \"%s <socket> -\" sends one request per line of stdin\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    int fd = connect_server(argv[1]);
+
+    if(strcmp(argv[2], "-") == 0){
+        //Many requests over one connection
+        while(fgets(request, REQUEST_SIZE, stdin) != NULL){
+            request[strcspn(request, "\n")] = '\0';
+            if(request[0] != '\0'){
+                all_succeeded &= send_request(fd, request);
+            }
+        }
+    }else{
+        request[0] = '\0';
+        for(i = 2; i < argc; i++){
+            if(strlen(request) + strlen(argv[i]) + 2 > REQUEST_SIZE){
+                fprintf(stderr, "Request is too long\n");
+                exit(EXIT_FAILURE);
+            }
+            strcat(request, argv[i]);
+            if(i + 1 < argc){
+                strcat(request, " ");
+            }
+        }
+        all_succeeded = send_request(fd, request);
+    }
+
+    close(fd);
+
+    return all_succeeded ? EXIT_SUCCESS : EXIT_FAILURE;
+
+}
@@ -0,0 +1,702 @@
+/********************************************************************
+    Module: mkfat32image.c
+    Author: Brennan Couturier
+
+    Generates synthetic FAT32 disk images with controllable geometry,
+        directory layout, file sizes and fragmentation, for testing
+        and benchmarking the file manager
+********************************************************************/
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <ctype.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "../include/FAT32_structs_globals.h"
+
+#define ENTRY_SIZE 32
+#define LFN_ATTR 0x0F
+#define DIR_ATTR 0x10
+#define VOLUME_ID_ATTR 0x08
+#define ARCHIVE_ATTR 0x20
+
+#pragma region Structs
+
+/********************************************************************
+Options controlling the generated image
+********************************************************************/
+typedef struct image_options_struct{
+    char* output_path;
+    char* extract_path;
+    uint64_t image_size;
+    uint16_t bytes_per_sector;
+    uint8_t sectors_per_cluster;
+    uint32_t FAT_size; //0 picks the smallest FAT that covers the image
+    uint32_t num_files;
+    uint32_t fan_out;
+    uint32_t depth;
+    uint64_t min_file_size;
+    uint64_t max_file_size;
+    uint32_t fragmentation;
+    uint32_t seed;
+    bool long_names;
+} image_options;
+
+/********************************************************************
+A directory being laid out in the image
+********************************************************************/
+typedef struct image_directory_struct{
+    char name[12];
+    char host_path[4096];
+    uint32_t first_cluster;
+    uint32_t parent_index;
+    uint32_t num_entries;
+    uint32_t capacity;
+    uint8_t* entries;
+} image_directory;
+
+#pragma endregion Structs
+
+#pragma region Globals
+
+static image_options options;
+static int image_fd;
+static uint32_t* FAT;
+static uint32_t num_clusters;
+static uint32_t next_cluster = 2;
+static uint32_t first_data_sector;
+static uint32_t cluster_size;
+static uint64_t rng_state;
+
+static image_directory* directories;
+static uint32_t num_directories;
+
+#pragma endregion Globals
+
+#pragma region Helper_Functions
+
+/********************************************************************
+xorshift64* pseudo random number generator, so images are
+    reproducible for a given seed
+********************************************************************/
+static uint64_t next_random(){
+
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+
+    return rng_state * 0x2545F4914F6CDD1DULL;
+
+}
+
+/********************************************************************
+Parse a size with an optional K, M or G suffix
+********************************************************************/
+static uint64_t parse_size(char* text){
+
+    char* end;
+    uint64_t value = strtoull(text, &end, 10);
+
+    switch(toupper(*end)){
+        case 'G': value <<= 10; //fall through
+        case 'M': value <<= 10; //fall through
+        case 'K': value <<= 10; break;
+        default: break;
+    }
+
+    return value;
+
+}
+
+/********************************************************************
+Write count bytes at offset into the image, exit on failure
+********************************************************************/
+static void write_image(const void* buffer, size_t count, off_t offset){
+
+    const uint8_t* bytes = buffer;
+
+    while(count > 0){
+        ssize_t written = pwrite(image_fd, bytes, count, offset);
+        if(written == -1){
+            fprintf(stderr, "\nError in write_image() : pwrite() returned -1 : %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        bytes += written;
+        offset += written;
+        count -= written;
+    }
+
+}
+
+/********************************************************************
+Byte offset of the given cluster in the image
+********************************************************************/
+static off_t cluster_offset(uint32_t cluster_number){
+
+    return ((off_t)(cluster_number - 2) * options.sectors_per_cluster + first_data_sector)
+            * options.bytes_per_sector;
+
+}
+
+/********************************************************************
+Allocate a chain of clusters large enough to hold size bytes. With
+    fragmentation enabled, the allocation cursor randomly skips
+    ahead, leaving holes and splitting the chain into extents
+********************************************************************/
+static uint32_t allocate_chain(uint64_t size){
+
+    uint64_t count = (size + cluster_size - 1) / cluster_size;
+    uint32_t first = 0;
+    uint32_t previous = 0;
+    uint64_t i;
+
+    if(count == 0){
+        return 0;
+    }
+
+    for(i = 0; i < count; i++){
+        if(i > 0 && options.fragmentation > 0 && (next_random() % 100) < options.fragmentation){
+            next_cluster += 1 + (next_random() % 8);
+        }
+        if(next_cluster >= num_clusters + 2){
+            fprintf(stderr, "\nError in allocate_chain() : Image is full, use a larger size (-s)\n");
+            exit(EXIT_FAILURE);
+        }
+
+        if(previous == 0){
+            first = next_cluster;
+        }else{
+            FAT[previous] = next_cluster;
+        }
+        previous = next_cluster;
+        next_cluster++;
+    }
+    FAT[previous] = FAT_ENTRY_MASK;
+
+    return first;
+
+}
+
+/********************************************************************
+Checksum of an 8.3 name, stored in each long name entry
+********************************************************************/
+static uint8_t short_name_checksum(const char* name){
+
+    uint8_t sum = 0;
+    int i;
+
+    for(i = 0; i < 11; i++){
+        sum = ((sum & 1) ? 0x80 : 0) + (sum >> 1) + (uint8_t)name[i];
+    }
+
+    return sum;
+
+}
+
+/********************************************************************
+Append a raw 32 byte entry to a directory
+********************************************************************/
+static void append_raw_entry(image_directory* directory, const uint8_t* entry){
+
+    if(directory->num_entries == directory->capacity){
+        directory->capacity = directory->capacity ? directory->capacity * 2 : 64;
+        directory->entries = realloc(directory->entries, (size_t)directory->capacity * ENTRY_SIZE);
+        if(directory->entries == NULL){
+            fprintf(stderr, "\nError in append_raw_entry() : Could not grow directory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    memcpy(directory->entries + (size_t)directory->num_entries * ENTRY_SIZE, entry, ENTRY_SIZE);
+    directory->num_entries++;
+
+}
+
+/********************************************************************
+Append a short entry, preceded by a long name entry holding the
+    lowercase version of the name when long names are enabled
+********************************************************************/
+static void append_entry(image_directory* directory, const char* short_name,
+                            uint8_t attributes, uint32_t first_cluster, uint32_t size){
+
+    uint8_t raw[ENTRY_SIZE];
+
+    if(options.long_names && attributes != VOLUME_ID_ATTR && short_name[0] != '.'){
+        //Rebuild "name.ext" in lowercase from the padded short name
+        char long_name[13];
+        int length = 0;
+        int i;
+        for(i = 0; i < 8 && short_name[i] != ' '; i++){
+            long_name[length++] = tolower(short_name[i]);
+        }
+        if(short_name[8] != ' '){
+            long_name[length++] = '.';
+            for(i = 8; i < 11 && short_name[i] != ' '; i++){
+                long_name[length++] = tolower(short_name[i]);
+            }
+        }
+
+        static const int character_offsets[13] = {1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30};
+        memset(raw, 0, ENTRY_SIZE);
+        raw[0] = 0x41; //first and last long entry, ordinal 1
+        raw[11] = LFN_ATTR;
+        raw[13] = short_name_checksum(short_name);
+        for(i = 0; i < 13; i++){
+            uint16_t character = (i < length) ? (uint8_t)long_name[i] : (i == length ? 0x0000 : 0xFFFF);
+            raw[character_offsets[i]] = character & 0xFF;
+            raw[character_offsets[i] + 1] = character >> 8;
+        }
+        append_raw_entry(directory, raw);
+    }
+
+    FAT32_Directory_Entry* entry = (FAT32_Directory_Entry*)raw;
+    memset(raw, 0, ENTRY_SIZE);
+    memcpy(entry->DIR_Name, short_name, 11);
+    entry->DIR_Attr = attributes;
+    entry->DIR_CrtDate = entry->DIR_WrtDate = entry->DIR_LstAccDate = (46 << 9) | (10 << 5) | 17;
+    entry->DIR_FstClusHI = first_cluster >> 16;
+    entry->DIR_FstClusLO = first_cluster & 0xFFFF;
+    entry->DIR_FileSize = size;
+    append_raw_entry(directory, raw);
+
+}
+
+/********************************************************************
+Format a padded 8.3 name from a base name and extension
+********************************************************************/
+static void make_short_name(char* out, const char* base, const char* extension){
+
+    memset(out, ' ', 11);
+    memcpy(out, base, strnlen(base, 8));
+    memcpy(out + 8, extension, strnlen(extension, 3));
+    out[11] = '\0';
+
+}
+
+/********************************************************************
+Create a directory on the host for the extracted copy of the tree
+********************************************************************/
+static void make_host_directory(const char* path){
+
+    if(mkdir(path, 0777) == -1 && errno != EEXIST){
+        fprintf(stderr, "\nError in make_host_directory() : Could not create %s : %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+}
+
+#pragma endregion Helper_Functions
+
+#pragma region Layout_Functions
+
+/********************************************************************
+Build the directory tree breadth first: every directory gets
+    fan_out subdirectories until the requested depth is reached
+********************************************************************/
+static void build_directory_tree(){
+
+    uint32_t total = 1;
+    uint32_t level_size = 1;
+    uint32_t level;
+    uint32_t i;
+
+    for(level = 0; level < options.depth; level++){
+        level_size *= options.fan_out;
+        total += level_size;
+    }
+
+    directories = calloc(total, sizeof(image_directory));
+    if(directories == NULL){
+        fprintf(stderr, "\nError in build_directory_tree() : Could not allocate directories\n");
+        exit(EXIT_FAILURE);
+    }
+
+    //Root directory
+    num_directories = 1;
+    make_short_name(directories[0].name, "ROOT", "");
+    char label[12];
+    make_short_name(label, "SYNTHETI", "C");
+    append_entry(&directories[0], label, VOLUME_ID_ATTR, 0, 0);
+    if(options.extract_path != NULL){
+        snprintf(directories[0].host_path, sizeof(directories[0].host_path), "%s", options.extract_path);
+        make_host_directory(directories[0].host_path);
+    }
+
+    uint32_t level_start = 0;
+    uint32_t level_end = 1;
+    for(level = 0; level < options.depth; level++){
+        for(i = level_start; i < level_end; i++){
+            uint32_t child;
+            for(child = 0; child < options.fan_out; child++){
+                image_directory* directory = &directories[num_directories];
+                char base[16];
+                snprintf(base, sizeof(base), "DIR%04" PRIu32, num_directories % 10000);
+                make_short_name(directory->name, base, "");
+                directory->parent_index = i;
+                if(options.extract_path != NULL){
+                    char host_path[sizeof(directory->host_path)];
+                    snprintf(host_path, sizeof(host_path), "%.4000s/%s", directories[i].host_path, base);
+                    memcpy(directory->host_path, host_path, sizeof(host_path));
+                    make_host_directory(directory->host_path);
+                }
+                num_directories++;
+            }
+        }
+        level_start = level_end;
+        level_end = num_directories;
+    }
+
+}
+
+/********************************************************************
+Allocate the files round robin across all the directories, writing
+    their contents into the image (and the host copy, if requested)
+********************************************************************/
+static void lay_out_files(){
+
+    uint8_t* buffer = malloc(cluster_size);
+    uint32_t i;
+
+    if(buffer == NULL){
+        fprintf(stderr, "\nError in lay_out_files() : Could not allocate buffer\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for(i = 0; i < options.num_files; i++){
+        image_directory* directory = &directories[i % num_directories];
+        uint64_t size = options.min_file_size;
+        if(options.max_file_size > options.min_file_size){
+            size += next_random() % (options.max_file_size - options.min_file_size + 1);
+        }
+        if(size > UINT32_MAX){
+            size = UINT32_MAX;
+        }
+
+        char base[16];
+        char short_name[12];
+        snprintf(base, sizeof(base), "F%06" PRIu32, i % 1000000);
+        make_short_name(short_name, base, "BIN");
+
+        uint32_t first_cluster = allocate_chain(size);
+        append_entry(directory, short_name, ARCHIVE_ATTR, first_cluster, (uint32_t)size);
+
+        int host_fd = -1;
+        if(options.extract_path != NULL){
+            char host_path[4200];
+            snprintf(host_path, sizeof(host_path), "%s/%s.BIN", directory->host_path, base);
+            host_fd = open(host_path, O_CREAT | O_TRUNC | O_WRONLY, 0666);
+            if(host_fd == -1){
+                fprintf(stderr, "\nError in lay_out_files() : Could not create %s : %s\n", host_path, strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        //Fill every cluster with a pattern unique to the file and position
+        uint32_t cluster = first_cluster;
+        uint64_t remaining = size;
+        uint64_t position = 0;
+        while(remaining > 0){
+            uint64_t count = remaining < cluster_size ? remaining : cluster_size;
+            uint64_t j;
+            for(j = 0; j < cluster_size; j += 8){
+                uint64_t word = ((uint64_t)i << 40) ^ (position + j) ^ options.seed;
+                memcpy(buffer + j, &word, 8);
+            }
+            write_image(buffer, cluster_size, cluster_offset(cluster));
+            if(host_fd != -1 && write(host_fd, buffer, count) != (ssize_t)count){
+                fprintf(stderr, "\nError in lay_out_files() : Could not write host copy\n");
+                exit(EXIT_FAILURE);
+            }
+            remaining -= count;
+            position += count;
+            cluster = FAT[cluster];
+        }
+
+        if(host_fd != -1){
+            close(host_fd);
+        }
+    }
+
+    free(buffer);
+
+}
+
+/********************************************************************
+Give every directory its entries and clusters, then write them out.
+    Children are allocated before their parents are written so the
+    parent entries can point at them
+********************************************************************/
+static void lay_out_directories(){
+
+    uint32_t i;
+
+    //Allocate every directory's first cluster up front so '.' and '..' can be filled in
+    directories[0].first_cluster = allocate_chain(cluster_size);
+    for(i = 1; i < num_directories; i++){
+        directories[i].first_cluster = allocate_chain(cluster_size);
+    }
+
+    for(i = 1; i < num_directories; i++){
+        image_directory* directory = &directories[i];
+        image_directory* parent = &directories[directory->parent_index];
+        char dot[12];
+        char dotdot[12];
+        make_short_name(dot, ".", "");
+        make_short_name(dotdot, "..", "");
+
+        //'.' and '..' come first, prepend them
+        image_directory prefix = {0};
+        append_entry(&prefix, dot, DIR_ATTR, directory->first_cluster, 0);
+        append_entry(&prefix, dotdot, DIR_ATTR, (parent == &directories[0]) ? 0 : parent->first_cluster, 0);
+        uint32_t j;
+        for(j = 0; j < directory->num_entries; j++){
+            append_raw_entry(&prefix, directory->entries + (size_t)j * ENTRY_SIZE);
+        }
+        free(directory->entries);
+        directory->entries = prefix.entries;
+        directory->num_entries = prefix.num_entries;
+        directory->capacity = prefix.capacity;
+
+        append_entry(parent, directory->name, DIR_ATTR, directory->first_cluster, 0);
+    }
+
+    //Grow each chain to fit its entries plus the end marker, then write it
+    uint8_t* zero = calloc(1, cluster_size);
+    for(i = 0; i < num_directories; i++){
+        image_directory* directory = &directories[i];
+        uint64_t bytes = ((uint64_t)directory->num_entries + 1) * ENTRY_SIZE;
+        uint32_t cluster = directory->first_cluster;
+        uint64_t written = 0;
+
+        while(true){
+            uint64_t count = bytes - written < cluster_size ? bytes - written : cluster_size;
+            write_image(zero, cluster_size, cluster_offset(cluster));
+            if(written < (uint64_t)directory->num_entries * ENTRY_SIZE){
+                uint64_t used = (uint64_t)directory->num_entries * ENTRY_SIZE - written;
+                write_image(directory->entries + written, used < count ? used : count, cluster_offset(cluster));
+            }
+            written += count;
+            if(written >= bytes){
+                break;
+            }
+            uint32_t extension = allocate_chain(cluster_size);
+            FAT[cluster] = extension;
+            cluster = extension;
+        }
+        free(directory->entries);
+    }
+    free(zero);
+
+}
+
+/********************************************************************
+Write the boot sector, its backup, FSInfo and every FAT copy
+********************************************************************/
+static void write_metadata(uint32_t FAT_size, uint32_t total_sectors){
+
+    FAT32_BS boot;
+    FAT32_FSInfo info;
+    uint32_t free_count = 0;
+    uint32_t i;
+
+    memset(&boot, 0, sizeof(boot));
+    boot.BS_jmpBoot[0] = 0xEB;
+    boot.BS_jmpBoot[1] = 0x58;
+    boot.BS_jmpBoot[2] = 0x90;
+    memcpy(boot.BS_OEMName, "MKFAT32 ", BS_OEMName_LENGTH);
+    boot.BPB_BytesPerSec = options.bytes_per_sector;
+    boot.BPB_SecPerClus = options.sectors_per_cluster;
+    boot.BPB_RsvdSecCnt = 32;
+    boot.BPB_NumFATs = 2;
+    boot.BPB_Media = 0xF8;
+    boot.BPB_SecPerTrk = 63;
+    boot.BPB_NumHeads = 255;
+    boot.BPB_TotSec32 = total_sectors;
+    boot.BPB_FATSz32 = FAT_size;
+    boot.BPB_RootClus = directories[0].first_cluster;
+    boot.BPB_FSInfo = 1;
+    boot.BPB_BkBootSec = 6;
+    boot.BS_DrvNum = 0x80;
+    boot.BS_BootSig = 0x29;
+    boot.BS_VolID = (uint32_t)options.seed;
+    memcpy(boot.BS_VolLab, "SYNTHETIC  ", BS_VolLab_LENGTH);
+    memcpy(boot.BS_FilSysType, "FAT32   ", BS_FilSysType_LENGTH);
+    boot.BS_SigA = 0x55;
+    boot.BS_SigB = 0xAA;
+
+    write_image(&boot, sizeof(boot), 0);
+    write_image(&boot, sizeof(boot), (off_t)6 * options.bytes_per_sector);
+
+    for(i = 2; i < num_clusters + 2; i++){
+        if(FAT[i] == 0){
+            free_count++;
+        }
+    }
+
+    memset(&info, 0, sizeof(info));
+    info.FSI_LeadSig = 0x41615252;
+    info.FSI_StrucSig = 0x61417272;
+    info.FSI_Free_Count = free_count;
+    info.FSI_Nxt_Free = next_cluster;
+    info.FSI_TrailSig = 0xAA550000;
+    write_image(&info, sizeof(info), options.bytes_per_sector);
+
+    FAT[0] = 0x0FFFFF00 | boot.BPB_Media;
+    FAT[1] = FAT_ENTRY_MASK;
+    for(i = 0; i < boot.BPB_NumFATs; i++){
+        off_t offset = ((off_t)boot.BPB_RsvdSecCnt + (off_t)i * FAT_size) * options.bytes_per_sector;
+        write_image(FAT, (size_t)FAT_size * options.bytes_per_sector, offset);
+    }
+
+}
+
+#pragma endregion Layout_Functions
+
+/********************************************************************
+Print the command line options
+********************************************************************/
+static void usage(char* program){
+
+    fprintf(stderr,
+        "Usage: \"%s [options] <output image>\"\n"
+        "  -s <size>     Image size, K/M/G suffixes allowed (default 512M)\n"
+        "  -b <bytes>    Bytes per sector (default 512)\n"
+        "  -c <sectors>  Sectors per cluster (default 8)\n"
+        "  -S <sectors>  Sectors per FAT (default: smallest that covers the image)\n"
+        "  -n <count>    Number of files (default 100)\n"
+        "  -w <count>    Subdirectories per directory (default 4)\n"
+        "  -d <depth>    Directory tree depth (default 2)\n"
+        "  -f <min[:max]> File size range (default 64K)\n"
+        "  -F <percent>  Chance of a gap between two clusters of a file (default 0)\n"
+        "  -r <seed>     Random seed (default 1)\n"
+        "  -L            Do not write long name entries\n"
+        "  -x <dir>      Also write a host copy of the tree into dir\n",
+        program);
+
+}
+
+int main(int argc, char* argv[]){
+
+    int option;
+
+    options.image_size = 512ULL << 20;
+    options.bytes_per_sector = 512;
+    options.sectors_per_cluster = 8;
+    options.num_files = 100;
+    options.fan_out = 4;
+    options.depth = 2;
+    options.min_file_size = options.max_file_size = 64 << 10;
+    options.seed = 1;
+    options.long_names = true;
+
+    while((option = getopt(argc, argv, "s:b:c:S:n:w:d:f:F:r:Lx:")) != -1){
+        switch(option){
+            case 's': options.image_size = parse_size(optarg); break;
+            case 'b': options.bytes_per_sector = atoi(optarg); break;
+            case 'c': options.sectors_per_cluster = atoi(optarg); break;
+            case 'S': options.FAT_size = strtoul(optarg, NULL, 10); break;
+            case 'n': options.num_files = strtoul(optarg, NULL, 10); break;
+            case 'w': options.fan_out = strtoul(optarg, NULL, 10); break;
+            case 'd': options.depth = strtoul(optarg, NULL, 10); break;
+            case 'f': {
+                char* separator = strchr(optarg, ':');
+                options.min_file_size = parse_size(optarg);
+                options.max_file_size = separator ? parse_size(separator + 1) : options.min_file_size;
+                break;
+            }
+            case 'F': options.fragmentation = strtoul(optarg, NULL, 10); break;
+            case 'r': options.seed = strtoul(optarg, NULL, 10); break;
+            case 'L': options.long_names = false; break;
+            case 'x': options.extract_path = optarg; break;
+            default: usage(argv[0]); exit(EXIT_FAILURE);
+        }
+    }
+    if(optind >= argc){
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    options.output_path = argv[optind];
+    if(options.fan_out == 0){
+        options.depth = 0;
+    }
+    rng_state = 0x9E3779B97F4A7C15ULL ^ options.seed;
+
+    if(options.bytes_per_sector < 512 || (options.bytes_per_sector & (options.bytes_per_sector - 1)) != 0
+            || options.sectors_per_cluster == 0 || (options.sectors_per_cluster & (options.sectors_per_cluster - 1)) != 0){
+        fprintf(stderr, "Error: Bytes per sector and sectors per cluster must be powers of 2, with at least 512 bytes per sector\n");
+        exit(EXIT_FAILURE);
+    }
+
+    //Geometry: solve for the FAT size that covers the data region, unless one was given
+    uint32_t total_sectors = options.image_size / options.bytes_per_sector;
+    uint32_t reserved = 32;
+    uint32_t FAT_size = (options.FAT_size > 0) ? options.FAT_size : 1;
+    while(true){
+        if((uint64_t)reserved + 2 * (uint64_t)FAT_size >= total_sectors){
+            fprintf(stderr, "Error: The FATs do not fit in the image, use a larger size (-s)\n");
+            exit(EXIT_FAILURE);
+        }
+        uint32_t data_sectors = total_sectors - reserved - 2 * FAT_size;
+        num_clusters = data_sectors / options.sectors_per_cluster;
+        uint32_t needed = (uint32_t)(((uint64_t)(num_clusters + 2) * 4 + options.bytes_per_sector - 1)
+                            / options.bytes_per_sector);
+        if(needed <= FAT_size){
+            break;
+        }
+        if(options.FAT_size > 0){
+            fprintf(stderr, "Error: A FAT of %" PRIu32 " sectors is too small, %" PRIu32 " clusters need %" PRIu32 " sectors\n",
+                    FAT_size, num_clusters, needed);
+            exit(EXIT_FAILURE);
+        }
+        FAT_size = needed;
+    }
+    if(num_clusters < 65525){
+        fprintf(stderr, "Error: %" PRIu32 " clusters is too few for FAT32, use a larger size (-s) or smaller clusters (-c)\n",
+                num_clusters);
+        exit(EXIT_FAILURE);
+    }
+    first_data_sector = reserved + 2 * FAT_size;
+    cluster_size = (uint32_t)options.bytes_per_sector * options.sectors_per_cluster;
+
+    FAT = calloc((size_t)FAT_size * options.bytes_per_sector / 4, sizeof(uint32_t));
+    if(FAT == NULL){
+        fprintf(stderr, "Error: Could not allocate the FAT\n");
+        exit(EXIT_FAILURE);
+    }
+
+    image_fd = open(options.output_path, O_CREAT | O_TRUNC | O_RDWR, 0666);
+    if(image_fd == -1){
+        fprintf(stderr, "Error: Could not create %s : %s\n", options.output_path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if(ftruncate(image_fd, (off_t)total_sectors * options.bytes_per_sector) == -1){
+        fprintf(stderr, "Error: Could not size %s : %s\n", options.output_path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    build_directory_tree();
+    lay_out_files();
+    lay_out_directories();
+    write_metadata(FAT_size, total_sectors);
+
+    fprintf(stdout, "Wrote %s: %" PRIu32 " clusters of %" PRIu32 " bytes, %" PRIu32 " directories, %" PRIu32 " files\n",
+            options.output_path, num_clusters, cluster_size, num_directories, options.num_files);
+
+    free(FAT);
+    free(directories);
+    close(image_fd);
+
+    return EXIT_SUCCESS;
+
+}